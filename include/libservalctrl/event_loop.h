@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Event loop that multiplexes message channels, file descriptors and
+ * a timer queue in the calling thread, using epoll and timerfd.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include <common/timer.h>
+
+struct event_loop;
+
+enum event_loop_events {
+    EVENT_IN  = 1 << 0,
+    EVENT_OUT = 1 << 1,
+    EVENT_ERR = 1 << 2,
+    EVENT_HUP = 1 << 3,
+};
+
+typedef void (*event_loop_cb_t)(struct event_loop *el, int fd,
+                                unsigned int events, void *data);
+
+struct event_loop *event_loop_create(void);
+void event_loop_free(struct event_loop *el);
+
+/*
+  Callbacks run in the thread that calls event_loop_run(). Several
+  threads may run the same loop; a file descriptor is then handled by
+  one thread at a time. Only remove a file descriptor from within its
+  own callback, or when the loop is not running.
+*/
+int event_loop_add_fd(struct event_loop *el, int fd, unsigned int events,
+                      event_loop_cb_t cb, void *data);
+int event_loop_del_fd(struct event_loop *el, int fd);
+
+/* Run the timers of tq from the loop. */
+int event_loop_add_timer_queue(struct event_loop *el,
+                               struct timer_queue *tq);
+
+int event_loop_run(struct event_loop *el);
+void event_loop_stop(struct event_loop *el);
+
+#endif /* _EVENT_LOOP_H_ */
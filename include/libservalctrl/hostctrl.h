@@ -16,6 +16,8 @@
 
 #include <netinet/serval.h>
 #include <serval/ctrlmsg.h>
+#include <pthread.h>
+#include <time.h>
 #include "message_channel.h"
 
 struct hostctrl;
@@ -60,12 +62,25 @@ struct hostctrl_callback {
                                  int retval,                                     
                                  const struct service_info_stat *sis,
                                  unsigned int num);
+    /* One message of a stats delta reply. Records start at sd->rec,
+       each with its type and length in the first two bytes. */
+    int (*stats_delta)(struct hostctrl *hc,
+                       unsigned int xid,
+                       int retval,
+                       const struct ctrlmsg_stats_delta *sd);
     int (*start)(struct hostctrl *hc); /* Called one time, when thread starts */
     void (*stop)(struct hostctrl *hc); /* Called when thread stops */
 };
 
 struct hostctrl_ops;
 
+/* Batch messages that may await a reply at the same time */
+#define HOSTCTRL_BATCH_WINDOW 32
+/* Seconds to wait for a reply before assuming it was lost */
+#define HOSTCTRL_BATCH_TIMEOUT 5
+
+struct hostctrl_batch_msg;
+
 typedef struct hostctrl {
 	struct message_channel *mc;
     void *context;
@@ -73,8 +88,22 @@ typedef struct hostctrl {
 	const struct hostctrl_ops *ops;
 	const struct hostctrl_callback *cbs;
 	struct message_channel_callback mccb;
+    /* xids and send times of batch messages in flight, and the
+     * messages waiting for room in the window */
+    pthread_mutex_t batch_lock;
+    unsigned int batch_inflight;
+    unsigned int batch_xids[HOSTCTRL_BATCH_WINDOW];
+    time_t batch_sent[HOSTCTRL_BATCH_WINDOW];
+    struct hostctrl_batch_msg *batch_head, *batch_tail;
+    /* Thread that expires lost replies and sends queued messages
+     * while the window is non-empty */
+    pthread_cond_t batch_cond;
+    pthread_t batch_thr;
+    unsigned char batch_thr_started, batch_thr_stop;
 } hostctrl_t;
 
+struct hostctrl_batch;
+
 enum hostctrl_flags {
     HCF_NONE   = 0,
     HCF_ROUTER = 1 << 0,
@@ -95,6 +124,7 @@ struct hostctrl *hostctrl_local_create(const struct hostctrl_callback *cbs,
                                        unsigned short flags);
 void hostctrl_free(struct hostctrl *hc);
 int hostctrl_start(struct hostctrl *hc);
+int hostctrl_start_loop(struct hostctrl *hc, struct event_loop *el);
 
 unsigned int hostctrl_get_xid(struct hostctrl *hc);
 int hostctrl_interface_migrate(struct hostctrl *hc, 
@@ -145,6 +175,27 @@ int hostctrl_service_query(struct hostctrl *hc,
                            unsigned short prefix,
                            struct service_info_stat **si);
 
+/*
+  Batches pack many service table operations into as few messages as
+  the channel allows, and keep up to HOSTCTRL_BATCH_WINDOW of them in
+  flight. Messages that do not fit in the window are queued and sent
+  as replies arrive, or as unanswered messages time out, so no call
+  blocks and batches may be used from an event loop or a callback. Results are reported through the usual
+  callbacks, with the xid that append returned.
+*/
+struct hostctrl_batch *hostctrl_batch_begin(struct hostctrl *hc);
+int hostctrl_batch_append(struct hostctrl_batch *b, int type,
+                          const struct service_info *si,
+                          unsigned int *xid);
+int hostctrl_batch_commit(struct hostctrl_batch *b);
+
+/*
+  Request the stats that changed since the previous request. The
+  stack keeps one baseline for all clients, so only one client
+  should use this.
+*/
+int hostctrl_stats_delta_request(struct hostctrl *hc, int full);
+
 int hostctrl_set_capabilities(struct hostctrl *hc,
                               uint32_t capabilities);
 
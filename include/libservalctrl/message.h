@@ -17,10 +17,15 @@
 #include <netinet/in.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <libservalctrl/message_channel.h>
 
+struct message_pool;
+
 typedef struct message {
 	atomic_t refcount;
+    struct message_pool *pool; /* Returned here when freed, if set */
+    struct message *next; /* For queues and the pool's free list */
     channel_addr_t from;
     socklen_t from_len;
 	unsigned int length;
@@ -28,6 +33,25 @@ typedef struct message {
 	unsigned char data[0];
 } message_t;
 
+/*
+  Recycles messages of one size, so that receiving does not have to
+  malloc and free a buffer per message. At most max_free messages are
+  kept for reuse.
+*/
+typedef struct message_pool {
+    pthread_mutex_t lock;
+    struct message *free_list;
+    unsigned int num_free;
+    unsigned int max_free;
+    size_t size;
+} message_pool_t;
+
+void message_pool_init(struct message_pool *pool, size_t size, 
+                       unsigned int max_free);
+void message_pool_destroy(struct message_pool *pool);
+message_t *message_pool_alloc(struct message_pool *pool);
+void message_pool_free(struct message *m);
+
 static inline void message_hold(struct message *m)
 {
 	atomic_inc(&m->refcount);
@@ -35,8 +59,12 @@ static inline void message_hold(struct message *m)
 
 static inline void message_put(struct message *m)
 {
-	if (atomic_dec_and_test(&m->refcount))
-		free(m);
+	if (atomic_dec_and_test(&m->refcount)) {
+        if (m->pool)
+            message_pool_free(m);
+        else
+            free(m);
+    }
 }
 
 message_t *message_alloc(const void *data, size_t len);
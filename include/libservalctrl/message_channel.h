@@ -111,7 +111,11 @@ int message_channel_send_iov(struct message_channel *channel,
                              struct iovec *iov,
                              size_t veclen, size_t length);
 
+struct event_loop;
+
 int message_channel_start(struct message_channel *channel);
+int message_channel_start_loop(struct message_channel *channel,
+                               struct event_loop *el);
 void message_channel_stop(struct message_channel *channel);
 
 #endif /* MESSAGE_CHANNEL_H_ */
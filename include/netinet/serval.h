@@ -98,6 +98,9 @@ enum sv_service_flags {
                                 * = backup or strict match */
         SVSF_MULTICAST = 1 << 5, /* service instance can be
                                   * multicasted */
+        SVSF_REUSEPORT = 1 << 6, /* listening sockets bound with this
+                                  * flag share the serviceID and
+                                  * split new flows among them */
         SVSF_INVALID = 0xFF
 };
 
@@ -115,6 +118,11 @@ SERVAL_ASSERT(sizeof(struct sockaddr_sv) == 36)
 
 #define SERVAL_ADDRSTRLEN 80
 
+/* SOL_TCP socket option: the number of full-sized segments to
+ * receive before sending an ACK. Zero gives the default behavior of
+ * acknowledging every other segment. */
+#define SERVAL_TCP_ACK_COALESCE 64
+
 struct flow_id {
         union {
                 uint8_t  un_id8[4];
@@ -4,6 +4,7 @@
 
 #if defined(OS_LINUX_KERNEL)
 #include <asm/checksum.h>
+#include <net/checksum.h>
 #else
 #if defined(OS_LINUX)
 #include <linux/types.h>
@@ -133,6 +134,22 @@ static inline __wsum csum_unfold(__sum16 n)
 	return (__force __wsum)n;
 }
 
+#define CSUM_MANGLED_0 ((__force __sum16)0xffff)
+
+/*
+ * Update a checksum in place after a 32-bit word of the covered data
+ * changed from "from" to "to" (RFC 1624)
+ */
+static inline void csum_replace4(__sum16 *sum, __be32 from, __be32 to)
+{
+	*sum = csum_fold(csum_add(csum_sub(~csum_unfold(*sum), from), to));
+}
+
+static inline void csum_replace2(__sum16 *sum, __be16 from, __be16 to)
+{
+	csum_replace4(sum, (__force __be32)from, (__force __be32)to);
+}
+
 static inline
 __wsum csum_and_copy_from_user (const void *src, void *dst,
 				int len, __wsum sum, int *err_ptr)
@@ -151,18 +168,17 @@ __wsum csum_and_copy_from_user (const void *src, void *dst,
 static __inline__ __wsum csum_and_copy_to_user
 (const void *src, void *dst, int len, __wsum sum, int *err_ptr)
 {
-	sum = csum_partial(src, len, sum);
-        
-	if (1 /* access_ok(VERIFY_WRITE, dst, len) */) {
-		if (memcpy(dst, src, len) == 0)
-			return sum;
-	}
-	if (len)
-		*err_ptr = -EFAULT;
-
-	return (__force __wsum)-1; /* invalid checksum */
+	return csum_partial_copy(src, dst, len, sum);
 }
 
+/*
+ * The checksum routines use the fastest implementation (e.g., AVX2,
+ * SSE2 or NEON) that the CPU supports. These select one by name, or
+ * the default with a NULL name, for testing and benchmarking.
+ */
+extern int csum_impl_select(const char *name);
+extern const char *csum_impl_name(void);
+
 #endif /* __CHECKSUM_H_ */
 
 #endif /* OS_LINUX_KERNEL */
@@ -33,6 +33,7 @@ enum ctrlmsg_type {
         CTRLMSG_TYPE_SERVICE_STAT,
         CTRLMSG_TYPE_CAPABILITIES,
         CTRLMSG_TYPE_MIGRATE,
+        CTRLMSG_TYPE_STATS_DELTA,
         CTRLMSG_TYPE_DUMMY,
         _CTRLMSG_TYPE_MAX,
 };
@@ -92,6 +93,9 @@ enum ctrlmsg_retval {
         CTRLMSG_RETVAL_MALFORMED,
 };
  
+/* Largest control message that the stack and libservalctrl accept */
+#define CTRLMSG_MAX_LEN 8192
+
 struct ctrlmsg {
         uint8_t type;
         uint8_t retval;
@@ -145,6 +149,10 @@ CTRLMSG_ASSERT(sizeof(struct ctrlmsg_resolve) == 84)
 
 /* resolution lookup for a service id (prefix), returns all
  * matching resolutions
+ *
+ * Replies to ADD_SERVICE and DEL_SERVICE have one entry for each
+ * requested service, in order. Entries that failed have srvid_flags
+ * set to SVSF_INVALID.
  */
 struct ctrlmsg_service {
         struct ctrlmsg cmh;
@@ -170,6 +178,22 @@ CTRLMSG_ASSERT(sizeof(struct ctrlmsg_service) == 12)
         (((cmsg)->cmh.len - sizeof(struct ctrlmsg_service)) /       \
          sizeof(struct service_info))
 
+/*
+  Values of service[0].type in a GET_SERVICE request. The whole
+  service table is read by sending GET_FIRST, and then GET_NEXT with
+  the last entry of the previous reply as service[0], until a reply
+  has retval CTRLMSG_RETVAL_NOENTRY. Each reply holds at most
+  CTRLMSG_SERVICE_GET_MAX_NUM entries, and a service with more
+  targets than that continues in the next reply.
+*/
+enum ctrlmsg_service_get_type {
+        CTRLMSG_SERVICE_GET_MATCH = 0, /* Entries matching service[0] */
+        CTRLMSG_SERVICE_GET_FIRST,
+        CTRLMSG_SERVICE_GET_NEXT,
+};
+
+#define CTRLMSG_SERVICE_GET_MAX_NUM 64
+
 struct ctrlmsg_service_info_stat {
         struct ctrlmsg cmh;
         uint32_t xid;
@@ -210,6 +234,86 @@ CTRLMSG_ASSERT(sizeof(struct ctrlmsg_service_stat) == 40)
         (((cmsg)->cmh.len - sizeof(struct ctrlmsg)) /                  \
          sizeof(struct service_stat))
 
+/*
+  Stats delta stream. A STATS_DELTA request (with num = 0) is answered
+  by one or more STATS_DELTA messages carrying records for the
+  services, targets and flows whose counters changed since the
+  previous request. Counters are the increments since then, or
+  absolute values if the request had STATS_DELTA_F_FULL set, which
+  also resets the baseline. A target record refers to the service
+  record before it. All but the last message of a reply have
+  STATS_DELTA_F_MORE set.
+
+  There is a single baseline in the stack, not one per requester, so
+  the stream supports one consumer. With several requesters, each
+  sees only the changes since the latest request by any of them.
+*/
+enum stats_delta_flags {
+        STATS_DELTA_F_FULL = 1 << 0,
+        STATS_DELTA_F_MORE = 1 << 1,
+};
+
+enum stats_delta_rec_type {
+        STATS_DELTA_REC_SERVICE = 1,
+        STATS_DELTA_REC_TARGET,
+        STATS_DELTA_REC_FLOW,
+};
+
+struct stats_delta_service {
+        uint8_t type;
+        uint8_t len;
+        uint8_t srvid_prefix_bits;
+        uint8_t reserved;
+        struct service_id srvid;
+        uint32_t packets_resolved;
+        uint32_t bytes_resolved;
+        uint32_t packets_dropped;
+        uint32_t bytes_dropped;
+} CTRLMSG_PACKED;
+
+CTRLMSG_ASSERT(sizeof(struct stats_delta_service) == 52)
+
+struct stats_delta_target {
+        uint8_t type;
+        uint8_t len;
+        uint16_t reserved;
+        struct in_addr address; /* Zero for local sockets */
+        uint32_t packets_resolved;
+        uint32_t bytes_resolved;
+        uint32_t packets_dropped;
+        uint32_t bytes_dropped;
+} CTRLMSG_PACKED;
+
+CTRLMSG_ASSERT(sizeof(struct stats_delta_target) == 24)
+
+struct stats_delta_flow {
+        uint8_t type;
+        uint8_t len;
+        uint8_t state;
+        uint8_t reserved;
+        struct flow_id flowid;
+        uint32_t pkts_sent;
+        uint32_t bytes_sent;
+        uint32_t pkts_recv;
+        uint32_t bytes_recv;
+} CTRLMSG_PACKED;
+
+CTRLMSG_ASSERT(sizeof(struct stats_delta_flow) == 24)
+
+struct ctrlmsg_stats_delta {
+        struct ctrlmsg cmh;
+        uint32_t xid;
+        uint32_t seqno; /* Number of the snapshot */
+        uint16_t flags;
+        uint16_t num; /* Number of records */
+        unsigned char rec[0];
+} CTRLMSG_PACKED;
+
+CTRLMSG_ASSERT(sizeof(struct ctrlmsg_stats_delta) == 20)
+
+#define CTRLMSG_STATS_DELTA_SIZE (sizeof(struct ctrlmsg_stats_delta))
+#define CTRLMSG_STATS_DELTA_MAX_LEN CTRLMSG_MAX_LEN
+
 struct ctrlmsg_capabilities {
         struct ctrlmsg cmh;
         uint32_t capabilities;
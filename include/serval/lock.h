@@ -6,6 +6,7 @@
 
 #if defined(OS_LINUX_KERNEL)
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
 
 #define spin_lock_destroy(x)
 #define rwlock_destroy(x)
@@ -63,6 +64,16 @@ typedef pthread_mutex_t rwlock_t;
 #define local_bh_disable()
 #define local_bh_enable()
 
+struct mutex {
+        pthread_mutex_t m;
+};
+
+#define DEFINE_MUTEX(x) struct mutex x = { PTHREAD_MUTEX_INITIALIZER }
+#define mutex_init(x) pthread_mutex_init(&(x)->m, NULL)
+#define mutex_destroy(x) pthread_mutex_destroy(&(x)->m)
+#define mutex_lock(x) pthread_mutex_lock(&(x)->m)
+#define mutex_unlock(x) pthread_mutex_unlock(&(x)->m)
+
 #endif /* OS_USER */
 
 #endif /* _LOCK_H */
@@ -117,6 +117,7 @@ static inline void yield(void) {}
 
 #define __init
 #define __exit
+#define noinline __attribute__((noinline))
 
 #define panic(name) { int *foo = NULL; *foo = 1; } /* Cause a sefault */
 #define WARN_ON(cond) ({                        \
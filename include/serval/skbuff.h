@@ -170,6 +170,13 @@ static inline void skb_dst_set(struct sk_buff *skb, struct dst_entry *dst)
         for (iter = skb_shinfo(skb)->frag_list; iter; iter = iter->next)
 #endif
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,37))
+static inline int skb_has_frag_list(const struct sk_buff *skb)
+{
+        return skb_shinfo(skb)->frag_list != NULL;
+}
+#endif
+
 #endif /* OS_LINUX_KERNEL */
 
 #if defined(OS_USER)
@@ -180,6 +187,7 @@ static inline void skb_dst_set(struct sk_buff *skb, struct dst_entry *dst)
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 #if defined(OS_LINUX)
 #include <netpacket/packet.h>
@@ -334,6 +342,16 @@ static inline unsigned char *skb_end_pointer(const struct sk_buff *skb)
 	return skb->head + skb->end;
 }
 
+/* Only forwarded packets have a frag_list, which shares the payload
+   of the packet they were copied from. See skb_to_iovec(). */
+static inline int skb_has_frag_list(const struct sk_buff *skb)
+{
+	return skb_shinfo(skb)->frag_list != NULL;
+}
+
+#define skb_walk_frags(skb, iter)                                       \
+        for (iter = skb_shinfo(skb)->frag_list; iter; iter = iter->next)
+
 static inline unsigned char *skb_tail_pointer(const struct sk_buff *skb)
 {
 	return skb->head + skb->tail;
@@ -598,6 +616,7 @@ static inline int skb_dst_is_noref(const struct sk_buff *skb)
 
 void __kfree_skb(struct sk_buff *skb);
 void kfree_skb(struct sk_buff *);
+int skb_to_iovec(const struct sk_buff *skb, struct iovec *iov, int max);
 struct sk_buff *__alloc_skb(unsigned int size, int fclone, int node);
 
 static inline struct sk_buff *alloc_skb(unsigned int size,
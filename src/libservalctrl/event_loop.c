@@ -0,0 +1,360 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ *
+ * Event loop based on epoll and timerfd, which lets a process run its
+ * message channels and timers without a thread per channel.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <common/debug.h>
+#include <common/list.h>
+#include <common/signal.h>
+#include <libservalctrl/event_loop.h>
+
+#define EVENT_LOOP_MAX_EVENTS 32
+
+struct event_loop_fd {
+    struct list_head lh;
+    int fd;
+    unsigned int events;
+    int busy; /* In its callback */
+    event_loop_cb_t cb;
+    void *data;
+};
+
+struct event_loop {
+    int epfd;
+    int stop;
+    struct signal stop_signal;
+    pthread_mutex_t lock; /* Protects the fd list */
+    struct list_head fds;
+    struct timer_queue *tq;
+    int timerfd;
+};
+
+static unsigned int to_epoll_events(unsigned int events)
+{
+    unsigned int ev = 0;
+
+    if (events & EVENT_IN)
+        ev |= EPOLLIN;
+    if (events & EVENT_OUT)
+        ev |= EPOLLOUT;
+
+    return ev;
+}
+
+static unsigned int from_epoll_events(unsigned int ev)
+{
+    unsigned int events = 0;
+
+    if (ev & EPOLLIN)
+        events |= EVENT_IN;
+    if (ev & EPOLLOUT)
+        events |= EVENT_OUT;
+    if (ev & EPOLLERR)
+        events |= EVENT_ERR;
+    if (ev & EPOLLHUP)
+        events |= EVENT_HUP;
+
+    return events;
+}
+
+struct event_loop *event_loop_create(void)
+{
+    struct event_loop *el;
+    struct epoll_event ev;
+
+    el = malloc(sizeof(*el));
+
+    if (!el)
+        return NULL;
+
+    memset(el, 0, sizeof(*el));
+    INIT_LIST_HEAD(&el->fds);
+    pthread_mutex_init(&el->lock, NULL);
+    el->timerfd = -1;
+
+    el->epfd = epoll_create(EVENT_LOOP_MAX_EVENTS);
+
+    if (el->epfd == -1) {
+        LOG_ERR("epoll_create: %s\n", strerror(errno));
+        goto fail_epoll;
+    }
+
+    if (signal_init(&el->stop_signal) == -1)
+        goto fail_signal;
+
+    /* Never cleared, so that all threads running the loop see it */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+
+    if (epoll_ctl(el->epfd, EPOLL_CTL_ADD,
+                  signal_get_fd(&el->stop_signal), &ev) == -1) {
+        LOG_ERR("epoll_ctl: %s\n", strerror(errno));
+        goto fail_ctl;
+    }
+
+    return el;
+ fail_ctl:
+    signal_destroy(&el->stop_signal);
+ fail_signal:
+    close(el->epfd);
+ fail_epoll:
+    pthread_mutex_destroy(&el->lock);
+    free(el);
+    return NULL;
+}
+
+void event_loop_free(struct event_loop *el)
+{
+    while (!list_empty(&el->fds)) {
+        struct event_loop_fd *efd =
+            list_first_entry(&el->fds, struct event_loop_fd, lh);
+        list_del(&efd->lh);
+        free(efd);
+    }
+
+    if (el->timerfd != -1)
+        close(el->timerfd);
+
+    close(el->epfd);
+    signal_destroy(&el->stop_signal);
+    pthread_mutex_destroy(&el->lock);
+    free(el);
+}
+
+/*
+  File descriptors are registered one-shot, and rearmed after their
+  callback returns, so that only one thread handles each at a time.
+*/
+static int event_loop_arm(struct event_loop *el, struct event_loop_fd *efd,
+                          int op)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = to_epoll_events(efd->events) | EPOLLONESHOT;
+    ev.data.ptr = efd;
+
+    return epoll_ctl(el->epfd, op, efd->fd, &ev);
+}
+
+int event_loop_add_fd(struct event_loop *el, int fd, unsigned int events,
+                      event_loop_cb_t cb, void *data)
+{
+    struct event_loop_fd *efd;
+
+    efd = malloc(sizeof(*efd));
+
+    if (!efd)
+        return -1;
+
+    memset(efd, 0, sizeof(*efd));
+    efd->fd = fd;
+    efd->events = events;
+    efd->cb = cb;
+    efd->data = data;
+
+    pthread_mutex_lock(&el->lock);
+    list_add_tail(&efd->lh, &el->fds);
+    pthread_mutex_unlock(&el->lock);
+
+    if (event_loop_arm(el, efd, EPOLL_CTL_ADD) == -1) {
+        LOG_ERR("epoll_ctl fd=%d: %s\n", fd, strerror(errno));
+        pthread_mutex_lock(&el->lock);
+        list_del(&efd->lh);
+        pthread_mutex_unlock(&el->lock);
+        free(efd);
+        return -1;
+    }
+
+    return 0;
+}
+
+int event_loop_del_fd(struct event_loop *el, int fd)
+{
+    struct event_loop_fd *efd, *found = NULL;
+
+    pthread_mutex_lock(&el->lock);
+
+    list_for_each_entry(efd, &el->fds, lh) {
+        if (efd->fd == fd) {
+            found = efd;
+            list_del(&efd->lh);
+            break;
+        }
+    }
+
+    if (found) {
+        epoll_ctl(el->epfd, EPOLL_CTL_DEL, fd, NULL);
+        
+        /* If called from the callback, event_loop_dispatch() frees
+         * it afterwards */
+        if (found->busy)
+            found->cb = NULL;
+        else
+            free(found);
+    }
+
+    pthread_mutex_unlock(&el->lock);
+
+    return found ? 0 : -1;
+}
+
+static void event_loop_timer_arm(struct event_loop *el)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+
+    if (timer_next_timeout_timespec(el->tq, &its.it_value)) {
+        /* A zero value would disarm the timer */
+        if (!timespec_nz(&its.it_value))
+            its.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(el->timerfd, 0, &its, NULL) == -1) {
+        LOG_ERR("timerfd_settime: %s\n", strerror(errno));
+    }
+}
+
+static void event_loop_timer_expired(struct event_loop *el, int fd,
+                                     unsigned int events, void *data)
+{
+    struct timespec ts;
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) == -1 &&
+        errno != EAGAIN) {
+        LOG_ERR("timerfd read: %s\n", strerror(errno));
+    }
+
+    /* Like a poll loop, run the first timer when the timeout
+     * expires, and any others that are due by then */
+    if (timer_handle_timeout(el->tq) == 0) {
+        while (timer_next_timeout_timespec(el->tq, &ts) && 
+               !timespec_nz(&ts))
+            timer_handle_timeout(el->tq);
+    }
+
+    event_loop_timer_arm(el);
+}
+
+static void event_loop_timer_changed(struct event_loop *el, int fd,
+                                     unsigned int events, void *data)
+{
+    /* A timer was added or modified, reschedule */
+    timer_queue_signal_lower(el->tq);
+    event_loop_timer_arm(el);
+}
+
+int event_loop_add_timer_queue(struct event_loop *el,
+                               struct timer_queue *tq)
+{
+    if (el->tq)
+        return -1;
+
+    el->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+    if (el->timerfd == -1) {
+        LOG_ERR("timerfd_create: %s\n", strerror(errno));
+        return -1;
+    }
+
+    el->tq = tq;
+
+    if (event_loop_add_fd(el, el->timerfd, EVENT_IN,
+                          event_loop_timer_expired, NULL) == -1 ||
+        event_loop_add_fd(el, timer_queue_get_signal(tq), EVENT_IN,
+                          event_loop_timer_changed, NULL) == -1) {
+        event_loop_del_fd(el, el->timerfd);
+        close(el->timerfd);
+        el->timerfd = -1;
+        el->tq = NULL;
+        return -1;
+    }
+
+    event_loop_timer_arm(el);
+
+    return 0;
+}
+
+static void event_loop_dispatch(struct event_loop *el,
+                                struct event_loop_fd *efd,
+                                unsigned int ev)
+{
+    int deleted;
+
+    pthread_mutex_lock(&el->lock);
+    efd->busy = 1;
+    pthread_mutex_unlock(&el->lock);
+
+    efd->cb(el, efd->fd, from_epoll_events(ev), efd->data);
+
+    pthread_mutex_lock(&el->lock);
+    efd->busy = 0;
+    deleted = efd->cb == NULL;
+
+    if (!deleted)
+        event_loop_arm(el, efd, EPOLL_CTL_MOD);
+
+    pthread_mutex_unlock(&el->lock);
+
+    if (deleted)
+        free(efd);
+}
+
+/*
+  Run until event_loop_stop() is called. Returns -1 on error.
+*/
+int event_loop_run(struct event_loop *el)
+{
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    int ret = 0;
+
+    while (!el->stop) {
+        int i, n;
+
+        /* Timers added by this thread do not raise the queue's
+         * signal, so reschedule every round, like a poll loop */
+        if (el->tq)
+            event_loop_timer_arm(el);
+
+        n = epoll_wait(el->epfd, events, EVENT_LOOP_MAX_EVENTS, -1);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERR("epoll_wait: %s\n", strerror(errno));
+            ret = -1;
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            /* The stop signal */
+            if (events[i].data.ptr == NULL)
+                continue;
+
+            event_loop_dispatch(el, events[i].data.ptr, events[i].events);
+        }
+    }
+
+    return ret;
+}
+
+void event_loop_stop(struct event_loop *el)
+{
+    el->stop = 1;
+    signal_raise(&el->stop_signal);
+}
@@ -4,6 +4,8 @@
 #include <serval/ctrlmsg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <netinet/serval.h>
@@ -26,12 +28,192 @@ static struct hostctrl_ops *hops[] = {
 	[MSG_CHANNEL_UDP] = &remote_ops,
 };
 
+struct hostctrl_batch {
+    struct hostctrl *hc;
+    struct ctrlmsg_service *cm; /* Message being filled */
+    unsigned int max_len;
+    unsigned int num_msgs;
+};
+
+/* A full batch message waiting for room in the window */
+struct hostctrl_batch_msg {
+    struct hostctrl_batch_msg *next;
+    struct ctrlmsg_service *cm;
+};
+
+#if defined(OS_LINUX)
+#define HOSTCTRL_BATCH_CLOCK CLOCK_MONOTONIC
+#else
+/* Condition variables cannot wait on the monotonic clock */
+#define HOSTCTRL_BATCH_CLOCK CLOCK_REALTIME
+#endif
+
+static time_t hostctrl_batch_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(HOSTCTRL_BATCH_CLOCK, &ts);
+
+    return ts.tv_sec;
+}
+
+/*
+  Forget in-flight messages that had no reply in time, so that a lost
+  reply does not close the window for good. Called with the batch
+  lock held.
+*/
+static void __hostctrl_batch_expire(struct hostctrl *hc, time_t now)
+{
+    unsigned int i = 0;
+
+    while (i < hc->batch_inflight) {
+        if (now - hc->batch_sent[i] < HOSTCTRL_BATCH_TIMEOUT) {
+            i++;
+            continue;
+        }
+        LOG_ERR("No reply to batch message xid=%u, assuming lost\n",
+                hc->batch_xids[i]);
+        hc->batch_inflight--;
+        hc->batch_xids[i] = hc->batch_xids[hc->batch_inflight];
+        hc->batch_sent[i] = hc->batch_sent[hc->batch_inflight];
+    }
+}
+
+/* Called with the batch lock held and room in the window. */
+static int __hostctrl_batch_send(struct hostctrl *hc, 
+                                 struct ctrlmsg_service *cm, time_t now)
+{
+    int ret = message_channel_send(hc->mc, cm, cm->cmh.len);
+
+    if (ret < 0)
+        return ret;
+
+    hc->batch_xids[hc->batch_inflight] = cm->cmh.xid;
+    hc->batch_sent[hc->batch_inflight] = now;
+
+    /* Wake up the batch thread, which sleeps while nothing is in
+     * flight */
+    if (hc->batch_inflight++ == 0)
+        pthread_cond_signal(&hc->batch_cond);
+
+    return 0;
+}
+
+/*
+  Send queued messages, oldest first, while there is room in the
+  window. Called with the batch lock held.
+*/
+static void __hostctrl_batch_send_queued(struct hostctrl *hc, time_t now)
+{
+    while (hc->batch_head && hc->batch_inflight < HOSTCTRL_BATCH_WINDOW) {
+        struct hostctrl_batch_msg *m = hc->batch_head;
+
+        hc->batch_head = m->next;
+
+        if (!hc->batch_head)
+            hc->batch_tail = NULL;
+
+        if (__hostctrl_batch_send(hc, m->cm, now) < 0)
+            LOG_ERR("Could not send batch message xid=%u\n",
+                    m->cm->cmh.xid);
+        free(m);
+    }
+}
+
+/*
+  Replies drive the window, but a lost reply would leave the window,
+  and the queue behind it, stuck until the next batch is flushed. So
+  this thread wakes up when the oldest message in flight times out.
+*/
+static void *hostctrl_batch_thread(void *arg)
+{
+    struct hostctrl *hc = (struct hostctrl *)arg;
+
+    pthread_mutex_lock(&hc->batch_lock);
+
+    while (!hc->batch_thr_stop) {
+        time_t now = hostctrl_batch_now();
+        time_t oldest;
+        struct timespec ts;
+        unsigned int i;
+
+        __hostctrl_batch_expire(hc, now);
+        __hostctrl_batch_send_queued(hc, now);
+
+        if (hc->batch_inflight == 0) {
+            pthread_cond_wait(&hc->batch_cond, &hc->batch_lock);
+            continue;
+        }
+
+        oldest = hc->batch_sent[0];
+
+        for (i = 1; i < hc->batch_inflight; i++) {
+            if (hc->batch_sent[i] < oldest)
+                oldest = hc->batch_sent[i];
+        }
+
+        clock_gettime(HOSTCTRL_BATCH_CLOCK, &ts);
+        ts.tv_sec += oldest + HOSTCTRL_BATCH_TIMEOUT - now;
+        pthread_cond_timedwait(&hc->batch_cond, &hc->batch_lock, &ts);
+    }
+
+    pthread_mutex_unlock(&hc->batch_lock);
+
+    return NULL;
+}
+
+/* Called with the batch lock held. */
+static int __hostctrl_batch_thread_start(struct hostctrl *hc)
+{
+    int ret;
+
+    if (hc->batch_thr_started)
+        return 0;
+
+    ret = pthread_create(&hc->batch_thr, NULL, hostctrl_batch_thread, hc);
+
+    if (ret) {
+        LOG_ERR("Could not start batch thread: %s\n", strerror(ret));
+        return -1;
+    }
+
+    hc->batch_thr_started = 1;
+
+    return 0;
+}
+
+static void hostctrl_batch_complete(struct hostctrl *hc, unsigned int xid)
+{
+    time_t now = hostctrl_batch_now();
+    unsigned int i;
+
+    pthread_mutex_lock(&hc->batch_lock);
+
+    for (i = 0; i < hc->batch_inflight; i++) {
+        if (hc->batch_xids[i] == xid) {
+            hc->batch_inflight--;
+            hc->batch_xids[i] = hc->batch_xids[hc->batch_inflight];
+            hc->batch_sent[i] = hc->batch_sent[hc->batch_inflight];
+            break;
+        }
+    }
+
+    __hostctrl_batch_expire(hc, now);
+    __hostctrl_batch_send_queued(hc, now);
+
+    pthread_mutex_unlock(&hc->batch_lock);
+}
+
 static int hostctrl_recv(struct message_channel_callback *mcb, 
                          struct message *m)
 {
     struct hostctrl *hc = (struct hostctrl *)mcb->target;
 	struct ctrlmsg *cm = (struct ctrlmsg *)m->data;
 
+    if (cm->type == CTRLMSG_TYPE_ADD_SERVICE ||
+        cm->type == CTRLMSG_TYPE_DEL_SERVICE)
+        hostctrl_batch_complete(hc, cm->xid);
+
     if (!hc->ops)
         return 0;
 
@@ -60,6 +242,7 @@ static struct hostctrl *hostctrl_create(struct message_channel *mc,
                                         void *context)
 {
 	struct hostctrl *hc;
+    pthread_condattr_t attr;
 
 	hc = malloc(sizeof(*hc));
 
@@ -76,6 +259,13 @@ static struct hostctrl *hostctrl_create(struct message_channel *mc,
     hc->context = context;
 	hc->ops = hops[message_channel_get_type(mc)];
 	hc->cbs = cbs;
+    pthread_mutex_init(&hc->batch_lock, NULL);
+    pthread_condattr_init(&attr);
+#if defined(OS_LINUX)
+    pthread_condattr_setclock(&attr, HOSTCTRL_BATCH_CLOCK);
+#endif
+    pthread_cond_init(&hc->batch_cond, &attr);
+    pthread_condattr_destroy(&attr);
 	message_channel_register_callback(mc, &hc->mccb);
 
 	return hc;
@@ -217,11 +407,36 @@ int hostctrl_start(struct hostctrl *hc)
     return message_channel_start(hc->mc);
 }
 
+/*
+  Run the host control's callbacks from an event loop, see
+  event_loop.h, instead of a channel thread.
+*/
+int hostctrl_start_loop(struct hostctrl *hc, struct event_loop *el)
+{
+    return message_channel_start_loop(hc->mc, el);
+}
+
 void hostctrl_free(struct hostctrl *hc)
 {
+    if (hc->batch_thr_started) {
+        pthread_mutex_lock(&hc->batch_lock);
+        hc->batch_thr_stop = 1;
+        pthread_cond_signal(&hc->batch_cond);
+        pthread_mutex_unlock(&hc->batch_lock);
+        pthread_join(hc->batch_thr, NULL);
+    }
+
     message_channel_stop(hc->mc);
 	message_channel_unregister_callback(hc->mc, &hc->mccb);
 	message_channel_put(hc->mc);
+
+    while (hc->batch_head) {
+        struct hostctrl_batch_msg *m = hc->batch_head;
+        hc->batch_head = m->next;
+        free(m);
+    }
+    pthread_cond_destroy(&hc->batch_cond);
+    pthread_mutex_destroy(&hc->batch_lock);
 	free(hc);
 }
 
@@ -324,18 +539,183 @@ int hostctrl_service_modify(struct hostctrl *hc,
                                    old_ip, new_ip);
 }
 
+struct hostctrl_batch *hostctrl_batch_begin(struct hostctrl *hc)
+{
+    struct hostctrl_batch *b;
+    int max_len = message_channel_get_max_message_size(hc->mc);
+    int ret;
+
+    /* The reply to a delete carries more per entry than the
+     * request, so that is what has to fit */
+    if (max_len < (int)CTRLMSG_SERVICE_INFO_STAT_NUM_LEN(1))
+        max_len = CTRLMSG_SERVICE_INFO_STAT_NUM_LEN(1);
+
+    pthread_mutex_lock(&hc->batch_lock);
+    ret = __hostctrl_batch_thread_start(hc);
+    pthread_mutex_unlock(&hc->batch_lock);
+
+    if (ret < 0)
+        return NULL;
+
+    b = malloc(sizeof(*b) + max_len);
+
+    if (!b)
+        return NULL;
+
+    memset(b, 0, sizeof(*b));
+    b->hc = hc;
+    b->cm = (struct ctrlmsg_service *)(b + 1);
+    b->cm->cmh.len = CTRLMSG_SERVICE_NUM_LEN(0);
+    b->max_len = max_len;
+
+    return b;
+}
+
+/*
+  Send the message that is being filled, or queue it if the window is
+  full or older messages are still queued. Never blocks.
+*/
+static int hostctrl_batch_flush(struct hostctrl_batch *b)
+{
+    struct hostctrl *hc = b->hc;
+    unsigned int num = CTRLMSG_SERVICE_NUM(b->cm);
+    time_t now = hostctrl_batch_now();
+    int ret = 0;
+
+    if (num == 0)
+        return 0;
+
+    pthread_mutex_lock(&hc->batch_lock);
+
+    __hostctrl_batch_expire(hc, now);
+    __hostctrl_batch_send_queued(hc, now);
+
+    if (hc->batch_head || hc->batch_inflight == HOSTCTRL_BATCH_WINDOW) {
+        struct hostctrl_batch_msg *m;
+
+        m = malloc(sizeof(*m) + b->cm->cmh.len);
+
+        if (!m) {
+            ret = -1;
+        } else {
+            m->next = NULL;
+            m->cm = (struct ctrlmsg_service *)(m + 1);
+            memcpy(m->cm, b->cm, b->cm->cmh.len);
+
+            if (hc->batch_tail)
+                hc->batch_tail->next = m;
+            else
+                hc->batch_head = m;
+            hc->batch_tail = m;
+        }
+    } else {
+        ret = __hostctrl_batch_send(hc, b->cm, now);
+    }
+
+    pthread_mutex_unlock(&hc->batch_lock);
+
+    if (ret < 0)
+        return ret;
+    
+    b->num_msgs++;
+    b->cm->cmh.len = CTRLMSG_SERVICE_NUM_LEN(0);
+
+    return 0;
+}
+
+/*
+  Add an operation of the given type (CTRLMSG_TYPE_ADD_SERVICE or
+  CTRLMSG_TYPE_DEL_SERVICE) to the batch. The xid of the message that
+  carries it is returned in xid, if not NULL.
+*/
+int hostctrl_batch_append(struct hostctrl_batch *b, int type,
+                          const struct service_info *si,
+                          unsigned int *xid)
+{
+    unsigned int num = CTRLMSG_SERVICE_NUM(b->cm);
+    size_t entry_size = sizeof(struct service_info_stat);
+    
+    if (type != CTRLMSG_TYPE_ADD_SERVICE &&
+        type != CTRLMSG_TYPE_DEL_SERVICE)
+        return -1;
+
+    if (type == CTRLMSG_TYPE_ADD_SERVICE)
+        entry_size = sizeof(struct service_info);
+
+    if (num > 0 && (b->cm->cmh.type != type ||
+                    CTRLMSG_SERVICE_INFO_STAT_NUM_LEN(0) + 
+                    (num + 1) * entry_size > b->max_len)) {
+        if (hostctrl_batch_flush(b) < 0)
+            return -1;
+        num = 0;
+    }
+
+    if (num == 0) {
+        memset(b->cm, 0, sizeof(*b->cm));
+        b->cm->cmh.type = type;
+        b->cm->cmh.xid = ++b->hc->xid;
+        b->cm->cmh.len = CTRLMSG_SERVICE_NUM_LEN(0);
+    }
+
+    memcpy(&b->cm->service[num], si, sizeof(*si));
+    b->cm->cmh.len += sizeof(*si);
+
+    if (xid)
+        *xid = b->cm->cmh.xid;
+
+    return 0;
+}
+
+/*
+  Send what is left of the batch and free it. Returns the number of
+  messages the batch was sent or queued in, or -1 on error.
+*/
+int hostctrl_batch_commit(struct hostctrl_batch *b)
+{
+    int ret = hostctrl_batch_flush(b);
+
+    if (ret == 0)
+        ret = b->num_msgs;
+
+    free(b);
+
+    return ret;
+}
+
+static int hostctrl_services_batch(struct hostctrl *hc, int type,
+                                   const struct service_info *si,
+                                   unsigned int num_si)
+{
+    struct hostctrl_batch *b = hostctrl_batch_begin(hc);
+    unsigned int i;
+
+    if (!b)
+        return -1;
+
+    for (i = 0; i < num_si; i++) {
+        if (hostctrl_batch_append(b, type, &si[i], NULL) < 0) {
+            free(b);
+            return -1;
+        }
+    }
+
+    return hostctrl_batch_commit(b) < 0 ? -1 : 0;
+}
+
 int hostctrl_services_add(struct hostctrl *hc,
                           const struct service_info *si,
                           unsigned int num_si)
 {
-    return 0;
+    return hostctrl_services_batch(hc, CTRLMSG_TYPE_ADD_SERVICE, 
+                                   si, num_si);
 }
 
 int hostctrl_services_remove(struct hostctrl *hc,
                              const struct service_info *si,
                              unsigned int num_si)
 {
-    return 0;
+    return hostctrl_services_batch(hc, CTRLMSG_TYPE_DEL_SERVICE, 
+                                   si, num_si);
 }
 
 int hostctrl_service_query(struct hostctrl *hc,
@@ -347,6 +727,19 @@ int hostctrl_service_query(struct hostctrl *hc,
     return 0;
 }
 
+/*
+  Ask the stack for the stats that changed since the last request, or
+  for all of them if full is set. The reply arrives through the
+  stats_delta callback.
+*/
+int hostctrl_stats_delta_request(struct hostctrl *hc, int full)
+{
+    if (!hc->ops->stats_delta_request)
+        return -1;
+    
+    return hc->ops->stats_delta_request(hc, full);
+}
+
 int hostctrl_set_capabilities(struct hostctrl *hc,
                               uint32_t capabilities)
 {
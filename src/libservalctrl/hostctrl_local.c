@@ -210,6 +210,19 @@ static int local_service_migrate(struct hostctrl *hc,
     return message_channel_send(hc->mc, &cm, cm.cmh.len);
 }
 
+static int local_stats_delta_request(struct hostctrl *hc, int full)
+{
+    struct ctrlmsg_stats_delta cm;
+
+    memset(&cm, 0, sizeof(cm));
+    cm.cmh.type = CTRLMSG_TYPE_STATS_DELTA;
+    cm.cmh.len = CTRLMSG_STATS_DELTA_SIZE;
+    cm.cmh.xid = ++hc->xid;
+    cm.flags = full ? STATS_DELTA_F_FULL : 0;
+
+    return message_channel_send(hc->mc, &cm, cm.cmh.len);
+}
+
 int local_ctrlmsg_recv(struct hostctrl *hc, struct ctrlmsg *cm, 
                        struct sockaddr *from, socklen_t from_len)
 {
@@ -317,6 +330,11 @@ int local_ctrlmsg_recv(struct hostctrl *hc, struct ctrlmsg *cm,
                                                  CTRLMSG_SERVICE_INFO_STAT_NUM(csis));
         break;
     }
+    case CTRLMSG_TYPE_STATS_DELTA:
+        if (hc->cbs->stats_delta)
+            ret = hc->cbs->stats_delta(hc, cm->xid, cm->retval,
+                                       (struct ctrlmsg_stats_delta *)cm);
+        break;
 	default:
 		LOG_DBG("Received message type %u\n", cm->type);
 		break;
@@ -335,5 +353,6 @@ struct hostctrl_ops local_ops = {
 	.service_remove = local_service_remove,
 	.service_modify = local_service_modify,
     .service_get = local_service_get,
+    .stats_delta_request = local_stats_delta_request,
     .ctrlmsg_recv = local_ctrlmsg_recv,
 };
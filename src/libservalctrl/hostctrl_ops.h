@@ -50,6 +50,7 @@ struct hostctrl_ops {
     int (*services_query)(struct hostctrl *hc,
                           const struct service_info *si,
                           unsigned int num_si);
+    int (*stats_delta_request)(struct hostctrl *hc, int full);
     int (*ctrlmsg_recv)(struct hostctrl *hc, struct ctrlmsg *cm,
                         struct sockaddr *from, socklen_t from_len);
 };
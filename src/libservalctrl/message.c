@@ -21,3 +21,77 @@ message_t *message_alloc(const void *data, size_t len)
 	
 	return m;
 }
+
+void message_pool_init(struct message_pool *pool, size_t size, 
+                       unsigned int max_free)
+{
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->size = size;
+    pool->max_free = max_free;
+}
+
+void message_pool_destroy(struct message_pool *pool)
+{
+    while (pool->free_list) {
+        message_t *m = pool->free_list;
+        pool->free_list = m->next;
+        free(m);
+    }
+    pool->num_free = 0;
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/*
+  Get a message of the pool's size with a single reference. Unlike
+  message_alloc(), the data is not cleared.
+*/
+message_t *message_pool_alloc(struct message_pool *pool)
+{
+	message_t *m;
+
+    pthread_mutex_lock(&pool->lock);
+    
+    m = pool->free_list;
+
+    if (m) {
+        pool->free_list = m->next;
+        pool->num_free--;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!m) {
+        m = malloc(sizeof(*m) + pool->size);
+
+        if (!m)
+            return NULL;
+    }
+
+    memset(m, 0, sizeof(*m));
+	atomic_set(&m->refcount, 1);
+    m->pool = pool;
+	m->length = pool->size;
+    m->alloc_len = pool->size;
+
+	return m;
+}
+
+void message_pool_free(struct message *m)
+{
+    struct message_pool *pool = m->pool;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->num_free < pool->max_free) {
+        m->next = pool->free_list;
+        pool->free_list = m;
+        pool->num_free++;
+        m = NULL;
+    }
+    
+    pthread_mutex_unlock(&pool->lock);
+
+    if (m)
+        free(m);
+}
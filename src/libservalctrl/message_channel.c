@@ -302,6 +302,26 @@ int message_channel_start(message_channel_t *channel)
     return ret;
 }
 
+/*
+  Like message_channel_start(), but receive from the event loop
+  instead of a thread of the channel's own.
+*/
+int message_channel_start_loop(message_channel_t *channel,
+                               struct event_loop *el)
+{
+    int ret;
+
+    if (!channel->ops->start_loop)
+        return -1;
+
+    ret = channel->ops->start_loop(channel, el);
+ 
+    if (ret == 0 && !message_channel_hashed(channel))
+        message_channel_hash(channel);
+
+    return ret;
+}
+
 void message_channel_stop(message_channel_t *channel)
 {
     LOG_DBG("Stopping channel %s\n", channel->name);
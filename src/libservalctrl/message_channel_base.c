@@ -11,6 +11,9 @@
  *	published by the Free Software Foundation; either version 2 of
  *	the License, or (at your option) any later version.
  */
+#if defined(__linux__)
+#define _GNU_SOURCE /* For recvmmsg */
+#endif
 #include <assert.h>
 #include <string.h>
 #include <sys/types.h>
@@ -25,11 +28,60 @@
 #include <common/debug.h>
 #include "message_channel_internal.h"
 #include "message_channel_base.h"
+#if defined(OS_LINUX)
+#include <libservalctrl/event_loop.h>
+#endif
 
 #if defined(ENABLE_USERMODE)
 #include <libserval/serval.h>
 #endif
 
+static struct message_pool recv_pool;
+static pthread_once_t recv_pool_once = PTHREAD_ONCE_INIT;
+
+static void recv_pool_init(void)
+{
+    message_pool_init(&recv_pool, RECV_BUFFER_SIZE, RECV_POOL_MAX);
+}
+
+/*
+  Receive buffers come from a pool shared by all channels.
+*/
+struct message *message_channel_base_alloc_recv(void)
+{
+    pthread_once(&recv_pool_once, recv_pool_init);
+    return message_pool_alloc(&recv_pool);
+}
+
+void message_channel_base_rx_enqueue(message_channel_base_t *base,
+                                     struct message *m)
+{
+    m->next = NULL;
+
+    if (base->rx_tail)
+        base->rx_tail->next = m;
+    else
+        base->rx_head = m;
+
+    base->rx_tail = m;
+}
+
+struct message *message_channel_base_rx_dequeue(message_channel_base_t *base)
+{
+    struct message *m = base->rx_head;
+
+    if (m) {
+        base->rx_head = m->next;
+
+        if (!base->rx_head)
+            base->rx_tail = NULL;
+
+        m->next = NULL;
+    }
+
+    return m;
+}
+
 static int make_async(int fd)
 {
     int flags;
@@ -232,6 +284,9 @@ void message_channel_base_finalize(message_channel_t *channel)
 
     signal_destroy(&base->exit_signal);
 
+    while (base->rx_head)
+        message_put(message_channel_base_rx_dequeue(base));
+
     channel->state = CHANNEL_CREATED;
 }
 
@@ -246,14 +301,92 @@ static void *thread_start(void *arg)
     return NULL;
 }
 
+#if defined(OS_LINUX)
+/*
+  Read up to RECV_BATCH_SIZE datagrams with one system call and queue
+  them. Returns the number read.
+*/
+static int message_channel_base_recv_batch(message_channel_base_t *base)
+{
+    struct mmsghdr mmsg[RECV_BATCH_SIZE];
+    struct iovec iov[RECV_BATCH_SIZE];
+    message_t *m[RECV_BATCH_SIZE];
+    int i, n, num = 0, err;
+
+    memset(mmsg, 0, sizeof(mmsg));
+
+    while (num < RECV_BATCH_SIZE) {
+        m[num] = message_channel_base_alloc_recv();
+
+        if (!m[num])
+            break;
+
+        if (base->peer_len > 0) {
+            memcpy(&m[num]->from.sa, &base->peer.sa, base->peer_len);
+            m[num]->from_len = base->peer_len;
+        } else {
+            m[num]->from_len = sizeof(m[num]->from);
+        }
+
+        iov[num].iov_base = m[num]->data;
+        iov[num].iov_len = m[num]->alloc_len;
+        mmsg[num].msg_hdr.msg_name = &m[num]->from.sa;
+        mmsg[num].msg_hdr.msg_namelen = m[num]->from_len;
+        mmsg[num].msg_hdr.msg_iov = &iov[num];
+        mmsg[num].msg_hdr.msg_iovlen = 1;
+        num++;
+    }
+
+    if (num == 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    n = recvmmsg(base->sock, mmsg, num, 0, NULL);
+    err = errno;
+
+    for (i = 0; i < num; i++) {
+        if (i < n) {
+            m[i]->length = mmsg[i].msg_len;
+            m[i]->from_len = mmsg[i].msg_hdr.msg_namelen;
+            message_channel_base_rx_enqueue(base, m[i]);
+        } else {
+            message_put(m[i]);
+        }
+    }
+
+    errno = err;
+
+    return n;
+}
+#endif /* OS_LINUX */
+
 ssize_t message_channel_base_recv(struct message_channel *channel, 
                                   struct message **msg)
 {
     message_channel_base_t *base = (message_channel_base_t *)channel;
     message_t *m;
     ssize_t ret;
+
+    m = message_channel_base_rx_dequeue(base);
+
+#if defined(OS_LINUX)
+    if (!m && base->native_socket) {
+        ret = message_channel_base_recv_batch(base);
+
+        if (ret <= 0)
+            return ret;
+
+        m = message_channel_base_rx_dequeue(base);
+    }
+#endif
+
+    if (m) {
+        *msg = m;
+        return m->length;
+    }
    
-    m = message_alloc(NULL, RECV_BUFFER_SIZE);
+    m = message_channel_base_alloc_recv();
 
     if (!m)
         return -1;
@@ -490,6 +623,88 @@ int message_channel_base_start(message_channel_t *channel)
     return ret;
 }
 
+#if defined(OS_LINUX)
+/*
+  Dispatch everything that can be read without blocking.
+*/
+static void message_channel_base_event(struct event_loop *el, int fd,
+                                       unsigned int events, void *data)
+{
+    message_channel_t *channel = (message_channel_t *)data;
+    message_channel_base_t *base = (message_channel_base_t *)channel;
+    struct message *msg;
+    ssize_t ret;
+
+    while (base->running) {
+        ret = channel->ops->recv(channel, &msg);
+
+        if (ret > 0) {
+            if (channel->ops->recv_callback)
+                channel->ops->recv_callback(channel, msg);
+            continue;
+        }
+
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        
+        if (ret == 0) {
+            LOG_DBG("%s other end closed\n", channel->name);
+        } else {
+            LOG_ERR("%s recv error: %s\n",
+                    channel->name, strerror(errno));
+        }
+        base->running = 0;
+    }
+
+    event_loop_del_fd(el, fd);
+    base->loop = NULL;
+    channel->state = CHANNEL_STOPPED;
+    message_channel_internal_on_stop(channel);
+}
+#endif /* OS_LINUX */
+
+int message_channel_base_start_loop(message_channel_t *channel,
+                                    struct event_loop *el)
+{
+#if defined(OS_LINUX)
+    message_channel_base_t *base = (message_channel_base_t *)channel;
+    int ret = 0;
+
+    LOG_DBG("Starting %s channel on event loop\n", channel->name);
+
+    if (!base->native_socket) {
+        LOG_ERR("%s cannot run on an event loop\n", channel->name);
+        return -1;
+    }
+
+    pthread_mutex_lock(&channel->lock);
+
+    if (channel->state != CHANNEL_INITIALIZED) {
+        pthread_mutex_unlock(&channel->lock);
+        return 0;
+    }
+
+    channel->state = CHANNEL_RUNNING;
+    base->loop = el;
+
+    pthread_mutex_unlock(&channel->lock);
+
+    message_channel_internal_on_start(channel);
+
+    ret = event_loop_add_fd(el, base->sock, EVENT_IN,
+                            message_channel_base_event, channel);
+
+    if (ret == -1) {
+        base->loop = NULL;
+        channel->state = CHANNEL_INITIALIZED;
+    }
+
+    return ret;
+#else
+    return -1;
+#endif
+}
+
 void message_channel_base_stop(message_channel_t *channel)
 {
     message_channel_base_t *base = (message_channel_base_t *)channel;
@@ -512,6 +727,15 @@ void message_channel_base_stop(message_channel_t *channel)
         }
     }
 
+#if defined(OS_LINUX)
+    if (base->loop) {
+        event_loop_del_fd(base->loop, base->sock);
+        base->loop = NULL;
+        channel->state = CHANNEL_STOPPED;
+        message_channel_internal_on_stop(channel);
+    }
+#endif
+
     if (base->should_join) {
         ret = pthread_join(base->thread, NULL);
         
@@ -564,6 +788,11 @@ int message_channel_base_get_peer(message_channel_t *channel,
     return ret;
 }
 
+int message_channel_base_get_max_message_size(message_channel_t *channel)
+{
+    return CTRLMSG_MAX_LEN;
+}
+
 int message_channel_base_set_peer(message_channel_t *channel, 
                                   const struct sockaddr *addr, socklen_t len)
 {
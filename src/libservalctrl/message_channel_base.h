@@ -24,8 +24,14 @@
 #include <linux/netlink.h>
 #endif
 #include <netinet/serval.h>
+#include <serval/ctrlmsg.h>
 
-#define RECV_BUFFER_SIZE 2048
+/* Fits the largest control message and a netlink header */
+#define RECV_BUFFER_SIZE (CTRLMSG_MAX_LEN + 64)
+/* Messages read per recvmmsg() call */
+#define RECV_BATCH_SIZE 16
+/* Receive buffers kept for reuse */
+#define RECV_POOL_MAX 128
 
 typedef struct message_channel_base {
     struct message_channel channel;
@@ -41,6 +47,9 @@ typedef struct message_channel_base {
     socklen_t peer_len;
     struct signal exit_signal;
     pthread_t thread;
+    /* Received but not yet dispatched, only used by the task */
+    struct message *rx_head, *rx_tail;
+    struct event_loop *loop; /* Used instead of a thread, if set */
 } message_channel_base_t;
 
 #define MAX_SEND_RETRIES 10
@@ -62,6 +71,8 @@ int message_channel_base_fillkey(const message_channel_t *channel, void *_key);
 int message_channel_base_initialize(message_channel_t *channel);
 void message_channel_base_finalize(message_channel_t *channel);
 int message_channel_base_start(message_channel_t *channel);
+int message_channel_base_start_loop(message_channel_t *channel,
+                                    struct event_loop *el);
 void message_channel_base_stop(message_channel_t *channel);
 int message_channel_base_get_local(message_channel_t *channel,
                                    struct sockaddr *addr,
@@ -71,12 +82,17 @@ int message_channel_base_get_peer(message_channel_t *channel,
                                   socklen_t *addrlen);
 int message_channel_base_set_peer(message_channel_t *channel, 
                                   const struct sockaddr *addr, socklen_t len);
+int message_channel_base_get_max_message_size(message_channel_t *channel);
 int message_channel_base_send_iov(message_channel_t *channel, struct iovec *iov,
                                   size_t veclen, size_t msglen);
 int message_channel_base_send(message_channel_t *channel, 
                               void *msg, size_t msglen);
 ssize_t message_channel_base_recv(struct message_channel *channel, 
                                   struct message **msg);
+struct message *message_channel_base_alloc_recv(void);
+void message_channel_base_rx_enqueue(message_channel_base_t *base,
+                                     struct message *m);
+struct message *message_channel_base_rx_dequeue(message_channel_base_t *base);
 int message_channel_base_task(struct message_channel *channel);
 
 #endif /* MESSAGE_CHANNEL_BASE_H_ */
@@ -43,6 +43,7 @@ typedef struct message_channel {
 } message_channel_t;
 
 struct message;
+struct event_loop;
 
 typedef struct message_channel_ops {
     int (*equalfn)(const struct message_channel *channel, const void *key);
@@ -50,6 +51,8 @@ typedef struct message_channel_ops {
     int (*fillkey)(const struct message_channel *channel, void *key);
     int (*initialize) (struct message_channel *channel);
     int (*start) (struct message_channel *channel);
+    int (*start_loop) (struct message_channel *channel, 
+                       struct event_loop *el);
     void (*stop) (struct message_channel *channel);
     void (*finalize) (struct message_channel *channel);
     void (*hold)(struct message_channel *channel);
@@ -287,14 +287,23 @@ static ssize_t netlink_recv(message_channel_t *channel, struct message **msg)
     struct nlmsghdr *nlm;
     unsigned int num_msgs = 0;
     long bytes_left;
-    message_t *m;
+    message_t *m, *cm;
     ssize_t ret;
 
-    m = message_alloc(NULL, RECV_BUFFER_SIZE);
+    /* Messages left from the previous buffer go first */
+    m = message_channel_base_rx_dequeue(&mcnl->base);
+
+    if (m) {
+        *msg = m;
+        return m->length;
+    }
+
+    m = message_channel_base_alloc_recv();
     
     if (!m)
         return -1;
 
+    m->from_len = sizeof(m->from);
     
     ret = recvfrom(mcnl->base.sock, m->data,
                    m->length, 0,
@@ -345,10 +354,18 @@ static ssize_t netlink_recv(message_channel_t *channel, struct message **msg)
             /* LOG_DBG("NLMSG_DONE\n"); */
             break;
         case NLMSG_SERVAL:
-            /* Strip off netlink headers */
-            memmove(m->data, NLMSG_DATA(nlm), bytes_left - NLMSG_LENGTH(0));
-            m->length = bytes_left - NLMSG_LENGTH(0);
-            ret = bytes_left - NLMSG_LENGTH(0);
+            /* A buffer may hold several messages; queue each one
+             * without its netlink header */
+            cm = message_channel_base_alloc_recv();
+
+            if (!cm)
+                break;
+
+            memcpy(&cm->from, &m->from, m->from_len);
+            cm->from_len = m->from_len;
+            cm->length = nlm->nlmsg_len - NLMSG_LENGTH(0);
+            memcpy(cm->data, NLMSG_DATA(nlm), cm->length);
+            message_channel_base_rx_enqueue(&mcnl->base, cm);
             break;
         default:
             LOG_DBG("Unknown netlink message\n");
@@ -356,18 +373,22 @@ static ssize_t netlink_recv(message_channel_t *channel, struct message **msg)
         }
     }
 
-    if (ret <= 0)
-        message_put(m);
-    else {
-        *msg = m;
-    }
+    message_put(m);
 
-    return ret;
+    m = message_channel_base_rx_dequeue(&mcnl->base);
+
+    if (!m)
+        return ret;
+
+    *msg = m;
+
+    return m->length;
 }
 
 message_channel_ops_t netlink_ops = {
     .initialize = message_channel_base_initialize,
     .start = message_channel_base_start,
+    .start_loop = message_channel_base_start_loop,
     .stop = message_channel_base_stop,
     .finalize = message_channel_base_finalize,
     .hold = message_channel_internal_hold,
@@ -378,6 +399,7 @@ message_channel_ops_t netlink_ops = {
     .get_local = message_channel_base_get_local,
     .set_peer = message_channel_base_set_peer,
     .get_peer = message_channel_base_get_peer,
+    .get_max_message_size = message_channel_base_get_max_message_size,
     .register_callback = message_channel_internal_register_callback,
     .unregister_callback = message_channel_internal_unregister_callback,
     .get_callback_count = message_channel_internal_get_callback_count,
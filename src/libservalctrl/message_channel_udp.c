@@ -117,6 +117,13 @@ static int message_channel_udp_start(message_channel_t *channel)
     return message_channel_start(&mcu->base->channel);
 }
 
+static int message_channel_udp_start_loop(message_channel_t *channel,
+                                          struct event_loop *el)
+{
+    message_channel_udp_t *mcu = (message_channel_udp_t *)channel;
+    return message_channel_start_loop(&mcu->base->channel, el);
+}
+
 static void message_channel_udp_stop(message_channel_t *channel)
 {
     message_channel_udp_t *mcu = (message_channel_udp_t *)channel;
@@ -199,6 +206,7 @@ static int message_channel_udp_send_iov(message_channel_t *channel,
 struct message_channel_ops udp_base_ops = {
     .initialize = message_channel_base_initialize,
     .start = message_channel_base_start,
+    .start_loop = message_channel_base_start_loop,
     .stop = message_channel_base_stop,
     .finalize = message_channel_base_finalize,
     .hold = message_channel_internal_hold,
@@ -209,6 +217,7 @@ struct message_channel_ops udp_base_ops = {
     .get_local = message_channel_base_get_local,
     .set_peer = message_channel_base_set_peer,
     .get_peer = message_channel_base_get_peer,
+    .get_max_message_size = message_channel_base_get_max_message_size,
     .register_callback = message_channel_internal_register_callback,
     .unregister_callback = message_channel_internal_unregister_callback,
     .get_callback_count = message_channel_internal_get_callback_count,
@@ -222,6 +231,7 @@ struct message_channel_ops udp_base_ops = {
 struct message_channel_ops udp_ops = {
     .initialize = message_channel_udp_initialize,
     .start = message_channel_udp_start,
+    .start_loop = message_channel_udp_start_loop,
     .stop = message_channel_udp_stop,
     .finalize = message_channel_udp_finalize,
     .hold = message_channel_internal_hold,
@@ -232,6 +242,7 @@ struct message_channel_ops udp_ops = {
     .get_local = message_channel_udp_get_local,
     .set_peer = message_channel_udp_set_peer,
     .get_peer = message_channel_udp_get_peer,
+    .get_max_message_size = message_channel_base_get_max_message_size,
     .register_callback = message_channel_internal_register_callback,
     .unregister_callback = message_channel_internal_unregister_callback,
     .get_callback_count = message_channel_internal_get_callback_count,
@@ -63,6 +63,7 @@ static int message_channel_unix_initialize(message_channel_t *channel)
 struct message_channel_ops unix_ops = {
     .initialize = message_channel_unix_initialize,
     .start = message_channel_base_start,
+    .start_loop = message_channel_base_start_loop,
     .stop = message_channel_base_stop,
     .finalize = message_channel_unix_finalize,
     .hashfn = message_channel_internal_hashfn,
@@ -73,6 +74,7 @@ struct message_channel_ops unix_ops = {
     .get_local = message_channel_base_get_local,
     .set_peer = message_channel_base_set_peer,
     .get_peer = message_channel_base_get_peer,
+    .get_max_message_size = message_channel_base_get_max_message_size,
     .register_callback = message_channel_internal_register_callback,
     .unregister_callback = message_channel_internal_unregister_callback,
     .get_callback_count = message_channel_internal_get_callback_count,
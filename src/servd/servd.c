@@ -34,10 +34,13 @@
 #include <common/signal.h>
 #include <common/debug.h>
 #include <common/list.h>
+#include <common/hash.h>
+#include <common/atomic.h>
 #include <pthread.h>
 #include <poll.h>
 
 #if defined(OS_LINUX)
+#include <libservalctrl/event_loop.h>
 #include "rtnl.h"
 #endif
 #if defined(OS_BSD)
@@ -48,6 +51,40 @@ static int should_exit = 0;
 static struct signal exit_signal;
 static struct service_id default_service;
 
+/* Registrations are hashed on (type, serviceID, prefix, IP) */
+#define REG_HTABLE_BITS 16
+#define REG_HTABLE_SIZE (1 << REG_HTABLE_BITS)
+/* Buckets share a smaller set of locks */
+#define REG_HTABLE_LOCKS 256
+/* One slot per second, must exceed the longest timeout */
+#define REG_WHEEL_SIZE 64
+/* Refreshed registrations are handled in batches of this many */
+#define REG_EXPIRE_BATCH 256
+
+/*
+  Registrations are found through the hash table and expire through a
+  timing wheel that is advanced once a second by a single timer,
+  instead of having a timer each. A refresh only moves the expiry
+  time forward; the wheel reschedules the registration when it gets
+  to its old slot. Deleted registrations are marked dead and unhashed,
+  and are freed by the wheel. Timed out remote registrations are
+  moved from the wheel to the expired list, and are freed once their
+  removal from the service table has been sent from the main loop, so
+  that the timer never waits on the stack.
+*/
+struct registration_table {
+        struct hlist_head *hash;
+        pthread_mutex_t locks[REG_HTABLE_LOCKS];
+        struct list_head wheel[REG_WHEEL_SIZE];
+        pthread_mutex_t wheel_lock; /* Also protects expired */
+        struct list_head expired;
+        struct signal expire_signal; /* Raised when expired is filled */
+        unsigned long now; /* Last tick that was handled */
+        struct timespec start;
+        struct timer tick;
+        atomic_t count;
+};
+
 struct servd_context {
         struct timer_queue tq;
         int router; /* Whether this service daemon is a stub
@@ -56,10 +93,8 @@ struct servd_context {
         int router_ip_set;
         struct sockaddr_sv raddr, caddr;
         struct hostctrl *lhc, *rhc;
-        struct list_head reglist;
+        struct registration_table regs;
         struct signal reregister_signal;
-        unsigned int num_regs;
-        pthread_mutex_t lock; /* Protects the registration list */
 };
 
 enum service_type {
@@ -68,66 +103,135 @@ enum service_type {
 };
 
 struct registration {
-        struct list_head lh;
-        struct servd_context *ctx;
+        struct hlist_node node;
+        struct list_head lh; /* In a wheel slot */
         enum service_type type;
         struct service_id srvid;
         unsigned short prefix;
         struct in_addr ipaddr;
-        struct timer timer;
+        unsigned int bucket;
+        unsigned long expires; /* Tick */
         int ip_set;
+        int dead;
 };
 
 #define LOCAL_SERVICE_TIMEOUT (20)
 #define REMOTE_SERVICE_TIMEOUT ((LOCAL_SERVICE_TIMEOUT * 2) + 10)
 
-static void registration_timeout_local(struct timer *t)
+/*
+  The IP address of a local registration changes with the interface
+  address, so it is only part of the key of remote ones.
+*/
+static unsigned int registration_hash(enum service_type type,
+                                      const struct service_id *srvid,
+                                      unsigned short prefix,
+                                      const struct in_addr *ip)
 {
-        struct registration *r = (struct registration *)t->data;
-        char ip1[18];
-        int ret;
+        u32 h = (type << 16) | prefix;
+        unsigned int i;
 
-        printf("Refreshing registration of service %s:%u %s\n",
-               service_id_to_str(&r->srvid), r->prefix,
-               inet_ntop(AF_INET, &r->ipaddr, ip1, 18));
-        
-        ret = hostctrl_service_register(r->ctx->rhc, 
-                                        &r->srvid,
-                                        r->prefix, 
-                                        &r->ipaddr);
-        
-        if (ret <= 0) {
-                fprintf(stderr, "Could not reregister service %s\n",
-                        service_id_to_str(&r->srvid));
+        for (i = 0; i < 8; i++)
+                h = (h * 31) + srvid->s_sid32[i];
+
+        if (type == SERVICE_REMOTE && ip)
+                h = (h * 31) + ip->s_addr;
+
+        return hash_32(h, REG_HTABLE_BITS);
+}
+
+static inline pthread_mutex_t *registration_lock(struct registration_table *tbl,
+                                                 unsigned int bucket)
+{
+        return &tbl->locks[bucket & (REG_HTABLE_LOCKS - 1)];
+}
+
+static struct registration *
+__registration_find(struct registration_table *tbl,
+                    unsigned int bucket,
+                    enum service_type type,
+                    const struct service_id *srvid,
+                    unsigned short prefix,
+                    const struct in_addr *ip)
+{
+        struct registration *r;
+        struct hlist_node *walk;
+
+        hlist_for_each_entry(r, walk, &tbl->hash[bucket], node) {
+                if (r->type == type && r->prefix == prefix &&
+                    memcmp(&r->srvid, srvid, sizeof(*srvid)) == 0 &&
+                    (type != SERVICE_REMOTE || !ip || 
+                     r->ipaddr.s_addr == ip->s_addr))
+                        return r;
         }
+        return NULL;
+}
+
+static inline unsigned int registration_timeout(enum service_type type)
+{
+        return type == SERVICE_LOCAL ? 
+                LOCAL_SERVICE_TIMEOUT : REMOTE_SERVICE_TIMEOUT;
+}
 
-        timer_schedule_secs(&r->ctx->tq, &r->timer, LOCAL_SERVICE_TIMEOUT);
+/* Called with the bucket locked. */
+static void __registration_schedule(struct registration_table *tbl,
+                                    struct registration *r)
+{
+        pthread_mutex_lock(&tbl->wheel_lock);
+        list_add_tail(&r->lh, &tbl->wheel[r->expires & (REG_WHEEL_SIZE - 1)]);
+        pthread_mutex_unlock(&tbl->wheel_lock);
 }
 
-static void registration_timeout_remote(struct timer *t)
+/* 
+   Called with the bucket locked. Reading the tick unlocked can at
+   worst make the registration expire a second early.
+*/
+static inline void __registration_refresh(struct registration_table *tbl,
+                                          struct registration *r)
 {
-        struct registration *r = (struct registration *)t->data;
-        char ip1[18];
+        r->expires = tbl->now + registration_timeout(r->type);
+}
 
-        printf("Registration timeout - service %s:%u %s\n",
-               service_id_to_str(&r->srvid), r->prefix,
-               inet_ntop(AF_INET, &r->ipaddr, ip1, 18));
-        hostctrl_service_remove(r->ctx->lhc, &r->srvid, 
-                                r->prefix, &r->ipaddr);
+/* Called with the bucket locked. */
+static void __registration_unhash(struct registration_table *tbl,
+                                  struct registration *r)
+{
+        hlist_del_init(&r->node);
+        r->dead = 1;
+        atomic_dec(&tbl->count);
 }
 
-static struct registration *registration_add(struct servd_context *ctx,
-                                             enum service_type type,
-                                             const struct service_id *srvid, 
-                                             unsigned short prefix,
-                                             const struct in_addr *ipaddr)
+/*
+  Add a registration, or refresh it if it already exists. Returns 1
+  if it was added, 0 if refreshed, and -1 on error.
+*/
+static int registration_add(struct servd_context *ctx,
+                            enum service_type type,
+                            const struct service_id *srvid, 
+                            unsigned short prefix,
+                            const struct in_addr *ipaddr)
 {
+        struct registration_table *tbl = &ctx->regs;
+        unsigned int bucket = registration_hash(type, srvid, prefix, ipaddr);
         struct registration *r;
 
+        pthread_mutex_lock(registration_lock(tbl, bucket));
+
+        r = __registration_find(tbl, bucket, type, srvid, prefix, ipaddr);
+        
+        if (r) {
+                if (ipaddr)
+                        memcpy(&r->ipaddr, ipaddr, sizeof(*ipaddr));
+                __registration_refresh(tbl, r);
+                pthread_mutex_unlock(registration_lock(tbl, bucket));
+                return 0;
+        }
+
         r = malloc(sizeof(struct registration));
 
-        if (!r)
-                return NULL;
+        if (!r) {
+                pthread_mutex_unlock(registration_lock(tbl, bucket));
+                return -1;
+        }
 
         memset(r, 0, sizeof(struct registration));
         INIT_LIST_HEAD(&r->lh);
@@ -137,52 +241,39 @@ static struct registration *registration_add(struct servd_context *ctx,
                 memcpy(&r->ipaddr, ipaddr, sizeof(struct in_addr));
                 r->ip_set = 1;
         }
-        timer_init(&r->timer);
-        r->timer.data = r;
         r->type = type;
         r->prefix = prefix;
-        r->ctx = ctx;
-        pthread_mutex_lock(&ctx->lock);
-        list_add_tail(&r->lh, &ctx->reglist);
-        ctx->num_regs++;
-        pthread_mutex_unlock(&ctx->lock);
-
-        if (type == SERVICE_LOCAL) {
-                r->timer.callback = registration_timeout_local;
-                timer_schedule_secs(&ctx->tq, &r->timer, LOCAL_SERVICE_TIMEOUT);
-        } else {
-                r->timer.callback = registration_timeout_remote;
-                timer_schedule_secs(&ctx->tq, &r->timer, REMOTE_SERVICE_TIMEOUT);
-        }
+        r->bucket = bucket;
+        hlist_add_head(&r->node, &tbl->hash[bucket]);
+        atomic_inc(&tbl->count);
+        __registration_refresh(tbl, r);
+        __registration_schedule(tbl, r);
+
+        pthread_mutex_unlock(registration_lock(tbl, bucket));
 
-        return r;        
+        return 1;        
 }
 
 static int registration_del(struct servd_context *ctx,
-                            const struct service_id *srvid)
+                            enum service_type type,
+                            const struct service_id *srvid,
+                            unsigned short prefix,
+                            const struct in_addr *ipaddr)
 {
+        struct registration_table *tbl = &ctx->regs;
+        unsigned int bucket = registration_hash(type, srvid, prefix, ipaddr);
         struct registration *r;
-        int ret = 0;
 
-        pthread_mutex_lock(&ctx->lock);
-        
-        list_for_each_entry(r, &ctx->reglist, lh) {
-                if (memcmp(&r->srvid, srvid, 
-                           sizeof(struct service_id)) == 0) {
-                        list_del(&r->lh);
-                        ret = 1;
-                        break;
-                }
-        }
+        pthread_mutex_lock(registration_lock(tbl, bucket));
 
-        pthread_mutex_unlock(&ctx->lock);
+        r = __registration_find(tbl, bucket, type, srvid, prefix, ipaddr);
         
-        if (ret == 1) {
-                timer_del(&ctx->tq, &r->timer);
-                free(r);
-        }
+        if (r)
+                __registration_unhash(tbl, r);
 
-        return ret;
+        pthread_mutex_unlock(registration_lock(tbl, bucket));
+
+        return r != NULL;
 }
 
 static int registration_update_local(struct servd_context *ctx, 
@@ -191,63 +282,64 @@ static int registration_update_local(struct servd_context *ctx,
                                      const struct in_addr *new_ip,
                                      struct in_addr *old_ip)
 {
+        struct registration_table *tbl = &ctx->regs;
+        unsigned int bucket = registration_hash(SERVICE_LOCAL, srvid, 
+                                                prefix, NULL);
         struct registration *r;
-        int ret = 0;
 
-        pthread_mutex_lock(&ctx->lock);
+        pthread_mutex_lock(registration_lock(tbl, bucket));
+
+        r = __registration_find(tbl, bucket, SERVICE_LOCAL, 
+                                srvid, prefix, NULL);
         
-        list_for_each_entry(r, &ctx->reglist, lh) {
-                if (r->type == SERVICE_LOCAL && 
-                    memcmp(&r->srvid, srvid, 
-                           sizeof(struct service_id)) == 0 &&
-                        r->prefix == prefix) {
-                        if (old_ip)
-                                memcpy(old_ip, &r->ipaddr, 
-                                       sizeof(*old_ip));
-                        if (new_ip)
-                                memcpy(&r->ipaddr, new_ip, sizeof(*new_ip));
-                        ret = 1;
-                        break;
-                }
+        if (r) {
+                if (old_ip)
+                        memcpy(old_ip, &r->ipaddr, sizeof(*old_ip));
+                if (new_ip)
+                        memcpy(&r->ipaddr, new_ip, sizeof(*new_ip));
         }
         
-        pthread_mutex_unlock(&ctx->lock);
+        pthread_mutex_unlock(registration_lock(tbl, bucket));
 
-        return ret;
-        
+        return r != NULL;
 }
 
+/*
+  Refresh a remote registration, which moves to another bucket if the
+  IP address changed.
+*/
 static int registration_update_remote(struct servd_context *ctx, 
                                       const struct service_id *srvid,
                                       unsigned short prefix,
                                       const struct in_addr *new_ip,
                                       const struct in_addr *old_ip)
 {
+        struct registration_table *tbl = &ctx->regs;
+        unsigned int bucket = registration_hash(SERVICE_REMOTE, srvid, 
+                                                prefix, old_ip);
         struct registration *r;
-        int ret = 0;
+        int moved = 0;
 
-        pthread_mutex_lock(&ctx->lock);
+        pthread_mutex_lock(registration_lock(tbl, bucket));
+
+        r = __registration_find(tbl, bucket, SERVICE_REMOTE, 
+                                srvid, prefix, old_ip);
         
-        list_for_each_entry(r, &ctx->reglist, lh) {
-                if (r->type == SERVICE_REMOTE && 
-                    memcmp(&r->srvid, srvid, 
-                           sizeof(struct service_id)) == 0 && 
-                    memcmp(&r->ipaddr, old_ip, 
-                           sizeof(*old_ip)) == 0 && 
-                    r->prefix == prefix) {
-                        /* The old IP matched the IP stored,
-                           so this is the old record. */
-                        memcpy(&r->ipaddr, new_ip, 
-                               sizeof(*new_ip));
-                        ret = 1;
-                        timer_mod(&ctx->tq, &r->timer, 
-                                  timer_secs(REMOTE_SERVICE_TIMEOUT));
+        if (r) {
+                if (r->ipaddr.s_addr == new_ip->s_addr) {
+                        __registration_refresh(tbl, r);
+                } else {
+                        __registration_unhash(tbl, r);
+                        moved = 1;
                 }
         }
+
+        pthread_mutex_unlock(registration_lock(tbl, bucket));
         
-        pthread_mutex_unlock(&ctx->lock);
+        if (moved)
+                registration_add(ctx, SERVICE_REMOTE, srvid, prefix, new_ip);
 
-        return ret;
+        return r != NULL;
 }
 
 static int registration_redo(struct servd_context *ctx,
@@ -255,69 +347,313 @@ static int registration_redo(struct servd_context *ctx,
                              const struct in_addr *new_ip,
                              const struct in_addr *old_ip)
 {
-        struct registration *r;
+        struct registration_table *tbl = &ctx->regs;
+        unsigned int i;
         int ret = 0;
 
-        pthread_mutex_lock(&ctx->lock);
+        for (i = 0; i < REG_HTABLE_SIZE; i++) {
+                struct registration *r;
+                struct hlist_node *walk;
+
+                if (hlist_empty(&tbl->hash[i]))
+                        continue;
+
+                pthread_mutex_lock(registration_lock(tbl, i));
         
-        list_for_each_entry(r, &ctx->reglist, lh) {
-                char ip1[18], ip2[18];
+                hlist_for_each_entry(r, walk, &tbl->hash[i], node) {
+                        char ip1[18], ip2[18];
+
+                        if (r->type != SERVICE_LOCAL)
+                                continue;
 
-                printf("Reregistering service %s new_ip=%s old_ip=%s\n",
-                       service_id_to_str(&r->srvid),
-                       inet_ntop(AF_INET, new_ip, ip1, 18),
-                       old_ip ? inet_ntop(AF_INET, old_ip, ip2, 18) : "none");
+                        printf("Reregistering service %s new_ip=%s old_ip=%s\n",
+                               service_id_to_str(&r->srvid),
+                               inet_ntop(AF_INET, new_ip, ip1, 18),
+                               old_ip ? inet_ntop(AF_INET, old_ip, ip2, 18) : "none");
                 
-                ret = hostctrl_service_register(ctx->rhc, &r->srvid, 0, 
-                                                old_ip);
-                
-                if (ret <= 0) {
-                        fprintf(stderr, "Could not reregister service %s\n",
-                                service_id_to_str(&r->srvid));
-                }
+                        ret = hostctrl_service_register(ctx->rhc, &r->srvid, 0, 
+                                                        old_ip);
                 
+                        if (ret <= 0) {
+                                fprintf(stderr, "Could not reregister service %s\n",
+                                        service_id_to_str(&r->srvid));
+                        }
                 
-                memcpy(&r->ipaddr, new_ip, sizeof(*new_ip));
-        }
+                        memcpy(&r->ipaddr, new_ip, sizeof(*new_ip));
+                }
 
-        pthread_mutex_unlock(&ctx->lock);
+                pthread_mutex_unlock(registration_lock(tbl, i));
+        }
 
         return ret;
 }
 
-static int registration_exists(struct servd_context *ctx, 
-                               enum service_type type,
-                               const struct service_id *srvid,
-                               const struct in_addr *ip)
+/*
+  Remove the timed out remote registrations from the service table, in
+  as few messages as possible. Called from the main loop when the
+  expire signal is raised. The batch does not wait for replies.
+*/
+static void registration_expire(struct servd_context *ctx)
 {
-        struct registration *r;
-        int ret = 0;
+        struct registration_table *tbl = &ctx->regs;
+        struct hostctrl_batch *b;
+        struct list_head expired;
+        unsigned int num = 0;
+
+        signal_clear(&tbl->expire_signal);
+        INIT_LIST_HEAD(&expired);
+
+        pthread_mutex_lock(&tbl->wheel_lock);
+        list_splice_init(&tbl->expired, &expired);
+        pthread_mutex_unlock(&tbl->wheel_lock);
+
+        if (list_empty(&expired))
+                return;
+
+        b = hostctrl_batch_begin(ctx->lhc);
+
+        while (!list_empty(&expired)) {
+                struct registration *r = 
+                        list_first_entry(&expired, struct registration, lh);
+                struct service_info si;
+
+                list_del(&r->lh);
+
+                memset(&si, 0, sizeof(si));
+                memcpy(&si.srvid, &r->srvid, sizeof(r->srvid));
+                si.srvid_prefix_bits = r->prefix;
+                memcpy(&si.address, &r->ipaddr, sizeof(r->ipaddr));
+                free(r);
+
+                if (b && hostctrl_batch_append(b, CTRLMSG_TYPE_DEL_SERVICE, 
+                                               &si, NULL) == -1) {
+                        free(b);
+                        b = NULL;
+                }
+                num++;
+        }
+
+        printf("%u remote registrations timed out\n", num);
+
+        if (!b || hostctrl_batch_commit(b) == -1) {
+                fprintf(stderr, "Could not remove timed out services\n");
+        }
+}
+
+/* What a refresh needs of a registration, copied out under its lock */
+struct registration_refresh {
+        struct service_id srvid;
+        unsigned short prefix;
+        struct in_addr ipaddr;
+};
 
-        pthread_mutex_lock(&ctx->lock);
+static void registration_reregister(struct servd_context *ctx,
+                                    struct registration_refresh *rr, 
+                                    unsigned int num)
+{
+        unsigned int i;
         
-        list_for_each_entry(r, &ctx->reglist, lh) {
-                if (memcmp(&r->srvid, srvid, 
-                           sizeof(struct service_id)) == 0 &&
-                    r->type == type) {
-                        ret = 1;
-                        break;
+        for (i = 0; i < num; i++) {
+                char ip1[18];
+                int ret;
+
+                printf("Refreshing registration of service %s:%u %s\n",
+                       service_id_to_str(&rr[i].srvid), 
+                       rr[i].prefix,
+                       inet_ntop(AF_INET, &rr[i].ipaddr, ip1, 18));
+                
+                ret = hostctrl_service_register(ctx->rhc, &rr[i].srvid,
+                                                rr[i].prefix,
+                                                &rr[i].ipaddr);
+                
+                if (ret <= 0) {
+                        fprintf(stderr, "Could not reregister service %s\n",
+                                service_id_to_str(&rr[i].srvid));
                 }
         }
+}
+
+/*
+  Handle the registrations in one wheel slot: free dead ones,
+  reschedule refreshed ones, and collect the ones that timed
+  out. Local registrations are refreshed with the service router, in
+  batches, and remote ones are queued for removal from the service
+  table.
+*/
+static void registration_handle_slot(struct servd_context *ctx,
+                                     unsigned long now)
+{
+        struct registration_table *tbl = &ctx->regs;
+        struct registration_refresh refresh[REG_EXPIRE_BATCH];
+        unsigned int num_refresh = 0;
+        struct list_head slot, expired;
+
+        INIT_LIST_HEAD(&slot);
+        INIT_LIST_HEAD(&expired);
+
+        pthread_mutex_lock(&tbl->wheel_lock);
+        list_splice_init(&tbl->wheel[now & (REG_WHEEL_SIZE - 1)], &slot);
+        pthread_mutex_unlock(&tbl->wheel_lock);
+
+        while (!list_empty(&slot)) {
+                struct registration *r = 
+                        list_first_entry(&slot, struct registration, lh);
+                pthread_mutex_t *lock = registration_lock(tbl, r->bucket);
+                struct registration_refresh *rr;
+
+                list_del_init(&r->lh);
+                pthread_mutex_lock(lock);
+
+                if (r->dead) {
+                        pthread_mutex_unlock(lock);
+                        free(r);
+                        continue;
+                }
 
-        pthread_mutex_unlock(&ctx->lock);
+                if ((long)(r->expires - now) > 0) {
+                        __registration_schedule(tbl, r);
+                        pthread_mutex_unlock(lock);
+                        continue;
+                }
 
-        return ret;
+                if (r->type == SERVICE_REMOTE) {
+                        __registration_unhash(tbl, r);
+                        pthread_mutex_unlock(lock);
+                        list_add_tail(&r->lh, &expired);
+                        continue;
+                }
+
+                rr = &refresh[num_refresh++];
+                __registration_refresh(tbl, r);
+                __registration_schedule(tbl, r);
+
+                memcpy(&rr->srvid, &r->srvid, sizeof(r->srvid));
+                rr->prefix = r->prefix;
+                memcpy(&rr->ipaddr, &r->ipaddr, sizeof(r->ipaddr));
+
+                pthread_mutex_unlock(lock);
+
+                if (num_refresh == REG_EXPIRE_BATCH) {
+                        registration_reregister(ctx, refresh, num_refresh);
+                        num_refresh = 0;
+                }
+        }
+
+        registration_reregister(ctx, refresh, num_refresh);
+
+        if (!list_empty(&expired)) {
+                pthread_mutex_lock(&tbl->wheel_lock);
+                list_splice_tail_init(&expired, &tbl->expired);
+                pthread_mutex_unlock(&tbl->wheel_lock);
+                signal_raise(&tbl->expire_signal);
+        }
+}
+
+static unsigned long registration_ticks(struct registration_table *tbl)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timespec_sub(&now, &tbl->start);
+
+        return now.tv_sec;
+}
+
+/*
+  Advance the wheel to the current time, catching up on slots that
+  were missed if the timer ran late.
+*/
+static void registration_tick(struct timer *t)
+{
+        struct servd_context *ctx = t->data;
+        struct registration_table *tbl = &ctx->regs;
+        unsigned long ticks = registration_ticks(tbl);
+        unsigned long n = 0;
+
+        while ((long)(ticks - tbl->now) > 0) {
+                tbl->now++;
+
+                /* Only the slots differ, not the registrations that
+                   are due */
+                if (n++ < REG_WHEEL_SIZE)
+                        registration_handle_slot(ctx, tbl->now);
+        }
+
+        timer_schedule_secs(&ctx->tq, &tbl->tick, 1);
+}
+
+static int registration_table_init(struct servd_context *ctx)
+{
+        struct registration_table *tbl = &ctx->regs;
+        unsigned int i;
+
+        tbl->hash = malloc(sizeof(struct hlist_head) * REG_HTABLE_SIZE);
+
+        if (!tbl->hash)
+                return -1;
+
+        for (i = 0; i < REG_HTABLE_SIZE; i++)
+                INIT_HLIST_HEAD(&tbl->hash[i]);
+
+        for (i = 0; i < REG_HTABLE_LOCKS; i++)
+                pthread_mutex_init(&tbl->locks[i], NULL);
+
+        for (i = 0; i < REG_WHEEL_SIZE; i++)
+                INIT_LIST_HEAD(&tbl->wheel[i]);
+
+        if (signal_init(&tbl->expire_signal) == -1) {
+                free(tbl->hash);
+                tbl->hash = NULL;
+                return -1;
+        }
+
+        INIT_LIST_HEAD(&tbl->expired);
+        pthread_mutex_init(&tbl->wheel_lock, NULL);
+        atomic_set(&tbl->count, 0);
+        tbl->now = 0;
+        clock_gettime(CLOCK_MONOTONIC, &tbl->start);
+        timer_init(&tbl->tick);
+        tbl->tick.callback = registration_tick;
+        tbl->tick.data = ctx;
+
+        return 0;
 }
 
 static void registration_clear(struct servd_context *ctx)
 {
-        while (!list_empty(&ctx->reglist)) {
+        struct registration_table *tbl = &ctx->regs;
+        unsigned int i;
+
+        if (!tbl->hash)
+                return;
+
+        /* All registrations, including dead ones, are in the wheel */
+        for (i = 0; i < REG_WHEEL_SIZE; i++) {
+                while (!list_empty(&tbl->wheel[i])) {
+                        struct registration *reg = 
+                                list_first_entry(&tbl->wheel[i], 
+                                                 struct registration, lh);
+                        list_del(&reg->lh);
+                        free(reg);
+                }
+        }
+
+        while (!list_empty(&tbl->expired)) {
                 struct registration *reg = 
-                        list_first_entry(&ctx->reglist, 
-                                        struct registration, lh);
+                        list_first_entry(&tbl->expired, 
+                                         struct registration, lh);
                 list_del(&reg->lh);
                 free(reg);
         }
+        
+        signal_destroy(&tbl->expire_signal);
+
+        for (i = 0; i < REG_HTABLE_LOCKS; i++)
+                pthread_mutex_destroy(&tbl->locks[i]);
+
+        pthread_mutex_destroy(&tbl->wheel_lock);
+        free(tbl->hash);
+        tbl->hash = NULL;
 }
 
 static int name_to_inet_addr(const char *name, struct in_addr *ip)
@@ -486,7 +822,7 @@ static int unregister_service_remotely(struct hostctrl *hc,
         if (ctx->rhc) {
                 ret = hostctrl_service_unregister(ctx->rhc, srvid, prefix);
     
-                registration_del(ctx, srvid);
+                registration_del(ctx, SERVICE_LOCAL, srvid, prefix, NULL);
         }
 
         return ret;
@@ -516,9 +852,12 @@ static int handle_incoming_registration(struct hostctrl *hc,
                        inet_ntop(AF_INET, remote_ip, ip1, sizeof(ip1)),
                        old_ip ? inet_ntop(AF_INET, old_ip, ip2, sizeof(ip2)) : "none");
                 */
-                ret = hostctrl_service_modify(ctx->lhc, srvid, prefix, 
-                                              0, 0, old_ip, remote_ip);
-        } else {
+                /* A plain refresh leaves the service table as is */
+                if (old_ip->s_addr != remote_ip->s_addr)
+                        ret = hostctrl_service_modify(ctx->lhc, srvid, prefix, 
+                                                      0, 0, old_ip, remote_ip);
+        } else if (registration_add(ctx, SERVICE_REMOTE, srvid, 
+                                    prefix, remote_ip) == 1) {
                 /* Add this service the local service table. */
                 char buf[18];
                 
@@ -526,9 +865,6 @@ static int handle_incoming_registration(struct hostctrl *hc,
                        service_id_to_str(srvid), prefix,
                        inet_ntop(AF_INET, remote_ip, buf, sizeof(buf)));
                 
-                registration_add(ctx, SERVICE_REMOTE, srvid, 
-                                 prefix, remote_ip);
-
                 ret = hostctrl_service_add(ctx->lhc, srvid, prefix, 
                                            0, 0, remote_ip);
         }
@@ -545,7 +881,7 @@ static int handle_incoming_unregistration(struct hostctrl *hc,
         struct servd_context *ctx = hc->context;
         int ret = 0;
         
-        if (registration_exists(ctx, SERVICE_REMOTE, srvid, remote_ip)) {
+        if (registration_del(ctx, SERVICE_REMOTE, srvid, prefix, remote_ip)) {
                 char buf[18];
                 
                 printf("Remote service %s @ %s unregistered\n", 
@@ -713,17 +1049,65 @@ static void print_usage(void)
                "\t-rid,--router-id SERVICEID\t - Specify the SERVICEID of a router.\n"
                "\t-cid,--client-id SERVICEID\t - Specify the SERVICEID of a client.\n"
                "\t-rip,--router-ip ROUTER_IP\t - Specify the IP of a service router.\n"
+#if defined(OS_LINUX)
+               "\t-s,--single-thread\t\t - Handle all events in one thread.\n"
+#endif
                "\t-h,--help\t\t\t - Print this help message.\n");
 }
 
 
+#if defined(OS_LINUX)
+static void on_rtnl_event(struct event_loop *el, int fd, 
+                          unsigned int events, void *data)
+{
+        rtnl_read((struct netlink_handle *)data);
+}
+
+static void on_exit_event(struct event_loop *el, int fd, 
+                          unsigned int events, void *data)
+{
+        should_exit = 1;
+        event_loop_stop(el);
+}
+
+static void on_expire_event(struct event_loop *el, int fd, 
+                            unsigned int events, void *data)
+{
+        registration_expire((struct servd_context *)data);
+}
+
+/*
+  Run the host controls, the timers and the interface monitor from
+  one event loop, so that all callbacks run in this thread.
+*/
+static int servd_run_event_loop(struct event_loop *el, 
+                                struct servd_context *ctx,
+                                struct netlink_handle *nlh)
+{
+        if (event_loop_add_timer_queue(el, &ctx->tq) == -1 ||
+            event_loop_add_fd(el, nlh->fd, EVENT_IN, 
+                              on_rtnl_event, nlh) == -1 ||
+            event_loop_add_fd(el, signal_get_fd(&ctx->regs.expire_signal),
+                              EVENT_IN, on_expire_event, ctx) == -1 ||
+            event_loop_add_fd(el, signal_get_fd(&exit_signal), EVENT_IN, 
+                              on_exit_event, NULL) == -1) {
+                LOG_ERR("Could not set up event loop\n");
+                return -1;
+        }
+
+        return event_loop_run(el);
+}
+#endif
+
 int main(int argc, char **argv)
 {
 	struct sigaction sigact;
 #if defined(OS_LINUX)
         struct netlink_handle nlh;
+        struct event_loop *el = NULL;
 #endif
         fd_set readfds;
+        int single_thread = 0;
         int daemon = 0;
 	int ret = EXIT_SUCCESS;
         unsigned int router_id = 88888, client_id = 55555;
@@ -732,8 +1116,11 @@ int main(int argc, char **argv)
         memset(&default_service, 0, sizeof(default_service));
 	memset(&sigact, 0, sizeof(struct sigaction));
         memset(&ctx, 0, sizeof(ctx));
-        INIT_LIST_HEAD(&ctx.reglist);
-        pthread_mutex_init(&ctx.lock, NULL);
+        
+        if (registration_table_init(&ctx) == -1) {
+                LOG_ERR("Could not allocate registration table\n");
+                return EXIT_FAILURE;
+        }
 
 	sigact.sa_handler = &signal_handler;
 	sigaction(SIGINT, &sigact, NULL);
@@ -807,7 +1194,10 @@ int main(int argc, char **argv)
 
                         argc--;
                         argv++;
-                } 
+                } else if (strcmp(argv[0], "-s") == 0 ||
+                           strcmp(argv[0], "--single-thread") == 0) {
+                        single_thread = 1;
+                }
 		argc--;
 		argv++;
 	}	
@@ -826,9 +1216,12 @@ int main(int argc, char **argv)
 
         if (ret == -1) {
                 LOG_ERR("timer_queue_init failure\n");
+                registration_clear(&ctx);
                 return -1;
         }
 
+        timer_schedule_secs(&ctx.tq, &ctx.regs.tick, 1);
+
 	ret = signal_init(&exit_signal);
 
         if (ret == -1) {
@@ -882,16 +1275,36 @@ int main(int argc, char **argv)
                 goto fail_hostctrl_remote;
         }
 
-        hostctrl_start(ctx.rhc);
-        hostctrl_start(ctx.lhc);
+#if defined(OS_LINUX)
+        if (single_thread) {
+                el = event_loop_create();
+
+                if (!el) {
+                        LOG_ERR("Could not create event loop\n");
+                        goto fail_event_loop;
+                }
+                if (hostctrl_start_loop(ctx.rhc, el) < 0 ||
+                    hostctrl_start_loop(ctx.lhc, el) < 0) {
+                        LOG_ERR("Could not run host control on event loop\n");
+                        ret = -1;
+                        goto fail_start_loop;
+                }
+        } else
+#endif
+        {
+                hostctrl_start(ctx.rhc);
+                hostctrl_start(ctx.lhc);
+        }
 
         /* If we are a client and have a fixed IP for the service
            router, then replace an existing "default" service rule by
            querying for the current one and modifying it in the
-           resulting callback. */
+           resulting callback. On an event loop, the reply is
+           handled once the loop runs. */
         if (ctx.router_ip_set && !ctx.router) {
                 hostctrl_service_get(ctx.lhc, &default_service, 0, NULL);
-                if (signal_wait(&ctx.reregister_signal, 3000) == 0) {
+                if (!single_thread &&
+                    signal_wait(&ctx.reregister_signal, 3000) == 0) {
                         LOG_DBG("Timeout when retrieving default entry\n");
                 }
         }
@@ -925,6 +1338,11 @@ int main(int argc, char **argv)
 
 #define MAX(x,y) (x > y ? x : y)
 
+#if defined(OS_LINUX)
+        if (el && servd_run_event_loop(el, &ctx, &nlh) == -1)
+                should_exit = 1;
+#endif
+
         while (!should_exit) {
                 int maxfd = 0;
                 struct timeval timeout = { 0, 0 }, *t = NULL;
@@ -938,6 +1356,9 @@ int main(int argc, char **argv)
                 FD_SET(nlh.fd, &readfds);
 		maxfd = MAX(nlh.fd, maxfd);
 #endif
+                FD_SET(signal_get_fd(&ctx.regs.expire_signal), &readfds);
+                maxfd = MAX(signal_get_fd(&ctx.regs.expire_signal), maxfd);
+
                 FD_SET(signal_get_fd(&exit_signal), &readfds);
                 maxfd = MAX(signal_get_fd(&exit_signal), maxfd);
 
@@ -966,6 +1387,10 @@ int main(int argc, char **argv)
                                 rtnl_read(&nlh);
                         }
 #endif
+                        if (FD_ISSET(signal_get_fd(&ctx.regs.expire_signal), 
+                                     &readfds)) {
+                                registration_expire(&ctx);
+                        }
                         if (FD_ISSET(signal_get_fd(&exit_signal), &readfds)) {
                                 should_exit = 1;
                         }
@@ -986,11 +1411,23 @@ int main(int argc, char **argv)
 #if defined(OS_LINUX)
 	rtnl_fini(&nlh);
  fail_netlink:
+ fail_start_loop:
+        if (el) {
+                /* Stop the channels before the loop goes away */
+                hostctrl_free(ctx.rhc);
+                hostctrl_free(ctx.lhc);
+                event_loop_free(el);
+                goto out_event_loop;
+        }
+ fail_event_loop:
 #endif
         hostctrl_free(ctx.rhc);
         ctx.rhc = NULL;
  fail_hostctrl_remote:
         hostctrl_free(ctx.lhc);
+#if defined(OS_LINUX)
+ out_event_loop:
+#endif
  fail_hostctrl_local:
         libservalctrl_fini();
  fail_libservalctrl:
@@ -1001,7 +1438,6 @@ int main(int argc, char **argv)
         timer_queue_fini(&ctx.tq);
 
         registration_clear(&ctx);
-        pthread_mutex_destroy(&ctx.lock);
 	LOG_DBG("done\n");
 
         return ret;
@@ -54,11 +54,17 @@ extern int __init packet_init(void);
 extern void __exit packet_fini(void);
 extern int __init service_init(void);
 extern void __exit service_fini(void);
+extern int __init serval_tcp_metrics_init(void);
+extern void __exit serval_tcp_metrics_fini(void);
+extern int __init serval_sal_init(void);
+extern void __exit serval_sal_fini(void);
 
 extern struct proto serval_udp_proto;
 extern struct proto serval_tcp_proto;
 
-struct netns_serval net_serval;
+struct netns_serval net_serval = {
+        .sysctl_sal_syncookies = SAL_SYNCOOKIES_ON_OVERFLOW,
+};
 
 static struct sock *serval_accept_dequeue(struct sock *parent,
                                           struct socket *newsock);
@@ -162,6 +168,10 @@ int serval_bind(struct socket *sock, struct sockaddr *addr, int addr_len)
                 return -EINVAL;
         }
 
+        /* Reuse groups register once, for the first member */
+        if (serval_sock_flag(ssk, SSK_FLAG_JOINED))
+                return 0;
+
         /* Notify the service daemon */
         memset(&cm, 0, sizeof(cm));
         cm.cmh.type = CTRLMSG_TYPE_REGISTER;
@@ -302,8 +312,29 @@ int serval_setsockopt(struct socket *sock, int level, int optname,
 
 static int serval_listen_start(struct sock *sk, int backlog)
 {
+        struct serval_sock *ssk = serval_sk(sk);
+        struct serval_request_sock *srsk;
+        int err;
+
+        err = serval_sock_syn_hash_resize(sk, backlog);
+
+        if (err)
+                return err;
+
         serval_sock_set_state(sk, SERVAL_LISTEN);
+
+        /* A sock that listens again keeps its pending requests, so
+         * count them rather than start from zero */
         sk->sk_ack_backlog = 0;
+        ssk->accept_queue_len = 0;
+
+        list_for_each_entry(srsk, &ssk->syn_queue, lh)
+                sk->sk_ack_backlog++;
+
+        list_for_each_entry(srsk, &ssk->accept_queue, lh)
+                ssk->accept_queue_len++;
+
+        sk->sk_ack_backlog += ssk->accept_queue_len;
  
         return 0;
 }
@@ -324,6 +355,7 @@ static int serval_listen_stop(struct sock *sk)
                                         struct serval_request_sock, lh);
                 
                 list_del(&srsk->lh);
+                serval_rsk_unhash(srsk);
 
                 LOG_DBG("deleting SYN queued request socket\n");
 
@@ -342,6 +374,7 @@ static int serval_listen_stop(struct sock *sk)
                                         struct serval_request_sock, lh);
                 
                 list_del(&srsk->lh);
+                serval_rsk_unhash(srsk);
 
                 if (srsk->rsk.req.sk) {
                         struct sock *child = srsk->rsk.req.sk;
@@ -372,9 +405,12 @@ static int serval_listen_stop(struct sock *sk)
                         sock_put(child);
                 }
                 reqsk_free(&srsk->rsk.req);
+                ssk->accept_queue_len--;
                 sk->sk_ack_backlog--;
         }
 
+        serval_sock_syn_hash_destroy(sk);
+
         return 0;
 }
 
@@ -439,7 +475,9 @@ struct sock *serval_accept_dequeue(struct sock *parent,
                 }
 
                 list_del(&srsk->lh);
+                serval_rsk_unhash(srsk);
                 reqsk_free(&srsk->rsk.req);
+                pssk->accept_queue_len--;
                 parent->sk_ack_backlog--;
                 return sk;
         }
@@ -669,9 +707,11 @@ static int serval_shutdown(struct socket *sock, int how)
 
         /*
           Unregister notification only if we previously registered and
-          this is not a child socket.
+          this is not a child socket. Reuse groups unregister when
+          their last member is unhashed.
         */
-        if (serval_sock_flag(ssk, SSK_FLAG_BOUND) &&
+        if (!(ssk->srvid_flags & SVSF_REUSEPORT) &&
+            serval_sock_flag(ssk, SSK_FLAG_BOUND) &&
             !serval_sock_flag(ssk, SSK_FLAG_AUTOBOUND) && 
             !serval_sock_flag(ssk, SSK_FLAG_CHILD)) {
                 struct ctrlmsg_register cm;
@@ -1068,6 +1108,20 @@ int __init serval_init(void)
                   goto fail_sock;
         }
 
+        err = serval_tcp_metrics_init();
+
+        if (err < 0) {
+                LOG_CRIT("Cannot initialize TCP metrics cache\n");
+                goto fail_metrics;
+        }
+
+        err = serval_sal_init();
+
+        if (err < 0) {
+                LOG_CRIT("Cannot initialize SAL\n");
+                goto fail_sal;
+        }
+
         err = packet_init();
 
         if (err != 0) {
@@ -1105,6 +1159,10 @@ fail_tcp_proto:
 fail_udp_proto:
         packet_fini();
 fail_packet:
+        serval_sal_fini();
+fail_sal:
+        serval_tcp_metrics_fini();
+fail_metrics:
         serval_sock_tables_fini();
 fail_sock:
         service_fini();
@@ -1122,6 +1180,8 @@ void __exit serval_fini(void)
 	proto_unregister(&serval_udp_proto);
 	proto_unregister(&serval_tcp_proto);
         packet_fini();
+        serval_sal_fini();
+        serval_tcp_metrics_fini();
         serval_sock_tables_fini();
         service_fini();
 }
@@ -13,6 +13,7 @@ struct ctl_table_header;
 struct netns_serval {
 	int sysctl_sal_forward;
 	int sysctl_udp_encap;
+        int sysctl_sal_syncookies;
         int sysctl_udp_encap_client_port;
         int sysctl_udp_encap_server_port;
 	struct ctl_table_header *ctl;
@@ -515,15 +515,73 @@ static int bst_node_init(struct bst_node *n,
         return 0;
 }
 
+void bst_node_reserve_init(struct bst_node_reserve *r, 
+                           unsigned int prefix_size)
+{
+        INIT_LIST_HEAD(&r->nodes);
+        r->count = 0;
+        r->prefix_size = prefix_size;
+}
+
+/*
+  Allocate num nodes that later inserts can take from the reserve
+  instead of allocating. Returns the number of nodes reserved.
+ */
+int bst_node_reserve_fill(struct bst_node_reserve *r, unsigned int num,
+                          gfp_t alloc)
+{
+        while (r->count < num) {
+                struct bst_node *n;
+
+                n = (struct bst_node *)MALLOC(sizeof(*n) + r->prefix_size, 
+                                              alloc);
+                
+                if (!n)
+                        break;
+                
+                list_add(&n->lh, &r->nodes);
+                r->count++;
+        }
+        return r->count;
+}
+
+void bst_node_reserve_release(struct bst_node_reserve *r)
+{
+        while (!list_empty(&r->nodes)) {
+                struct bst_node *n = 
+                        list_first_entry(&r->nodes, struct bst_node, lh);
+                list_del(&n->lh);
+                FREE(n);
+        }
+        r->count = 0;
+}
+
+static struct bst_node *bst_node_alloc(unsigned int prefix_size,
+                                       struct bst_node_reserve *r,
+                                       gfp_t alloc)
+{
+        struct bst_node *n;
+
+        if (r && r->count > 0 && prefix_size <= r->prefix_size) {
+                n = list_first_entry(&r->nodes, struct bst_node, lh);
+                list_del(&n->lh);
+                r->count--;
+                return n;
+        }
+
+        return (struct bst_node *)MALLOC(sizeof(*n) + prefix_size, alloc);
+}
+
 static struct bst_node *bst_create_node(struct bst_node *parent,
                                         void *prefix, 
                                         unsigned int prefix_size,
                                         unsigned int prefix_bits,
+                                        struct bst_node_reserve *r,
                                         gfp_t alloc)
 {
         struct bst_node *n;
 
-	n = (struct bst_node *)MALLOC(sizeof(*n) + prefix_size, alloc);
+	n = bst_node_alloc(prefix_size, r, alloc);
 	
 	if (!n)
 		return NULL;
@@ -579,6 +637,7 @@ static struct bst_node *bst_node_new(struct bst_node *parent,
                                      void *private,
 				     void *prefix, 
 				     unsigned int prefix_bits,
+                                     struct bst_node_reserve *r,
                                      gfp_t alloc)
 {
 
@@ -589,7 +648,7 @@ static struct bst_node *bst_node_new(struct bst_node *parent,
                                      prefix,
                                      PREFIX_SIZE(parent->prefix_bits + 1),
                                      prefix_bits,
-                                     alloc);
+                                     r, alloc);
                 
                 if (!n) {
                         LOG_ERR("Memory allocation failed\n");
@@ -616,11 +675,12 @@ static struct bst_node *bst_node_new(struct bst_node *parent,
         return n;
 }
 
-struct bst_node *bst_node_insert_prefix(struct bst_node *root, 
-                                        struct bst_node_ops *ops, 
-                                        void *private, void *prefix, 
-                                        unsigned int prefix_bits,
-                                        gfp_t alloc)
+static struct bst_node *bst_node_insert_prefix(struct bst_node *root, 
+                                               struct bst_node_ops *ops, 
+                                               void *private, void *prefix, 
+                                               unsigned int prefix_bits,
+                                               struct bst_node_reserve *r,
+                                               gfp_t alloc)
 {
 	struct bst_node *n, *prev = NULL;
         
@@ -635,7 +695,8 @@ struct bst_node *bst_node_insert_prefix(struct bst_node *root,
           bst_node_flag(n, BST_FLAG_ACTIVE));
         */
         if (n->prefix_bits < prefix_bits) {
-                n = bst_node_new(n, ops, private, prefix, prefix_bits, alloc);
+                n = bst_node_new(n, ops, private, prefix, prefix_bits, 
+                                 r, alloc);
 		
 		if (!n) {
                         LOG_ERR("node_new failed\n");
@@ -654,16 +715,39 @@ struct bst_node *bst_node_insert_prefix(struct bst_node *root,
 	return n;
 }
 
-struct bst_node *bst_insert_prefix(struct bst *tree, struct bst_node_ops *ops, 
-                                   void *private, void *prefix, 
-                                   unsigned int prefix_bits,
-                                   gfp_t alloc)
+/*
+  The number of nodes an insert of the prefix would add to the tree
+  in its current state.
+ */
+unsigned int bst_nodes_needed(struct bst *tree, void *prefix,
+                              unsigned int prefix_bits)
+{
+        struct bst_node *n, *prev = NULL;
+
+        if (tree->entries == 0)
+                return prefix_bits + 1;
+
+        n = bst_node_find_longest_prefix(tree->root, &prev, prefix, 
+                                         prefix_bits, NULL);
+        
+        return prefix_bits - n->prefix_bits;
+}
+
+/*
+  Insert a prefix, taking new nodes from the reserve r while it has
+  any left, and allocating them otherwise.
+ */
+struct bst_node *bst_insert_prefix_reserved(struct bst *tree, 
+                                            struct bst_node_ops *ops, 
+                                            void *private, void *prefix, 
+                                            unsigned int prefix_bits,
+                                            struct bst_node_reserve *r,
+                                            gfp_t alloc)
 {
         struct bst_node *n;
 
         if (tree->entries == 0) {
-                tree->root = (struct bst_node *)MALLOC(sizeof(struct bst_node), 
-                                                       alloc);
+                tree->root = bst_node_alloc(0, r, alloc);
                 
                 if (!tree->root)
                         return NULL;
@@ -679,7 +763,7 @@ struct bst_node *bst_insert_prefix(struct bst *tree, struct bst_node_ops *ops,
         }
 
         n = bst_node_insert_prefix(tree->root, ops, private, 
-                                   prefix, prefix_bits, alloc);
+                                   prefix, prefix_bits, r, alloc);
 
         if (n) {
                 tree->entries++;
@@ -688,6 +772,107 @@ struct bst_node *bst_insert_prefix(struct bst *tree, struct bst_node_ops *ops,
         return n;
 }
 
+struct bst_node *bst_insert_prefix(struct bst *tree, struct bst_node_ops *ops, 
+                                   void *private, void *prefix, 
+                                   unsigned int prefix_bits,
+                                   gfp_t alloc)
+{
+        return bst_insert_prefix_reserved(tree, ops, private, prefix,
+                                          prefix_bits, NULL, alloc);
+}
+
+/*
+  The node following n in a pre-order walk, i.e., in the order of the
+  prefixes, with a prefix before the longer prefixes it covers.
+ */
+static struct bst_node *bst_node_preorder_next(struct bst_node *n)
+{
+        if (n->left)
+                return n->left;
+
+        if (n->right)
+                return n->right;
+
+        /* Climb until there is a right subtree we have not visited */
+        while (n->parent != n) {
+                struct bst_node *parent = n->parent;
+
+                if (parent->left == n && parent->right)
+                        return parent->right;
+                n = parent;
+        }
+        return NULL;
+}
+
+/* The first active node following n in prefix order */
+struct bst_node *bst_node_next(struct bst_node *n)
+{
+        do {
+                n = bst_node_preorder_next(n);
+        } while (n && !bst_node_flag(n, BST_FLAG_ACTIVE));
+
+        return n;
+}
+
+/*
+  Find the first active node following the given prefix, which need
+  not be in the tree. This allows walking the tree in steps, without
+  holding on to nodes that may be removed in between. With a NULL
+  prefix, the first active node is returned.
+ */
+struct bst_node *bst_find_next(struct bst *tree, void *prefix,
+                               unsigned int prefix_bits)
+{
+        struct bst_node *n = tree->root;
+
+        if (!n || tree->entries == 0)
+                return NULL;
+
+        if (!prefix) {
+                if (bst_node_flag(n, BST_FLAG_ACTIVE))
+                        return n;
+                return bst_node_next(n);
+        }
+        
+        while (n->prefix_bits < prefix_bits) {
+                struct bst_node *child = CHECK_BIT(prefix, n->prefix_bits) ?
+                        n->right : n->left;
+
+                if (!child)
+                        break;
+                n = child;
+        }
+
+        if (n->prefix_bits == prefix_bits)
+                return bst_node_next(n);
+
+        /* The prefix branches off from the tree below n. If it
+           would have been a left child, the right subtree follows
+           it. */
+        if (!CHECK_BIT(prefix, n->prefix_bits) && n->right) {
+                n = n->right;
+
+                if (bst_node_flag(n, BST_FLAG_ACTIVE))
+                        return n;
+                return bst_node_next(n);
+        }
+
+        /* Otherwise, skip the subtree of n entirely */
+        while (n->parent != n) {
+                struct bst_node *parent = n->parent;
+
+                if (parent->left == n && parent->right) {
+                        n = parent->right;
+                        
+                        if (bst_node_flag(n, BST_FLAG_ACTIVE))
+                                return n;
+                        return bst_node_next(n);
+                }
+                n = parent;
+        }
+        return NULL;
+}
+
 void bst_remove_node(struct bst *tree, struct bst_node *n)
 {
         bst_node_remove(n);
@@ -2,6 +2,8 @@
 #ifndef _BST_H_
 #define _BST_H_
 
+#include <serval/list.h>
+
 struct bst_node;
 
 struct bst {
@@ -19,12 +21,36 @@ struct bst_node_ops {
 
 extern struct bst_node_ops default_bst_node_ops;
 
+/*
+  Nodes allocated ahead of inserts, so that a tree can be grown while
+  it is locked without allocating memory there.
+ */
+struct bst_node_reserve {
+        struct list_head nodes;
+        unsigned int count;
+        unsigned int prefix_size; /* Largest prefix a node can hold */
+};
+
+void bst_node_reserve_init(struct bst_node_reserve *r, 
+                           unsigned int prefix_size);
+int bst_node_reserve_fill(struct bst_node_reserve *r, unsigned int num,
+                          gfp_t alloc);
+void bst_node_reserve_release(struct bst_node_reserve *r);
+
 int bst_init(struct bst *tree);
 void bst_destroy(struct bst *tree);
 struct bst_node *bst_insert_prefix(struct bst *tree, struct bst_node_ops *ops,
                                    void *private, void *prefix, 
                                    unsigned int prefix_bits,
                                    gfp_t alloc);
+struct bst_node *bst_insert_prefix_reserved(struct bst *tree, 
+                                            struct bst_node_ops *ops,
+                                            void *private, void *prefix, 
+                                            unsigned int prefix_bits,
+                                            struct bst_node_reserve *r,
+                                            gfp_t alloc);
+unsigned int bst_nodes_needed(struct bst *tree, void *prefix,
+                              unsigned int prefix_bits);
 void bst_remove_node(struct bst *tree, struct bst_node *n);
 int bst_remove_prefix(struct bst *tree, void *prefix,
                        unsigned int prefix_bits);
@@ -39,6 +65,10 @@ struct bst_node *bst_find_longest_prefix_match(struct bst *tree,
                                                unsigned int prefix_bits,
                                                int (*match)(struct bst_node *));
 
+struct bst_node *bst_node_next(struct bst_node *n);
+struct bst_node *bst_find_next(struct bst *tree, void *prefix,
+                               unsigned int prefix_bits);
+
 int bst_node_print_prefix(struct bst_node *n, char *buf, int buflen);
 int bst_print(struct bst *tree, char *buf, int buflen);
 void *bst_node_get_private(struct bst_node *n);
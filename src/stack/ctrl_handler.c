@@ -37,6 +37,7 @@ static const char *ctrlmsg_str[] = {
         [CTRLMSG_TYPE_SERVICE_STAT] = "CTRLMSG_TYPE_SERVICE_STAT",
         [CTRLMSG_TYPE_CAPABILITIES] = "CTRLMSG_TYPE_CAPABILITIES",
         [CTRLMSG_TYPE_MIGRATE] = "CTRLMSG_TYPE_MIGRATE",
+        [CTRLMSG_TYPE_STATS_DELTA] = "CTRLMSG_TYPE_STATS_DELTA",
         [CTRLMSG_TYPE_DUMMY] = "CTRLMSG_TYPE_DUMMY",
         NULL
 };
@@ -56,29 +57,65 @@ static int dummy_ctrlmsg_handler(struct ctrlmsg *cm)
         return 0;
 }
 
+static void ctrl_bulk_entry_init(struct service_bulk_entry *e,
+                                 struct service_info *entry)
+{
+        memset(e, 0, sizeof(*e));
+        memcpy(&e->srvid, &entry->srvid, sizeof(e->srvid));
+        e->prefix_bits = SERVICE_ID_MAX_PREFIX_BITS;
+
+        if (entry->srvid_prefix_bits > 0)
+                e->prefix_bits = entry->srvid_prefix_bits;
+
+        e->flags = entry->srvid_flags;
+        e->priority = entry->priority;
+        e->weight = entry->weight;
+        e->dst = &entry->address;
+        e->dstlen = sizeof(entry->address);
+}
+
+/*
+  Services are added as one bulk update of the service table. The
+  reply carries all entries in the order requested, where the ones
+  that could not be added have their flags set to SVSF_INVALID.
+ */
 static int ctrl_handle_add_service_msg(struct ctrlmsg *cm)
 {
         struct ctrlmsg_service *cmr = (struct ctrlmsg_service *)cm;
         unsigned int num_res = CTRLMSG_SERVICE_NUM(cmr);
+        struct service_bulk_entry *entries;
         /* TODO - flags, etc */
-        unsigned int i, index = 0;
-        int err = 0;
+        unsigned int i;
+        int ret;
 
         LOG_DBG("adding %u services, msg size %u\n", 
                 num_res, CTRLMSG_SERVICE_LEN(cmr));
+
+        if (num_res == 0) {
+                cm->retval = CTRLMSG_RETVAL_NOENTRY;
+                ctrl_sendmsg(cm, GFP_KERNEL);
+                return 0;
+        }
+
+        entries = kmalloc(sizeof(*entries) * num_res, GFP_KERNEL);
+
+        if (!entries) {
+                cm->retval = CTRLMSG_RETVAL_ERROR;
+                ctrl_sendmsg(cm, GFP_KERNEL);
+                return -ENOMEM;
+        }
         
         for (i = 0; i < num_res; i++) {
-                struct net_device *dev = NULL;
                 struct service_info *entry = &cmr->service[i];
-                unsigned short prefix_bits = SERVICE_ID_MAX_PREFIX_BITS;
+                struct service_bulk_entry *e = &entries[i];
 
-                dev = resolve_dev(entry);
-                
-                if (!dev)
-                        continue;
+                ctrl_bulk_entry_init(e, entry);
+                /* An entry without a target is rejected by the bulk
+                 * add */
+                e->out = make_target(resolve_dev(entry));
 
-                if (entry->srvid_prefix_bits > 0)
-                        prefix_bits = entry->srvid_prefix_bits;
+                if (!e->out.dev)
+                        e->dstlen = 0;
          
 #if defined(ENABLE_DEBUG)
                 {
@@ -86,44 +123,35 @@ static int ctrl_handle_add_service_msg(struct ctrlmsg *cm)
                         LOG_DBG("Adding service id: %s(%u) "
                                 "@ address %s, priority %u, weight %u\n", 
                                 service_id_to_str(&entry->srvid), 
-                                prefix_bits, 
+                                e->prefix_bits, 
                                 inet_ntop(AF_INET, &entry->address,
                                           ipstr, sizeof(ipstr)),
                                 entry->priority, entry->weight);
                 }
 #endif
-                err = service_add(&entry->srvid, 
-                                  prefix_bits, 
-                                  RULE_FORWARD,
-                                  entry->srvid_flags, 
-                                  entry->priority, 
-                                  entry->weight,
-                                  &entry->address, 
-                                  sizeof(entry->address),
-                                  make_target(dev), GFP_KERNEL);
-
-                dev_put(dev);
+        }
 
-                if (err > 0) {
-                        if (index < i) {
-                                /* copy it over */
-                                memcpy(&cmr->service[index], 
-                                       entry, sizeof(*entry));
-                        }
-                        index++;
-                } else {
+        ret = service_add_bulk(RULE_FORWARD, entries, num_res, GFP_KERNEL);
+
+        for (i = 0; i < num_res; i++) {
+                struct service_bulk_entry *e = &entries[i];
+
+                if (e->out.dev)
+                        dev_put(e->out.dev);
+
+                if (e->result <= 0) {
                         LOG_ERR("Error adding service %s: err=%d\n", 
-                                service_id_to_str(&entry->srvid), err);
+                                service_id_to_str(&e->srvid), e->result);
+                        cmr->service[i].srvid_flags = SVSF_INVALID;
                 }
         }
 
-        if (index == 0) {
-                /* Just return the original request with a return value */
+        kfree(entries);
+
+        if (ret <= 0) {
                 cm->retval = CTRLMSG_RETVAL_NOENTRY;
         } else {
-                /* Return the entries added */
                 cm->retval = CTRLMSG_RETVAL_OK;
-                cm->len = CTRLMSG_SERVICE_NUM_LEN(index);
         }
 
         ctrl_sendmsg(cm, GFP_KERNEL);
@@ -131,6 +159,11 @@ static int ctrl_handle_add_service_msg(struct ctrlmsg *cm)
         return 0;
 }
 
+/*
+  Like adds, deletes are applied as one bulk update, and the reply
+  has an entry per requested service. Failed entries are flagged
+  SVSF_INVALID and have zero statistics.
+ */
 static int ctrl_handle_del_service_msg(struct ctrlmsg *cm)
 {
         struct ctrlmsg_service *cmr = (struct ctrlmsg_service *)cm;
@@ -138,15 +171,27 @@ static int ctrl_handle_del_service_msg(struct ctrlmsg *cm)
         const size_t cmsg_size = sizeof(struct ctrlmsg_service_info_stat) + 
                 sizeof(struct service_info_stat) * num_res;
         struct ctrlmsg_service_info_stat *cms;
+        struct service_bulk_entry *entries;
         struct service_id null_service = { .s_sid = { 0 } };
-        unsigned int i = 0, index = 0;
-        int err = 0;       
+        unsigned int i = 0;
+        int ret;
 
         LOG_DBG("deleting %u services\n", num_res);
 
+        if (num_res == 0) {
+                cm->retval = CTRLMSG_RETVAL_NOENTRY;
+                ctrl_sendmsg(cm, GFP_KERNEL);
+                return 0;
+        }
+
         cms = kmalloc(cmsg_size, GFP_KERNEL);
+        entries = kmalloc(sizeof(*entries) * num_res, GFP_KERNEL);
 
-        if (!cms) {
+        if (!cms || !entries) {
+                if (cms)
+                        kfree(cms);
+                if (entries)
+                        kfree(entries);
                 cm->retval = CTRLMSG_RETVAL_ERROR;
                 ctrl_sendmsg(cm, GFP_KERNEL);
                 return -ENOMEM;
@@ -156,61 +201,45 @@ static int ctrl_handle_del_service_msg(struct ctrlmsg *cm)
 
         for (i = 0; i < num_res; i++) {
                 struct service_info *entry = &cmr->service[i];
-                struct service_info_stat *stat = &cms->service[index];
-                struct target_stats tstat;
-                struct service_entry *se;
-                unsigned short prefix_bits = SERVICE_ID_MAX_PREFIX_BITS;
+
+                ctrl_bulk_entry_init(&entries[i], entry);
 
                 /*
                   We might be trying to delete the "default" entry. In
                   that case
                 */
                 if (memcmp(&entry->srvid, &null_service, 
-                           sizeof(null_service)) == 0 ||
-                    entry->srvid_prefix_bits > 0)
-                        prefix_bits = entry->srvid_prefix_bits;
-                
-                se = service_find_exact(&entry->srvid, 
-                                        prefix_bits);
-
-                if (!se) {
-                        LOG_DBG("No match for serviceID %s:(%u)\n",
-                                service_id_to_str(&entry->srvid),
-                                prefix_bits);
-                        continue;
-                }
-
-                memset(&tstat, 0, sizeof(tstat));
-                
-                err = service_entry_remove_target(se,
-                                                  RULE_FORWARD, 
-                                                  &entry->address, 
-                                                  sizeof(entry->address), 
-                                                  &tstat);
+                           sizeof(null_service)) == 0)
+                        entries[i].prefix_bits = entry->srvid_prefix_bits;
+        }
 
-                if (err > 0) {
-                        stat->duration_sec = tstat.duration_sec;
-                        stat->duration_nsec = tstat.duration_nsec;
-                        stat->packets_resolved = tstat.packets_resolved;
-                        stat->bytes_resolved = tstat.bytes_resolved;
-                        stat->packets_dropped = tstat.packets_dropped;
-                        stat->bytes_dropped = tstat.packets_dropped;
+        ret = service_del_bulk(RULE_FORWARD, entries, num_res);
 
-                        if (index < i) {
-                                memcpy(&stat->service, entry, 
-                                       sizeof(*entry));
-                        }
-                        index++;
+        for (i = 0; i < num_res; i++) {
+                struct service_bulk_entry *e = &entries[i];
+                struct service_info_stat *stat = &cms->service[i];
+
+                memcpy(&stat->service, &cmr->service[i], 
+                       sizeof(stat->service));
+
+                if (e->result > 0) {
+                        stat->duration_sec = e->stats.duration_sec;
+                        stat->duration_nsec = e->stats.duration_nsec;
+                        stat->packets_resolved = e->stats.packets_resolved;
+                        stat->bytes_resolved = e->stats.bytes_resolved;
+                        stat->packets_dropped = e->stats.packets_dropped;
+                        stat->bytes_dropped = e->stats.bytes_dropped;
                 } else {
-                        LOG_ERR("Could not remove service %s: %d\n", 
-                                service_id_to_str(&entry->srvid), 
-                                err);
+                        LOG_DBG("No match for serviceID %s:(%u)\n",
+                                service_id_to_str(&e->srvid),
+                                e->prefix_bits);
+                        stat->service.srvid_flags = SVSF_INVALID;
                 }
-
-                service_entry_put(se);
         }
 
-        if (index == 0) {
+        kfree(entries);
+
+        if (ret <= 0) {
                 cm->retval = CTRLMSG_RETVAL_NOENTRY;
                 ctrl_sendmsg(cm, GFP_KERNEL);
         } else {
@@ -218,7 +247,7 @@ static int ctrl_handle_del_service_msg(struct ctrlmsg *cm)
                 cms->xid = cmr->xid;
                 cms->cmh.xid = cm->xid;
                 cms->cmh.retval = CTRLMSG_RETVAL_OK;
-                cms->cmh.len = CTRLMSG_SERVICE_INFO_STAT_NUM_LEN(index);
+                cms->cmh.len = CTRLMSG_SERVICE_INFO_STAT_NUM_LEN(num_res);
                 ctrl_sendmsg(&cms->cmh, GFP_KERNEL);
         }
 
@@ -310,6 +339,127 @@ static int ctrl_handle_mod_service_msg(struct ctrlmsg *cm)
         return 0;
 }
 
+struct get_service_chunk {
+        struct ctrlmsg_service *cres;
+        unsigned int num;
+        /* Skip the targets up to and including this one */
+        int resume;
+        struct in_addr resume_addr;
+        uint32_t resume_priority;
+};
+
+static int ctrl_fill_service_chunk(struct service_entry *se, void *arg)
+{
+        struct get_service_chunk *gsc = (struct get_service_chunk *)arg;
+        struct service_iter iter;
+        struct target *t;
+
+        /* Only whole entries, unless it is the first one */
+        if (gsc->num > 0 && 
+            gsc->num + se->count > CTRLMSG_SERVICE_GET_MAX_NUM)
+                return -1;
+
+        memset(&iter, 0, sizeof(iter));
+        service_iter_init(&iter, se, SERVICE_ITER_FORWARD);
+
+        while ((t = service_iter_next(&iter)) != NULL &&
+               gsc->num < CTRLMSG_SERVICE_GET_MAX_NUM) {
+                struct service_info *entry;
+
+                if (gsc->resume) {
+                        if (t->dstlen == sizeof(gsc->resume_addr) &&
+                            memcmp(t->dst, &gsc->resume_addr, 
+                                   t->dstlen) == 0 &&
+                            service_iter_get_priority(&iter) == 
+                            gsc->resume_priority)
+                                gsc->resume = 0;
+                        continue;
+                }
+
+                entry = &gsc->cres->service[gsc->num++];
+
+                service_get_id(se, &entry->srvid);
+                memcpy(&entry->address, t->dst, t->dstlen);
+                entry->srvid_prefix_bits = service_get_prefix_bits(se);
+                entry->srvid_flags = service_iter_get_flags(&iter);
+                entry->weight = t->weight;
+                entry->priority = service_iter_get_priority(&iter);
+        }
+
+        service_iter_destroy(&iter);
+
+        return 0;
+}
+
+/*
+  Return the next part of the service table, following the cursor
+  given in the request, see enum ctrlmsg_service_get_type. The table
+  is only locked while the reply is filled. An entry that did not fit
+  in the previous reply is continued after the target given in the
+  request.
+*/
+static int ctrl_handle_get_service_chunk(struct ctrlmsg_service *cmg)
+{
+        struct service_table_cursor cursor;
+        struct get_service_chunk gsc;
+        size_t size = CTRLMSG_SERVICE_NUM_LEN(CTRLMSG_SERVICE_GET_MAX_NUM);
+
+        service_table_cursor_init(&cursor);
+
+        if (cmg->service[0].type == CTRLMSG_SERVICE_GET_NEXT) {
+                memcpy(&cursor.prefix, &cmg->service[0].srvid, 
+                       sizeof(cursor.prefix));
+                cursor.prefix_bits = cmg->service[0].srvid_prefix_bits;
+                cursor.started = 1;
+                memcpy(&gsc.resume_addr, &cmg->service[0].address,
+                       sizeof(gsc.resume_addr));
+                gsc.resume_priority = cmg->service[0].priority;
+        }
+
+        gsc.num = 0;
+        gsc.resume = 0;
+        gsc.cres = kmalloc(size, GFP_KERNEL);
+
+        if (!gsc.cres) {
+                cmg->cmh.retval = CTRLMSG_RETVAL_ERROR;
+                ctrl_sendmsg(&cmg->cmh, GFP_KERNEL);
+                return -ENOMEM;
+        }
+
+        memset(gsc.cres, 0, size);
+
+        if (cursor.started) {
+                struct service_entry *se = 
+                        service_find_exact(&cursor.prefix, 
+                                           cursor.prefix_bits);
+
+                /* Return the targets of the previous entry that
+                 * follow the last one returned, if any */
+                if (se) {
+                        gsc.resume = 1;
+                        ctrl_fill_service_chunk(se, &gsc);
+                        gsc.resume = 0;
+                        service_entry_put(se);
+                }
+        }
+        
+        service_table_walk(&cursor, -1U, ctrl_fill_service_chunk, &gsc);
+
+        gsc.cres->cmh.type = CTRLMSG_TYPE_GET_SERVICE;
+        gsc.cres->cmh.len = CTRLMSG_SERVICE_NUM_LEN(gsc.num);
+        gsc.cres->cmh.xid = cmg->cmh.xid;
+        gsc.cres->cmh.retval = gsc.num == 0 ? 
+                CTRLMSG_RETVAL_NOENTRY : CTRLMSG_RETVAL_OK;
+        gsc.cres->xid = cmg->xid;
+
+        LOG_DBG("service table chunk with %u entries\n", gsc.num);
+
+        ctrl_sendmsg(&gsc.cres->cmh, GFP_KERNEL);
+        kfree(gsc.cres);
+
+        return 0;
+}
+
 static int ctrl_handle_get_service_msg(struct ctrlmsg *cm)
 {
         struct ctrlmsg_service *cmg = (struct ctrlmsg_service *)cm;
@@ -318,6 +468,10 @@ static int ctrl_handle_get_service_msg(struct ctrlmsg *cm)
         unsigned short prefix_bits = SERVICE_ID_MAX_PREFIX_BITS;
         struct target *t;
 
+        if (cmg->service[0].type == CTRLMSG_SERVICE_GET_FIRST ||
+            cmg->service[0].type == CTRLMSG_SERVICE_GET_NEXT)
+                return ctrl_handle_get_service_chunk(cmg);
+
         LOG_DBG("getting service: %s\n",
                 service_id_to_str(&cmg->service[0].srvid));
 
@@ -476,6 +630,301 @@ static int ctrl_handle_migrate_msg(struct ctrlmsg *cm)
         return ret;
 }
 
+/*
+  Builds the messages of a stats delta reply. The counter values last
+  reported are kept in the service entries, targets and sockets
+  themselves (the "marks"), so there is a single baseline shared by
+  all control clients, which also all receive the reply. Only one
+  consumer of the stream is supported.
+*/
+struct stats_delta_writer {
+        struct ctrlmsg_stats_delta *cm;
+        struct list_head queue;
+        int full;
+        int stop; /* No more service entries have changed */
+};
+
+/* Message filled while a lock is held, sent after it is released */
+struct stats_delta_msg {
+        struct list_head lh;
+        struct ctrlmsg_stats_delta cm; /* Must be last */
+};
+
+static uint32_t stats_delta_seqno = 0;
+
+static void *stats_delta_put(struct stats_delta_writer *w, 
+                             uint8_t type, unsigned int len)
+{
+        unsigned char *rec;
+
+        if (w->cm->cmh.len + len > CTRLMSG_STATS_DELTA_MAX_LEN)
+                return NULL;
+
+        rec = (unsigned char *)w->cm + w->cm->cmh.len;
+        memset(rec, 0, len);
+        rec[0] = type;
+        rec[1] = len;
+        w->cm->cmh.len += len;
+        w->cm->num++;
+
+        return rec;
+}
+
+static void stats_delta_flush(struct stats_delta_writer *w, int more, 
+                              gfp_t alloc)
+{
+        if (more)
+                w->cm->flags |= STATS_DELTA_F_MORE;
+        else
+                w->cm->flags &= ~STATS_DELTA_F_MORE;
+
+        ctrl_sendmsg(&w->cm->cmh, alloc);
+
+        w->cm->cmh.len = CTRLMSG_STATS_DELTA_SIZE;
+        w->cm->num = 0;
+}
+
+static int stats_delta_queue(struct stats_delta_writer *w, gfp_t alloc)
+{
+        struct stats_delta_msg *msg;
+
+        msg = kmalloc(sizeof(*msg) + w->cm->cmh.len - 
+                      CTRLMSG_STATS_DELTA_SIZE, alloc);
+
+        if (!msg)
+                return -ENOMEM;
+
+        w->cm->flags |= STATS_DELTA_F_MORE;
+        memcpy(&msg->cm, w->cm, w->cm->cmh.len);
+        list_add_tail(&msg->lh, &w->queue);
+
+        w->cm->cmh.len = CTRLMSG_STATS_DELTA_SIZE;
+        w->cm->num = 0;
+
+        return 0;
+}
+
+static void stats_delta_send_queued(struct stats_delta_writer *w)
+{
+        while (!list_empty(&w->queue)) {
+                struct stats_delta_msg *msg = 
+                        list_first_entry(&w->queue, 
+                                         struct stats_delta_msg, lh);
+                list_del(&msg->lh);
+                ctrl_sendmsg(&msg->cm.cmh, GFP_KERNEL);
+                kfree(msg);
+        }
+}
+
+static inline uint32_t stats_delta(uint32_t *mark, uint32_t now, int full)
+{
+        uint32_t delta = full ? now : now - *mark;
+        *mark = now;
+        return delta;
+}
+
+static inline int target_stats_changed(struct target *t)
+{
+        return t->mark.packets_resolved != 
+                (uint32_t)atomic_read(&t->packets_resolved) ||
+                t->mark.packets_dropped != 
+                (uint32_t)atomic_read(&t->packets_dropped);
+}
+
+static int ctrl_stats_delta_service(struct service_entry *se, void *arg)
+{
+        struct stats_delta_writer *w = (struct stats_delta_writer *)arg;
+        struct stats_delta_service *rs;
+        struct service_id srvid;
+        struct service_iter iter;
+        struct target *t;
+        unsigned int need = sizeof(*rs) + 
+                se->count * sizeof(struct stats_delta_target);
+        uint16_t len = w->cm->cmh.len, num = w->cm->num;
+        int changed, complete = 1;
+
+        if (!w->full) {
+                if (service_table_stats_dirty() == 0) {
+                        w->stop = 1;
+                        return -1;
+                }
+                
+                if (!service_entry_stats_dirty(se))
+                        return 0;
+        }
+
+        /* Keep entries whole, unless they do not fit in an empty
+         * message */
+        if (w->cm->num > 0 && 
+            w->cm->cmh.len + need > CTRLMSG_STATS_DELTA_MAX_LEN)
+                return -1;
+
+        rs = stats_delta_put(w, STATS_DELTA_REC_SERVICE, sizeof(*rs));
+
+        if (!rs)
+                return -1;
+
+        service_entry_stats_reported(se);
+
+        changed = w->full ||
+                se->mark.packets_resolved != 
+                (uint32_t)atomic_read(&se->packets_resolved) ||
+                se->mark.packets_dropped != 
+                (uint32_t)atomic_read(&se->packets_dropped);
+
+        service_get_id(se, &srvid);
+        memcpy(&rs->srvid, &srvid, sizeof(srvid));
+        rs->srvid_prefix_bits = service_get_prefix_bits(se);
+
+        service_iter_init(&iter, se, SERVICE_ITER_ALL);
+
+        while ((t = service_iter_next(&iter)) != NULL) {
+                struct stats_delta_target *rt;
+
+                if (!w->full && !target_stats_changed(t))
+                        continue;
+
+                rt = stats_delta_put(w, STATS_DELTA_REC_TARGET, sizeof(*rt));
+
+                if (!rt) {
+                        complete = 0;
+                        break;
+                }
+
+                changed = 1;
+
+                if (!is_sock_target(t))
+                        memcpy(&rt->address, t->dst, sizeof(rt->address));
+
+                rt->packets_resolved = 
+                        stats_delta(&t->mark.packets_resolved, 
+                                    atomic_read(&t->packets_resolved), 
+                                    w->full);
+                rt->bytes_resolved = 
+                        stats_delta(&t->mark.bytes_resolved, 
+                                    atomic_read(&t->bytes_resolved), 
+                                    w->full);
+                rt->packets_dropped = 
+                        stats_delta(&t->mark.packets_dropped, 
+                                    atomic_read(&t->packets_dropped), 
+                                    w->full);
+                rt->bytes_dropped = 
+                        stats_delta(&t->mark.bytes_dropped, 
+                                    atomic_read(&t->bytes_dropped), 
+                                    w->full);
+        }
+
+        service_iter_destroy(&iter);
+
+        /* The remaining targets go in the next delta */
+        if (!complete)
+                service_entry_stats_unreported(se);
+
+        if (!changed) {
+                /* Nothing to report, take back the service record */
+                w->cm->cmh.len = len;
+                w->cm->num = num;
+                return 0;
+        }
+
+        rs->packets_resolved = 
+                stats_delta(&se->mark.packets_resolved, 
+                            atomic_read(&se->packets_resolved), w->full);
+        rs->bytes_resolved = 
+                stats_delta(&se->mark.bytes_resolved, 
+                            atomic_read(&se->bytes_resolved), w->full);
+        rs->packets_dropped = 
+                stats_delta(&se->mark.packets_dropped, 
+                            atomic_read(&se->packets_dropped), w->full);
+        rs->bytes_dropped = 
+                stats_delta(&se->mark.bytes_dropped, 
+                            atomic_read(&se->bytes_dropped), w->full);
+        return 0;
+}
+
+static int ctrl_stats_delta_flow(struct serval_sock *ssk, void *arg)
+{
+        struct stats_delta_writer *w = (struct stats_delta_writer *)arg;
+        struct stats_delta_flow *rf;
+
+        if (!w->full && 
+            ssk->stats_mark.pkts_sent == (u32)ssk->tot_pkts_sent &&
+            ssk->stats_mark.pkts_recv == (u32)ssk->tot_pkts_recv)
+                return 0;
+
+        rf = stats_delta_put(w, STATS_DELTA_REC_FLOW, sizeof(*rf));
+
+        if (!rf) {
+                /* The flow table lock is held, so send the message
+                 * later. If that fails, the remaining flows keep their
+                 * marks and are reported next time. */
+                if (stats_delta_queue(w, GFP_ATOMIC) < 0)
+                        return -1;
+
+                rf = stats_delta_put(w, STATS_DELTA_REC_FLOW, sizeof(*rf));
+        }
+
+        memcpy(&rf->flowid, &ssk->local_flowid, sizeof(rf->flowid));
+        rf->state = ((struct sock *)ssk)->sk_state;
+        rf->pkts_sent = stats_delta(&ssk->stats_mark.pkts_sent,
+                                    ssk->tot_pkts_sent, w->full);
+        rf->bytes_sent = stats_delta(&ssk->stats_mark.bytes_sent,
+                                     ssk->tot_bytes_sent, w->full);
+        rf->pkts_recv = stats_delta(&ssk->stats_mark.pkts_recv,
+                                    ssk->tot_pkts_recv, w->full);
+        rf->bytes_recv = stats_delta(&ssk->stats_mark.bytes_recv,
+                                     ssk->tot_bytes_recv, w->full);
+        return 0;
+}
+
+static int ctrl_handle_stats_delta_msg(struct ctrlmsg *cm)
+{
+        struct ctrlmsg_stats_delta *req = (struct ctrlmsg_stats_delta *)cm;
+        struct service_table_cursor cursor;
+        struct stats_delta_writer w;
+
+        INIT_LIST_HEAD(&w.queue);
+        w.full = req->flags & STATS_DELTA_F_FULL;
+        w.stop = 0;
+        w.cm = kmalloc(CTRLMSG_STATS_DELTA_MAX_LEN, GFP_KERNEL);
+
+        if (!w.cm) {
+                cm->retval = CTRLMSG_RETVAL_ERROR;
+                ctrl_sendmsg(cm, GFP_KERNEL);
+                return -ENOMEM;
+        }
+
+        memset(w.cm, 0, CTRLMSG_STATS_DELTA_SIZE);
+        w.cm->cmh.type = CTRLMSG_TYPE_STATS_DELTA;
+        w.cm->cmh.len = CTRLMSG_STATS_DELTA_SIZE;
+        w.cm->cmh.xid = cm->xid;
+        w.cm->xid = req->xid;
+        w.cm->seqno = ++stats_delta_seqno;
+        w.cm->flags = w.full ? STATS_DELTA_F_FULL : 0;
+
+        service_table_cursor_init(&cursor);
+
+        /* Unless the request is full, the walk skips unchanged
+         * entries and ends after the last changed one */
+        while (service_table_walk(&cursor, -1U, 
+                                  ctrl_stats_delta_service, &w) > 0 &&
+               !w.stop) {
+                if (!cursor.done)
+                        stats_delta_flush(&w, 1, GFP_KERNEL);
+        }
+
+        flow_table_for_each(ctrl_stats_delta_flow, &w);
+        stats_delta_send_queued(&w);
+
+        LOG_DBG("stats delta %u: last message has %u records\n",
+                w.cm->seqno, w.cm->num);
+
+        stats_delta_flush(&w, 0, GFP_KERNEL);
+        kfree(w.cm);
+
+        return 0;
+}
+
 ctrlmsg_handler_t handlers[] = {
         dummy_ctrlmsg_handler,
         dummy_ctrlmsg_handler,
@@ -487,5 +936,6 @@ ctrlmsg_handler_t handlers[] = {
         ctrl_handle_service_stats_msg,
         ctrl_handle_capabilities_msg,
         ctrl_handle_migrate_msg,
+        ctrl_handle_stats_delta_msg,
         dummy_ctrlmsg_handler,
 };
@@ -9,6 +9,7 @@
 #include <linux/poll.h>
 #include <service.h>
 #include <serval_sock.h>
+#include <serval_sal.h>
 #include "log.h"
 
 
@@ -20,6 +21,7 @@
 #define SERVAL_PROC_DBG "dbg"
 #define SERVAL_PROC_FILE_SERVICE_TBL "service_table"
 #define SERVAL_PROC_FILE_FLOW_TBL "flow_table"
+#define SERVAL_PROC_FILE_SAL_STATS "sal_stats"
 
 static struct proc_dir_entry *serval_dir = NULL;
 
@@ -111,18 +113,36 @@ static int proc_generic_read(char **static_buf, int *static_buflen,
         return count;
 }
 
+/*
+  The service table can be large, so it is printed one page at a
+  time, and the table is only locked while each page is filled.
+ */
 static int proc_service_table_read(char *page, char **start, 
                                    off_t off, int count, 
                                    int *eof, void *data)
 {
-        static char *buf = NULL;
-        static int buflen = 0;
+        static struct service_table_cursor cursor;
+        int len;
 
-        return proc_generic_read(&buf, &buflen, page, start, off, 
-                                 count, eof, data,
-                                 __service_table_print,
-                                 service_table_read_lock,
-                                 service_table_read_unlock);
+        if (off == 0)
+                service_table_cursor_init(&cursor);
+
+        len = service_table_print_chunk(&cursor, page, count);
+
+        if (len < 0)
+                return len;
+
+        if (len == 0) {
+                *start = NULL;
+                *eof = 1;
+                return 0;
+        }
+
+        /* Make sure off is advanced, so that we continue from the
+           cursor in the next call */
+        *start = page;
+
+        return len;
 }
 
 static int proc_flow_table_read(char *page, char **start, 
@@ -139,6 +159,19 @@ static int proc_flow_table_read(char *page, char **start,
                                  flow_table_read_unlock);
 }
 
+/* The counters fit in a page */
+static int proc_sal_stats_read(char *page, char **start, 
+                               off_t off, int count, 
+                               int *eof, void *data)
+{
+        *eof = 1;
+
+        if (off > 0)
+                return 0;
+
+        return serval_sal_stats_print(page, count);
+}
+
 /*
   Debug output through /proc/serval/dbg based on linux kernel
   /proc/kmsg
@@ -236,11 +269,21 @@ int __init proc_init(void)
 
         if (!proc)
                 goto fail_flow_tbl;
+
+        proc = create_proc_read_entry(SERVAL_PROC_FILE_SAL_STATS, 0, 
+                                      serval_dir, 
+                                      proc_sal_stats_read, 
+                                      NULL);
+
+        if (!proc)
+                goto fail_sal_stats;
         
         ret = 0;
 out:        
         return ret;
 
+fail_sal_stats:
+        remove_proc_entry(SERVAL_PROC_FILE_FLOW_TBL, serval_dir);
 fail_flow_tbl:
         remove_proc_entry(SERVAL_PROC_FILE_SERVICE_TBL, serval_dir);
 fail_service_tbl:
@@ -257,6 +300,7 @@ void proc_fini(void)
 
         remove_proc_entry(SERVAL_PROC_FILE_SERVICE_TBL, serval_dir);
         remove_proc_entry(SERVAL_PROC_FILE_FLOW_TBL, serval_dir);
+        remove_proc_entry(SERVAL_PROC_FILE_SAL_STATS, serval_dir);
         remove_proc_entry(SERVAL_PROC_DBG, serval_dir);
 	remove_proc_entry(SERVAL_PROC_DIR, proc_net);
 }
@@ -11,10 +11,16 @@
 #include <linux/sysctl.h>
 #include <net/net_namespace.h>
 #include <af_serval.h>
+#include <serval_tcp.h>
+#include <serval_syncookies.h>
 
 extern struct netns_serval net_serval;
 static int encap_port_max = 65535;
 static int encap_port_min = 1;
+static int ack_coalesce_min = 0;
+static int ack_coalesce_max = 255;
+static int syncookies_min = SAL_SYNCOOKIES_OFF;
+static int syncookies_max = SAL_SYNCOOKIES_ALWAYS;
 
 extern int udp_encap_client_init(unsigned short);
 extern int udp_encap_server_init(unsigned short);
@@ -64,6 +70,15 @@ static ctl_table serval_table[] = {
 		.mode= 0644,
 		.proc_handler= proc_dointvec
 	},
+	{
+		.procname= "sal_syncookies",
+		.data= &net_serval.sysctl_sal_syncookies,
+		.maxlen= sizeof(int),
+		.mode= 0644,
+		.proc_handler= proc_dointvec_minmax,
+		.extra1 = &syncookies_min,
+		.extra2 = &syncookies_max,
+	},
 	{
 		.procname= "udp_encap",
 		.data= &net_serval.sysctl_udp_encap,
@@ -89,6 +104,15 @@ static ctl_table serval_table[] = {
 		.extra1 = &encap_port_min,
 		.extra2 = &encap_port_max,
 	},
+	{
+		.procname= "tcp_ack_coalesce",
+		.data= &sysctl_serval_tcp_ack_coalesce,
+		.maxlen= sizeof(int),
+		.mode= 0644,
+		.proc_handler= proc_dointvec_minmax,
+		.extra1 = &ack_coalesce_min,
+		.extra2 = &ack_coalesce_max,
+	},
 	{ }
 };
 
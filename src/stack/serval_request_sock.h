@@ -11,6 +11,7 @@
 #include <string.h>
 #endif
 #include "serval_sock.h"
+#include "serval_syncookies.h"
 
 struct serval_request_sock {
         struct inet_request_sock rsk;
@@ -25,7 +26,9 @@ struct serval_request_sock {
         u8 peer_nonce[SERVAL_NONCE_SIZE];
         u16 udp_encap_sport;
         u16 udp_encap_dport;
+        u8 syncookie; /* Rebuilt from, or answered with, a cookie */
         struct list_head lh;
+        struct hlist_node hash_node; /* In the parent's syn_hash */
 };
 
 static inline struct serval_request_sock *serval_rsk(struct request_sock *rsk)
@@ -33,8 +36,12 @@ static inline struct serval_request_sock *serval_rsk(struct request_sock *rsk)
         return (struct serval_request_sock *)rsk;
 }
 
+/*
+  Allocate a request sock without a flowID, nonce or initial sequence
+  number, e.g., to rebuild one from a SYN cookie.
+ */
 static inline struct request_sock *
-serval_reqsk_alloc(const struct request_sock_ops *ops)
+__serval_reqsk_alloc(const struct request_sock_ops *ops)
 {
         struct request_sock *rsk;
         struct serval_request_sock *srsk;
@@ -46,9 +53,29 @@ serval_reqsk_alloc(const struct request_sock_ops *ops)
 
         srsk = serval_rsk(rsk);
 
+        /* Set once the request has a child sock */
+        rsk->sk = NULL;
         INIT_LIST_HEAD(&srsk->lh);
+        INIT_HLIST_NODE(&srsk->hash_node);
         srsk->udp_encap_sport = 0;
         srsk->udp_encap_dport = 0;
+        srsk->syncookie = 0;
+
+        return rsk;
+}
+
+static inline struct request_sock *
+serval_reqsk_alloc(const struct request_sock_ops *ops)
+{
+        struct request_sock *rsk;
+        struct serval_request_sock *srsk;
+
+        rsk = __serval_reqsk_alloc(ops);
+
+        if (!rsk)
+                return NULL;
+
+        srsk = serval_rsk(rsk);
 
         serval_sock_get_flowid(&srsk->local_flowid);
 
@@ -70,4 +97,33 @@ serval_reqsk_alloc(const struct request_sock_ops *ops)
         return rsk;
 }
 
+/*
+  Pending requests are hashed on the parent by the peer's nonce,
+  which is keyed so that peers cannot aim for a single bucket.
+ */
+static inline struct hlist_head *
+serval_rsk_hash_head(struct serval_sock *ssk, const u8 *nonce)
+{
+        u32 words[SERVAL_NONCE_SIZE / sizeof(u32)];
+
+        memcpy(words, nonce, SERVAL_NONCE_SIZE);
+
+        return &ssk->syn_hash[serval_keyed_hash(words,
+                                                SERVAL_NONCE_SIZE /
+                                                sizeof(u32)) &
+                              ssk->syn_hash_mask];
+}
+
+static inline void serval_rsk_hash(struct serval_sock *ssk,
+                                   struct serval_request_sock *srsk)
+{
+        hlist_add_head(&srsk->hash_node,
+                       serval_rsk_hash_head(ssk, srsk->peer_nonce));
+}
+
+static inline void serval_rsk_unhash(struct serval_request_sock *srsk)
+{
+        hlist_del_init(&srsk->hash_node);
+}
+
 #endif /* _SERVAL_REQUEST_SOCK_H_ */
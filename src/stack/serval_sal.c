@@ -16,9 +16,11 @@
 #include <serval/platform_tcpip.h>
 #include <serval/skbuff.h>
 #include <serval/debug.h>
+#include <serval/hash.h>
 #include <serval_sock.h>
 #include <serval/netdevice.h>
 #include <serval_sal.h>
+#include <serval_sal_parse.h>
 #include <serval_ipv4.h>
 #include <netinet/serval.h>
 #if defined(OS_LINUX_KERNEL)
@@ -37,6 +39,7 @@
 #include <arpa/inet.h>
 #endif
 #include <serval_request_sock.h>
+#include <serval_syncookies.h>
 #include <service.h>
 #include <af_serval.h>
 
@@ -50,7 +53,40 @@ static struct net_addr zero_addr = {
         .net_raw = { 0x00, 0x00, 0x00, 0x00 }
 };
 
-#define MAX_NUM_SERVAL_EXTENSIONS 5 /* TODO: Set reasonable number */
+atomic_t sal_statistics[__SAL_MIB_MAX];
+
+static const char *sal_mib_names[__SAL_MIB_MAX] = {
+        [SAL_MIB_FWD_EXPAND] = "ForwardExpand",
+        [SAL_MIB_IN_HDR_ERRORS] = "InHdrErrors",
+        [SAL_MIB_IN_CSUM_ERRORS] = "InCsumErrors",
+        [SAL_MIB_IN_TRANSPORT_ERRORS] = "InTransportErrors",
+        [SAL_MIB_IN_SEQNO_ERRORS] = "InSeqnoErrors",
+        [SAL_MIB_SYNCOOKIES_SENT] = "SyncookiesSent",
+        [SAL_MIB_SYNCOOKIES_RECV] = "SyncookiesRecv",
+        [SAL_MIB_SYNCOOKIES_FAILED] = "SyncookiesFailed",
+        [SAL_MIB_SYN_QUEUE_EXPIRED] = "SynQueueExpired",
+};
+
+int serval_sal_stats_print(char *buf, int buflen)
+{
+        unsigned int hits, misses;
+        int i, len = 0;
+
+        for (i = 0; i < __SAL_MIB_MAX && len < buflen; i++) {
+                len += snprintf(buf + len, buflen - len, "%s %u\n",
+                                sal_mib_names[i],
+                                atomic_read(&sal_statistics[i]));
+        }
+
+        service_cache_get_stats(&hits, &misses);
+
+        if (len < buflen)
+                len += snprintf(buf + len, buflen - len, 
+                                "ResolveCacheHits %u\n"
+                                "ResolveCacheMisses %u\n", hits, misses);
+
+        return len < buflen ? len : buflen;
+}
 
 /*
  * The next routines deal with comparing 32 bit unsigned ints
@@ -70,25 +106,6 @@ static inline int between(__u32 seq1, __u32 seq2, __u32 seq3)
 	return seq3 - seq2 >= seq1 - seq2;
 }
 
-/* 
-   Context for parsed Serval headers 
-*/   
-struct serval_context {
-        struct sk_buff *skb;
-        struct serval_hdr *hdr;
-        unsigned short length; /* Total length of all headers */
-        unsigned short flags;
-        uint32_t seqno; /* Sequence number of control information */
-        uint32_t ackno; /* Acknowledgement number of control information */
-        struct serval_ext *ext[MAX_NUM_SERVAL_EXTENSIONS];
-        struct serval_control_ext *ctrl_ext;
-        struct serval_connection_ext *conn_ext;
-        struct serval_description_ext *desc_ext;
-        struct serval_service_ext *srv_ext;
-        struct serval_source_ext *src_ext;
-        struct serval_migrate_ext *mig_ext;
-};
-
 #if defined(OS_LINUX_KERNEL)
 extern int serval_udp_encap_skb(struct sk_buff *skb, 
                                 __u32 saddr, __u32 daddr, 
@@ -102,28 +119,8 @@ static int serval_sal_state_process(struct sock *sk,
 static int serval_sal_transmit_skb(struct sock *sk, struct sk_buff *skb, 
                                    int clone_it, gfp_t gfp_mask);
 
-static size_t min_ext_length[] = {
-        [0] = sizeof(struct serval_hdr),
-        [SERVAL_CONNECTION_EXT] = sizeof(struct serval_connection_ext),
-        [SERVAL_CONTROL_EXT] = sizeof(struct serval_control_ext),
-        [SERVAL_SERVICE_EXT] = sizeof(struct serval_service_ext),
-        [SERVAL_DESCRIPTION_EXT] = sizeof(struct serval_description_ext),
-        [SERVAL_SOURCE_EXT] = sizeof(struct serval_source_ext),
-        [SERVAL_MIGRATE_EXT] = sizeof(struct serval_migrate_ext),
-};
-
 #if defined(ENABLE_DEBUG)
 
-static char* serval_ext_name[] = {
-        [0] = "INVALID",
-        [SERVAL_CONNECTION_EXT] = "CONNECTION",
-        [SERVAL_CONTROL_EXT] = "CONTROL",
-        [SERVAL_SERVICE_EXT] = "SERVICE",
-        [SERVAL_DESCRIPTION_EXT] = "DESCRIPTION",
-        [SERVAL_SOURCE_EXT] = "SOURCE",
-        [SERVAL_MIGRATE_EXT] = "MIGRATE",
-};
-
 static int print_base_hdr(struct serval_hdr *sh, char *buf, int buflen)
 {
         return snprintf(buf, buflen,
@@ -296,193 +293,15 @@ static const char *serval_hdr_to_str(struct serval_hdr *sh)
 
 #endif /* ENABLE_DEBUG */
 
-static int parse_base_ext(struct serval_ext *ext, struct sk_buff *skb,
-                          struct serval_context *ctx)
-{
-        return 0;
-}
-
-static int parse_connection_ext(struct serval_ext *ext, struct sk_buff *skb,
-                                struct serval_context *ctx)
-{
-        if (ctx->conn_ext)
-                return -1;
-        
-        ctx->conn_ext = (struct serval_connection_ext *)ext;
-        ctx->seqno = ntohl(ctx->conn_ext->seqno);
-        ctx->ackno = ntohl(ctx->conn_ext->ackno);
-        
-        return ext->length;
-}
-
-static int parse_control_ext(struct serval_ext *ext, struct sk_buff *skb,
-                             struct serval_context *ctx)
-{
-        if (ctx->ctrl_ext)
-                return -1;
-        
-        ctx->ctrl_ext = (struct serval_control_ext *)ext;
-        ctx->seqno = ntohl(ctx->ctrl_ext->seqno);
-        ctx->ackno = ntohl(ctx->ctrl_ext->ackno);
-        
-        return ext->length;
-}
-
-static int parse_service_ext(struct serval_ext *ext, struct sk_buff *skb,
-                             struct serval_context *ctx)
-{
-        if (ctx->srv_ext)
-                return -1;
-        
-        ctx->srv_ext = (struct serval_service_ext *)ext;
-
-        return ext->length;
-}
-
-static int parse_description_ext(struct serval_ext *ext, struct sk_buff *skb,
-                                 struct serval_context *ctx)
+static inline int serval_sal_parse_hdr(struct sk_buff *skb, 
+                                       struct serval_context *ctx,
+                                       enum serval_parse_mode mode)
 {
-        return ext->length;
-}
-
-static int parse_source_ext(struct serval_ext *ext, struct sk_buff *skb,
-                            struct serval_context *ctx)
-{
-        /*
-        int i;
-        __u32 addr;
-        */      
-        if (ctx->src_ext)
-                return -1;
-        
-        ctx->src_ext = (struct serval_source_ext *)ext;
+        int ret = serval_sal_parse(serval_hdr(skb), ctx, mode);
 
-        /* Should be two addresses minimum */
-        if (SERVAL_SOURCE_EXT_NUM_ADDRS(ctx->src_ext) < 2)
-                return -1;
-
-        /*
-        dev_get_ipv4_addr(skb->dev, IFADDR_LOCAL, &addr);
-
-        for (i = 0; i < SERVAL_SOURCE_EXT_NUM_ADDRS(ctx->src_ext); i++) {
-                if (memcmp(SERVAL_SOURCE_EXT_GET_ADDR(ctx->src_ext, i),
-                           &addr, sizeof(addr)) == 0) {
-                        LOG_DBG("Our address already in SOURCE ext. Possible loop!\n");
-                        return -1;
-                }
-        }
-        */                  
-        return ext->length;
-}
-
-static int parse_migrate_ext(struct serval_ext *ext, struct sk_buff *skb,
-                             struct serval_context *ctx)
-{
-        if (ctx->mig_ext)
-                return -1;
-
-        ctx->mig_ext = (struct serval_migrate_ext *)ext;
-        ctx->seqno = ntohl(ctx->mig_ext->seqno);
-        ctx->ackno = ntohl(ctx->mig_ext->ackno);
-                    
-        return ext->length;
-}
-
-
-typedef int (*parse_ext_func_t)(struct serval_ext *, struct sk_buff *, 
-                                struct serval_context *ctx);
-
-static parse_ext_func_t parse_ext_func[] = {
-        [0] = &parse_base_ext,
-        [SERVAL_CONNECTION_EXT] = &parse_connection_ext,
-        [SERVAL_CONTROL_EXT] = &parse_control_ext,
-        [SERVAL_SERVICE_EXT] = &parse_service_ext,
-        [SERVAL_DESCRIPTION_EXT] = &parse_description_ext,
-        [SERVAL_SOURCE_EXT] = &parse_source_ext,
-        [SERVAL_MIGRATE_EXT] = &parse_migrate_ext,
-};
-
-static inline int parse_ext(struct serval_ext *ext, struct sk_buff *skb,
-                            struct serval_context *ctx)
-{
-        if (ext->type >= __SERVAL_EXT_TYPE_MAX) {
-                LOG_DBG("Bad extension type (=%u)\n",
-                        ext->type);
-                return -1;
-        }
-        
-        if (ext->length < min_ext_length[ext->type]) {
-                LOG_DBG("Bad extension \'%s\' length (=%u)\n",
-                        serval_ext_name[ext->type], ext->length);
-                return -1;
-        }
-        
-        LOG_DBG("EXT %s length=%u\n",
-                serval_ext_name[ext->type], 
-                ext->length);
-        
-        return parse_ext_func[ext->type](ext, skb, ctx);
-}
-
-enum serval_parse_mode {
-        SERVAL_PARSE_BASE,
-        SERVAL_PARSE_ALL,
-};
-
-/**
-   Parse Serval header and all extension, doing basic sanity checks.
-
-   Returns: 0 on success.
-*/
-static int serval_sal_parse_hdr(struct sk_buff *skb, 
-                                struct serval_context *ctx,
-                                enum serval_parse_mode mode)
-{
-        struct serval_ext *ext;
-        unsigned int i = 0;
-        int hdr_len;
-
-        memset(ctx, 0, sizeof(struct serval_context));
-        
         ctx->skb = skb;
-        ctx->hdr = serval_hdr(skb);
-        ctx->length = ntohs(ctx->hdr->length);
-        ext = SERVAL_EXT_FIRST(ctx->hdr);
-        
-        /* Sanity checks */
-        if (ctx->length < sizeof(struct serval_hdr))
-                return -1;
-
-        /* Only base header parse, return */
-        if (mode == SERVAL_PARSE_BASE)
-                return 0;
-
-        /* Parse extensions */
-        hdr_len = ctx->length - sizeof(*ctx->hdr);
-
-        while (hdr_len > 0 && i < MAX_NUM_SERVAL_EXTENSIONS) {
-                if (parse_ext(ext, skb, ctx) < 0)
-                        return -1;
 
-                ctx->ext[i++] = ext;                
-                hdr_len -= ext->length;
-                ext = SERVAL_EXT_NEXT(ext);
-        }
-
-        /* Parse flags */
-        if (ctx->hdr->syn)
-                ctx->flags |= SVH_SYN;
-        if (ctx->hdr->ack)
-                ctx->flags |= SVH_ACK;
-        if (ctx->hdr->fin)
-                ctx->flags |= SVH_FIN;
-        if (ctx->hdr->rst)
-                ctx->flags |= SVH_RST;
-        if (ctx->hdr->rsyn)
-                ctx->flags |= SVH_RSYN;
-
-        /* hdr_len should be zero if everything was OK */
-        return hdr_len;
+        return ret;
 }
 
 static inline int has_seqno(struct serval_context *ctx)
@@ -1135,7 +954,11 @@ void serval_sal_done(struct sock *sk)
         serval_sock_done(sk);
 }
 
-static int serval_sal_send_rsyn(struct sock *sk, u32 seqno)
+/*
+  Unless told to wait, returns -ENOMEM without any change of state if
+  no packet could be allocated.
+*/
+static int __serval_sal_send_rsyn(struct sock *sk, u32 seqno, int wait)
 {
         struct serval_sock *ssk = serval_sk(sk);
         struct sk_buff *skb;
@@ -1149,6 +972,16 @@ static int serval_sal_send_rsyn(struct sock *sk, u32 seqno)
                 return 0;
         }
 
+        for (;;) {
+                skb = sk_sal_alloc_skb(sk, sk->sk_prot->max_header,
+                                       GFP_ATOMIC);
+                if (skb)
+                        break;
+                if (!wait)
+                        return -ENOMEM;
+                yield();
+        }
+
         switch (ssk->sal_state) {
         case SAL_INITIAL:
                 serval_sock_set_sal_state(sk, SAL_RSYN_SENT);
@@ -1163,14 +996,6 @@ static int serval_sal_send_rsyn(struct sock *sk, u32 seqno)
                 break;
         }
 
-        for (;;) {
-                skb = sk_sal_alloc_skb(sk, sk->sk_prot->max_header,
-                                       GFP_ATOMIC);
-                if (skb)
-                        break;
-                yield();
-        }
-
         /* Use same sequence number as previous packet for migration
            requests */
         LOG_DBG("Sending Migrate Request\n");
@@ -1197,7 +1022,234 @@ static int serval_sal_send_rsyn(struct sock *sk, u32 seqno)
 int serval_sal_migrate(struct sock *sk)
 {
         LOG_DBG("Sending RSYN\n");
-        return serval_sal_send_rsyn(sk, serval_sk(sk)->snd_seq.nxt++);
+        return __serval_sal_send_rsyn(sk, serval_sk(sk)->snd_seq.nxt++, 1);
+}
+
+/*
+  Migration engine. When many flows migrate at once, their RSYNs are
+  grouped by peer host and sent in paced rounds of at most
+  SAL_MIGRATE_BUDGET, taking a burst from each peer in turn, rather
+  than all at once from the caller.
+ */
+#define SAL_MIGRATE_BURST 8
+#define SAL_MIGRATE_BUDGET 64
+#define SAL_MIGRATE_HTABLE_BITS 6
+#define SAL_MIGRATE_HTABLE_SIZE (1 << SAL_MIGRATE_HTABLE_BITS)
+
+struct sal_migrate_peer {
+        struct hlist_node node;
+        struct list_head lh;
+        u32 daddr;
+        struct list_head socks;
+};
+
+static struct {
+        spinlock_t lock;
+        struct hlist_head hash[SAL_MIGRATE_HTABLE_SIZE];
+        struct list_head peers; /* In round-robin order */
+        struct list_head retry; /* Flows that could not be sent */
+        unsigned int num_peers;
+        struct timer_list timer;
+} migrate_engine;
+
+static inline struct hlist_head *migrate_peer_head(u32 daddr)
+{
+        return &migrate_engine.hash[hash_32(daddr, SAL_MIGRATE_HTABLE_BITS)];
+}
+
+static void migrate_peer_free(struct sal_migrate_peer *peer)
+{
+        hlist_del(&peer->node);
+        list_del(&peer->lh);
+        migrate_engine.num_peers--;
+        kfree(peer);
+}
+
+static inline void serval_sal_migrate_schedule(void)
+{
+        if (!timer_pending(&migrate_engine.timer))
+                mod_timer(&migrate_engine.timer, jiffies);
+}
+
+/*
+  Queue the RSYN of a migrating flow. Called with the socket
+  locked. If the flow is already queued, its RSYN will be sent for
+  the device that is current at that time.
+*/
+void serval_sal_migrate_queue(struct sock *sk)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+        u32 daddr = inet_sk(sk)->inet_daddr;
+        struct hlist_head *head = migrate_peer_head(daddr);
+        struct sal_migrate_peer *peer;
+        struct hlist_node *walk;
+
+        spin_lock_bh(&migrate_engine.lock);
+
+        if (!list_empty(&ssk->mig_node)) {
+                spin_unlock_bh(&migrate_engine.lock);
+                return;
+        }
+
+        hlist_for_each_entry(peer, walk, head, node) {
+                if (peer->daddr == daddr)
+                        goto found;
+        }
+
+        peer = kmalloc(sizeof(*peer), GFP_ATOMIC);
+
+        if (!peer) {
+                spin_unlock_bh(&migrate_engine.lock);
+                serval_sal_migrate(sk);
+                return;
+        }
+
+        peer->daddr = daddr;
+        INIT_LIST_HEAD(&peer->socks);
+        hlist_add_head(&peer->node, head);
+        list_add_tail(&peer->lh, &migrate_engine.peers);
+        migrate_engine.num_peers++;
+found:
+        sock_hold(sk);
+        list_add_tail(&ssk->mig_node, &peer->socks);
+        serval_sal_migrate_schedule();
+
+        spin_unlock_bh(&migrate_engine.lock);
+}
+
+static void serval_sal_migrate_timeout(unsigned long data)
+{
+        struct sock *batch[SAL_MIGRATE_BUDGET];
+        struct serval_sock *ssk;
+        unsigned int num = 0, i, npeers;
+
+        spin_lock_bh(&migrate_engine.lock);
+
+        /* Flows that were busy last round go first */
+        while (!list_empty(&migrate_engine.retry) && 
+               num < SAL_MIGRATE_BUDGET) {
+                ssk = list_first_entry(&migrate_engine.retry, 
+                                       struct serval_sock, mig_node);
+                list_del_init(&ssk->mig_node);
+                batch[num++] = (struct sock *)ssk;
+        }
+
+        npeers = migrate_engine.num_peers;
+
+        for (i = 0; i < npeers && num < SAL_MIGRATE_BUDGET; i++) {
+                struct sal_migrate_peer *peer = 
+                        list_first_entry(&migrate_engine.peers, 
+                                         struct sal_migrate_peer, lh);
+                unsigned int n = 0;
+
+                while (!list_empty(&peer->socks) && 
+                       n++ < SAL_MIGRATE_BURST &&
+                       num < SAL_MIGRATE_BUDGET) {
+                        ssk = list_first_entry(&peer->socks, 
+                                               struct serval_sock, mig_node);
+                        list_del_init(&ssk->mig_node);
+                        batch[num++] = (struct sock *)ssk;
+                }
+
+                if (list_empty(&peer->socks))
+                        migrate_peer_free(peer);
+                else
+                        list_move_tail(&peer->lh, &migrate_engine.peers);
+        }
+
+        spin_unlock_bh(&migrate_engine.lock);
+
+        for (i = 0; i < num; i++) {
+                struct sock *sk = batch[i];
+                int requeue = 1;
+
+                ssk = serval_sk(sk);
+
+                bh_lock_sock(sk);
+
+                if (!sock_owned_by_user(sk)) {
+                        if (__serval_sal_send_rsyn(sk, ssk->snd_seq.nxt++, 
+                                                   0) == -ENOMEM)
+                                ssk->snd_seq.nxt--;
+                        else
+                                requeue = 0;
+                }
+
+                if (requeue) {
+                        spin_lock(&migrate_engine.lock);
+
+                        /* The owner may have queued the flow again
+                           while the engine lock was dropped, holding
+                           a reference of its own */
+                        if (list_empty(&ssk->mig_node))
+                                list_add_tail(&ssk->mig_node, 
+                                              &migrate_engine.retry);
+                        else
+                                requeue = 0;
+
+                        spin_unlock(&migrate_engine.lock);
+                }
+                bh_unlock_sock(sk);
+
+                if (!requeue)
+                        sock_put(sk);
+        }
+
+        LOG_DBG("Sent %u RSYNs\n", num);
+
+        spin_lock_bh(&migrate_engine.lock);
+
+        if (!list_empty(&migrate_engine.peers) ||
+            !list_empty(&migrate_engine.retry))
+                mod_timer(&migrate_engine.timer, jiffies + 1);
+
+        spin_unlock_bh(&migrate_engine.lock);
+}
+
+static void serval_sal_migrate_init(void)
+{
+        unsigned int i;
+
+        spin_lock_init(&migrate_engine.lock);
+
+        for (i = 0; i < SAL_MIGRATE_HTABLE_SIZE; i++)
+                INIT_HLIST_HEAD(&migrate_engine.hash[i]);
+
+        INIT_LIST_HEAD(&migrate_engine.peers);
+        INIT_LIST_HEAD(&migrate_engine.retry);
+        migrate_engine.num_peers = 0;
+        setup_timer(&migrate_engine.timer, serval_sal_migrate_timeout, 0);
+}
+
+static void serval_sal_migrate_fini(void)
+{
+        struct serval_sock *ssk;
+
+#if defined(OS_LINUX_KERNEL)
+        del_timer_sync(&migrate_engine.timer);
+#else
+        del_timer(&migrate_engine.timer);
+#endif
+        spin_lock_bh(&migrate_engine.lock);
+
+        while (!list_empty(&migrate_engine.peers)) {
+                struct sal_migrate_peer *peer = 
+                        list_first_entry(&migrate_engine.peers, 
+                                         struct sal_migrate_peer, lh);
+
+                list_splice_init(&peer->socks, &migrate_engine.retry);
+                migrate_peer_free(peer);
+        }
+
+        while (!list_empty(&migrate_engine.retry)) {
+                ssk = list_first_entry(&migrate_engine.retry, 
+                                       struct serval_sock, mig_node);
+                list_del_init(&ssk->mig_node);
+                sock_put((struct sock *)ssk);
+        }
+
+        spin_unlock_bh(&migrate_engine.lock);
+        spin_lock_destroy(&migrate_engine.lock);
 }
 
 static int serval_sal_send_fin(struct sock *sk, u32 seqno)
@@ -1381,9 +1433,12 @@ static int serval_sal_add_source_ext(struct sk_buff **in_skb,
         /* Push back to IP header */
         skb_push(skb, size);
 
-        if (skb_headroom(skb) < (extra_len + size + 
-                                 skb->dev->hard_header_len)) {
+        /* Devices reserve room for this on receive, see
+           SAL_FORWARD_EXT_GROWTH, so this should be rare */
+        if (skb_headroom(skb) < (extra_len + 
+                                 LL_RESERVED_SPACE(skb->dev))) {
                 LOG_DBG("Expanding SKB headroom\n");
+                SAL_INC_STATS(SAL_MIB_FWD_EXPAND);
                 skb = skb_copy_expand(skb, skb_headroom(skb) + 
                                       extra_len,
                                       skb_tailroom(skb),
@@ -1618,65 +1673,55 @@ static int serval_sal_send_synack(struct sock *sk,
         return 0;
 }
 
-static int serval_sal_rcv_syn(struct sock *sk, 
-                              struct sk_buff *skb,
-                              struct serval_context *ctx)
+/*
+  Whether to answer a SYN with a cookie rather than queueing a
+  request sock for it.
+ */
+static inline int serval_sal_want_cookie(struct sock *sk)
 {
-        struct serval_sock *ssk = serval_sk(sk);
-        struct serval_connection_ext *conn_ext = ctx->conn_ext;
-        struct request_sock *rsk;
-        struct serval_request_sock *srsk;
-        struct net_addr myaddr;
-        int err = 0;
-
-        /* Make compiler be quiet */
-        memset(&myaddr, 0, sizeof(myaddr));
-
-        LOG_DBG("REQUEST seqno=%u\n", ctx->seqno);
-
-        if (sk->sk_ack_backlog >= sk->sk_max_ack_backlog) 
-                goto drop;
-
-        /* Try to figure out the source address for the incoming
-         * interface so that we can use it in our reply.  
-         *
-         * FIXME:
-         * should probably route the reply here somehow in case we
-         * want to reply on another interface than the incoming one.
-         */
-        if (!dev_get_ipv4_addr(skb->dev, IFADDR_LOCAL, &myaddr)) {
-                LOG_ERR("No source address for interface %s\n",
-                        skb->dev);
-                goto drop;
+        switch (net_serval.sysctl_sal_syncookies) {
+        case SAL_SYNCOOKIES_ALWAYS:
+                return 1;
+        case SAL_SYNCOOKIES_ON_OVERFLOW:
+                return sk->sk_ack_backlog >= sk->sk_max_ack_backlog;
+        default:
+                break;
         }
+        return 0;
+}
 
-        rsk = serval_reqsk_alloc(sk->sk_prot->rsk_prot);
-
-        if (!rsk)
-                goto drop;
-
-        srsk = serval_rsk(rsk);
-
-        /* Copy fields in request packet into request sock */
-        memcpy(&srsk->peer_flowid, &ctx->hdr->src_flowid, 
-               sizeof(ctx->hdr->src_flowid));
-        memcpy(&srsk->peer_srvid, &ctx->conn_ext->srvid,
-               sizeof(ctx->conn_ext->srvid));
-        memcpy(srsk->peer_nonce, conn_ext->nonce, SERVAL_NONCE_SIZE);
-        srsk->rcv_seq = ctx->seqno;
+/*
+  Whether a cookie sent by the listener could still be valid, so that
+  ACKs without a request are worth checking for one.
+ */
+static inline int serval_sal_cookie_recent(struct sock *sk)
+{
+        return time_before(jiffies, serval_sk(sk)->syncookie_stamp +
+                           SERVAL_SYNCOOKIE_VALID);
+}
 
+/*
+  Save the addresses of a connection request, taken from the packet
+  that carries it and the interface it arrived on.
+ */
+static void serval_sal_rsk_init_addrs(struct request_sock *rsk,
+                                      struct sk_buff *skb,
+                                      struct serval_context *ctx,
+                                      struct net_addr *myaddr)
+{
+        struct serval_request_sock *srsk = serval_rsk(rsk);
 
         /* Save our local address that we grabbed from the incoming
          * interface. This address should in most cases be the same
          * address as the IP header destination of the incoming
          * packet, unless the SYN was broadcast. */
-        memcpy(&inet_rsk(rsk)->loc_addr, &myaddr,
+        memcpy(&inet_rsk(rsk)->loc_addr, myaddr,
                sizeof(inet_rsk(rsk)->loc_addr));
 
-        /* 
+        /*
            Here we need to figure out which addresses to save in our
            sockets, and which ones to use in our reply.
-           
+
            This decision may vary depending on whether we are dealing
            with a client behind a NAT or not. For a NAT'd client we
            need to spoof the source address in the reply to ensure it
@@ -1698,7 +1743,7 @@ static int serval_sal_rcv_syn(struct sock *sk,
                 memcpy(&inet_rsk(rsk)->rmt_addr,
                        SERVAL_SOURCE_EXT_GET_ADDR(ctx->src_ext, 0),
                        sizeof(inet_rsk(rsk)->rmt_addr));
-                
+
                 /* If the request was UDP encapsulated due to NAT, we
                  * should spoof our source address in the reply to
                  * make sure we can traverse the NAT on the way
@@ -1714,7 +1759,7 @@ static int serval_sal_rcv_syn(struct sock *sk,
                 } else {
                         /* No NAT, use our own address in the reply. */
                         memcpy(&srsk->reply_saddr,
-                               &myaddr,
+                               myaddr,
                                sizeof(srsk->reply_saddr));
                 }
         } else {
@@ -1722,47 +1767,158 @@ static int serval_sal_rcv_syn(struct sock *sk,
                  * addresses in the IP header. */
                 memcpy(&inet_rsk(rsk)->rmt_addr, &ip_hdr(skb)->saddr,
                        sizeof(inet_rsk(rsk)->rmt_addr));
-                
+
                 /* Packet was broadcasted, so we cannot use the
                  * incoming destination address to figure out which
                  * interface address to use. */
                 if (skb->pkt_type == PACKET_BROADCAST)
                         memcpy(&srsk->reply_saddr,
-                               &myaddr,
+                               myaddr,
                                sizeof(srsk->reply_saddr));
-                else 
+                else
                         memcpy(&srsk->reply_saddr,
                                &ip_hdr(skb)->daddr,
                                sizeof(srsk->reply_saddr));
         }
-        
+
 #if defined(ENABLE_DEBUG)
         {
                 char rmtstr[18], locstr[18], replystr[18];
                 LOG_DBG("rmt_addr=%s loc_addr=%s reply_saddr=%s\n",
-                        inet_ntop(AF_INET, &inet_rsk(rsk)->rmt_addr, 
+                        inet_ntop(AF_INET, &inet_rsk(rsk)->rmt_addr,
                                   rmtstr, 18),
-                        inet_ntop(AF_INET, &inet_rsk(rsk)->loc_addr, 
+                        inet_ntop(AF_INET, &inet_rsk(rsk)->loc_addr,
                                   locstr, 18),
-                        inet_ntop(AF_INET, &srsk->reply_saddr, 
+                        inet_ntop(AF_INET, &srsk->reply_saddr,
                                   replystr, 18));
         }
 #endif
+}
+
+/*
+  Drop requests whose handshake did not complete in time. The SYN
+  queue is kept in order of expiry, so only the expired requests are
+  looked at.
+ */
+static void serval_sal_syn_queue_prune(struct sock *sk)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+        struct serval_request_sock *srsk;
+
+        while (!list_empty(&ssk->syn_queue)) {
+                srsk = list_first_entry(&ssk->syn_queue,
+                                        struct serval_request_sock, lh);
+
+                if (time_before(jiffies, srsk->rsk.req.expires))
+                        break;
+
+                LOG_DBG("SYN queued request expired\n");
+
+                list_del(&srsk->lh);
+                serval_rsk_unhash(srsk);
+                reqsk_free(&srsk->rsk.req);
+                sk->sk_ack_backlog--;
+                SAL_INC_STATS(SAL_MIB_SYN_QUEUE_EXPIRED);
+        }
+}
+
+/* Give a request more time, e.g., when its SYN is retransmitted */
+static inline void serval_sal_syn_queue_refresh(struct sock *sk,
+                                                struct request_sock *rsk)
+{
+        struct serval_request_sock *srsk = serval_rsk(rsk);
+
+        if (rsk->sk)
+                return;
+
+        rsk->expires = jiffies + SAL_SYN_QUEUE_TIMEOUT;
+        list_move_tail(&srsk->lh, &serval_sk(sk)->syn_queue);
+}
+
+static int serval_sal_rcv_syn(struct sock *sk,
+                              struct sk_buff *skb,
+                              struct serval_context *ctx)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+        struct serval_connection_ext *conn_ext = ctx->conn_ext;
+        struct request_sock *rsk;
+        struct serval_request_sock *srsk;
+        struct net_addr myaddr;
+        int want_cookie, err = 0;
+
+        /* Make compiler be quiet */
+        memset(&myaddr, 0, sizeof(myaddr));
+
+        LOG_DBG("REQUEST seqno=%u\n", ctx->seqno);
+
+        want_cookie = serval_sal_want_cookie(sk);
+
+        if (sk->sk_ack_backlog >= sk->sk_max_ack_backlog && !want_cookie)
+                goto drop;
+
+        /* Try to figure out the source address for the incoming
+         * interface so that we can use it in our reply.
+         *
+         * FIXME:
+         * should probably route the reply here somehow in case we
+         * want to reply on another interface than the incoming one.
+         */
+        if (!dev_get_ipv4_addr(skb->dev, IFADDR_LOCAL, &myaddr)) {
+                LOG_ERR("No source address for interface %s\n",
+                        skb->dev);
+                goto drop;
+        }
+
+        rsk = serval_reqsk_alloc(sk->sk_prot->rsk_prot);
+
+        if (!rsk)
+                goto drop;
+
+        srsk = serval_rsk(rsk);
+
+        /* Copy fields in request packet into request sock */
+        memcpy(&srsk->peer_flowid, &ctx->hdr->src_flowid,
+               sizeof(ctx->hdr->src_flowid));
+        memcpy(&srsk->peer_srvid, &ctx->conn_ext->srvid,
+               sizeof(ctx->conn_ext->srvid));
+        memcpy(srsk->peer_nonce, conn_ext->nonce, SERVAL_NONCE_SIZE);
+        srsk->rcv_seq = ctx->seqno;
+
+        serval_sal_rsk_init_addrs(rsk, skb, ctx, &myaddr);
+
+        if (want_cookie) {
+                /* Keep no state: the ACK brings back all that is
+                 * needed to rebuild the request. */
+                srsk->syncookie = 1;
+                serval_sal_cookie_init(srsk);
+                ssk->syncookie_stamp = jiffies;
+        } else {
+                /* Add the new request socket to the SYN queue,
+                 * which is in order of expiry. */
+                rsk->expires = jiffies + SAL_SYN_QUEUE_TIMEOUT;
+                list_add_tail(&srsk->lh, &ssk->syn_queue);
+                serval_rsk_hash(ssk, srsk);
+                sk->sk_ack_backlog++;
+        }
 
-        /* Add the new request socket to the SYN queue. */
-        list_add(&srsk->lh, &ssk->syn_queue);
-        sk->sk_ack_backlog++;
-        
         /* Call upper transport protocol handler */
         if (ssk->af_ops->conn_request) {
                 err = ssk->af_ops->conn_request(sk, rsk, skb);
-                
+
                 /* Transport protocol will free the skb on error */
-                if (err)
+                if (err) {
+                        if (want_cookie)
+                                reqsk_free(rsk);
                         goto done;
+                }
         }
-        
+
         err = serval_sal_send_synack(sk, rsk, skb, ctx);
+
+        if (want_cookie) {
+                SAL_INC_STATS(SAL_MIB_SYNCOOKIES_SENT);
+                reqsk_free(rsk);
+        }
  drop:
         /* Free the SYN request */
         kfree_skb(skb);
@@ -1813,36 +1969,182 @@ serval_sal_create_respond_sock(struct sock *sk,
         return nsk;
 }
 
-/*
-  Check if a request sock has previously been created by a SYN, in
-  case of receiving retransmitted/duplicate SYNs.  */  
-static struct request_sock *serval_sal_find_rsk(struct sock *sk,
-                                                struct serval_context *ctx)
-{
-        struct serval_sock *ssk = serval_sk(sk);
-        struct serval_request_sock *srsk;
-        
-        list_for_each_entry(srsk, &ssk->syn_queue, lh) {
-                if (memcmp(&srsk->peer_flowid, &ctx->hdr->src_flowid, 
-                           sizeof(srsk->peer_flowid)) == 0) {
-                        return &srsk->rsk.req;
-                }
+/*
+  Check if a request sock has previously been created by a SYN, in
+  case of receiving retransmitted/duplicate SYNs.  */
+static struct request_sock *serval_sal_find_rsk(struct sock *sk,
+                                                struct serval_context *ctx)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+        struct serval_request_sock *srsk;
+        struct hlist_node *walk;
+
+        hlist_for_each_entry(srsk, walk,
+                             serval_rsk_hash_head(ssk, ctx->conn_ext->nonce),
+                             hash_node) {
+                if (memcmp(&srsk->peer_flowid, &ctx->hdr->src_flowid,
+                           sizeof(srsk->peer_flowid)) == 0) {
+                        return &srsk->rsk.req;
+                }
+        }
+
+        return NULL;
+}
+
+/*
+  Turn a request sock whose handshake just completed into a child
+  sock, and queue it for accept().
+ */
+static struct sock *serval_sal_rsk_accept(struct sock *sk,
+                                          struct sk_buff *skb,
+                                          struct request_sock *rsk)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+        struct serval_request_sock *srsk = serval_rsk(rsk);
+        struct inet_request_sock *irsk = &srsk->rsk;
+        struct serval_sock *nssk;
+        struct inet_sock *newinet;
+        struct sock *nsk;
+
+        nsk = serval_sal_create_respond_sock(sk, skb, rsk, NULL);
+
+        if (!nsk)
+                return NULL;
+
+        /* Move request sock to accept queue */
+        if (srsk->syncookie) {
+                list_add_tail(&srsk->lh, &ssk->accept_queue);
+                serval_rsk_hash(ssk, srsk);
+                sk->sk_ack_backlog++;
+        } else {
+                list_move_tail(&srsk->lh, &ssk->accept_queue);
+        }
+        ssk->accept_queue_len++;
+        nsk->sk_ack_backlog = 0;
+
+        newinet = inet_sk(nsk);
+        nssk = serval_sk(nsk);
+
+        serval_sock_set_state(nsk, SERVAL_RESPOND);
+
+        memcpy(&nssk->local_flowid, &srsk->local_flowid,
+               sizeof(srsk->local_flowid));
+        memcpy(&nssk->peer_flowid, &srsk->peer_flowid,
+               sizeof(srsk->peer_flowid));
+        memcpy(&nssk->peer_srvid, &srsk->peer_srvid,
+               sizeof(srsk->peer_srvid));
+        memcpy(&newinet->inet_daddr, &irsk->rmt_addr,
+               sizeof(newinet->inet_daddr));
+        memcpy(&newinet->inet_saddr, &irsk->loc_addr,
+               sizeof(newinet->inet_saddr));
+
+        memcpy(nssk->local_nonce, srsk->local_nonce,
+               SERVAL_NONCE_SIZE);
+        memcpy(nssk->peer_nonce, srsk->peer_nonce,
+               SERVAL_NONCE_SIZE);
+        nssk->snd_seq.iss = srsk->iss_seq;
+        nssk->snd_seq.una = srsk->iss_seq;
+        nssk->snd_seq.nxt = srsk->iss_seq + 1;
+        nssk->rcv_seq.iss = srsk->rcv_seq;
+        nssk->rcv_seq.nxt = srsk->rcv_seq + 1;
+        nssk->udp_encap_sport = srsk->udp_encap_sport;
+        nssk->udp_encap_dport = srsk->udp_encap_dport;
+        rsk->sk = nsk;
+
+        /* Hash the sock to make it available */
+        nsk->sk_prot->hash(nsk);
+
+        return nsk;
+}
+
+/*
+  Rebuild the request that a SYN cookie was sent for from the ACK
+  that echoes it, and accept the connection if the cookie is valid.
+ */
+static struct sock *serval_sal_cookie_sock(struct sock *sk,
+                                           struct sk_buff *skb,
+                                           struct serval_context *ctx)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+        struct request_sock *rsk;
+        struct serval_request_sock *srsk;
+        struct net_addr myaddr;
+        struct sock *nsk;
+
+        /* A valid cookie takes a new place in the backlog, so there
+         * has to be room in the accept queue. The SYN queue may well
+         * be full, which is why a cookie was sent. */
+        if (ssk->accept_queue_len >= sk->sk_max_ack_backlog) {
+                LOG_PKT("Accept queue full, dropping cookie ACK\n");
+                return NULL;
+        }
+
+        if (!dev_get_ipv4_addr(skb->dev, IFADDR_LOCAL, &myaddr))
+                return NULL;
+
+        /* The flowID, nonce and sequence number all come from the
+         * ACK and the cookie */
+        rsk = __serval_reqsk_alloc(sk->sk_prot->rsk_prot);
+
+        if (!rsk)
+                return NULL;
+
+        srsk = serval_rsk(rsk);
+        srsk->syncookie = 1;
+
+        memcpy(&srsk->local_flowid, &ctx->hdr->dst_flowid,
+               sizeof(srsk->local_flowid));
+        memcpy(&srsk->peer_flowid, &ctx->hdr->src_flowid,
+               sizeof(srsk->peer_flowid));
+        memcpy(&srsk->peer_srvid, &ctx->conn_ext->srvid,
+               sizeof(srsk->peer_srvid));
+        memcpy(srsk->peer_nonce, ctx->conn_ext->nonce, SERVAL_NONCE_SIZE);
+        srsk->rcv_seq = ctx->seqno - 1;
+
+        if (serval_sal_cookie_check(srsk, ctx->ackno - 1)) {
+                LOG_PKT("Bad SYN cookie ackno=%u\n", ctx->ackno);
+                goto failed;
+        }
+
+        serval_sal_rsk_init_addrs(rsk, skb, ctx, &myaddr);
+
+#if defined(OS_LINUX_KERNEL)
+        if (ip_hdr(skb)->protocol == IPPROTO_UDP) {
+                struct iphdr *iph = ip_hdr(skb);
+                struct udphdr *uh = (struct udphdr *)
+                        ((char *)iph + (iph->ihl << 2));
+
+                srsk->udp_encap_sport = ntohs(uh->dest);
+                srsk->udp_encap_dport = ntohs(uh->source);
+        }
+#endif
+        if (ssk->af_ops->conn_cookie_check &&
+            ssk->af_ops->conn_cookie_check(sk, rsk, skb)) {
+                LOG_PKT("Bad transport SYN cookie\n");
+                goto failed;
         }
 
-        list_for_each_entry(srsk, &ssk->accept_queue, lh) {
-                if (memcmp(&srsk->peer_flowid, &ctx->hdr->src_flowid, 
-                           sizeof(srsk->peer_flowid)) == 0) {
-                        return &srsk->rsk.req;
-                }
+        nsk = serval_sal_rsk_accept(sk, skb, rsk);
+
+        if (!nsk) {
+                reqsk_free(rsk);
+                return NULL;
         }
 
+        SAL_INC_STATS(SAL_MIB_SYNCOOKIES_RECV);
+
+        return nsk;
+ failed:
+        SAL_INC_STATS(SAL_MIB_SYNCOOKIES_FAILED);
+        reqsk_free(rsk);
         return NULL;
 }
+
 /*
   This function is called as a result of receiving a ACK in response
   to a SYNACK that was sent by a "parent" sock in LISTEN state (the sk
-  argument). 
-   
+  argument).
+
   The objective is to find a serval_request_sock that corresponds to
   the ACK just received and initiate processing on that request
   sock. Such processing includes transforming the request sock into a
@@ -1855,17 +2157,18 @@ static struct sock * serval_sal_request_sock_handle(struct sock *sk,
 {
         struct serval_sock *ssk = serval_sk(sk);
         struct serval_request_sock *srsk;
+        struct hlist_node *walk;
 
-        list_for_each_entry(srsk, &ssk->syn_queue, lh) {
-                if (memcmp(&srsk->local_flowid, &ctx->hdr->dst_flowid, 
+        hlist_for_each_entry(srsk, walk,
+                             serval_rsk_hash_head(ssk, ctx->conn_ext->nonce),
+                             hash_node) {
+                if (memcmp(&srsk->local_flowid, &ctx->hdr->dst_flowid,
                            sizeof(srsk->local_flowid)) == 0) {
-                        struct sock *nsk;
-                        struct serval_sock *nssk;
-                        struct request_sock *rsk = &srsk->rsk.req;
-                        struct inet_request_sock *irsk = &srsk->rsk;
-                        struct inet_sock *newinet;
-                        
-                        if (memcmp(srsk->peer_nonce, ctx->conn_ext->nonce, 
+                        /* Already accepted, e.g., a duplicate ACK */
+                        if (srsk->rsk.req.sk)
+                                return sk;
+
+                        if (memcmp(srsk->peer_nonce, ctx->conn_ext->nonce,
                                    SERVAL_NONCE_SIZE) != 0) {
                                 LOG_ERR("Bad nonce\n");
                                 return NULL;
@@ -1873,63 +2176,28 @@ static struct sock * serval_sal_request_sock_handle(struct sock *sk,
 
                         if (ctx->seqno != srsk->rcv_seq + 1) {
                                 LOG_ERR("Bad seqno received=%u expected=%u\n",
-                                        ctx->seqno, 
+                                        ctx->seqno,
                                         srsk->rcv_seq + 1);
                                 return NULL;
                         }
                         if (ctx->ackno != srsk->iss_seq + 1) {
                                 LOG_ERR("Bad ackno received=%u expected=%u\n",
-                                        ctx->ackno, 
+                                        ctx->ackno,
                                         srsk->iss_seq + 1);
                                 return NULL;
                         }
-                        
-                        nsk = serval_sal_create_respond_sock(sk, skb, 
-                                                             rsk, NULL);
-                        
-                        if (!nsk)
-                                return NULL;
-
-                        /* Move request sock to accept queue */
-                        list_move_tail(&srsk->lh, &ssk->accept_queue);
-                        nsk->sk_ack_backlog = 0;
-
-                        newinet = inet_sk(nsk);
-                        nssk = serval_sk(nsk);
-
-                        serval_sock_set_state(nsk, SERVAL_RESPOND);
-
-                        memcpy(&nssk->local_flowid, &srsk->local_flowid, 
-                               sizeof(srsk->local_flowid));
-                        memcpy(&nssk->peer_flowid, &srsk->peer_flowid, 
-                               sizeof(srsk->peer_flowid));
-                        memcpy(&nssk->peer_srvid, &srsk->peer_srvid,
-                               sizeof(srsk->peer_srvid));
-                        memcpy(&newinet->inet_daddr, &irsk->rmt_addr,
-                               sizeof(newinet->inet_daddr));
-                        memcpy(&newinet->inet_saddr, &irsk->loc_addr,
-                               sizeof(newinet->inet_saddr));      
-
-                        memcpy(nssk->local_nonce, srsk->local_nonce, 
-                               SERVAL_NONCE_SIZE);
-                        memcpy(nssk->peer_nonce, srsk->peer_nonce, 
-                               SERVAL_NONCE_SIZE);
-                        nssk->snd_seq.iss = srsk->iss_seq;
-                        nssk->snd_seq.una = srsk->iss_seq;
-                        nssk->snd_seq.nxt = srsk->iss_seq + 1;
-                        nssk->rcv_seq.iss = srsk->rcv_seq;
-                        nssk->rcv_seq.nxt = srsk->rcv_seq + 1;
-                        nssk->udp_encap_sport = srsk->udp_encap_sport;
-                        nssk->udp_encap_dport = srsk->udp_encap_dport;
-                        rsk->sk = nsk;
-                        
-                        /* Hash the sock to make it available */
-                        nsk->sk_prot->hash(nsk);
 
-                        return nsk;
+                        return serval_sal_rsk_accept(sk, skb,
+                                                     &srsk->rsk.req);
                 }
         }
-        
+
+        /* No pending request; the handshake may have been answered
+         * with a cookie, if any was sent lately */
+        if (net_serval.sysctl_sal_syncookies != SAL_SYNCOOKIES_OFF &&
+            !ctx->hdr->syn && serval_sal_cookie_recent(sk))
+                return serval_sal_cookie_sock(sk, skb, ctx);
+
         return sk;
 }
 
@@ -2339,12 +2607,23 @@ static int serval_sal_listen_state_process(struct sock *sk,
                                            struct sk_buff *skb,
                                            struct serval_context *ctx)
 {
+        /* Pending requests are found by the nonce in the connection
+         * extension, so the handshake cannot do without it */
+        if (!has_connection_extension(ctx))
+                goto drop;
+
+        /* Expire requests before any lookup, so that neither a
+         * retransmitted SYN nor an ACK can revive one that timed out,
+         * and so that a new SYN finds room */
+        serval_sal_syn_queue_prune(sk);
+
         /* Is this a SYN? */
         if (ctx->hdr->syn && !ctx->hdr->ack) {
                 struct request_sock *rsk = serval_sal_find_rsk(sk, ctx);
                 
                 if (rsk) {
                         LOG_DBG("SYN already received, dropping!\n");
+                        serval_sal_syn_queue_refresh(sk, rsk);
                         serval_sal_send_synack(sk, rsk, skb, ctx);
                         goto drop;
                 }
@@ -2808,6 +3087,9 @@ int serval_sal_do_rcv(struct sock *sk, struct sk_buff *skb)
                 return -1;
         }
 
+        serval_sk(sk)->tot_pkts_recv++;
+        serval_sk(sk)->tot_bytes_recv += skb->len;
+
         pskb_pull(skb, ctx.length);
         skb_reset_transport_header(skb);
 
@@ -2834,48 +3116,76 @@ enum {
         SAL_RESOLVE_DROP,
 };
 
+/*
+  Fix up the transport checksum of a forwarded packet whose IP
+  destination changed from old_daddr. The segment itself is untouched,
+  so only the pseudo-header term needs patching (RFC 1624), which keeps
+  the cost independent of the payload size. On return, skb->csum holds
+  the sum over the whole segment, for the encapsulation checksum.
+ */
 static int serval_sal_update_transport_csum(struct sk_buff *skb,
-                                            int protocol)
+                                            int protocol,
+                                            __be32 old_daddr)
 {
         struct iphdr *iph = ip_hdr(skb);
+        __sum16 *check;
+        int proto;
 
-        skb->ip_summed = CHECKSUM_NONE;
-        
         switch (protocol) {
         case SERVAL_PROTO_TCP:
-                tcp_hdr(skb)->check = 0;
-                skb->csum = csum_partial(tcp_hdr(skb),
-                                         skb->len, 0);
-                tcp_hdr(skb)->check = 
-                        csum_tcpudp_magic(iph->saddr, 
-                                          iph->daddr, 
-                                          skb->len, 
-                                          IPPROTO_TCP, 
-                                          skb->csum);
+                check = &tcp_hdr(skb)->check;
+                proto = IPPROTO_TCP;
                 break;
         case SERVAL_PROTO_UDP:
-                udp_hdr(skb)->check = 0;
-                skb->csum = csum_partial(udp_hdr(skb),
-                                         skb->len, 0);
-                udp_hdr(skb)->check = 
-                        csum_tcpudp_magic(iph->saddr, 
-                                          iph->daddr, 
-                                          skb->len, 
-                                          IPPROTO_UDP, 
-                                          skb->csum);
+                check = &udp_hdr(skb)->check;
+                proto = IPPROTO_UDP;
                 break;
         default:
                 LOG_INF("Unknown transport protocol %u, "
                         "forgoing checksum calculation\n",
                         protocol);
-                break;
+                skb->ip_summed = CHECKSUM_NONE;
+                skb->csum = csum_partial(skb->data, skb->len, 0);
+                return 0;
         }
-        
+
+        /* A partial checksum only covers the pseudo-header, and a zero
+           UDP checksum means none at all, so recompute those */
+        if (skb->ip_summed == CHECKSUM_PARTIAL ||
+            (proto == IPPROTO_UDP && *check == 0)) {
+                skb->ip_summed = CHECKSUM_NONE;
+                *check = 0;
+                skb->csum = csum_partial(skb->data, skb->len, 0);
+                *check = csum_tcpudp_magic(iph->saddr, iph->daddr,
+                                           skb->len, proto, skb->csum);
+                if (proto == IPPROTO_UDP && *check == 0)
+                        *check = CSUM_MANGLED_0;
+                skb->csum = csum_partial(check, sizeof(*check), 
+                                         skb->csum);
+                return 0;
+        }
+
+        skb->ip_summed = CHECKSUM_NONE;
+        csum_replace4(check, old_daddr, iph->daddr);
+
+        if (proto == IPPROTO_UDP && *check == 0)
+                *check = CSUM_MANGLED_0;
+
+        /* With a valid checksum, the segment sums to the complement
+           of the pseudo-header */
+        skb->csum = csum_unfold(csum_tcpudp_magic(iph->saddr, iph->daddr,
+                                                  skb->len, proto, 0));
         return 0;
 }
 
 #if defined(OS_LINUX_KERNEL)
-static int serval_sal_update_encap_csum(struct sk_buff *skb)
+/*
+  Checksum the UDP encapsulation. Only the UDP and SAL headers are
+  summed; the transport segment's sum is passed in seg_csum.
+ */
+static int serval_sal_update_encap_csum(struct sk_buff *skb,
+                                        unsigned int hdr_len,
+                                        __wsum seg_csum)
 {
         struct udphdr *uh;
         
@@ -2885,11 +3195,173 @@ static int serval_sal_update_encap_csum(struct sk_buff *skb)
                                       ip_hdr(skb)->daddr, 
                                       skb->len,
                                       IPPROTO_UDP,
-                                      csum_partial(uh, skb->len, 0));
+                                      csum_partial(uh, sizeof(*uh) + 
+                                                   hdr_len, seg_csum));
+        if (uh->check == 0)
+                uh->check = CSUM_MANGLED_0;
+
         return 0;
 }
 #endif /* OS_LINUX_KERNEL */
 
+/*
+  State for forwarding one packet to several targets. Each target gets
+  a private copy of a small header template, which already carries
+  the source extension and SAL checksum, while the transport payload
+  of the original packet is shared, read-only, through the frag_list
+  of each copy.
+ */
+struct sal_fanout {
+        struct sk_buff *tmpl;       /* IP, SAL and transport headers */
+        unsigned int hdr_len;       /* SAL header with source ext */
+        unsigned int payload_off;   /* Payload offset from SAL header */
+};
+
+/*
+  Build the header template. Returns -1 if the packet cannot be
+  fanned out without copying, e.g., because the transport checksum
+  must be computed over the payload.
+ */
+static int serval_sal_fanout_init(struct sk_buff *skb,
+                                  struct serval_context *ctx,
+                                  struct sal_fanout *fo)
+{
+        unsigned char *iph = skb_network_header(skb);
+        unsigned int size = skb->data - iph;
+        unsigned int thlen, tmpl_len, reserve;
+        struct sk_buff *tmpl;
+        int len;
+
+        if (skb->ip_summed == CHECKSUM_PARTIAL ||
+            skb_has_frag_list(skb))
+                return -1;
+
+        switch (serval_hdr(skb)->protocol) {
+        case SERVAL_PROTO_TCP:
+                if (ctx->length + sizeof(struct tcphdr) > skb_headlen(skb))
+                        return -1;
+                thlen = ((struct tcphdr *)(skb->data + ctx->length))->doff << 2;
+                break;
+        case SERVAL_PROTO_UDP:
+                thlen = sizeof(struct udphdr);
+                if (ctx->length + thlen > skb_headlen(skb) ||
+                    ((struct udphdr *)(skb->data + ctx->length))->check == 0)
+                        return -1;
+                break;
+        default:
+                return -1;
+        }
+
+        if (ctx->length + thlen > skb_headlen(skb))
+                return -1;
+
+        tmpl_len = size + ctx->length + thlen;
+        /* Room for the link header and a new source extension, so
+           that serval_sal_add_source_ext() need not reallocate */
+        reserve = LL_RESERVED_SPACE(skb->dev) + SAL_FORWARD_EXT_GROWTH;
+
+        tmpl = alloc_skb(reserve + tmpl_len, GFP_ATOMIC);
+
+        if (!tmpl)
+                return -1;
+
+        skb_reserve(tmpl, reserve);
+        memcpy(skb_put(tmpl, tmpl_len), iph, tmpl_len);
+        skb_reset_network_header(tmpl);
+        skb_pull(tmpl, size);
+        skb_reset_transport_header(tmpl);
+        tmpl->dev = skb->dev;
+        tmpl->protocol = skb->protocol;
+        tmpl->pkt_type = skb->pkt_type;
+        tmpl->priority = skb->priority;
+        tmpl->mark = skb->mark;
+        tmpl->ip_summed = CHECKSUM_NONE;
+
+        len = serval_sal_add_source_ext(&tmpl, ctx);
+
+        if (len < 0) {
+                kfree_skb(tmpl);
+                return -1;
+        }
+
+        serval_sal_send_check(serval_hdr(tmpl));
+
+        fo->tmpl = tmpl;
+        fo->hdr_len = ctx->length + len;
+        fo->payload_off = ctx->length + thlen;
+
+        return 0;
+}
+
+/*
+  Like pskb_copy(), but the copy also includes the headers in front
+  of skb->data, starting at the IP header.
+ */
+static struct sk_buff *serval_sal_pskb_copy(struct sk_buff *skb)
+{
+        unsigned int off = skb->data - skb_network_header(skb);
+        struct sk_buff *n;
+
+        skb_push(skb, off);
+        n = pskb_copy(skb, GFP_ATOMIC);
+        skb_pull(skb, off);
+
+        if (n)
+                skb_pull(n, off);
+
+        return n;
+}
+
+static struct sk_buff *serval_sal_fanout_skb(struct sal_fanout *fo,
+                                             struct sk_buff *skb)
+{
+        struct sk_buff *hskb, *payload;
+
+        hskb = serval_sal_pskb_copy(fo->tmpl);
+
+        if (!hskb)
+                return NULL;
+
+        payload = skb_clone(skb, GFP_ATOMIC);
+
+        if (!payload) {
+                kfree_skb(hskb);
+                return NULL;
+        }
+
+        pskb_pull(payload, fo->payload_off);
+        payload->next = NULL;
+
+        skb_shinfo(hskb)->frag_list = payload;
+        hskb->len += payload->len;
+        hskb->data_len += payload->len;
+        hskb->truesize += payload->truesize;
+
+        return hskb;
+}
+
+/*
+  Hash of the peer's end of a flow, used to pick a listener among
+  sockets sharing a serviceID (SVSF_REUSEPORT). It covers only the
+  peer's flowID and nonce, which the SYN and the ACK that completes
+  the handshake both carry unchanged end to end. The source address
+  is left out, since a service router rewrites it when forwarding
+  the SYN, while the ACK comes straight from the peer. Packets
+  without a connection extension all go to the same listener.
+ */
+static u32 serval_sal_flow_hash(struct serval_context *ctx)
+{
+        u32 w[3];
+
+        if (!ctx->conn_ext)
+                return 0;
+
+        w[0] = ctx->hdr->src_flowid.s_id32;
+        memcpy(&w[1], ctx->conn_ext->nonce, SERVAL_NONCE_SIZE);
+
+        return serval_keyed_hash(w, 3);
+}
+
 static int serval_sal_resolve_service(struct sk_buff *skb, 
                                       struct serval_context *ctx,
                                       struct service_id *srvid,
@@ -2898,9 +3370,10 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
         struct service_entry* se = NULL;
         struct service_iter iter;
         struct target *target = NULL;
-        unsigned int hdr_len = ctx->length;
+        struct sal_fanout fo = { NULL, 0, 0 };
+        int fanout = 0;
         unsigned int num_forward = 0;
-        unsigned int data_len = skb->len - hdr_len;
+        unsigned int data_len = skb->len - ctx->length;
         int err = SAL_RESOLVE_NO_MATCH;
 
         *sk = NULL;
@@ -2913,7 +3386,7 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
          * probably be in a separate function call
          * serval_sal_transit_rcv or resolve something
          */
-        se = service_find(srvid, SERVICE_ID_MAX_PREFIX_BITS);
+        se = service_find_cached(srvid);
 
         if (!se) {
                 LOG_INF("No matching service entry for serviceID %s\n",
@@ -2953,7 +3426,13 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
                    until we hit a socket, and then break (i.e., DEMUX
                    to socket but stop forwarding). */
                 if (is_sock_target(target)) {
-                        /* local resolution */
+                        u32 hash = serval_sal_flow_hash(ctx);
+
+                        /* local resolution, picking among a group
+                           of listeners by flow hash */
+                        target = service_iter_get_sock_target(&iter, 
+                                          target->out.sk->sk_protocol,
+                                          hash);
                         *sk = target->out.sk;
                         sock_hold(*sk);
                         err = SAL_RESOLVE_DEMUX;
@@ -2961,8 +3440,9 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
                 } else {
                         struct sk_buff *cskb;
                         struct iphdr *iph;
-                        unsigned int iph_len;
+                        unsigned int iph_len, fwd_hdr_len;
                         unsigned int protocol = serval_hdr(skb)->protocol;
+                        __be32 old_daddr;
                         int len = 0;
 
                         err = SAL_RESOLVE_FORWARD;
@@ -2980,10 +3460,16 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
                         if (next_target == NULL) {
                                 cskb = skb;
                         } else {
-                                if (skb_cloned(skb))
-                                        cskb = pskb_copy(skb, GFP_ATOMIC);
+                                /* The headers are rewritten for each
+                                   target, so every copy but the last
+                                   needs private ones */
+                                if (fanout == 0)
+                                        fanout = serval_sal_fanout_init(skb, ctx, &fo) ? -1 : 1;
+
+                                if (fanout == 1)
+                                        cskb = serval_sal_fanout_skb(&fo, skb);
                                 else
-                                        cskb = skb_clone(skb, GFP_ATOMIC);
+                                        cskb = serval_sal_pskb_copy(skb);
                                 
                                 if (!cskb) {
                                         LOG_ERR("Skb allocation failed\n");
@@ -3002,40 +3488,50 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
                                 skb_set_dev(cskb, target->out.dev);
 #endif /* OS_LINUX_KERNEL */
                         
-                        /* Set the true overlay source address if the
-                         * packet may be ingress-filtered user-level
-                         * raw socket forwarding may drop the packet
-                         * if the source address is invalid */
-                        len = serval_sal_add_source_ext(&cskb, ctx);
+                        if (fanout == 1 && cskb != skb) {
+                                /* The template has the extension and
+                                   SAL checksum already */
+                                fwd_hdr_len = fo.hdr_len;
+                        } else {
+                                /* Set the true overlay source address
+                                 * if the packet may be
+                                 * ingress-filtered user-level raw
+                                 * socket forwarding may drop the
+                                 * packet if the source address is
+                                 * invalid */
+                                len = serval_sal_add_source_ext(&cskb, ctx);
                         
-                        if (len < 0) {
-                                LOG_ERR("Failed to add source extension\n");
-                                kfree_skb(cskb);
-                                break;
+                                if (len < 0) {
+                                        LOG_ERR("Failed to add source extension\n");
+                                        kfree_skb(cskb);
+                                        break;
+                                }
+                                fwd_hdr_len = ctx->length + len;
+
+                                /* Recalculate SAL checksum */
+                                serval_sal_send_check(serval_hdr(cskb));
                         }
                         iph = ip_hdr(cskb);
-                        hdr_len += len;
 
-                        LOG_DBG("new serval header len=%u\n", hdr_len);
+                        LOG_DBG("new serval header len=%u\n", fwd_hdr_len);
 
                         /* Update destination address */
+                        old_daddr = iph->daddr;
                         memcpy(&iph->daddr, target->dst, sizeof(iph->daddr));
 
-                        /* Must recalculate transport checksum. Pull
+                        /* Must update transport checksum. Pull
                            to reveal transport header */
-                        pskb_pull(cskb, hdr_len);
+                        pskb_pull(cskb, fwd_hdr_len);
                         skb_reset_transport_header(cskb);
                         
                         serval_sal_update_transport_csum(cskb,
-                                                         protocol);
+                                                         protocol,
+                                                         old_daddr);
                         
                         /* Push back to Serval header */
-                        skb_push(cskb, hdr_len);
+                        skb_push(cskb, fwd_hdr_len);
                         skb_reset_transport_header(cskb);
 
-                        /* Recalculate SAL checksum */
-                        serval_sal_send_check(serval_hdr(cskb));
-
 #if defined(OS_LINUX_KERNEL)
                         /* Packet is UDP encapsulated, push back UDP
                          * encapsulation header */
@@ -3046,7 +3542,8 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
                                 LOG_DBG("Pushed back UDP encapsulation [%u:%u]\n",
                                         ntohs(udp_hdr(skb)->source),
                                         ntohs(udp_hdr(skb)->dest));
-                                serval_sal_update_encap_csum(cskb);
+                                serval_sal_update_encap_csum(cskb, fwd_hdr_len,
+                                                             cskb->csum);
                         }
 #endif
                         /* Push back to IP header */
@@ -3063,6 +3560,9 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
                 target = next_target;
         }
 
+        if (fanout == 1)
+                kfree_skb(fo.tmpl);
+
         if (num_forward == 0)
                 service_iter_inc_stats(&iter, -1, -data_len);
 
@@ -3073,6 +3573,7 @@ static int serval_sal_resolve_service(struct sk_buff *skb,
 }
 
 static struct sock *serval_sal_demux_service(struct sk_buff *skb, 
+                                             struct serval_context *ctx,
                                              struct service_id *srvid,
                                              int protocol)
 {
@@ -3081,7 +3582,8 @@ static struct sock *serval_sal_demux_service(struct sk_buff *skb,
         LOG_DBG("Demux on serviceID %s\n", service_id_to_str(srvid));
 
         /* only allow listening socket demux */
-        sk = serval_sock_lookup_service(srvid, protocol);
+        sk = serval_sock_lookup_service_hash(srvid, protocol, 
+                                             serval_sal_flow_hash(ctx));
         
         if (!sk) {
                 LOG_INF("No matching sock for serviceID %s\n",
@@ -3135,7 +3637,8 @@ static int serval_sal_resolve(struct sk_buff *skb,
         if (net_serval.sysctl_sal_forward) {
                 ret = serval_sal_resolve_service(skb, ctx, srvid, sk);
         } else {
-                *sk = serval_sal_demux_service(skb, srvid, ctx->hdr->protocol);
+                *sk = serval_sal_demux_service(skb, ctx, srvid, 
+                                               ctx->hdr->protocol);
                 
                 if (!(*sk))
                         ret = SAL_RESOLVE_NO_MATCH;
@@ -3146,6 +3649,95 @@ static int serval_sal_resolve(struct sk_buff *skb,
         return ret;
 }
 
+/*
+  Cheap checks of a packet for a local socket, done before the socket
+  is locked so that garbage does not get to take the lock or go on the
+  backlog. Socket state is only read here, and since the SAL receive
+  sequence number never moves back, a packet found to be old now would
+  also be dropped later under the lock.
+
+  Pulling the transport header may move the packet data, which leaves
+  the header pointers in ctx dangling, so what is needed of them is
+  read up front. The caller must not use them afterwards either; the
+  headers are parsed again when the packet is processed.
+
+  Returns 0 if the packet may proceed, or else the SAL MIB counter of
+  the reason it should be dropped.
+ */
+static int serval_sal_rcv_validate(struct sock *sk, struct sk_buff *skb,
+                                   struct serval_context *ctx)
+{
+        unsigned int len = skb->len - ctx->length;
+        u8 protocol = ctx->hdr->protocol;
+        const struct iphdr *iph;
+
+        if (has_seqno(ctx) && 
+            sk->sk_state != SERVAL_LISTEN &&
+            sk->sk_state != SERVAL_REQUEST &&
+            before(ctx->seqno, 
+                   ACCESS_ONCE(serval_sk(sk)->rcv_seq.nxt))) {
+                LOG_PKT("Old seqno=%u\n", ctx->seqno);
+                return SAL_MIB_IN_SEQNO_ERRORS;
+        }
+
+        /* Pure SAL control packet */
+        if (len == 0)
+                return 0;
+
+        switch (protocol) {
+        case SERVAL_PROTO_TCP:
+        {
+                struct tcphdr *th;
+
+                if (len < sizeof(*th) ||
+                    !pskb_may_pull(skb, ctx->length + sizeof(*th)))
+                        return SAL_MIB_IN_TRANSPORT_ERRORS;
+
+                th = (struct tcphdr *)(skb->data + ctx->length);
+
+                if (th->doff < sizeof(*th) / 4 || (th->doff << 2) > len)
+                        return SAL_MIB_IN_TRANSPORT_ERRORS;
+                break;
+        }
+        case SERVAL_PROTO_UDP:
+        {
+                struct udphdr *uh;
+
+                if (len < sizeof(*uh) ||
+                    !pskb_may_pull(skb, ctx->length + sizeof(*uh)))
+                        return SAL_MIB_IN_TRANSPORT_ERRORS;
+
+                uh = (struct udphdr *)(skb->data + ctx->length);
+
+                /* No checksum */
+                if (uh->check == 0)
+                        return 0;
+                break;
+        }
+        default:
+                return 0;
+        }
+
+        /* Checksums are otherwise verified as the transport reads
+           the data, so only check short segments (e.g., SYNs) here,
+           as the transport would do right away anyway */
+        if (skb->ip_summed != CHECKSUM_NONE || len > 76)
+                return 0;
+
+        /* Found from the (possibly new) head after pulling */
+        iph = ip_hdr(skb);
+
+        if (csum_fold(skb_checksum(skb, ctx->length, len, 
+                                   csum_tcpudp_nofold(iph->saddr, 
+                                                      iph->daddr, len, 
+                                                      protocol, 0))))
+                return SAL_MIB_IN_CSUM_ERRORS;
+
+        skb->ip_summed = CHECKSUM_UNNECESSARY;
+
+        return 0;
+}
+
 int serval_sal_rcv(struct sk_buff *skb)
 {
         struct sock *sk = NULL;
@@ -3155,23 +3747,27 @@ int serval_sal_rcv(struct sk_buff *skb)
         if (skb->len < sizeof(struct serval_hdr)) {
                 LOG_DBG("skb length too short (%u bytes)\n", 
                         skb->len);
+                SAL_INC_STATS(SAL_MIB_IN_HDR_ERRORS);
                 goto drop;
         }
 
         if (serval_sal_parse_hdr(skb, &ctx, SERVAL_PARSE_ALL)) {
                 LOG_DBG("Bad Serval header %s\n",
                         ctx.hdr ? serval_hdr_to_str(ctx.hdr) : "NULL");
+                SAL_INC_STATS(SAL_MIB_IN_HDR_ERRORS);
                 goto drop;
         }
         
         if (!pskb_may_pull(skb, ctx.length)) {
                 LOG_DBG("Cannot pull header (hdr_len=%u)\n",
                         ctx.length);
+                SAL_INC_STATS(SAL_MIB_IN_HDR_ERRORS);
                 goto drop;
         }
         
         if (unlikely(serval_sal_csum(ctx.hdr, ctx.length))) {
                 LOG_DBG("SAL checksum error!\n");
+                SAL_INC_STATS(SAL_MIB_IN_CSUM_ERRORS);
                 goto drop;
         }
 
@@ -3186,12 +3782,6 @@ int serval_sal_rcv(struct sk_buff *skb)
                         inet_ntop(AF_INET, &iph->daddr, dst, 18));
         }
 #endif
-        /*
-          FIXME: We should try to do early transport layer header
-          checks here so that we can drop bad packets before we put
-          them on, e.g., the backlog queue
-        */
-        
         /* Try flowID demux first */
         sk = serval_sal_demux_flow(skb, &ctx);
         
@@ -3216,6 +3806,14 @@ int serval_sal_rcv(struct sk_buff *skb)
                         goto drop;
                 }
         }
+
+        err = serval_sal_rcv_validate(sk, skb, &ctx);
+
+        if (err) {
+                SAL_INC_STATS(err);
+                sock_put(sk);
+                goto drop;
+        }
         
         bh_lock_sock_nested(sk);
 
@@ -3303,13 +3901,11 @@ static int serval_sal_rexmit(struct sock *sk)
         return err;
 }
 
-void serval_sal_rexmit_timeout(unsigned long data)
+/* Called with the socket locked, when its RTO expired. */
+static void serval_sal_rexmit_timeout(struct sock *sk)
 {
-        struct sock *sk = (struct sock *)data;
         struct serval_sock *ssk = serval_sk(sk);
 
-        bh_lock_sock(sk);
-
         LOG_DBG("Transmit timeout sock=%p rto=%u (ms) backoff=%u\n", 
                 sk, jiffies_to_msecs(ssk->rto), ssk->backoff);
         
@@ -3329,8 +3925,134 @@ void serval_sal_rexmit_timeout(unsigned long data)
                                                      SAL_RTO_MAX),
                                              SAL_RTO_MAX);
         }
-        bh_unlock_sock(sk);
-        sock_put(sk);
+}
+
+/*
+  Retransmit wheel. Instead of a timer each, sockets with pending
+  control packets are kept in slots of SAL_REXMIT_TICK jiffies by
+  their deadline, and a single timer scans the slots that have
+  expired. Sockets are rescheduled by moving them between slots, and
+  are dropped lazily by the scan once nothing is pending. A socket
+  on the wheel holds a reference, like a pending timer did. Deadlines
+  beyond the span of the wheel are rescheduled when their slot comes
+  up, and retransmissions are at most one tick late.
+ */
+#define SAL_REXMIT_TICK (HZ >= 100 ? HZ / 100 : 1)
+#define SAL_REXMIT_WHEEL_SIZE 512
+
+static struct {
+        spinlock_t lock;
+        struct list_head slots[SAL_REXMIT_WHEEL_SIZE];
+        unsigned long clock; /* Start of the next slot to scan */
+        unsigned int num;
+        struct timer_list timer;
+} rexmit_wheel;
+
+static inline struct list_head *rexmit_slot(unsigned long when)
+{
+        return &rexmit_wheel.slots[(when / SAL_REXMIT_TICK) & 
+                                   (SAL_REXMIT_WHEEL_SIZE - 1)];
+}
+
+/* Put the socket in the slot of its deadline. */
+void serval_sal_rexmit_schedule(struct sock *sk)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+        unsigned long when = ssk->timeout;
+
+        spin_lock_bh(&rexmit_wheel.lock);
+
+        if (rexmit_wheel.num == 0)
+                rexmit_wheel.clock = jiffies - (jiffies % SAL_REXMIT_TICK);
+
+        /* Slots before the clock have already been scanned */
+        if (time_before(when, rexmit_wheel.clock))
+                when = rexmit_wheel.clock;
+
+        if (list_empty(&ssk->rexmit_node)) {
+                sock_hold(sk);
+                rexmit_wheel.num++;
+        }
+
+        list_move_tail(&ssk->rexmit_node, rexmit_slot(when));
+
+        if (!timer_pending(&rexmit_wheel.timer))
+                mod_timer(&rexmit_wheel.timer, jiffies + SAL_REXMIT_TICK);
+
+        spin_unlock_bh(&rexmit_wheel.lock);
+}
+
+void serval_sal_rexmit_cancel(struct sock *sk)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+        int linked;
+
+        spin_lock_bh(&rexmit_wheel.lock);
+
+        linked = !list_empty(&ssk->rexmit_node);
+
+        if (linked) {
+                list_del_init(&ssk->rexmit_node);
+                rexmit_wheel.num--;
+        }
+
+        spin_unlock_bh(&rexmit_wheel.lock);
+
+        if (linked)
+                sock_put(sk);
+}
+
+static void serval_sal_rexmit_scan(unsigned long data)
+{
+        unsigned long now = jiffies;
+        struct list_head expired;
+        unsigned int n = 0;
+
+        INIT_LIST_HEAD(&expired);
+
+        /* Sockets that are rescheduled meanwhile move off the
+           private list, which is only touched under the lock */
+        spin_lock_bh(&rexmit_wheel.lock);
+
+        while (!time_after(rexmit_wheel.clock, now) && 
+               n++ < SAL_REXMIT_WHEEL_SIZE) {
+                list_splice_tail_init(rexmit_slot(rexmit_wheel.clock), 
+                                      &expired);
+                rexmit_wheel.clock += SAL_REXMIT_TICK;
+        }
+
+        if (time_before_eq(rexmit_wheel.clock, now))
+                rexmit_wheel.clock = now - (now % SAL_REXMIT_TICK) + 
+                        SAL_REXMIT_TICK;
+
+        while (!list_empty(&expired)) {
+                struct serval_sock *ssk = 
+                        list_first_entry(&expired, struct serval_sock, 
+                                         rexmit_node);
+                struct sock *sk = (struct sock *)ssk;
+
+                list_del_init(&ssk->rexmit_node);
+                rexmit_wheel.num--;
+                spin_unlock_bh(&rexmit_wheel.lock);
+
+                bh_lock_sock(sk);
+
+                if (ssk->pending) {
+                        if (time_after(ssk->timeout, now))
+                                serval_sal_rexmit_schedule(sk);
+                        else
+                                serval_sal_rexmit_timeout(sk);
+                }
+                bh_unlock_sock(sk);
+                sock_put(sk);
+
+                spin_lock_bh(&rexmit_wheel.lock);
+        }
+
+        if (rexmit_wheel.num > 0)
+                mod_timer(&rexmit_wheel.timer, jiffies + SAL_REXMIT_TICK);
+
+        spin_unlock_bh(&rexmit_wheel.lock);
 }
 
 /* This timeout is used for TIMEWAIT and FINWAIT2 */
@@ -3600,6 +4322,9 @@ int serval_sal_transmit_skb(struct sock *sk, struct sk_buff *skb,
         memcpy(&sh->dst_flowid, &ssk->peer_flowid, sizeof(ssk->peer_flowid));
 
         skb->protocol = IPPROTO_SERVAL;
+
+        ssk->tot_pkts_sent++;
+        ssk->tot_bytes_sent += skb->len;
         
         LOG_PKT("Serval XMIT %s skb->len=%u\n",
                 serval_hdr_to_str(sh), skb->len);
@@ -3648,8 +4373,7 @@ int serval_sal_transmit_skb(struct sock *sk, struct sk_buff *skb,
         LOG_DBG("Resolving service %s\n",
                 service_id_to_str(&ssk->peer_srvid));
 
-        se = service_find(&ssk->peer_srvid, 
-                          sizeof(struct service_id) * 8);
+        se = service_find_cached(&ssk->peer_srvid);
 
 	if (!se) {
 		LOG_DBG("service lookup failed for [%s]\n",
@@ -3832,3 +4556,54 @@ int serval_sal_xmit_skb(struct sk_buff *skb)
 {
         return serval_sal_transmit_skb(skb->sk, skb, 0, GFP_ATOMIC);
 }
+
+int __init serval_sal_init(void)
+{
+        unsigned int i;
+        int err;
+
+        err = serval_syncookies_init();
+
+        if (err < 0)
+                return err;
+
+        spin_lock_init(&rexmit_wheel.lock);
+
+        for (i = 0; i < SAL_REXMIT_WHEEL_SIZE; i++)
+                INIT_LIST_HEAD(&rexmit_wheel.slots[i]);
+
+        rexmit_wheel.num = 0;
+        rexmit_wheel.clock = jiffies;
+        setup_timer(&rexmit_wheel.timer, serval_sal_rexmit_scan, 0);
+
+        serval_sal_migrate_init();
+
+        return 0;
+}
+
+void __exit serval_sal_fini(void)
+{
+        unsigned int i;
+
+        serval_sal_migrate_fini();
+
+#if defined(OS_LINUX_KERNEL)
+        del_timer_sync(&rexmit_wheel.timer);
+#else
+        del_timer(&rexmit_wheel.timer);
+#endif
+        /* Sockets are all closed by now, release the wheel's
+           references */
+        for (i = 0; i < SAL_REXMIT_WHEEL_SIZE; i++) {
+                while (!list_empty(&rexmit_wheel.slots[i])) {
+                        struct serval_sock *ssk = 
+                                list_first_entry(&rexmit_wheel.slots[i],
+                                                 struct serval_sock, 
+                                                 rexmit_node);
+                        list_del_init(&ssk->rexmit_node);
+                        sock_put((struct sock *)ssk);
+                }
+        }
+        rexmit_wheel.num = 0;
+        spin_lock_destroy(&rexmit_wheel.lock);
+}
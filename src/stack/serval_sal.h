@@ -240,8 +240,8 @@ static inline unsigned int serval_sal_ctrl_queue_len(struct sock *sk)
 int serval_sal_connect(struct sock *sk, struct sockaddr *uaddr, int addr_len);
 void serval_sal_close(struct sock *sk, long timeout);
 int serval_sal_migrate(struct sock *sk);
+void serval_sal_migrate_queue(struct sock *sk);
 int serval_sal_do_rcv(struct sock *sk, struct sk_buff *skb);
-void serval_sal_rexmit_timeout(unsigned long data);
 void serval_sal_timewait_timeout(unsigned long data);
 int serval_sal_send_shutdown(struct sock *sk);
 int serval_sal_recv_shutdown(struct sock *sk);
@@ -263,6 +263,31 @@ static inline struct serval_hdr *serval_hdr(struct sk_buff *skb)
 #define SERVAL_NET_HEADER_LEN (sizeof(struct iphdr) +           \
                                sizeof(struct serval_hdr))
 
+/* The most that forwarding grows the SAL header by, i.e., a new
+   source extension with the source and the resolver's address */
+#define SAL_FORWARD_EXT_GROWTH (SERVAL_SOURCE_EXT_LEN + 4)
+
 extern int serval_sal_forwarding;
 
+/* SAL counters, in /proc/net/serval/sal_stats or the user-level
+   stack's "stats" command */
+enum {
+        SAL_MIB_FWD_EXPAND, /* Forwarding had to reallocate headroom */
+        SAL_MIB_IN_HDR_ERRORS, /* Bad SAL header */
+        SAL_MIB_IN_CSUM_ERRORS, /* Bad SAL or transport checksum */
+        SAL_MIB_IN_TRANSPORT_ERRORS, /* Bad transport header */
+        SAL_MIB_IN_SEQNO_ERRORS, /* Old SAL control sequence number */
+        SAL_MIB_SYNCOOKIES_SENT, /* SYN answered with a cookie */
+        SAL_MIB_SYNCOOKIES_RECV, /* Connection rebuilt from a cookie */
+        SAL_MIB_SYNCOOKIES_FAILED, /* ACK with a bad cookie */
+        SAL_MIB_SYN_QUEUE_EXPIRED, /* Request dropped, handshake timed out */
+        __SAL_MIB_MAX
+};
+
+extern atomic_t sal_statistics[__SAL_MIB_MAX];
+
+#define SAL_INC_STATS(field) atomic_inc(&sal_statistics[field])
+
+int serval_sal_stats_print(char *buf, int buflen);
+
 #endif /* _SERVAL_SAL_H_ */
@@ -0,0 +1,321 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+/*
+ * Parsing of SAL headers and extensions.
+ *
+ * The common layouts, i.e., a base header alone or followed by one
+ * connection, control or service extension, are parsed inline in a
+ * single pass. Anything else, including malformed headers, goes to
+ * the generic parser, which walks the extensions one at a time.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#ifndef _SERVAL_SAL_PARSE_H_
+#define _SERVAL_SAL_PARSE_H_
+
+#include <serval/platform.h>
+#include <serval/debug.h>
+#include <netinet/serval.h>
+#include <serval_sal.h>
+#if defined(OS_USER)
+#include <string.h>
+#endif
+
+#define MAX_NUM_SERVAL_EXTENSIONS 5 /* TODO: Set reasonable number */
+
+/*
+   Context for parsed Serval headers. Only the first extensions up to
+   the number parsed are valid in ext[].
+*/
+struct serval_context {
+        struct sk_buff *skb;
+        struct serval_hdr *hdr;
+        unsigned short length; /* Total length of all headers */
+        unsigned short flags;
+        uint32_t seqno; /* Sequence number of control information */
+        uint32_t ackno; /* Acknowledgement number of control information */
+        struct serval_ext *ext[MAX_NUM_SERVAL_EXTENSIONS];
+        struct serval_control_ext *ctrl_ext;
+        struct serval_connection_ext *conn_ext;
+        struct serval_description_ext *desc_ext;
+        struct serval_service_ext *srv_ext;
+        struct serval_source_ext *src_ext;
+        struct serval_migrate_ext *mig_ext;
+};
+
+static size_t min_ext_length[] = {
+        [0] = sizeof(struct serval_hdr),
+        [SERVAL_CONNECTION_EXT] = sizeof(struct serval_connection_ext),
+        [SERVAL_CONTROL_EXT] = sizeof(struct serval_control_ext),
+        [SERVAL_SERVICE_EXT] = sizeof(struct serval_service_ext),
+        [SERVAL_DESCRIPTION_EXT] = sizeof(struct serval_description_ext),
+        [SERVAL_SOURCE_EXT] = sizeof(struct serval_source_ext),
+        [SERVAL_MIGRATE_EXT] = sizeof(struct serval_migrate_ext),
+};
+
+#if defined(ENABLE_DEBUG)
+static char* serval_ext_name[] = {
+        [0] = "INVALID",
+        [SERVAL_CONNECTION_EXT] = "CONNECTION",
+        [SERVAL_CONTROL_EXT] = "CONTROL",
+        [SERVAL_SERVICE_EXT] = "SERVICE",
+        [SERVAL_DESCRIPTION_EXT] = "DESCRIPTION",
+        [SERVAL_SOURCE_EXT] = "SOURCE",
+        [SERVAL_MIGRATE_EXT] = "MIGRATE",
+};
+#endif
+
+static int parse_base_ext(struct serval_ext *ext, struct serval_context *ctx)
+{
+        return 0;
+}
+
+static int parse_connection_ext(struct serval_ext *ext,
+                                struct serval_context *ctx)
+{
+        if (ctx->conn_ext)
+                return -1;
+
+        ctx->conn_ext = (struct serval_connection_ext *)ext;
+        ctx->seqno = ntohl(ctx->conn_ext->seqno);
+        ctx->ackno = ntohl(ctx->conn_ext->ackno);
+
+        return ext->length;
+}
+
+static int parse_control_ext(struct serval_ext *ext,
+                             struct serval_context *ctx)
+{
+        if (ctx->ctrl_ext)
+                return -1;
+
+        ctx->ctrl_ext = (struct serval_control_ext *)ext;
+        ctx->seqno = ntohl(ctx->ctrl_ext->seqno);
+        ctx->ackno = ntohl(ctx->ctrl_ext->ackno);
+
+        return ext->length;
+}
+
+static int parse_service_ext(struct serval_ext *ext,
+                             struct serval_context *ctx)
+{
+        if (ctx->srv_ext)
+                return -1;
+
+        ctx->srv_ext = (struct serval_service_ext *)ext;
+
+        return ext->length;
+}
+
+static int parse_description_ext(struct serval_ext *ext,
+                                 struct serval_context *ctx)
+{
+        return ext->length;
+}
+
+static int parse_source_ext(struct serval_ext *ext,
+                            struct serval_context *ctx)
+{
+        if (ctx->src_ext)
+                return -1;
+
+        ctx->src_ext = (struct serval_source_ext *)ext;
+
+        /* Should be two addresses minimum */
+        if (SERVAL_SOURCE_EXT_NUM_ADDRS(ctx->src_ext) < 2)
+                return -1;
+
+        return ext->length;
+}
+
+static int parse_migrate_ext(struct serval_ext *ext,
+                             struct serval_context *ctx)
+{
+        if (ctx->mig_ext)
+                return -1;
+
+        ctx->mig_ext = (struct serval_migrate_ext *)ext;
+        ctx->seqno = ntohl(ctx->mig_ext->seqno);
+        ctx->ackno = ntohl(ctx->mig_ext->ackno);
+
+        return ext->length;
+}
+
+typedef int (*parse_ext_func_t)(struct serval_ext *,
+                                struct serval_context *ctx);
+
+static parse_ext_func_t parse_ext_func[] = {
+        [0] = &parse_base_ext,
+        [SERVAL_CONNECTION_EXT] = &parse_connection_ext,
+        [SERVAL_CONTROL_EXT] = &parse_control_ext,
+        [SERVAL_SERVICE_EXT] = &parse_service_ext,
+        [SERVAL_DESCRIPTION_EXT] = &parse_description_ext,
+        [SERVAL_SOURCE_EXT] = &parse_source_ext,
+        [SERVAL_MIGRATE_EXT] = &parse_migrate_ext,
+};
+
+static inline int parse_ext(struct serval_ext *ext,
+                            struct serval_context *ctx)
+{
+        if (ext->type >= __SERVAL_EXT_TYPE_MAX) {
+                LOG_DBG("Bad extension type (=%u)\n",
+                        ext->type);
+                return -1;
+        }
+
+        if (ext->length < min_ext_length[ext->type]) {
+                LOG_DBG("Bad extension \'%s\' length (=%u)\n",
+                        serval_ext_name[ext->type], ext->length);
+                return -1;
+        }
+
+        LOG_DBG("EXT %s length=%u\n",
+                serval_ext_name[ext->type],
+                ext->length);
+
+        return parse_ext_func[ext->type](ext, ctx);
+}
+
+enum serval_parse_mode {
+        SERVAL_PARSE_BASE,
+        SERVAL_PARSE_ALL,
+};
+
+static inline unsigned short serval_sal_parse_flags(struct serval_hdr *sh)
+{
+        return (sh->syn * SVH_SYN) | (sh->ack * SVH_ACK) |
+                (sh->fin * SVH_FIN) | (sh->rst * SVH_RST) |
+                (sh->rsyn * SVH_RSYN);
+}
+
+/**
+   Parse Serval header and all extensions one at a time, doing basic
+   sanity checks. Handles any layout, but is kept out of line since
+   only the uncommon ones get here.
+
+   Returns: 0 on success.
+*/
+static noinline int serval_sal_parse_slow(struct serval_hdr *sh,
+                                          struct serval_context *ctx,
+                                          enum serval_parse_mode mode)
+{
+        struct serval_ext *ext;
+        unsigned int i = 0;
+        int hdr_len;
+
+        memset(ctx, 0, sizeof(struct serval_context));
+
+        ctx->hdr = sh;
+        ctx->length = ntohs(ctx->hdr->length);
+        ext = SERVAL_EXT_FIRST(ctx->hdr);
+
+        /* Sanity checks */
+        if (ctx->length < sizeof(struct serval_hdr))
+                return -1;
+
+        /* Only base header parse, return */
+        if (mode == SERVAL_PARSE_BASE)
+                return 0;
+
+        /* Parse extensions */
+        hdr_len = ctx->length - sizeof(*ctx->hdr);
+
+        while (hdr_len > 0 && i < MAX_NUM_SERVAL_EXTENSIONS) {
+                if (parse_ext(ext, ctx) < 0)
+                        return -1;
+
+                ctx->ext[i++] = ext;
+                hdr_len -= ext->length;
+                ext = SERVAL_EXT_NEXT(ext);
+        }
+
+        ctx->flags = serval_sal_parse_flags(ctx->hdr);
+
+        /* hdr_len should be zero if everything was OK */
+        return hdr_len;
+}
+
+/*
+  Set up the context for a header with at most one extension,
+  without clearing it all.
+ */
+static inline void serval_sal_parse_init(struct serval_hdr *sh,
+                                         struct serval_context *ctx,
+                                         unsigned short length,
+                                         struct serval_ext *ext)
+{
+        ctx->hdr = sh;
+        ctx->length = length;
+        ctx->flags = serval_sal_parse_flags(sh);
+        ctx->seqno = 0;
+        ctx->ackno = 0;
+        ctx->ext[0] = ext;
+        ctx->ctrl_ext = NULL;
+        ctx->conn_ext = NULL;
+        ctx->desc_ext = NULL;
+        ctx->srv_ext = NULL;
+        ctx->src_ext = NULL;
+        ctx->mig_ext = NULL;
+}
+
+/* The extension is exactly what fills the rest of the header */
+#define serval_sal_ext_is(ext, t, st)                                   \
+        (((ext)->type == (t)) & ((ext)->length == sizeof(st)))
+
+/**
+   Parse Serval header and all extensions, doing basic sanity checks.
+
+   Returns: 0 on success.
+*/
+static inline int serval_sal_parse(struct serval_hdr *sh,
+                                   struct serval_context *ctx,
+                                   enum serval_parse_mode mode)
+{
+        unsigned short length = ntohs(sh->length);
+        struct serval_ext *ext = SERVAL_EXT_FIRST(sh);
+
+        if (unlikely(mode != SERVAL_PARSE_ALL))
+                return serval_sal_parse_slow(sh, ctx, mode);
+
+        /* The extension lengths differ, so the header length tells
+           which layout to expect */
+        switch (length) {
+        case sizeof(struct serval_hdr):
+                serval_sal_parse_init(sh, ctx, length, NULL);
+                return 0;
+        case sizeof(struct serval_hdr) +
+                sizeof(struct serval_connection_ext):
+                if (!serval_sal_ext_is(ext, SERVAL_CONNECTION_EXT,
+                                       struct serval_connection_ext))
+                        break;
+                serval_sal_parse_init(sh, ctx, length, ext);
+                ctx->conn_ext = (struct serval_connection_ext *)ext;
+                ctx->seqno = ntohl(ctx->conn_ext->seqno);
+                ctx->ackno = ntohl(ctx->conn_ext->ackno);
+                return 0;
+        case sizeof(struct serval_hdr) +
+                sizeof(struct serval_control_ext):
+                if (!serval_sal_ext_is(ext, SERVAL_CONTROL_EXT,
+                                       struct serval_control_ext))
+                        break;
+                serval_sal_parse_init(sh, ctx, length, ext);
+                ctx->ctrl_ext = (struct serval_control_ext *)ext;
+                ctx->seqno = ntohl(ctx->ctrl_ext->seqno);
+                ctx->ackno = ntohl(ctx->ctrl_ext->ackno);
+                return 0;
+        case sizeof(struct serval_hdr) +
+                sizeof(struct serval_service_ext):
+                if (!serval_sal_ext_is(ext, SERVAL_SERVICE_EXT,
+                                       struct serval_service_ext))
+                        break;
+                serval_sal_parse_init(sh, ctx, length, ext);
+                ctx->srv_ext = (struct serval_service_ext *)ext;
+                return 0;
+        }
+
+        return serval_sal_parse_slow(sh, ctx, mode);
+}
+
+#endif /* _SERVAL_SAL_PARSE_H_ */
@@ -19,8 +19,10 @@
 #include <serval/netdevice.h>
 #include <netinet/serval.h>
 #include <serval_sock.h>
+#include <serval_request_sock.h>
 #include <serval_sal.h>
 #include <service.h>
+#include <ctrl.h>
 #if defined(OS_LINUX_KERNEL)
 #include <linux/ip.h>
 #include <net/route.h>
@@ -38,6 +40,10 @@ static struct serval_table established_table;
 static struct serval_table listen_table;
 static struct list_head sock_list = { &sock_list, &sock_list };
 static DEFINE_RWLOCK(sock_list_lock);
+/* Flows by the device they are bound to */
+static struct serval_hslot dev_index[SERVAL_DEV_HTABLE_SIZE];
+/* Serializes users of the dev_walk list node */
+static DEFINE_MUTEX(dev_walk_mutex);
 
 /* The number of (prefix) bytes to hash on in the serviceID */
 #define SERVICE_KEY_LEN (8)
@@ -121,108 +127,130 @@ void __exit serval_table_fini(struct serval_table *table)
         FREE(table->hash);
 }
 
+static inline struct serval_hslot *dev_index_slot(int ifindex)
+{
+        return &dev_index[ifindex & (SERVAL_DEV_HTABLE_SIZE - 1)];
+}
+
+static void serval_sock_dev_index_del(struct sock *sk)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+        struct serval_hslot *slot;
+
+        if (ssk->flow_dev_if == 0)
+                return;
+
+        slot = dev_index_slot(ssk->flow_dev_if);
+        
+        spin_lock_bh(&slot->lock);
+        hlist_del_init(&ssk->dev_node);
+        slot->count--;
+        spin_unlock_bh(&slot->lock);
+        ssk->flow_dev_if = 0;
+}
+
+static void serval_sock_dev_index_add(struct sock *sk, int ifindex)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+        struct serval_hslot *slot;
+
+        if (ssk->flow_dev_if == ifindex)
+                return;
+
+        serval_sock_dev_index_del(sk);
+
+        if (ifindex == 0)
+                return;
+
+        slot = dev_index_slot(ifindex);
+
+        spin_lock_bh(&slot->lock);
+        hlist_add_head(&ssk->dev_node, &slot->head);
+        slot->count++;
+        spin_unlock_bh(&slot->lock);
+        ssk->flow_dev_if = ifindex;
+}
+
 /*
-  The interface migration is somewhat ugly, but the ugliness is
-  necessary because we cannot lock a socket (an operation that can
-  sleep) while we hold the hash table lock.
-
-  We therefore create a temporary private list of all sockets where we
-  protect them from release by using the reference counter. We can
-  then safely iterate through the private list without holding a list
-  lock, and are thereby free lock each socket.
+  Run action on each flow bound to the device, with the socket
+  locked. We cannot lock a socket (an operation that can sleep) while
+  holding the index lock, so the flows are first moved to a private
+  list, protected from release by a reference. The list is threaded
+  through the sockets, so nothing is allocated, and walks are
+  serialized. Returns the number of flows the action was run on.
  */
-void serval_sock_migrate_iface(struct net_device *old_if,
-                               struct net_device *new_if)
+static int serval_sock_dev_walk(int ifindex, 
+                                void (*action)(struct sock *sk, void *arg),
+                                void *arg)
 {
+        struct serval_hslot *slot = dev_index_slot(ifindex);
+        struct list_head wlist;
         struct hlist_node *walk;
-        struct sock *sk = NULL;
-        struct list_head mlist;
-        /* A structure we can put on our private list, containing a
-           pointer to each socket. */
-        struct migrate_sock {
-                struct list_head lh;
-                struct sock *sk;
-        } *msk;
-        int i, n = 0;
-        
-        /* Initialize our private list. */
-        INIT_LIST_HEAD(&mlist);
+        struct serval_sock *ssk;
+        int n = 0;
 
-        for (i = 0; i < SERVAL_HTABLE_SIZE_MIN; i++) {
-                struct serval_hslot *slot;
-                
-                slot = &established_table.hash[i];
-                
-                spin_lock_bh(&slot->lock);
-                                
-                hlist_for_each_entry(sk, walk, &slot->head, sk_node) {
-                        msk = kmalloc(sizeof(struct migrate_sock), 
-                                      GFP_ATOMIC);
-                        
-                        if (msk) {
-                                sock_hold(sk);
-                                INIT_LIST_HEAD(&msk->lh);
-                                msk->sk = sk;
-                                list_add(&msk->lh, &mlist);
-                        }
+        INIT_LIST_HEAD(&wlist);
+
+        mutex_lock(&dev_walk_mutex);
+
+        spin_lock_bh(&slot->lock);
+
+        hlist_for_each_entry(ssk, walk, &slot->head, dev_node) {
+                if (ssk->flow_dev_if == ifindex) {
+                        sock_hold((struct sock *)ssk);
+                        list_add_tail(&ssk->dev_walk, &wlist);
                 }
-                spin_unlock_bh(&slot->lock);
         }
+        spin_unlock_bh(&slot->lock);
 
-        /* Ok, we have our private list. Now iterate through it,
-           locking each socket in the process so that we can safely
-           access the device pointer and perform migration for
-           matching interfaces. */
-        while (!list_empty(&mlist)) {
-        
-                msk = list_first_entry(&mlist, struct migrate_sock, lh);
-                sk = msk->sk;
+        while (!list_empty(&wlist)) {
+                struct sock *sk;
+
+                ssk = list_first_entry(&wlist, struct serval_sock, dev_walk);
+                list_del_init(&ssk->dev_walk);
+                sk = (struct sock *)ssk;
 
                 lock_sock(sk);
                 
-                if (sk->sk_bound_dev_if > 0 && 
-                    sk->sk_bound_dev_if == old_if->ifindex) {
-                        LOG_DBG("Socket matches old if\n");
-                        serval_sock_set_mig_dev(sk, new_if);
-                        serval_sal_migrate(sk);
+                /* Only flows that are in the established table */
+                if (sk->sk_bound_dev_if == ifindex && 
+                    sk->sk_state != SERVAL_LISTEN &&
+                    serval_sock_flag(ssk, SSK_FLAG_HASHED)) {
+                        action(sk, arg);
                         n++;
                 }
                 release_sock(sk);
-                list_del(&msk->lh);
                 sock_put(sk);
-                kfree(msk);
         }
 
-        LOG_DBG("Migrated %d flows\n", n);
+        mutex_unlock(&dev_walk_mutex);
+
+        return n;
 }
 
-void serval_sock_freeze_flows(struct net_device *dev)
+static void migrate_iface_action(struct sock *sk, void *arg)
 {
-        int i;
+        serval_sock_set_mig_dev(sk, (struct net_device *)arg);
+        serval_sal_migrate_queue(sk);
+}
 
-        for (i = 0; i < SERVAL_HTABLE_SIZE_MIN; i++) {
-                struct serval_hslot *slot;
-                struct hlist_node *walk;
-                struct sock *sk;                
-                
-                slot = &established_table.hash[i];
-                
-                spin_lock_bh(&slot->lock);
-                                
-                hlist_for_each_entry(sk, walk, &slot->head, sk_node) {          
-                        struct serval_sock *ssk = serval_sk(sk);
-                        
-                        lock_sock(sk);
-                        
-                        if (sk->sk_bound_dev_if > 0 && 
-                            sk->sk_bound_dev_if == dev->ifindex) {
-                                if (ssk->af_ops->freeze_flow)
-                                        ssk->af_ops->freeze_flow(sk);
-                        }
-                        release_sock(sk);
-                }
-                spin_unlock_bh(&slot->lock);
-        }
+void serval_sock_migrate_iface(struct net_device *old_if,
+                               struct net_device *new_if)
+{
+        serval_sock_dev_walk(old_if->ifindex, migrate_iface_action, new_if);
+}
+
+static void freeze_flow_action(struct sock *sk, void *arg)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+
+        if (ssk->af_ops->freeze_flow)
+                ssk->af_ops->freeze_flow(sk);
+}
+
+void serval_sock_freeze_flows(struct net_device *dev)
+{
+        serval_sock_dev_walk(dev->ifindex, freeze_flow_action, NULL);
 }
 
 void serval_sock_migrate_flow(struct flow_id *old_f,
@@ -301,6 +329,30 @@ struct sock *serval_sock_lookup_service(struct service_id *srvid, int protocol)
         return service_find_sock(srvid, SERVICE_ID_MAX_PREFIX_BITS, protocol);
 }
 
+/* Like above, but picks among a SVSF_REUSEPORT group by flow hash */
+struct sock *serval_sock_lookup_service_hash(struct service_id *srvid, 
+                                             int protocol, u32 hash)
+{
+        return service_find_sock_hash(srvid, SERVICE_ID_MAX_PREFIX_BITS, 
+                                      protocol, hash);
+}
+
+static int serval_sock_match_flowid(struct sock *sk, void *flowid)
+{
+        return memcmp(&serval_sk(sk)->local_flowid, flowid, 
+                      sizeof(struct flow_id)) == 0;
+}
+
+/* Find the listening sock on a serviceID that has the given flowID */
+struct sock *serval_sock_lookup_listener(struct service_id *srvid, 
+                                         int protocol, 
+                                         struct flow_id *flowid)
+{
+        return service_find_sock_match(srvid, SERVICE_ID_MAX_PREFIX_BITS, 
+                                       protocol, serval_sock_match_flowid,
+                                       flowid);
+}
+
 static inline unsigned int serval_sock_ehash(struct serval_table *table,
                                              struct sock *sk)
 {
@@ -357,6 +409,7 @@ static void __serval_sock_hash(struct sock *sk)
                 ssk->hash_key_len = sizeof(ssk->local_flowid);
 
                 __serval_table_hash(&established_table, sk);
+                serval_sock_dev_index_add(sk, sk->sk_bound_dev_if);
         } else { 
                 /* We use the service table for listening sockets. See
                  * serval_sock_hash() */
@@ -396,6 +449,13 @@ void serval_sock_hash(struct sock *sk)
                                   LOCAL_SERVICE_DEFAULT_PRIORITY, 
                                   LOCAL_SERVICE_DEFAULT_WEIGHT,
                                   NULL, 0, make_target(sk), GFP_ATOMIC);
+
+                /* Only the first member of a reuse group registers */
+                if (err > 1 && (ssk->srvid_flags & SVSF_REUSEPORT))
+                        serval_sock_set_flag(ssk, SSK_FLAG_JOINED);
+                else
+                        serval_sock_reset_flag(ssk, SSK_FLAG_JOINED);
+
                 if (err < 0) {
 #if defined(OS_LINUX_KERNEL)
                         LOG_ERR("could not add service for listening demux\n");
@@ -421,6 +481,7 @@ void serval_sock_unhash(struct sock *sk)
         struct serval_sock *ssk = serval_sk(sk);
         struct net *net = sock_net(sk);
         spinlock_t *lock;
+        int remain;
 
         if (ssk->hash_key_len == 0)
                 return;
@@ -435,12 +496,34 @@ void serval_sock_unhash(struct sock *sk)
                                 
                 LOG_DBG("removing socket %p from service table\n", sk);
 
-                service_del_target(&ssk->local_srvid,
-                                   ssk->srvid_prefix_bits == 0 ?
-                                   SERVICE_ID_MAX_PREFIX_BITS :
-                                   ssk->srvid_prefix_bits, 
-                                   RULE_DEMUX,
-                                   NULL, 0, NULL);
+                remain = service_del_target(&ssk->local_srvid,
+                                            ssk->srvid_prefix_bits == 0 ?
+                                            SERVICE_ID_MAX_PREFIX_BITS :
+                                            ssk->srvid_prefix_bits, 
+                                            RULE_DEMUX,
+                                            sk, 0, NULL);
+
+                /* serval_shutdown() leaves reuse groups to us, since
+                 * only the last member to leave unregisters */
+                if (remain == 0 &&
+                    (ssk->srvid_flags & SVSF_REUSEPORT) &&
+                    serval_sock_flag(ssk, SSK_FLAG_BOUND) &&
+                    !serval_sock_flag(ssk, SSK_FLAG_AUTOBOUND) &&
+                    !serval_sock_flag(ssk, SSK_FLAG_CHILD)) {
+                        struct ctrlmsg_register cm;
+
+                        memset(&cm, 0, sizeof(cm));
+                        cm.cmh.type = CTRLMSG_TYPE_UNREGISTER;
+                        cm.cmh.len = sizeof(cm);
+                        cm.srvid_flags = ssk->srvid_flags;
+                        cm.srvid_prefix_bits = ssk->srvid_prefix_bits;
+                        memcpy(&cm.srvid, &ssk->local_srvid, 
+                               sizeof(cm.srvid));
+
+                        if (ctrl_sendmsg(&cm.cmh, GFP_ATOMIC) < 0) {
+                                LOG_INF("No service daemon running?\n");
+                        }
+                }
 #if defined(OS_LINUX_KERNEL)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)
                 sock_prot_inuse_add(sock_net(sk), sk->sk_prot, -1);
@@ -455,6 +538,8 @@ void serval_sock_unhash(struct sock *sk)
 
         LOG_DBG("unhashing socket %p\n", sk);
 
+        serval_sock_dev_index_del(sk);
+
         lock = &established_table.hashslot(&established_table,
                                            net, &ssk->local_flowid, 
                                            ssk->hash_key_len)->lock;
@@ -478,8 +563,15 @@ void serval_sock_unhash(struct sock *sk)
 
 int __init serval_sock_tables_init(void)
 {
+        unsigned int i;
         int ret;
 
+        for (i = 0; i < SERVAL_DEV_HTABLE_SIZE; i++) {
+                INIT_HLIST_HEAD(&dev_index[i].head);
+                dev_index[i].count = 0;
+                spin_lock_init(&dev_index[i].lock);
+        }
+
         ret = serval_table_init(&listen_table, 
                                 serval_sock_lhash, 
                                 serval_hashslot_listen,
@@ -499,8 +591,14 @@ fail_table:
 
 void __exit serval_sock_tables_fini(void)
 {
+        unsigned int i;
+
         serval_table_fini(&listen_table);
         serval_table_fini(&established_table);
+
+        for (i = 0; i < SERVAL_DEV_HTABLE_SIZE; i++)
+                spin_lock_destroy(&dev_index[i].lock);
+
         if (sock_state_str[0]) {} /* Avoid compiler warning when
                                    * compiling with debug off */
 }
@@ -559,6 +657,60 @@ struct sock *serval_sk_alloc(struct net *net, struct socket *sock,
         return sk;
 }
 
+/*
+  Size the hash of pending connection requests of a listening socket
+  after its backlog, so that buckets stay short. Requests that are
+  already pending are moved over.
+ */
+int serval_sock_syn_hash_resize(struct sock *sk, int backlog)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+        struct serval_request_sock *srsk;
+        struct hlist_head *hash;
+        unsigned int i, size = SERVAL_SYN_HASH_MIN;
+
+        while ((int)size < backlog && size < SERVAL_SYN_HASH_MAX)
+                size <<= 1;
+
+        if (ssk->syn_hash && size == ssk->syn_hash_mask + 1)
+                return 0;
+
+        hash = kmalloc(size * sizeof(struct hlist_head), GFP_KERNEL);
+
+        if (!hash) {
+                /* The current size still works, just slower */
+                return ssk->syn_hash ? 0 : -ENOMEM;
+        }
+
+        for (i = 0; i < size; i++)
+                INIT_HLIST_HEAD(&hash[i]);
+
+        if (ssk->syn_hash)
+                kfree(ssk->syn_hash);
+
+        ssk->syn_hash = hash;
+        ssk->syn_hash_mask = size - 1;
+
+        list_for_each_entry(srsk, &ssk->syn_queue, lh)
+                serval_rsk_hash(ssk, srsk);
+
+        list_for_each_entry(srsk, &ssk->accept_queue, lh)
+                serval_rsk_hash(ssk, srsk);
+
+        return 0;
+}
+
+void serval_sock_syn_hash_destroy(struct sock *sk)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+
+        if (ssk->syn_hash) {
+                kfree(ssk->syn_hash);
+                ssk->syn_hash = NULL;
+                ssk->syn_hash_mask = 0;
+        }
+}
+
 void serval_sock_init(struct sock *sk)
 {
         struct serval_sock *ssk = serval_sk(sk);
@@ -568,11 +720,18 @@ void serval_sock_init(struct sock *sk)
         ssk->udp_encap_sport = 0;
         ssk->udp_encap_dport = 0;
         INIT_LIST_HEAD(&ssk->sock_node);
+        INIT_HLIST_NODE(&ssk->dev_node);
+        INIT_LIST_HEAD(&ssk->dev_walk);
+        INIT_LIST_HEAD(&ssk->mig_node);
+        ssk->flow_dev_if = 0;
         INIT_LIST_HEAD(&ssk->accept_queue);
+        ssk->accept_queue_len = 0;
+        ssk->syncookie_stamp = jiffies - SERVAL_SYNCOOKIE_VALID - 1;
         INIT_LIST_HEAD(&ssk->syn_queue);
-        setup_timer(&ssk->retransmit_timer, 
-                    serval_sal_rexmit_timeout,
-                    (unsigned long)sk);
+        /* Children are cloned from their listening parent */
+        ssk->syn_hash = NULL;
+        ssk->syn_hash_mask = 0;
+        INIT_LIST_HEAD(&ssk->rexmit_node);
 
         setup_timer(&ssk->tw_timer, 
                     serval_sal_timewait_timeout,
@@ -630,14 +789,19 @@ void serval_sock_destroy(struct sock *sk)
 		return;
 	}
 
+        serval_sock_dev_index_del(sk);
+
         /* Stop timers */
         LOG_DBG("Stopping timers\n");
-        sk_stop_timer(sk, &ssk->retransmit_timer);
+        ssk->pending = 0;
+        serval_sal_rexmit_cancel(sk);
         sk_stop_timer(sk, &ssk->tw_timer);
         
         /* Clean control queue */
         serval_sal_ctrl_queue_purge(sk);
 
+        serval_sock_syn_hash_destroy(sk);
+
 	if (sk->sk_prot->destroy)
 		sk->sk_prot->destroy(sk);
 
@@ -658,7 +822,8 @@ void serval_sock_destroy(struct sock *sk)
 static void serval_sock_clear_xmit_timers(struct sock *sk)
 {
         struct serval_sock *ssk = serval_sk(sk);
-        sk_stop_timer(sk, &ssk->retransmit_timer);        
+        ssk->pending = 0;
+        serval_sal_rexmit_cancel(sk);
 }
 
 void serval_sock_done(struct sock *sk)
@@ -724,12 +889,19 @@ void serval_sock_destruct(struct sock *sk)
                 sk, atomic_read(&serval_nr_socks));
 }
 
+/*
+  Called with the socket locked. Also keeps the device index up to
+  date, so that migration and freezing find the affected flows
+  directly.
+*/
 void serval_sock_set_dev(struct sock *sk, struct net_device *dev)
 {
         if (dev)
                 sk->sk_bound_dev_if = dev->ifindex;
         else
                 sk->sk_bound_dev_if = 0;
+
+        serval_sock_dev_index_add(sk, sk->sk_bound_dev_if);
 }
 
 void serval_sock_set_mig_dev(struct sock *sk, struct net_device *dev)
@@ -1054,4 +1226,28 @@ int flow_table_print(char *buf, int buflen)
         return ret;
 }
 
+/*
+  Call func on every flow while holding the flow table lock. Stops
+  and returns the error if func fails.
+ */
+int flow_table_for_each(int (*func)(struct serval_sock *ssk, void *arg),
+                        void *arg)
+{
+        struct serval_sock *ssk;
+        int ret = 0;
+
+        read_lock_bh(&sock_list_lock);
+
+        list_for_each_entry(ssk, &sock_list, sock_node) {
+                ret = func(ssk, arg);
+
+                if (ret < 0)
+                        break;
+        }
+
+        read_unlock_bh(&sock_list_lock);
+
+        return ret;
+}
+
 
@@ -84,6 +84,7 @@ enum serval_sock_flags {
         SSK_FLAG_HASHED,
         SSK_FLAG_CHILD,
         SSK_FLAG_FIN_SENT,
+        SSK_FLAG_JOINED, /* Joined an already registered reuse group */
 };
 
 struct serval_sock_af_ops {
@@ -106,6 +107,9 @@ struct serval_sock_af_ops {
                                                  struct sk_buff *skb);
 	int	        (*respond_state_process)(struct sock *sk, 
                                                  struct sk_buff *skb);
+        int             (*conn_cookie_check)(struct sock *sk,
+                                             struct request_sock *rsk,
+                                             struct sk_buff *skb);
         int             (*conn_child_sock)(struct sock *sk, 
                                            struct sk_buff *skb,
                                            struct request_sock *rsk,
@@ -133,6 +137,11 @@ struct serval_sock {
         u8                      flags;
         int                     mig_dev_if;
         u32                     mig_daddr;
+        /* Index of flows by bound device, see serval_sock_set_dev() */
+        int                     flow_dev_if;
+        struct hlist_node       dev_node;
+        struct list_head        dev_walk;
+        struct list_head        mig_node; /* Queued for migration */
         void                    *hash_key;
         u32                     hash_key_len;  /* Keylen in bytes */
         u16                     srvid_prefix_bits;
@@ -140,7 +149,7 @@ struct serval_sock {
         struct list_head        sock_node;
         struct serval_sock_af_ops *af_ops;
         struct sk_buff_head     tx_queue;
- 	struct timer_list	retransmit_timer;        
+        struct list_head        rexmit_node; /* In the retransmit wheel */
 	struct timer_list	tw_timer;
         struct flow_id          local_flowid;
         struct flow_id          peer_flowid;
@@ -148,6 +157,10 @@ struct serval_sock {
         struct service_id       peer_srvid;
         struct list_head        syn_queue;
         struct list_head        accept_queue;
+        unsigned int            accept_queue_len; /* Part of sk_ack_backlog */
+        unsigned long           syncookie_stamp; /* Last cookie sent */
+        struct hlist_head       *syn_hash; /* Requests, when listening */
+        unsigned int            syn_hash_mask;
 	struct sk_buff_head	ctrl_queue;
 	struct sk_buff		*ctrl_send_head;
         u8                      local_nonce[SERVAL_NONCE_SIZE];
@@ -180,16 +193,32 @@ struct serval_sock {
         unsigned long           tot_bytes_sent;
         unsigned long           tot_pkts_recv;
         unsigned long           tot_pkts_sent;
+        unsigned long           tot_bytes_recv;
+        struct {
+                u32 pkts_sent;
+                u32 bytes_sent;
+                u32 pkts_recv;
+                u32 bytes_recv;
+        } stats_mark; /* As of the last stats delta report */
 };
 
+/* Bounds on the buckets in a listening socket's hash of pending
+ * requests, which grows with the backlog */
+#define SERVAL_SYN_HASH_MIN 16
+#define SERVAL_SYN_HASH_MAX 16384
+
 #define SAL_RTO_MAX	((unsigned)(120*HZ))
 #define SAL_RTO_MIN	((unsigned)(HZ/5))
 #define SAL_TIMEOUT_INIT ((unsigned)(3*HZ))
+/* Time for a peer to complete the handshake before its request is
+ * dropped. Retransmitted SYNs restart it. */
+#define SAL_SYN_QUEUE_TIMEOUT ((unsigned)(60*HZ))
 
 #define serval_sk(__sk) ((struct serval_sock *)__sk)
 
 /* Should be power of two */
 #define SERVAL_HTABLE_SIZE_MIN 256
+#define SERVAL_DEV_HTABLE_SIZE 64
 
 struct serval_hslot {
 	struct hlist_head head;
@@ -250,6 +279,10 @@ void serval_sock_migrate_service(struct service_id *old_s,
                                  struct net_device *new_if);
 void serval_sock_freeze_flows(struct net_device *dev);
 struct sock *serval_sock_lookup_service(struct service_id *, int protocol);
+struct sock *serval_sock_lookup_service_hash(struct service_id *, 
+                                             int protocol, u32 hash);
+struct sock *serval_sock_lookup_listener(struct service_id *, int protocol,
+                                         struct flow_id *);
 struct sock *serval_sock_lookup_flow(struct flow_id *);
 
 void serval_sock_hash(struct sock *sk);
@@ -273,13 +306,20 @@ static inline int serval_sock_flag(struct serval_sock *ssk,
 	return ssk->flags & (0x1 << flag);
 }
 
+void serval_sal_rexmit_schedule(struct sock *sk);
+void serval_sal_rexmit_cancel(struct sock *sk);
+
+/*
+  SAL retransmissions are driven by a shared wheel of sockets (see
+  serval_sal.c), which drops sockets that are no longer pending when
+  it gets to them. Clearing is therefore just a matter of state.
+*/
 static inline void serval_sock_clear_xmit_timer(struct sock *sk)
 {
 	struct serval_sock *ssk = serval_sk(sk);
         ssk->pending = 0;
         ssk->retransmits = 0;
         ssk->backoff = 0;
-        sk_stop_timer(sk, &ssk->retransmit_timer);
 }
 
 static inline void serval_sock_reset_xmit_timer(struct sock *sk, 
@@ -293,7 +333,7 @@ static inline void serval_sock_reset_xmit_timer(struct sock *sk,
 	}
         ssk->pending = 1;
         ssk->timeout = jiffies + when;
-        sk_reset_timer(sk, &ssk->retransmit_timer, ssk->timeout);
+        serval_sal_rexmit_schedule(sk);
 }
 
 int __serval_assign_flowid(struct sock *sk);
@@ -303,6 +343,8 @@ struct sock *serval_sk_alloc(struct net *net, struct socket *sock,
 void serval_sock_init(struct sock *sk);
 void serval_sock_destroy(struct sock *sk);
 void serval_sock_done(struct sock *sk);
+int serval_sock_syn_hash_resize(struct sock *sk, int backlog);
+void serval_sock_syn_hash_destroy(struct sock *sk);
 
 void serval_sock_set_dev(struct sock *sk, struct net_device *dev);
 void serval_sock_set_mig_dev(struct sock *sk, struct net_device *dev);
@@ -349,5 +391,7 @@ void flow_table_read_lock(void);
 void flow_table_read_unlock(void);
 int __flow_table_print(char *buf, int buflen);
 int flow_table_print(char *buf, int buflen);
+int flow_table_for_each(int (*func)(struct serval_sock *ssk, void *arg),
+                        void *arg);
 
 #endif /* _SERVAL_SOCK_H */
@@ -0,0 +1,179 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Stateless SYN cookies for the SAL handshake.
+ *
+ * A listening socket under a SYN flood answers with a SYN-ACK whose
+ * sequence number and nonce are derived from the SYN, and then
+ * forgets about it. The peer's ACK echoes the sequence number and
+ * carries the rest of the SYN's state, so the request can be rebuilt
+ * and checked when (and if) it arrives.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#include <serval/platform.h>
+#include <serval/debug.h>
+#include <netinet/serval.h>
+#include <serval_request_sock.h>
+#include <serval_syncookies.h>
+#if defined(OS_LINUX_KERNEL)
+#include <linux/random.h>
+#else
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <serval/timer.h>
+#endif
+
+static u64 syncookie_secret[2];
+
+#define ROTL64(x, b) (u64)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                                        \
+        do {                                                            \
+                v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0;                \
+                v0 = ROTL64(v0, 32);                                    \
+                v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;                \
+                v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;                \
+                v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2;                \
+                v2 = ROTL64(v2, 32);                                    \
+        } while (0)
+
+/* SipHash-2-4 over the words, taken in pairs */
+u32 serval_keyed_hash(const u32 *words, unsigned int num)
+{
+        u64 v0 = 0x736f6d6570736575ULL ^ syncookie_secret[0];
+        u64 v1 = 0x646f72616e646f6dULL ^ syncookie_secret[1];
+        u64 v2 = 0x6c7967656e657261ULL ^ syncookie_secret[0];
+        u64 v3 = 0x7465646279746573ULL ^ syncookie_secret[1];
+        u64 m, b = (u64)num << 58;
+        unsigned int i;
+
+        for (i = 0; i + 1 < num; i += 2) {
+                m = ((u64)words[i + 1] << 32) | words[i];
+                v3 ^= m;
+                SIPROUND;
+                SIPROUND;
+                v0 ^= m;
+        }
+
+        if (i < num)
+                b |= words[i];
+
+        v3 ^= b;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= b;
+        v2 ^= 0xff;
+        SIPROUND;
+        SIPROUND;
+        SIPROUND;
+        SIPROUND;
+        b = v0 ^ v1 ^ v2 ^ v3;
+
+        return (u32)(b >> 32) ^ (u32)b;
+}
+
+enum {
+        SAL_COOKIE_SEQ,
+        SAL_COOKIE_NONCE,
+};
+
+static u32 serval_sal_cookie_hash(const struct serval_request_sock *srsk,
+                                  u32 count, u32 what)
+{
+        u32 w[8];
+
+        w[0] = count;
+        w[1] = what;
+        w[2] = srsk->peer_flowid.s_id32;
+        w[3] = srsk->local_flowid.s_id32;
+        w[4] = srsk->rcv_seq;
+        memcpy(&w[5], srsk->peer_nonce, SERVAL_NONCE_SIZE);
+        w[7] = what == SAL_COOKIE_NONCE ? srsk->iss_seq : 0;
+
+        return serval_keyed_hash(w, 8);
+}
+
+static void serval_sal_cookie_nonce(struct serval_request_sock *srsk,
+                                    u32 count)
+{
+        u32 nonce[SERVAL_NONCE_SIZE / sizeof(u32)];
+        unsigned int i;
+
+        for (i = 0; i < SERVAL_NONCE_SIZE / sizeof(u32); i++)
+                nonce[i] = serval_sal_cookie_hash(srsk, count + i,
+                                                  SAL_COOKIE_NONCE);
+
+        memcpy(srsk->local_nonce, nonce, SERVAL_NONCE_SIZE);
+}
+
+static inline u32 serval_sal_cookie_count(void)
+{
+        return jiffies / SERVAL_SYNCOOKIE_PERIOD;
+}
+
+void serval_sal_cookie_init(struct serval_request_sock *srsk)
+{
+        u32 count = serval_sal_cookie_count();
+
+        srsk->iss_seq = serval_sal_cookie_hash(srsk, count, SAL_COOKIE_SEQ);
+        serval_sal_cookie_nonce(srsk, count);
+}
+
+int serval_sal_cookie_check(struct serval_request_sock *srsk, u32 cookie)
+{
+        u32 count = serval_sal_cookie_count();
+        unsigned int i;
+
+        for (i = 0; i < 2; i++, count--) {
+                if (serval_sal_cookie_hash(srsk, count,
+                                           SAL_COOKIE_SEQ) == cookie) {
+                        srsk->iss_seq = cookie;
+                        serval_sal_cookie_nonce(srsk, count);
+                        return 0;
+                }
+        }
+
+        return -1;
+}
+
+int __init serval_syncookies_init(void)
+{
+#if defined(OS_LINUX_KERNEL)
+        get_random_bytes(syncookie_secret, sizeof(syncookie_secret));
+#else
+        /* Peers must not be able to guess the secret, so random(),
+           which is seeded with the time, will not do */
+        unsigned char *s = (unsigned char *)syncookie_secret;
+        size_t len = 0;
+        int fd;
+
+        fd = open("/dev/urandom", O_RDONLY);
+
+        if (fd == -1) {
+                LOG_ERR("Cannot open /dev/urandom: %s\n", strerror(errno));
+                return -1;
+        }
+
+        while (len < sizeof(syncookie_secret)) {
+                ssize_t n = read(fd, s + len, sizeof(syncookie_secret) - len);
+
+                if (n <= 0) {
+                        if (n == -1 && errno == EINTR)
+                                continue;
+                        LOG_ERR("Cannot read the SYN cookie secret\n");
+                        close(fd);
+                        return -1;
+                }
+                len += n;
+        }
+
+        close(fd);
+#endif
+        return 0;
+}
@@ -0,0 +1,43 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+#ifndef _SERVAL_SYNCOOKIES_H_
+#define _SERVAL_SYNCOOKIES_H_
+
+#include <serval/platform.h>
+
+struct serval_request_sock;
+
+/* A cookie is accepted during this period and the next one */
+#define SERVAL_SYNCOOKIE_PERIOD (64 * HZ)
+/* So ACKs are only checked for cookies this long after one was sent */
+#define SERVAL_SYNCOOKIE_VALID (2 * SERVAL_SYNCOOKIE_PERIOD)
+
+/* Values of net_serval.sysctl_sal_syncookies */
+enum {
+        SAL_SYNCOOKIES_OFF,
+        SAL_SYNCOOKIES_ON_OVERFLOW, /* When the SYN backlog is full */
+        SAL_SYNCOOKIES_ALWAYS,
+};
+
+/**
+   Hash of num words, keyed with a secret picked at start up, so that
+   the result can neither be predicted nor forced to collide by
+   peers.
+ */
+u32 serval_keyed_hash(const u32 *words, unsigned int num);
+
+/*
+  Derive the SAL initial sequence number (the cookie) and local nonce
+  of a request from the peer's SYN, so that they can be checked and
+  recovered from its ACK instead of being kept.
+ */
+void serval_sal_cookie_init(struct serval_request_sock *srsk);
+
+/*
+  Check the cookie echoed in an ACK against a request rebuilt from
+  it. On success, the local nonce is restored and 0 returned.
+ */
+int serval_sal_cookie_check(struct serval_request_sock *srsk, u32 cookie);
+
+int __init serval_syncookies_init(void);
+
+#endif /* _SERVAL_SYNCOOKIES_H_ */
@@ -12,6 +12,7 @@
 #include <serval_sal.h>
 #include <serval_ipv4.h>
 #include <serval_tcp.h>
+#include <serval_syncookies.h>
 #include <af_serval.h>
 
 #if defined(OS_LINUX_KERNEL)
@@ -132,6 +133,112 @@ static inline void serval_tcp_openreq_init(struct request_sock *req,
 	ireq->loc_port = tcp_hdr(skb)->dest;
 }
 
+/*
+  MSS values that a SYN cookie can encode. The peer gets the largest
+  one that does not exceed what it announced.
+ */
+static const __u16 serval_tcp_cookie_mss[] = {
+        SERVAL_TCP_MSS_DEFAULT, 1300, 1440, 1460,
+};
+
+#define SERVAL_TCP_COOKIE_MSS_NUM                                       \
+        (sizeof(serval_tcp_cookie_mss) / sizeof(serval_tcp_cookie_mss[0]))
+
+/* The low bits of the cookie are left for the MSS index */
+static __u32 serval_tcp_cookie_hash(struct request_sock *req)
+{
+        struct inet_request_sock *ireq = inet_rsk(req);
+        u32 words[3];
+
+        /* The SAL cookie already binds the flowIDs and nonces */
+        words[0] = serval_rsk(req)->iss_seq;
+        words[1] = serval_tcp_rsk(req)->rcv_isn;
+        words[2] = ((u32)ntohs(ireq->loc_port) << 16) | ntohs(ireq->rmt_port);
+
+        return serval_keyed_hash(words, 3) & ~(SERVAL_TCP_COOKIE_MSS_NUM - 1);
+}
+
+/*
+  Pick the initial sequence number of a request answered with a SAL
+  SYN cookie. It only has room for the MSS, so the other options are
+  turned off.
+ */
+static void serval_tcp_cookie_init_sequence(struct request_sock *req)
+{
+        struct inet_request_sock *ireq = inet_rsk(req);
+        unsigned int i;
+
+        for (i = SERVAL_TCP_COOKIE_MSS_NUM - 1; i > 0; i--)
+                if (req->mss >= serval_tcp_cookie_mss[i])
+                        break;
+
+        req->mss = serval_tcp_cookie_mss[i];
+        ireq->tstamp_ok = 0;
+        ireq->sack_ok = 0;
+        ireq->wscale_ok = 0;
+        ireq->snd_wscale = 0;
+
+        serval_tcp_rsk(req)->snt_isn = serval_tcp_cookie_hash(req) | i;
+}
+
+/*
+  Rebuild the TCP part of a request answered with a SYN cookie from
+  the ACK that completes the handshake.
+
+  Returns: 0 if the ACK acknowledges a valid cookie.
+ */
+static int serval_tcp_cookie_check(struct sock *sk,
+                                   struct request_sock *req,
+                                   struct sk_buff *skb)
+{
+        struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+        struct inet_request_sock *ireq = inet_rsk(req);
+        struct tcphdr *th;
+        __u32 cookie, i;
+        __u8 rcv_wscale;
+
+        if (serval_tcp_rcv_checks(sk, skb, 0))
+                return -1;
+
+        th = tcp_hdr(skb);
+
+        if (!th->ack || th->syn || th->rst)
+                return -1;
+
+        cookie = ntohl(th->ack_seq) - 1;
+        i = cookie & (SERVAL_TCP_COOKIE_MSS_NUM - 1);
+
+        req->cookie_ts = 0;
+        req->ts_recent = 0;
+        ireq->tstamp_ok = 0;
+        ireq->sack_ok = 0;
+        ireq->wscale_ok = 0;
+        ireq->snd_wscale = 0;
+        ireq->acked = 0;
+        ireq->ecn_ok = 0;
+        ireq->rmt_port = th->source;
+        ireq->loc_port = th->dest;
+        serval_tcp_rsk(req)->rcv_isn = ntohl(th->seq) - 1;
+        serval_tcp_rsk(req)->snt_isn = cookie;
+
+        if ((serval_tcp_cookie_hash(req) | i) != cookie)
+                return -1;
+
+        req->mss = serval_tcp_cookie_mss[i];
+
+        /* Same window as offered in the SYN-ACK */
+        req->rcv_wnd = 0;
+        req->window_clamp = tp->window_clamp;
+        serval_tcp_select_initial_window(serval_tcp_full_space(sk),
+                                         req->mss,
+                                         &req->rcv_wnd,
+                                         &req->window_clamp,
+                                         0, &rcv_wscale, 0);
+        ireq->rcv_wscale = rcv_wscale;
+
+        return 0;
+}
+
 static int serval_tcp_connection_request(struct sock *sk, 
                                          struct request_sock *req,
                                          struct sk_buff *skb)
@@ -156,7 +263,10 @@ static int serval_tcp_connection_request(struct sock *sk,
 
         serval_tcp_openreq_init(req, &tmp_opt, skb);
 
-        trsk->snt_isn = serval_tcp_init_sequence(skb);
+        if (serval_rsk(req)->syncookie)
+                serval_tcp_cookie_init_sequence(req);
+        else
+                trsk->snt_isn = serval_tcp_init_sequence(skb);
 
         return 0;
 }
@@ -2158,6 +2268,13 @@ static int serval_do_tcp_setsockopt(struct sock *sk, int level,
 						SOCK_MIN_RCVBUF / 2 : val;
 		break;
 
+	case SERVAL_TCP_ACK_COALESCE:
+		if (val < 0 || val > 255)
+			err = -EINVAL;
+		else
+			tp->ack_coalesce = val;
+		break;
+
 	case TCP_QUICKACK:
 		if (!val) {
 			tp->tp_ack.pingpong = 1;
@@ -2269,6 +2386,9 @@ static int serval_do_tcp_getsockopt(struct sock *sk, int level,
 	case TCP_QUICKACK:
 		val = !tp->tp_ack.pingpong;
 		break;
+	case SERVAL_TCP_ACK_COALESCE:
+		val = tp->ack_coalesce;
+		break;
                 /*
 	case TCP_CONGESTION:
 		if (get_user(len, optlen))
@@ -2422,6 +2542,7 @@ static struct serval_sock_af_ops serval_tcp_af_ops = {
         .conn_build_synack = serval_tcp_connection_build_synack,
         .conn_build_ack = serval_tcp_connection_build_ack,
         .conn_request = serval_tcp_connection_request,
+        .conn_cookie_check = serval_tcp_cookie_check,
         .conn_close = serval_tcp_connection_close,
         .net_header_len = SERVAL_NET_HEADER_LEN,
         .request_state_process = serval_tcp_syn_sent_state_process,
@@ -2444,6 +2565,7 @@ static struct serval_sock_af_ops serval_tcp_encap_af_ops = {
         .conn_build_synack = serval_tcp_connection_build_synack,
         .conn_build_ack = serval_tcp_connection_build_ack,
         .conn_request = serval_tcp_connection_request,
+        .conn_cookie_check = serval_tcp_cookie_check,
         .conn_close = serval_tcp_connection_close,
         .net_header_len = SERVAL_NET_HEADER_LEN + 8 /* sizeof(struct udphdr) */,
         .request_state_process = serval_tcp_syn_sent_state_process,
@@ -2517,6 +2639,9 @@ static struct sock *serval_tcp_create_openreq_child(struct sock *sk,
         serval_tcp_set_ca_state(newsk, TCP_CA_Open);
         serval_tcp_init_xmit_timers(newsk);
         skb_queue_head_init(&newtp->out_of_order_queue);
+#if defined(OS_USER)
+        INIT_LIST_HEAD(&newtp->ack_batch);
+#endif
         newtp->write_seq = newtp->pushed_seq =
                 treq->snt_isn + 1 + serval_tcp_s_data_size(oldtp);
         
@@ -2672,6 +2797,10 @@ static int serval_tcp_init_sock(struct sock *sk)
 	tp->mss_cache = SERVAL_TCP_MSS_DEFAULT;
 
 	tp->reordering = sysctl_serval_tcp_reordering;
+        tp->ack_coalesce = sysctl_serval_tcp_ack_coalesce;
+#if defined(OS_USER)
+        INIT_LIST_HEAD(&tp->ack_batch);
+#endif
 
 	/* So many TCP implementations out there (incorrectly) count the
 	 * initial SYN frame in their delayed-ACK and congestion control
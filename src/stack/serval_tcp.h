@@ -239,6 +239,7 @@ extern int sysctl_serval_tcp_mtu_probing;
 extern int sysctl_serval_tcp_base_mss;
 extern int sysctl_serval_tcp_workaround_signed_windows;
 extern int sysctl_serval_tcp_slow_start_after_idle;
+extern int sysctl_serval_tcp_ack_coalesce;
 extern int sysctl_serval_tcp_max_ssthresh;
 extern int sysctl_serval_tcp_cookie_size;
 extern int sysctl_serval_tcp_thin_linear_timeouts;
@@ -448,6 +449,7 @@ static inline void serval_tcp_enter_frto(struct sock *sk)
 
 void serval_tcp_enter_loss(struct sock *sk, int how);
 void serval_tcp_clear_retrans(struct serval_tcp_sock *tp);
+void serval_tcp_update_metrics(struct sock *sk);
 
 static inline void 
 serval_tcp_clear_options(struct serval_tcp_options_received *rx_opt)
@@ -942,6 +944,10 @@ void serval_tcp_done(struct sock *sk);
 
 void serval_tcp_send_active_reset(struct sock *sk, gfp_t priority);
 void serval_tcp_send_delayed_ack(struct sock *sk);
+#if defined(OS_USER)
+void serval_tcp_ack_batch_add(struct sock *sk);
+void serval_tcp_ack_batch_flush(void);
+#endif
 void serval_tcp_send_ack(struct sock *sk);
 void serval_tcp_send_fin(struct sock *sk);
 
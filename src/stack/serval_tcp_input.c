@@ -9,6 +9,7 @@
 #include <netinet/serval.h>
 #include <serval_tcp_sock.h>
 #include <serval_tcp.h>
+#include <serval_tcp_metrics.h>
 #if defined(OS_LINUX_KERNEL)
 #include <asm/unaligned.h>
 #include <net/netdma.h>
@@ -26,6 +27,7 @@ int sysctl_serval_tcp_app_win __read_mostly = 31;
 int sysctl_serval_tcp_max_orphans __read_mostly = NR_FILE;
 int sysctl_serval_tcp_thin_dupack __read_mostly;
 int sysctl_serval_tcp_nometrics_save __read_mostly;
+int sysctl_serval_tcp_ack_coalesce __read_mostly = 0;
 
 #define FLAG_DATA		0x01 /* Incoming frame contained data.		*/
 #define FLAG_WIN_UPDATE		0x02 /* Incoming ACK was a window update.	*/
@@ -1737,35 +1739,41 @@ static void serval_tcp_init_metrics(struct sock *sk)
 {
 	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
 	struct dst_entry *dst = __sk_dst_get(sk);
+        struct serval_tcp_metrics m;
 
 	if (dst == NULL)
 		goto reset;
 
-#if defined(OS_LINUX_KERNEL)
-
         LOG_DBG("preinit: snd_ssthresh=%u snd_cwnd_clamp=%u\n",
                 tp->snd_ssthresh, tp->snd_cwnd_clamp);
 
+#if defined(OS_LINUX_KERNEL)
 	dst_confirm(dst);
 
 	if (dst_metric_locked(dst, RTAX_CWND))
 		tp->snd_cwnd_clamp = dst_metric(dst, RTAX_CWND);
-	if (dst_metric(dst, RTAX_SSTHRESH)) {
-		tp->snd_ssthresh = dst_metric(dst, RTAX_SSTHRESH);
+#endif
+        /* Metrics are cached per peer address and serviceID (see
+         * serval_tcp_metrics.c) rather than in the route, so that
+         * they are available also in the user-level stack. */
+        if (serval_tcp_metrics_get(sk, &m) < 0)
+                goto reset;
+
+	if (m.ssthresh) {
+		tp->snd_ssthresh = m.ssthresh;
 		if (tp->snd_ssthresh > tp->snd_cwnd_clamp)
-			tp->snd_ssthresh = tp->snd_cwnd_clamp;	}
-        /*
-	if (dst_metric(dst, RTAX_REORDERING) &&
-	    tp->reordering != dst_metric(dst, RTAX_REORDERING)) {
-		tcp_disable_fack(tp);
-		tp->reordering = dst_metric(dst, RTAX_REORDERING);
+			tp->snd_ssthresh = tp->snd_cwnd_clamp;
 	}
-        */
 
-	if (dst_metric(dst, RTAX_RTT) == 0)
+	if (m.reordering && tp->reordering != m.reordering) {
+		serval_tcp_disable_fack(tp);
+		tp->reordering = m.reordering;
+	}
+
+	if (m.rtt == 0)
 		goto reset;
 
-	if (!tp->srtt && dst_metric_rtt(dst, RTAX_RTT) < (SERVAL_TCP_TIMEOUT_INIT << 3))
+	if (!tp->srtt && m.rtt < (SERVAL_TCP_TIMEOUT_INIT << 3))
 		goto reset;
 
 	/* Initial rtt is determined from SYN,SYN-ACK.
@@ -1782,19 +1790,18 @@ static void serval_tcp_init_metrics(struct sock *sk)
 	 * to low value, and then abruptly stops to do it and starts to delay
 	 * ACKs, wait for troubles.
 	 */
-	if (dst_metric_rtt(dst, RTAX_RTT) > tp->srtt) {
-		tp->srtt = dst_metric_rtt(dst, RTAX_RTT);
+	if (m.rtt > tp->srtt) {
+		tp->srtt = m.rtt;
 		tp->rtt_seq = tp->snd_nxt;
 	}
-	if (dst_metric_rtt(dst, RTAX_RTTVAR) > tp->mdev) {
-		tp->mdev = dst_metric_rtt(dst, RTAX_RTTVAR);
-		tp->mdev_max = tp->rttvar = max(tp->mdev, tcp_rto_min(sk));
+	if (m.rttvar > tp->mdev) {
+		tp->mdev = m.rttvar;
+		tp->mdev_max = tp->rttvar = max(tp->mdev, serval_tcp_rto_min(sk));
 	}
         
         LOG_DBG("postinit: snd_ssthresh=%u snd_cwnd_clamp=%u\n",
                 tp->snd_ssthresh, tp->snd_cwnd_clamp);
 
-#endif
 	serval_tcp_set_rto(sk);
 
 	if (tp->rto < SERVAL_TCP_TIMEOUT_INIT && !tp->rx_opt.saw_tstamp)
@@ -2509,6 +2516,19 @@ static inline void serval_tcp_data_snd_check(struct sock *sk)
 	serval_tcp_check_space(sk);
 }
 
+/*
+ * Received data beyond which an ACK is sent immediately. With ACK
+ * coalescing, this is the last of ack_coalesce full frames rather
+ * than the second.
+ */
+static inline u32 serval_tcp_ack_threshold(const struct serval_tcp_sock *tp)
+{
+        if (tp->ack_coalesce)
+                return (tp->ack_coalesce - 1) * tp->tp_ack.rcv_mss;
+
+        return tp->tp_ack.rcv_mss;
+}
+
 /*
  * Check if sending an ack is needed.
  */
@@ -2522,8 +2542,8 @@ static void __serval_tcp_ack_snd_check(struct sock *sk, int ofo_possible)
                 tp->rcv_wnd, serval_tcp_in_quickack_mode(sk), 
                 (ofo_possible && skb_peek(&tp->out_of_order_queue)));
 
-        /* More than one full frame received... */
-	if (((tp->rcv_nxt - tp->rcv_wup) > tp->tp_ack.rcv_mss &&
+        /* Enough full frames received... */
+	if (((tp->rcv_nxt - tp->rcv_wup) > serval_tcp_ack_threshold(tp) &&
 	     /* ... and right edge of window advances far enough.
 	      * (tcp_recvmsg() will send ACK otherwise). Or...
 	      */
@@ -2540,6 +2560,12 @@ static void __serval_tcp_ack_snd_check(struct sock *sk, int ofo_possible)
 		/* Else, send delayed ack. */
                 LOG_DBG("sending delayed ACK\n");
 		serval_tcp_send_delayed_ack(sk);
+#if defined(OS_USER)
+                /* ... or at the latest when the device is done with
+                 * the packets it has received so far. */
+                if (tp->ack_coalesce)
+                        serval_tcp_ack_batch_add(sk);
+#endif
 	}
 }
 
@@ -2751,6 +2777,7 @@ static void serval_tcp_fin(struct sk_buff *skb,
 	case TCP_FIN_WAIT2:
 		/* Received a FIN -- send ACK and enter TIME_WAIT. */
 		serval_tcp_send_ack(sk);
+		serval_tcp_update_metrics(sk);
 		//serval_tcp_time_wait(sk, TCP_TIME_WAIT, 0);
 		break;
 	default:
@@ -3567,102 +3594,80 @@ static inline int serval_tcp_checksum_complete_user(struct sock *sk,
  */
 void serval_tcp_update_metrics(struct sock *sk)
 {
-#if defined(OS_LINUX_KERNEL)
        	struct serval_tcp_sock *tp = serval_tcp_sk(sk);
-	struct dst_entry *dst = __sk_dst_get(sk);
+        struct serval_tcp_metrics m;
+        int m_delta;
 
 	if (sysctl_serval_tcp_nometrics_save)
 		return;
 
-	dst_confirm(dst);
-
-	if (dst && (dst->flags & DST_HOST)) {
-		int m;
-		unsigned long rtt;
-
-		if (tp->backoff || !tp->srtt) {
-			/* This session failed to estimate rtt. Why?
-			 * Probably, no packets returned in time.
-			 * Reset our results.
-			 */
-			if (!(dst_metric_locked(dst, RTAX_RTT)))
-				dst_metric_set(dst, RTAX_RTT, 0);
-			return;
-		}
-
-		rtt = dst_metric_rtt(dst, RTAX_RTT);
-		m = rtt - tp->srtt;
-
-		/* If newly calculated rtt larger than stored one,
-		 * store new one. Otherwise, use EWMA. Remember,
-		 * rtt overestimation is always better than underestimation.
-		 */
-		if (!(dst_metric_locked(dst, RTAX_RTT))) {
-			if (m <= 0)
-				set_dst_metric_rtt(dst, RTAX_RTT, tp->srtt);
-			else
-				set_dst_metric_rtt(dst, RTAX_RTT, rtt - (m >> 3));
-		}
-
-		if (!(dst_metric_locked(dst, RTAX_RTTVAR))) {
-			unsigned long var;
-			if (m < 0)
-				m = -m;
-
-			/* Scale deviation to rttvar fixed point */
-			m >>= 1;
-			if (m < tp->mdev)
-				m = tp->mdev;
+#if defined(OS_LINUX_KERNEL)
+	dst_confirm(__sk_dst_get(sk));
+#endif
+        if (serval_tcp_metrics_get(sk, &m) < 0)
+                memset(&m, 0, sizeof(m));
 
-			var = dst_metric_rtt(dst, RTAX_RTTVAR);
-			if (m >= var)
-				var = m;
-			else
-				var -= (var - m) >> 2;
+        if (tp->backoff || !tp->srtt) {
+                /* This session failed to estimate rtt. Why?
+                 * Probably, no packets returned in time.
+                 * Reset our results.
+                 */
+                if (m.rtt) {
+                        m.rtt = 0;
+                        serval_tcp_metrics_set(sk, &m);
+                }
+                return;
+        }
 
-			set_dst_metric_rtt(dst, RTAX_RTTVAR, var);
-		}
+        m_delta = m.rtt - tp->srtt;
+
+        /* If newly calculated rtt larger than stored one,
+         * store new one. Otherwise, use EWMA. Remember,
+         * rtt overestimation is always better than underestimation.
+         */
+        if (m_delta <= 0)
+                m.rtt = tp->srtt;
+        else
+                m.rtt -= (m_delta >> 3);
+
+        if (m_delta < 0)
+                m_delta = -m_delta;
+
+        /* Scale deviation to rttvar fixed point */
+        m_delta >>= 1;
+        if (m_delta < tp->mdev)
+                m_delta = tp->mdev;
+
+        if (m_delta >= m.rttvar)
+                m.rttvar = m_delta;
+        else
+                m.rttvar -= (m.rttvar - m_delta) >> 2;
+
+        if (serval_tcp_in_initial_slowstart(tp)) {
+                /* Slow start still did not finish. */
+                if (m.ssthresh && (tp->snd_cwnd >> 1) > m.ssthresh)
+                        m.ssthresh = tp->snd_cwnd >> 1;
+                if (tp->snd_cwnd > m.cwnd)
+                        m.cwnd = tp->snd_cwnd;
+        } else if (tp->snd_cwnd > tp->snd_ssthresh &&
+                   tp->ca_state == TCP_CA_Open) {
+                /* Cong. avoidance phase, cwnd is reliable. */
+                m.ssthresh = max(tp->snd_cwnd >> 1, tp->snd_ssthresh);
+                m.cwnd = (m.cwnd + tp->snd_cwnd) >> 1;
+        } else {
+                /* Else slow start did not finish, cwnd is non-sense,
+                   ssthresh may be also invalid.
+                */
+                m.cwnd = (m.cwnd + tp->snd_ssthresh) >> 1;
+                if (m.ssthresh && tp->snd_ssthresh > m.ssthresh)
+                        m.ssthresh = tp->snd_ssthresh;
+        }
 
-		if (serval_tcp_in_initial_slowstart(tp)) {
-			/* Slow start still did not finish. */
-			if (dst_metric(dst, RTAX_SSTHRESH) &&
-			    !dst_metric_locked(dst, RTAX_SSTHRESH) &&
-			    (tp->snd_cwnd >> 1) > dst_metric(dst, RTAX_SSTHRESH))
-				dst_metric_set(dst, RTAX_SSTHRESH, tp->snd_cwnd >> 1);
-			if (!dst_metric_locked(dst, RTAX_CWND) &&
-			    tp->snd_cwnd > dst_metric(dst, RTAX_CWND))
-				dst_metric_set(dst, RTAX_CWND, tp->snd_cwnd);
-		} else if (tp->snd_cwnd > tp->snd_ssthresh &&
-			   tp->ca_state == TCP_CA_Open) {
-			/* Cong. avoidance phase, cwnd is reliable. */
-			if (!dst_metric_locked(dst, RTAX_SSTHRESH))
-				dst_metric_set(dst, RTAX_SSTHRESH,
-					       max(tp->snd_cwnd >> 1, tp->snd_ssthresh));
-			if (!dst_metric_locked(dst, RTAX_CWND))
-				dst_metric_set(dst, RTAX_CWND,
-					       (dst_metric(dst, RTAX_CWND) +
-						tp->snd_cwnd) >> 1);
-		} else {
-			/* Else slow start did not finish, cwnd is non-sense,
-			   ssthresh may be also invalid.
-			 */
-			if (!dst_metric_locked(dst, RTAX_CWND))
-				dst_metric_set(dst, RTAX_CWND,
-					       (dst_metric(dst, RTAX_CWND) +
-						tp->snd_ssthresh) >> 1);
-			if (dst_metric(dst, RTAX_SSTHRESH) &&
-			    !dst_metric_locked(dst, RTAX_SSTHRESH) &&
-			    tp->snd_ssthresh > dst_metric(dst, RTAX_SSTHRESH))
-				dst_metric_set(dst, RTAX_SSTHRESH, tp->snd_ssthresh);
-		}
+        if (m.reordering < tp->reordering &&
+            tp->reordering != sysctl_serval_tcp_reordering)
+                m.reordering = tp->reordering;
 
-		if (!dst_metric_locked(dst, RTAX_REORDERING)) {
-			if (dst_metric(dst, RTAX_REORDERING) < tp->reordering &&
-			    tp->reordering != sysctl_tcp_reordering)
-				dst_metric_set(dst, RTAX_REORDERING, tp->reordering);
-		}
-	}
-#endif /* OS_LINUX_KERNEL */
+        serval_tcp_metrics_set(sk, &m);
 }
 
 /*
@@ -0,0 +1,192 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Cache of TCP metrics per peer address and serviceID.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License as
+ *	published by the Free Software Foundation; either version 2 of
+ *	the License, or (at your option) any later version.
+ */
+#include <serval/platform.h>
+#include <serval/debug.h>
+#include <serval/list.h>
+#include <serval/lock.h>
+#include <serval/hash.h>
+#include <serval/timer.h>
+#include <netinet/serval.h>
+#include <serval_sock.h>
+#include <serval_tcp_metrics.h>
+#if defined(OS_USER)
+#include <string.h>
+#include <errno.h>
+#endif
+
+struct tcp_metrics_key {
+        u32 daddr;
+        struct service_id srvid;
+};
+
+struct tcp_metrics_entry {
+        struct hlist_node node;
+        struct list_head lru;
+        struct tcp_metrics_key key;
+        unsigned long stamp;
+        struct serval_tcp_metrics m;
+};
+
+static struct {
+        struct hlist_head hash[SERVAL_TCP_METRICS_HTABLE_SIZE];
+        struct list_head lru;
+        unsigned int count;
+        spinlock_t lock;
+} metrics_table;
+
+/*
+  The passive side was reached through its own (listening)
+  serviceID, while the active side connected to the peer's.
+ */
+static void tcp_metrics_key_init(struct sock *sk, struct tcp_metrics_key *key)
+{
+        struct serval_sock *ssk = serval_sk(sk);
+
+        memset(key, 0, sizeof(*key));
+        key->daddr = inet_sk(sk)->inet_daddr;
+
+        if (serval_sock_flag(ssk, SSK_FLAG_CHILD))
+                memcpy(&key->srvid, &ssk->local_srvid, sizeof(key->srvid));
+        else
+                memcpy(&key->srvid, &ssk->peer_srvid, sizeof(key->srvid));
+}
+
+static inline struct hlist_head *tcp_metrics_bucket(struct tcp_metrics_key *key)
+{
+        u32 h = key->daddr;
+        unsigned int i;
+
+        for (i = 0; i < 8; i++)
+                h ^= key->srvid.srv_un.un_id32[i];
+
+        return &metrics_table.hash[hash_32(h, SERVAL_TCP_METRICS_HTABLE_BITS)];
+}
+
+static struct tcp_metrics_entry *__tcp_metrics_find(struct tcp_metrics_key *key,
+                                                    struct hlist_head *head)
+{
+        struct hlist_node *walk;
+
+        hlist_for_each(walk, head) {
+                struct tcp_metrics_entry *tm =
+                        hlist_entry(walk, struct tcp_metrics_entry, node);
+
+                if (memcmp(&tm->key, key, sizeof(*key)) == 0)
+                        return tm;
+        }
+        return NULL;
+}
+
+/*
+  Copy the cached metrics for the socket's destination into m.
+  Returns -ENOENT if nothing (recent) is known about it.
+ */
+int serval_tcp_metrics_get(struct sock *sk, struct serval_tcp_metrics *m)
+{
+        struct tcp_metrics_key key;
+        struct tcp_metrics_entry *tm;
+        int ret = -ENOENT;
+
+        tcp_metrics_key_init(sk, &key);
+
+        spin_lock_bh(&metrics_table.lock);
+
+        tm = __tcp_metrics_find(&key, tcp_metrics_bucket(&key));
+
+        if (tm && time_before(jiffies,
+                              tm->stamp + SERVAL_TCP_METRICS_TIMEOUT)) {
+                memcpy(m, &tm->m, sizeof(*m));
+                list_move(&tm->lru, &metrics_table.lru);
+                ret = 0;
+        }
+
+        spin_unlock_bh(&metrics_table.lock);
+
+        return ret;
+}
+
+/*
+  Store metrics for the socket's destination. When the cache is full,
+  the least recently used entry is recycled, so memory is bounded by
+  SERVAL_TCP_METRICS_MAX entries.
+ */
+void serval_tcp_metrics_set(struct sock *sk, const struct serval_tcp_metrics *m)
+{
+        struct tcp_metrics_key key;
+        struct tcp_metrics_entry *tm;
+        struct hlist_head *head;
+
+        tcp_metrics_key_init(sk, &key);
+        head = tcp_metrics_bucket(&key);
+
+        spin_lock_bh(&metrics_table.lock);
+
+        tm = __tcp_metrics_find(&key, head);
+
+        if (!tm) {
+                if (metrics_table.count >= SERVAL_TCP_METRICS_MAX) {
+                        tm = list_entry(metrics_table.lru.prev,
+                                        struct tcp_metrics_entry, lru);
+                        hlist_del(&tm->node);
+                        list_del(&tm->lru);
+                } else {
+                        tm = kmalloc(sizeof(*tm), GFP_ATOMIC);
+
+                        if (!tm) {
+                                spin_unlock_bh(&metrics_table.lock);
+                                return;
+                        }
+                        metrics_table.count++;
+                }
+                memcpy(&tm->key, &key, sizeof(key));
+                hlist_add_head(&tm->node, head);
+        } else {
+                list_del(&tm->lru);
+        }
+
+        memcpy(&tm->m, m, sizeof(*m));
+        tm->stamp = jiffies;
+        list_add(&tm->lru, &metrics_table.lru);
+
+        spin_unlock_bh(&metrics_table.lock);
+}
+
+unsigned int serval_tcp_metrics_count(void)
+{
+        return metrics_table.count;
+}
+
+int __init serval_tcp_metrics_init(void)
+{
+        unsigned int i;
+
+        for (i = 0; i < SERVAL_TCP_METRICS_HTABLE_SIZE; i++)
+                INIT_HLIST_HEAD(&metrics_table.hash[i]);
+
+        INIT_LIST_HEAD(&metrics_table.lru);
+        metrics_table.count = 0;
+        spin_lock_init(&metrics_table.lock);
+
+        return 0;
+}
+
+void __exit serval_tcp_metrics_fini(void)
+{
+        while (!list_empty(&metrics_table.lru)) {
+                struct tcp_metrics_entry *tm =
+                        list_first_entry(&metrics_table.lru,
+                                         struct tcp_metrics_entry, lru);
+                hlist_del(&tm->node);
+                list_del(&tm->lru);
+                kfree(tm);
+        }
+        metrics_table.count = 0;
+        spin_lock_destroy(&metrics_table.lock);
+}
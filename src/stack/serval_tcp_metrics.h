@@ -0,0 +1,36 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+#ifndef _SERVAL_TCP_METRICS_H_
+#define _SERVAL_TCP_METRICS_H_
+
+#include <serval/platform.h>
+#include <serval/sock.h>
+
+#define SERVAL_TCP_METRICS_HTABLE_BITS 10
+#define SERVAL_TCP_METRICS_HTABLE_SIZE (1 << SERVAL_TCP_METRICS_HTABLE_BITS)
+/* Upper bound on cached destinations, evicted in LRU order */
+#define SERVAL_TCP_METRICS_MAX 4096
+/* Cached values older than this are not trusted */
+#define SERVAL_TCP_METRICS_TIMEOUT (60 * 60 * HZ)
+
+/**
+   Metrics learned by previous TCP sessions to the same peer address
+   and serviceID. Replaces the per-route dst metrics that the Linux
+   TCP keeps, which we do not have in the user-level stack, and which
+   do not distinguish between services on the same host.
+ */
+struct serval_tcp_metrics {
+        u32 rtt;        /* smoothed rtt << 3, like tp->srtt */
+        u32 rttvar;
+        u32 ssthresh;
+        u32 cwnd;
+        u32 reordering;
+};
+
+int serval_tcp_metrics_get(struct sock *sk, struct serval_tcp_metrics *m);
+void serval_tcp_metrics_set(struct sock *sk, const struct serval_tcp_metrics *m);
+unsigned int serval_tcp_metrics_count(void);
+
+int __init serval_tcp_metrics_init(void);
+void __exit serval_tcp_metrics_fini(void);
+
+#endif /* _SERVAL_TCP_METRICS_H_ */
@@ -2333,6 +2333,11 @@ void serval_tcp_send_delayed_ack(struct sock *sk)
 		ato = min(ato, max_ato);
 	}
 
+        /* A coalescing receiver holds back more data, so do not let
+         * the sender wait long for the ACK. */
+        if (tp->ack_coalesce && ato > TCP_DELACK_MIN)
+                ato = TCP_DELACK_MIN;
+
 	/* Stay within the limit we were given */
 	timeout = jiffies + ato;
 
@@ -2355,6 +2360,67 @@ void serval_tcp_send_delayed_ack(struct sock *sk)
 	sk_reset_timer(sk, &tp->delack_timer, timeout);
 }
 
+#if defined(OS_USER)
+/* Sockets with a coalesced ACK outstanding, see
+ * serval_tcp_ack_batch_flush(). */
+static LIST_HEAD(ack_batch_list);
+static DEFINE_SPINLOCK(ack_batch_lock);
+
+void serval_tcp_ack_batch_add(struct sock *sk)
+{
+        struct serval_tcp_sock *tp = serval_tcp_sk(sk);
+
+        spin_lock_bh(&ack_batch_lock);
+
+        if (list_empty(&tp->ack_batch)) {
+                sock_hold(sk);
+                list_add_tail(&tp->ack_batch, &ack_batch_list);
+        }
+
+        spin_unlock_bh(&ack_batch_lock);
+}
+
+/* 
+ * Called by a device thread after a batch of received packets. A
+ * coalescing socket that got more than one full frame during the
+ * batch is ACKed now rather than when the delayed ACK timer fires, so
+ * that one ACK covers the entire batch. Less data is left to the
+ * timer, as with the default policy.
+ */
+void serval_tcp_ack_batch_flush(void)
+{
+        LIST_HEAD(batch);
+
+        spin_lock_bh(&ack_batch_lock);
+        list_splice_init(&ack_batch_list, &batch);
+        spin_unlock_bh(&ack_batch_lock);
+
+        while (!list_empty(&batch)) {
+                struct serval_tcp_sock *tp;
+                struct sock *sk;
+
+                spin_lock_bh(&ack_batch_lock);
+                tp = list_first_entry(&batch, struct serval_tcp_sock, 
+                                      ack_batch);
+                list_del_init(&tp->ack_batch);
+                spin_unlock_bh(&ack_batch_lock);
+
+                sk = (struct sock *)tp;
+
+                bh_lock_sock(sk);
+
+                if (!sock_owned_by_user(sk) &&
+                    sk->sk_state != TCP_CLOSE &&
+                    serval_tsk_ack_scheduled(sk) &&
+                    (tp->rcv_nxt - tp->rcv_wup) > tp->tp_ack.rcv_mss)
+                        serval_tcp_send_ack(sk);
+
+                bh_unlock_sock(sk);
+                sock_put(sk);
+        }
+}
+#endif /* OS_USER */
+
 /* Check if we forward retransmits are possible in the current
  * window/congestion state.
  */
@@ -216,6 +216,13 @@ struct serval_tcp_sock {
 		__u16		  last_seg_size; /* Size of last incoming segment	   */
 		__u16		  rcv_mss;	 /* MSS used for delayed ACK decisions	   */ 
 	} tp_ack;
+        /* Segments to receive per ACK, 0 = every other segment */
+        __u8                      ack_coalesce;
+#if defined(OS_USER)
+        /* On the list of sockets to ACK at the end of a receive
+         * batch */
+        struct list_head          ack_batch;
+#endif
 	struct {
 		int		  enabled;
 
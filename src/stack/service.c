@@ -14,9 +14,11 @@
 #include <serval/platform.h>
 #include <serval/netdevice.h>
 #include <serval/atomic.h>
+#include <serval/bitops.h>
 #include <serval/debug.h>
 #include <serval/list.h>
 #include <serval/lock.h>
+#include <serval/hash.h>
 #include <serval/dst.h>
 #include <netinet/serval.h>
 #if defined(OS_USER)
@@ -24,6 +26,7 @@
 #include <errno.h>
 #endif
 #if defined(OS_LINUX_KERNEL)
+#include <linux/percpu.h>
 #include <serval_ipv4.h>
 #endif
 #include "service.h"
@@ -42,6 +45,10 @@ struct service_table {
         atomic_t packets_resolved;
         atomic_t bytes_dropped;
         atomic_t packets_dropped;
+        /* Bumped on every change, invalidates the resolution caches */
+        atomic_t gen;
+        /* Entries whose counters changed since the last stats delta */
+        atomic_t stats_dirty;
         rwlock_t lock;
 };
 
@@ -51,6 +58,109 @@ static void service_entry_destroy(struct bst_node *n);
 static struct service_table srvtable;
 static struct service_id default_service;
 
+/*
+  Direct-mapped cache of full serviceID resolutions. Each slot holds
+  a reference to the entry it resolved to, and is valid as long as
+  its generation matches that of the table.
+ */
+#define SERVICE_CACHE_BITS 8
+#define SERVICE_CACHE_SIZE (1 << SERVICE_CACHE_BITS)
+
+struct service_cache_slot {
+        struct service_id srvid;
+        struct service_entry *se;
+        unsigned int gen;
+};
+
+struct service_cache {
+        struct service_cache_slot slot[SERVICE_CACHE_SIZE];
+#if defined(OS_LINUX_KERNEL)
+        /* Taken by the owner, and by others releasing stale slots */
+        spinlock_t lock;
+#endif
+        /* Only touched by the cache's owner */
+        unsigned int hits;
+        unsigned int misses;
+};
+
+#if defined(OS_LINUX_KERNEL)
+static DEFINE_PER_CPU(struct service_cache, srvcache);
+
+/* Softirq and process context share the CPU's cache */
+static inline struct service_cache *service_cache_get(void)
+{
+        struct service_cache *sc;
+
+        local_bh_disable();
+        sc = &per_cpu(srvcache, smp_processor_id());
+        spin_lock(&sc->lock);
+
+        return sc;
+}
+
+static inline void service_cache_put(struct service_cache *sc)
+{
+        spin_unlock(&sc->lock);
+        local_bh_enable();
+}
+#else
+/* No per-CPU data at user level, so all threads share one cache */
+static struct service_cache srvcache;
+static spinlock_t srvcache_lock;
+
+static inline struct service_cache *service_cache_get(void)
+{
+        spin_lock(&srvcache_lock);
+        return &srvcache;
+}
+
+static inline void service_cache_put(struct service_cache *sc)
+{
+        spin_unlock(&srvcache_lock);
+}
+#endif
+
+static void __service_cache_put_stale(struct service_cache *sc, 
+                                      unsigned int gen)
+{
+        unsigned int i;
+
+        for (i = 0; i < SERVICE_CACHE_SIZE; i++) {
+                struct service_cache_slot *slot = &sc->slot[i];
+
+                if (slot->se && slot->gen != gen) {
+                        service_entry_put(slot->se);
+                        slot->se = NULL;
+                }
+        }
+}
+
+/*
+  Release the entries that slots resolved before the table changed,
+  so that removed entries, and the devices and sockets their targets
+  hold, are not pinned until the slot happens to be reused. Must not
+  be called with the table locked.
+ */
+static void service_cache_put_stale(void)
+{
+        unsigned int gen = atomic_read(&srvtable.gen);
+#if defined(OS_LINUX_KERNEL)
+        int cpu;
+
+        for_each_possible_cpu(cpu) {
+                struct service_cache *sc = &per_cpu(srvcache, cpu);
+
+                spin_lock_bh(&sc->lock);
+                __service_cache_put_stale(sc, gen);
+                spin_unlock_bh(&sc->lock);
+        }
+#else
+        spin_lock(&srvcache_lock);
+        __service_cache_put_stale(&srvcache, gen);
+        spin_unlock(&srvcache_lock);
+#endif
+}
+
 static struct target *target_create(service_rule_type_t type,
                                     const void *dst, int dstlen,
                                     const union target_out out, 
@@ -188,6 +298,46 @@ static struct target * __service_entry_get_target(struct service_entry *se,
         return NULL;
 }
 
+/*
+  Get the socket target of a protocol for a flow with the given
+  hash. Members of a SVSF_REUSEPORT group are picked by the hash, so
+  that the packets of a flow keep reaching the same one.
+ */
+static struct target *__service_entry_get_sock_target(struct service_entry *se,
+                                                      int protocol,
+                                                      u32 hash)
+{
+        struct target_set *set;
+        struct target *t;
+        unsigned int n = 0;
+
+        list_for_each_entry(set, &se->target_set, lh) {
+                list_for_each_entry(t, &set->list, lh) {
+                        if (t->type == RULE_DEMUX &&
+                            (t->out.sk->sk_protocol == protocol ||
+                             protocol == MATCH_ANY_PROTOCOL))
+                                n++;
+                }
+        }
+
+        if (n == 0)
+                return NULL;
+
+        n = hash % n;
+
+        list_for_each_entry(set, &se->target_set, lh) {
+                list_for_each_entry(t, &set->list, lh) {
+                        if (t->type == RULE_DEMUX &&
+                            (t->out.sk->sk_protocol == protocol ||
+                             protocol == MATCH_ANY_PROTOCOL) &&
+                            n-- == 0)
+                                return t;
+                }
+        }
+
+        return NULL;
+}
+
 /* 
    The returned net_device will have an increased reference count, so
    a put is necessary following a successful call to this
@@ -246,43 +396,85 @@ __service_entry_get_target_set(struct service_entry *se,
         return NULL;
 }
 
-static int __service_entry_add_target(struct service_entry *se, 
+/*
+  A socket may only join the sockets of its protocol already on an
+  entry if it and they were all bound with SVSF_REUSEPORT, forming a
+  group that new flows are spread across.
+ */
+static int __service_entry_sock_conflict(struct service_entry *se,
+                                         uint16_t flags,
+                                         struct sock *sk)
+{
+        struct target_set *set;
+        struct target *t;
+
+        list_for_each_entry(set, &se->target_set, lh) {
+                list_for_each_entry(t, &set->list, lh) {
+                        if (t->type != RULE_DEMUX ||
+                            t->out.sk->sk_protocol != sk->sk_protocol)
+                                continue;
+
+                        if (t->out.sk == sk ||
+                            !(flags & set->flags & SVSF_REUSEPORT))
+                                return 1;
+                }
+        }
+
+        return 0;
+}
+
+static int __service_entry_has_target(struct service_entry *se, 
                                       service_rule_type_t type,
-                                      uint16_t flags, uint32_t priority,
-                                      uint32_t weight, const void *dst, 
-                                      int dstlen, const union target_out out, 
-                                      gfp_t alloc) 
+                                      uint16_t flags,
+                                      const void *dst, int dstlen, 
+                                      const union target_out out)
 {
-        struct target_set *set = NULL;
         struct target *t;
-        
+
+        if (type == RULE_DEMUX && dstlen == 0) {
+                if (__service_entry_sock_conflict(se, flags, out.sk))
+                        return -EADDRINUSE;
+                return 0;
+        }
+
         t = __service_entry_get_target(se, type, dst, dstlen,
-                                       out, &set,
-                                       dstlen == 0 ? 
-                                       out.sk->sk_protocol :
-                                       MATCH_NO_PROTOCOL);
+                                       out, NULL, MATCH_NO_PROTOCOL);
 
         if (t) {
                 if (is_sock_target(t)) {
                         return -EADDRINUSE;
                 }
                 LOG_INF("Identical service entry already exists\n");
-                return 0;
+                return 1;
         }
-        
-        t = target_create(type, dst, dstlen, out, weight, alloc);
+        return 0;
+}
 
-        if (!t)
-                return -ENOMEM;
+/*
+  Add an already created target. If there is no set with the given
+  priority, the one in set_p is used, if any, and set_p is cleared.
+ */
+static int __service_entry_insert_target(struct service_entry *se, 
+                                         uint16_t flags, uint32_t priority,
+                                         struct target *t,
+                                         struct target_set **set_p,
+                                         gfp_t alloc)
+{
+        struct target_set *set;
 
         set = __service_entry_get_target_set(se, priority);
 
         if (!set) {
-                set = target_set_create(flags, priority, alloc);
-
-                if (!set) {
-                        target_free(t);
-                        return -ENOMEM;
+                if (set_p && *set_p) {
+                        set = *set_p;
+                        *set_p = NULL;
+                        set->flags = flags;
+                        set->priority = priority;
+                } else {
+                        set = target_set_create(flags, priority, alloc);
+                        
+                        if (!set)
+                                return -ENOMEM;
                 }
                 service_entry_insert_target_set(se, set);
         }
@@ -294,6 +486,35 @@ static int __service_entry_add_target(struct service_entry *se,
         return 1;
 }
 
+static int __service_entry_add_target(struct service_entry *se, 
+                                      service_rule_type_t type,
+                                      uint16_t flags, uint32_t priority,
+                                      uint32_t weight, const void *dst, 
+                                      int dstlen, const union target_out out, 
+                                      gfp_t alloc) 
+{
+        struct target *t;
+        int ret;
+
+        ret = __service_entry_has_target(se, type, flags, dst, dstlen, out);
+
+        if (ret != 0)
+                return ret < 0 ? ret : 0;
+        
+        t = target_create(type, dst, dstlen, out, weight, alloc);
+
+        if (!t)
+                return -ENOMEM;
+
+        ret = __service_entry_insert_target(se, flags, priority, 
+                                            t, NULL, alloc);
+
+        if (ret < 0)
+                target_free(t);
+
+        return ret;
+}
+
 int service_entry_add_target(struct service_entry *se, 
                              service_rule_type_t type, uint16_t flags, 
                              uint32_t priority, uint32_t weight, 
@@ -434,6 +655,45 @@ int service_entry_modify_target(struct service_entry *se,
 }
 
 
+#define SERVICE_ENTRY_STATS_DIRTY 0
+
+static inline void service_entry_stats_changed(struct service_entry *se)
+{
+        if (!test_bit(SERVICE_ENTRY_STATS_DIRTY, &se->stats_dirty) &&
+            !test_and_set_bit(SERVICE_ENTRY_STATS_DIRTY, &se->stats_dirty))
+                atomic_inc(&srvtable.stats_dirty);
+}
+
+/*
+  The number of entries whose counters changed since they were last
+  reported, so that a stats delta walk can stop after the last one.
+ */
+unsigned int service_table_stats_dirty(void)
+{
+        return atomic_read(&srvtable.stats_dirty);
+}
+
+int service_entry_stats_dirty(struct service_entry *se)
+{
+        return test_bit(SERVICE_ENTRY_STATS_DIRTY, &se->stats_dirty);
+}
+
+/*
+  Call before reading the counters to report, so that changes made
+  after that mark the entry again.
+ */
+void service_entry_stats_reported(struct service_entry *se)
+{
+        if (test_and_clear_bit(SERVICE_ENTRY_STATS_DIRTY, &se->stats_dirty))
+                atomic_dec(&srvtable.stats_dirty);
+}
+
+/* Mark the entry again when not all of its changes were reported. */
+void service_entry_stats_unreported(struct service_entry *se)
+{
+        service_entry_stats_changed(se);
+}
+
 static void __service_entry_inc_target_stats(struct service_entry *se, 
                                              service_rule_type_t type,
                                              const void *dst, int dstlen, 
@@ -447,6 +707,8 @@ static void __service_entry_inc_target_stats(struct service_entry *se,
         if (!t)
                 return;
 
+        service_entry_stats_changed(se);
+
         if (packets > 0) {
                 atomic_add(packets, &t->packets_resolved);
                 atomic_add(bytes, &t->bytes_resolved);
@@ -525,6 +787,7 @@ int service_entry_remove_target_by_dev(struct service_entry *se,
         write_unlock(&se->lock);
         
         write_lock(&srvtable.lock);
+        atomic_inc(&srvtable.gen);
 
         if (list_empty(&se->target_set)) {
                 /* Removing the node also puts the service entry */
@@ -534,9 +797,28 @@ int service_entry_remove_target_by_dev(struct service_entry *se,
 
         write_unlock(&srvtable.lock);
         local_bh_enable();
+
+        service_cache_put_stale();
+
         return ret;
 }
 
+static unsigned int __service_entry_num_targets(struct service_entry *se,
+                                                service_rule_type_t type)
+{
+        struct target_set *set;
+        struct target *t;
+        unsigned int num = 0;
+
+        list_for_each_entry(set, &se->target_set, lh) {
+                list_for_each_entry(t, &set->list, lh) {
+                        if (t->type == type)
+                                num++;
+                }
+        }
+        return num;
+}
+
 int __service_entry_remove_target(struct service_entry *se, 
                                   service_rule_type_t type,
                                   const void *dst, int dstlen,
@@ -548,7 +830,8 @@ int __service_entry_remove_target(struct service_entry *se,
         list_for_each_entry(set, &se->target_set, lh) {
                 list_for_each_entry(t, &set->list, lh) {
                         if (t->type == type && 
-                            ((t->type == RULE_DEMUX && dstlen == 0) || 
+                            ((t->type == RULE_DEMUX && dstlen == 0 &&
+                              (!dst || t->out.sk == dst)) || 
                             (t->type == RULE_FORWARD && 
                              memcmp(t->dst, dst, dstlen) == 0))) {
                                 target_set_remove_target(set, t);
@@ -592,6 +875,7 @@ int service_entry_remove_target(struct service_entry *se,
         write_unlock(&se->lock);
 
         write_lock(&srvtable.lock);
+        atomic_inc(&srvtable.gen);
 
         if (list_empty(&se->target_set)) {
                 /* Removing the node also puts the service entry */
@@ -602,6 +886,8 @@ int service_entry_remove_target(struct service_entry *se,
         write_unlock(&srvtable.lock);
         local_bh_enable();
 
+        service_cache_put_stale();
+
         return ret;
 }
 
@@ -638,6 +924,7 @@ void __service_entry_free(struct service_entry *se)
                 target_set_free(set);
         }
 
+        service_entry_stats_reported(se);
         rwlock_destroy(&se->lock);
         kfree(se);
 }
@@ -798,6 +1085,8 @@ void service_iter_inc_stats(struct service_iter *iter,
                 if (iter->last_pos == NULL)
                         return;
 
+                service_entry_stats_changed(iter->entry);
+
                 dst = list_entry(iter->last_pos, struct target, lh);
 
                 atomic_add(packets, &dst->packets_resolved);
@@ -810,6 +1099,8 @@ void service_iter_inc_stats(struct service_iter *iter,
                 atomic_add(bytes, &srvtable.bytes_resolved);
 
         } else {
+                service_entry_stats_changed(iter->entry);
+
                 if (iter->last_pos != NULL) {
                         dst = list_entry(iter->last_pos, struct target, lh);
                         atomic_add(-packets, &dst->packets_dropped);
@@ -824,6 +1115,12 @@ void service_iter_inc_stats(struct service_iter *iter,
         }
 }
 
+struct target *service_iter_get_sock_target(struct service_iter *iter,
+                                            int protocol, u32 hash)
+{
+        return __service_entry_get_sock_target(iter->entry, protocol, hash);
+}
+
 int service_iter_get_priority(struct service_iter* iter) 
 {
         if (iter == NULL)
@@ -973,16 +1270,9 @@ void service_table_read_unlock(void)
         read_unlock_bh(&srvtable.lock);
 }
 
-int __service_table_print(char *buf, int buflen)
+static int service_table_print_header(char *buf, int buflen)
 {
-        int len = 0, tot_len = 0, find_size = 0;
-        char tmp_buf[200];
-
-        if (buflen < 0) {
-                find_size = 1;
-                buf = tmp_buf;
-                buflen = 200;
-        }
+        int len = 0, ret;
 
 #if defined(OS_USER)
         /* Adding this stuff prints garbage in the kernel */
@@ -995,34 +1285,159 @@ int __service_table_print(char *buf, int buflen)
                        atomic_read(&srvtable.bytes_dropped),
                        atomic_read(&srvtable.packets_dropped));
         
-        tot_len += len;
-        
-        /* If we are finding out the buffer size, only
-           increment tot_len, not len. */
-
-        if (find_size)
-                len = 0;
-        else
-                len = tot_len;
+        if (len >= buflen)
+                return len;
 #endif
-        len = snprintf(buf + len, buflen + len, 
+        ret = snprintf(buf + len, buflen - len, 
                        "%-64s %-4s %-4s %-5s %-6s %-6s %-8s %-7s %s\n", 
                        "prefix", "bits", "type", "flags", "prio", "weight", 
                        "resolved", "dropped", "target(s)");
         
-        tot_len += len;
-        
+        return len + ret;
+}
+
+int __service_table_print(char *buf, int buflen)
+{
+        int len = 0, find_size = 0;
+        char tmp_buf[256];
+
+        if (buflen < 0) {
+                find_size = 1;
+                buf = tmp_buf;
+                buflen = sizeof(tmp_buf);
+        }
+
+        len = service_table_print_header(buf, buflen);
+
         if (find_size)
-                len = 0;
-        else
-                len = tot_len;
+                return len + bst_print(&srvtable.tree, buf, -1);
+
+        if (len >= buflen)
+                return len;
+
+        return len + bst_print(&srvtable.tree, buf + len, buflen - len);
+}
+
+/*
+  Call func on up to max service entries following the cursor, while
+  holding the table lock, and advance the cursor past them. If func
+  returns an error, the walk stops without passing that entry. The
+  lock is not held between calls, so the table may change; entries
+  are visited in prefix order and none is visited twice. Returns the
+  number of entries visited, which is zero at the end of the table.
+ */
+int service_table_walk(struct service_table_cursor *c, unsigned int max,
+                       int (*func)(struct service_entry *se, void *arg),
+                       void *arg)
+{
+        struct bst_node *n;
+        unsigned int num = 0;
+
+        if (c->done)
+                return 0;
+
+        read_lock_bh(&srvtable.lock);
+
+        n = bst_find_next(&srvtable.tree, c->started ? &c->prefix : NULL,
+                          c->prefix_bits);
+
+        while (n && num < max) {
+                struct service_entry *se = get_service(n);
+
+                if (func(se, arg) < 0)
+                        break;
+
+                service_get_id(se, &c->prefix);
+                c->prefix_bits = bst_node_get_prefix_bits(n);
+                c->started = 1;
+                num++;
+                n = bst_node_next(n);
+        }
+
+        if (!n)
+                c->done = 1;
+
+        read_unlock_bh(&srvtable.lock);
+
+        return num;
+}
+
+struct print_chunk_arg {
+        char *buf;
+        int buflen;
+        int len;
+        int err;
+};
+
+static int service_entry_print_chunk(struct service_entry *se, void *arg)
+{
+        struct print_chunk_arg *pa = (struct print_chunk_arg *)arg;
+        int len = __service_entry_print(se->node, NULL, -1);
+        char *tmp;
+
+        if (pa->len + len < pa->buflen) {
+                pa->len += __service_entry_print(se->node, pa->buf + pa->len,
+                                                 pa->buflen - pa->len);
+                return 0;
+        }
+
+        /* Leave it to the next chunk */
+        if (pa->len > 0)
+                return -1;
+
+        /* The entry does not fit in an empty chunk, so print what
+         * fits */
+        tmp = kmalloc(len + 1, GFP_ATOMIC);
+
+        if (!tmp) {
+                pa->err = -ENOMEM;
+                return -1;
+        }
+
+        __service_entry_print(se->node, tmp, len + 1);
+        memcpy(pa->buf, tmp, pa->buflen - 1);
+        pa->buf[pa->buflen - 1] = '\0';
+        pa->len = pa->buflen - 1;
+        kfree(tmp);
+
+        /* Show that the entry was cut short */
+        if (pa->len >= 4)
+                memcpy(pa->buf + pa->len - 4, "...\n", 4);
+
+        return 0;
+}
+
+/*
+  Print the next part of the service table, starting with a header,
+  into buf. Only whole entries are printed, unless a single entry
+  does not fit, in which case it ends with "...". Returns the length
+  printed, which is zero when the whole table has been printed, or a
+  negative error.
+ */
+int service_table_print_chunk(struct service_table_cursor *c, 
+                              char *buf, int buflen)
+{
+        struct print_chunk_arg pa = { buf, buflen, 0, 0 };
         
-        len = bst_print(&srvtable.tree, buf + len, 
-                        find_size ? -1 : buflen - len);
+        if (c->done || buflen <= 0)
+                return 0;
 
-        tot_len += len;
+        if (!c->header_done) {
+                pa.len = service_table_print_header(buf, buflen);
+                
+                if (pa.len >= buflen)
+                        return -ENOBUFS;
 
-        return tot_len;
+                c->header_done = 1;
+        }
+
+        /* The number of entries per chunk is bounded by the buffer */
+        service_table_walk(c, -1U, service_entry_print_chunk, &pa);
+
+        if (pa.err < 0)
+                return pa.err;
+
+        return pa.len;
 }
 
 int service_table_print(char *buf, int buflen)
@@ -1127,7 +1542,8 @@ static struct service_entry *service_table_find(struct service_table *tbl,
 
 static struct sock* service_table_find_sock(struct service_table *tbl, 
                                             struct service_id *srvid,
-                                            int prefix, int protocol) 
+                                            int prefix, int protocol,
+                                            u32 hash) 
 {
         struct service_entry *se = NULL;
         struct sock *sk = NULL;
@@ -1141,9 +1557,7 @@ static struct sock* service_table_find_sock(struct service_table *tbl,
         
         if (se) {
                 struct target *t;
-                t = __service_entry_get_target(se, RULE_DEMUX, NULL, 0, 
-                                               make_target(NULL), 
-                                               NULL, protocol);
+                t = __service_entry_get_sock_target(se, protocol, hash);
                 
                 if (t) {
                         sk = t->out.sk;
@@ -1156,6 +1570,46 @@ static struct sock* service_table_find_sock(struct service_table *tbl,
         return sk;
 }
 
+static struct sock *service_table_find_sock_match(struct service_table *tbl,
+                                                  struct service_id *srvid,
+                                                  int prefix, int protocol,
+                                                  int (*match)(struct sock *,
+                                                               void *),
+                                                  void *arg)
+{
+        struct service_entry *se = NULL;
+        struct sock *sk = NULL;
+
+        if (!srvid)
+                return NULL;
+
+        read_lock_bh(&tbl->lock);
+
+        se = __service_table_find(tbl, srvid, prefix, RULE_MATCH_LOCAL);
+
+        if (se) {
+                struct target_set *set;
+                struct target *t;
+
+                list_for_each_entry(set, &se->target_set, lh) {
+                        list_for_each_entry(t, &set->list, lh) {
+                                if (t->type != RULE_DEMUX ||
+                                    t->out.sk->sk_protocol != protocol ||
+                                    !match(t->out.sk, arg))
+                                        continue;
+
+                                sk = t->out.sk;
+                                sock_hold(sk);
+                                goto out;
+                        }
+                }
+        }
+ out:
+        read_unlock_bh(&tbl->lock);
+
+        return sk;
+}
+
 static void service_table_get_stats(struct service_table *tbl, 
                                     struct table_stats *tstats) 
 {
@@ -1203,10 +1657,127 @@ struct service_entry *service_find_type(struct service_id *srvid, int prefix,
         return service_table_find(&srvtable, srvid, prefix, match);
 }
 
+static inline struct service_cache_slot *
+service_cache_slot(struct service_cache *sc, struct service_id *srvid)
+{
+        u32 h = 0;
+        unsigned int i;
+
+        for (i = 0; i < 8; i++)
+                h ^= srvid->srv_un.un_id32[i];
+
+        return &sc->slot[hash_32(h, SERVICE_CACHE_BITS)];
+}
+
+/*
+  Same as service_find() with the full prefix, but popular serviceIDs
+  resolve from the cache with a single probe.
+ */
+struct service_entry *service_find_cached(struct service_id *srvid)
+{
+        struct service_cache *sc;
+        struct service_cache_slot *slot;
+        struct service_entry *se;
+        unsigned int gen;
+
+        sc = service_cache_get();
+        slot = service_cache_slot(sc, srvid);
+
+        if (slot->se && 
+            slot->gen == (unsigned int)atomic_read(&srvtable.gen) &&
+            memcmp(&slot->srvid, srvid, sizeof(*srvid)) == 0) {
+                se = slot->se;
+                service_entry_hold(se);
+                sc->hits++;
+                service_cache_put(sc);
+                return se;
+        }
+
+        sc->misses++;
+
+        /* Do not keep a stale entry until the slot is refilled */
+        if (slot->se && 
+            slot->gen != (unsigned int)atomic_read(&srvtable.gen)) {
+                service_entry_put(slot->se);
+                slot->se = NULL;
+        }
+
+        /* The generation read under the lock belongs to the result */
+        read_lock(&srvtable.lock);
+        gen = atomic_read(&srvtable.gen);
+        se = __service_table_find(&srvtable, srvid, 
+                                  SERVICE_ID_MAX_PREFIX_BITS, 
+                                  RULE_MATCH_ANY);
+        if (se) {
+                /* One reference for the caller, one for the cache */
+                service_entry_hold(se);
+                service_entry_hold(se);
+        }
+        read_unlock(&srvtable.lock);
+
+        if (se) {
+                if (slot->se)
+                        service_entry_put(slot->se);
+                memcpy(&slot->srvid, srvid, sizeof(*srvid));
+                slot->se = se;
+                slot->gen = gen;
+        }
+
+        service_cache_put(sc);
+
+        return se;
+}
+
+static void service_cache_flush(struct service_cache *sc)
+{
+        unsigned int i;
+
+        for (i = 0; i < SERVICE_CACHE_SIZE; i++) {
+                if (sc->slot[i].se) {
+                        service_entry_put(sc->slot[i].se);
+                        sc->slot[i].se = NULL;
+                }
+        }
+}
+
+void service_cache_get_stats(unsigned int *hits, unsigned int *misses)
+{
+#if defined(OS_LINUX_KERNEL)
+        int cpu;
+
+        *hits = *misses = 0;
+
+        for_each_possible_cpu(cpu) {
+                *hits += per_cpu(srvcache, cpu).hits;
+                *misses += per_cpu(srvcache, cpu).misses;
+        }
+#else
+        *hits = srvcache.hits;
+        *misses = srvcache.misses;
+#endif
+}
+
 struct sock *service_find_sock(struct service_id *srvid, int prefix, 
                                int protocol) 
 {
-        return service_table_find_sock(&srvtable, srvid, prefix, protocol);
+        return service_table_find_sock(&srvtable, srvid, prefix, 
+                                       protocol, 0);
+}
+
+struct sock *service_find_sock_hash(struct service_id *srvid, int prefix, 
+                                    int protocol, u32 hash) 
+{
+        return service_table_find_sock(&srvtable, srvid, prefix, 
+                                       protocol, hash);
+}
+
+struct sock *service_find_sock_match(struct service_id *srvid, int prefix,
+                                     int protocol,
+                                     int (*match)(struct sock *, void *),
+                                     void *arg)
+{
+        return service_table_find_sock_match(&srvtable, srvid, prefix,
+                                             protocol, match, arg);
 }
 
 static int service_table_modify(struct service_table *tbl,
@@ -1310,6 +1881,7 @@ static int service_table_add(struct service_table *tbl,
                 prefix_bits = 0;
 
         write_lock_bh(&tbl->lock);
+        atomic_inc(&tbl->gen);
 
         n = bst_find_longest_prefix(&tbl->tree, srvid, prefix_bits);
 
@@ -1329,6 +1901,10 @@ static int service_table_add(struct service_table *tbl,
                                                          flags, priority, 
                                                          weight, dst, dstlen,
                                                          out, GFP_ATOMIC);
+                        /* Tell the caller whether it joined others */
+                        if (ret > 0)
+                                ret = __service_entry_num_targets(get_service(n),
+                                                                  type);
                 }
                 goto out;
         }
@@ -1398,6 +1974,240 @@ int service_add(struct service_id *srvid,
                                  out, alloc);
 }
 
+/*
+  Link one preallocated bulk entry into the table, which is write
+  locked. Consumed objects are cleared from the entry.
+ */
+static int __service_table_add_bulk_entry(struct service_table *tbl,
+                                          service_rule_type_t type,
+                                          struct service_bulk_entry *e,
+                                          struct bst_node_reserve *r)
+{
+        struct service_entry *se;
+        struct bst_node *n;
+        int ret;
+
+        n = bst_find_longest_prefix(&tbl->tree, &e->srvid, e->prefix_bits);
+
+        if (n && bst_node_get_prefix_bits(n) >= e->prefix_bits) {
+                se = get_service(n);
+
+                write_lock(&se->lock);
+
+                ret = __service_entry_has_target(se, type, e->flags,
+                                                 e->dst, e->dstlen, 
+                                                 e->out);
+                if (ret == 0) {
+                        ret = __service_entry_insert_target(se, e->flags,
+                                                            e->priority,
+                                                            e->t, &e->set,
+                                                            GFP_ATOMIC);
+                        if (ret > 0)
+                                e->t = NULL;
+                } else if (ret > 0) {
+                        ret = 0;
+                }
+                write_unlock(&se->lock);
+        } else {
+                se = e->se;
+                ret = __service_entry_insert_target(se, e->flags, 
+                                                    e->priority, e->t, 
+                                                    &e->set, GFP_ATOMIC);
+                if (ret < 0)
+                        return ret;
+
+                /* The target is now freed along with the entry */
+                e->t = NULL;
+
+                se->node = bst_insert_prefix_reserved(&tbl->tree, 
+                                                      &tbl->srv_ops,
+                                                      se, &e->srvid,
+                                                      e->prefix_bits, 
+                                                      r, GFP_ATOMIC);
+                if (!se->node)
+                        return -ENOMEM;
+
+                e->se = NULL;
+                tbl->services++;
+        }
+
+        if (ret > 0)
+                tbl->instances++;
+
+        return ret;
+}
+
+static int service_table_add_bulk(struct service_table *tbl,
+                                  service_rule_type_t type,
+                                  struct service_bulk_entry *entries,
+                                  unsigned int num,
+                                  gfp_t alloc)
+{
+        struct bst_node_reserve reserve;
+        unsigned int i, nodes = 0;
+        int added = 0;
+
+        if (type != RULE_FORWARD)
+                return -EINVAL;
+
+        /* Allocate everything that may be needed without holding
+         * the table lock. */
+        for (i = 0; i < num; i++) {
+                struct service_bulk_entry *e = &entries[i];
+
+                e->se = NULL;
+                e->set = NULL;
+                e->t = NULL;
+                e->result = 0;
+
+                if (e->dstlen == 0 || e->dst == NULL) {
+                        e->result = -EINVAL;
+                        continue;
+                }
+
+                if (memcmp(&e->srvid, &default_service, 
+                           sizeof(default_service)) == 0)
+                        e->prefix_bits = 0;
+
+                e->t = target_create(type, e->dst, e->dstlen, e->out, 
+                                     e->weight == 0 ? 1 : e->weight, alloc);
+                e->set = target_set_create(e->flags, e->priority, alloc);
+                e->se = service_entry_create(alloc);
+
+                if (!e->t || !e->set || !e->se)
+                        e->result = -ENOMEM;
+        }
+
+        /* Nodes are needed for the parts of the prefixes missing in
+           the tree. Entries sharing a new path are each counted, so
+           this overestimates rather than underestimates. */
+        read_lock_bh(&tbl->lock);
+
+        for (i = 0; i < num; i++) {
+                if (entries[i].result == 0)
+                        nodes += bst_nodes_needed(&tbl->tree, 
+                                                  &entries[i].srvid,
+                                                  entries[i].prefix_bits);
+        }
+
+        read_unlock_bh(&tbl->lock);
+
+        bst_node_reserve_init(&reserve, sizeof(struct service_id));
+        /* Inserts allocate atomically if this falls short */
+        bst_node_reserve_fill(&reserve, nodes, alloc);
+
+        write_lock_bh(&tbl->lock);
+        atomic_inc(&tbl->gen);
+
+        for (i = 0; i < num; i++) {
+                struct service_bulk_entry *e = &entries[i];
+
+                if (e->result == 0)
+                        e->result = __service_table_add_bulk_entry(tbl, type,
+                                                                   e, &reserve);
+        }
+
+        write_unlock_bh(&tbl->lock);
+
+        /* Free what was not used */
+        for (i = 0; i < num; i++) {
+                struct service_bulk_entry *e = &entries[i];
+
+                if (e->t)
+                        target_free(e->t);
+                if (e->set)
+                        target_set_free(e->set);
+                if (e->se)
+                        service_entry_free(e->se);
+                if (e->result > 0)
+                        added++;
+        }
+
+        bst_node_reserve_release(&reserve);
+
+        return added;
+}
+
+/*
+  Add a batch of targets while taking the table lock once. The new
+  entries, targets and tree nodes are allocated before locking, so
+  that lookups are only blocked while they are linked in. The result
+  of each entry is what service_add() would have returned for it.
+  Returns the number of targets added, or a negative error.
+ */
+int service_add_bulk(service_rule_type_t type,
+                     struct service_bulk_entry *entries,
+                     unsigned int num,
+                     gfp_t alloc)
+{
+        return service_table_add_bulk(&srvtable, type, entries, num, alloc);
+}
+
+static int service_table_del_bulk(struct service_table *tbl,
+                                  service_rule_type_t type,
+                                  struct service_bulk_entry *entries,
+                                  unsigned int num)
+{
+        unsigned int i;
+        int removed = 0;
+
+        write_lock_bh(&tbl->lock);
+        atomic_inc(&tbl->gen);
+
+        for (i = 0; i < num; i++) {
+                struct service_bulk_entry *e = &entries[i];
+                struct service_entry *se;
+                struct bst_node *n;
+                
+                memset(&e->stats, 0, sizeof(e->stats));
+                e->result = 0;
+
+                n = bst_find_longest_prefix(&tbl->tree, &e->srvid, 
+                                            e->prefix_bits);
+                
+                if (!n || bst_node_get_prefix_bits(n) != e->prefix_bits)
+                        continue;
+
+                se = get_service(n);
+
+                write_lock(&se->lock);
+                e->result = __service_entry_remove_target(se, type, e->dst,
+                                                          e->dstlen, 
+                                                          &e->stats);
+                write_unlock(&se->lock);
+
+                if (e->result > 0) {
+                        tbl->instances--;
+                        removed++;
+                }
+
+                if (list_empty(&se->target_set)) {
+                        /* Removing the node also puts the service entry */
+                        bst_node_remove(n);
+                        tbl->services--;
+                }
+        }
+
+        write_unlock_bh(&tbl->lock);
+
+        return removed;
+}
+
+/*
+  Remove a batch of targets while taking the table lock once. Entries
+  must match exactly. Returns the number of targets removed.
+ */
+int service_del_bulk(service_rule_type_t type,
+                     struct service_bulk_entry *entries,
+                     unsigned int num)
+{
+        int ret = service_table_del_bulk(&srvtable, type, entries, num);
+
+        service_cache_put_stale();
+
+        return ret;
+}
+
 static void service_table_del(struct service_table *tbl, 
                               struct service_id *srvid,
                               uint16_t prefix_bits) 
@@ -1405,6 +2215,7 @@ static void service_table_del(struct service_table *tbl,
         int ret;
 
         write_lock_bh(&tbl->lock);
+        atomic_inc(&tbl->gen);
         
         ret = bst_remove_prefix(&tbl->tree, srvid, prefix_bits);
         
@@ -1415,21 +2226,23 @@ static void service_table_del(struct service_table *tbl,
 
 void service_del(struct service_id *srvid, uint16_t prefix_bits) 
 {
-        return service_table_del(&srvtable, srvid, prefix_bits);
+        service_table_del(&srvtable, srvid, prefix_bits);
+        service_cache_put_stale();
 }
 
-static void service_table_del_target(struct service_table *tbl, 
-                                     struct service_id *srvid,
-                                     uint16_t prefix_bits,
-                                     service_rule_type_t type,
-                                     const void *dst, 
-                                     int dstlen, 
-                                     struct target_stats* stats) {
+static int service_table_del_target(struct service_table *tbl, 
+                                    struct service_id *srvid,
+                                    uint16_t prefix_bits,
+                                    service_rule_type_t type,
+                                    const void *dst, 
+                                    int dstlen, 
+                                    struct target_stats* stats) {
         struct bst_node *n;
-        int ret = 0;
+        int ret = 0, remain = 0;
 
         local_bh_disable();
         write_lock(&tbl->lock);
+        atomic_inc(&tbl->gen);
 
         n = bst_find_longest_prefix(&tbl->tree, srvid, prefix_bits);
 
@@ -1440,6 +2253,7 @@ static void service_table_del_target(struct service_table *tbl,
                 if (ret > 0) {
                         tbl->instances--;
                 }
+                remain = __service_entry_num_targets(get_service(n), type);
                 write_unlock(&get_service(n)->lock);
 
                 if (list_empty(&get_service(n)->target_set)) {
@@ -1451,16 +2265,22 @@ static void service_table_del_target(struct service_table *tbl,
 
         write_unlock(&tbl->lock);
         local_bh_enable();
+
+        return remain;
 }
 
-void service_del_target(struct service_id *srvid, 
-                        uint16_t prefix_bits, 
-                        service_rule_type_t type,
-                        const void *dst, int dstlen,
-                        struct target_stats* stats) 
+int service_del_target(struct service_id *srvid, 
+                       uint16_t prefix_bits, 
+                       service_rule_type_t type,
+                       const void *dst, int dstlen,
+                       struct target_stats* stats) 
 {
-        return service_table_del_target(&srvtable, srvid, prefix_bits, type,
-                                        dst, dstlen, stats);
+        int remain = service_table_del_target(&srvtable, srvid, prefix_bits,
+                                              type, dst, dstlen, stats);
+
+        service_cache_put_stale();
+
+        return remain;
 }
 
 static int del_dev_func(struct bst_node *n, void *arg) 
@@ -1499,6 +2319,7 @@ static int service_table_del_dev_all(struct service_table *tbl,
         int ret = 0;
         
         write_lock_bh(&tbl->lock);
+        atomic_inc(&tbl->gen);
         
         if (tbl->tree.root)
                 ret = bst_subtree_func(tbl->tree.root, del_dev_func, 
@@ -1510,7 +2331,11 @@ static int service_table_del_dev_all(struct service_table *tbl,
 
 int service_del_dev_all(const char *devname) 
 {
-        return service_table_del_dev_all(&srvtable, devname);
+        int ret = service_table_del_dev_all(&srvtable, devname);
+
+        service_cache_put_stale();
+
+        return ret;
 }
 
 static int del_target_func(struct bst_node *n, void *arg) 
@@ -1560,6 +2385,7 @@ static int service_table_del_target_all(struct service_table *tbl,
         } d = { type, dst, dstlen };
         
         write_lock_bh(&tbl->lock);
+        atomic_inc(&tbl->gen);
 
         if(tbl->tree.root)
                 ret = bst_subtree_func(tbl->tree.root, del_target_func, &d);
@@ -1572,7 +2398,11 @@ static int service_table_del_target_all(struct service_table *tbl,
 int service_del_target_all(service_rule_type_t type, 
                            const void *dst, int dstlen) 
 {
-        return service_table_del_target_all(&srvtable, type, dst, dstlen);
+        int ret = service_table_del_target_all(&srvtable, type, dst, dstlen);
+
+        service_cache_put_stale();
+
+        return ret;
 }
 
 void __service_table_destroy(struct service_table *tbl) 
@@ -1583,6 +2413,7 @@ void __service_table_destroy(struct service_table *tbl)
 void service_table_destroy(struct service_table *tbl) 
 {
         write_lock_bh(&tbl->lock);
+        atomic_inc(&tbl->gen);
         __service_table_destroy(tbl);
         write_unlock_bh(&tbl->lock);
 }
@@ -1600,17 +2431,36 @@ void service_table_init(struct service_table *tbl)
         atomic_set(&tbl->bytes_resolved, 0);
         atomic_set(&tbl->packets_dropped, 0);
         atomic_set(&tbl->bytes_dropped, 0);
+        atomic_set(&tbl->gen, 0);
+        atomic_set(&tbl->stats_dirty, 0);
         rwlock_init(&tbl->lock);
 }
 
 int __init service_init(void) 
 {
-        service_table_init(&srvtable);
+#if defined(OS_LINUX_KERNEL)
+        int cpu;
 
+        for_each_possible_cpu(cpu)
+                spin_lock_init(&per_cpu(srvcache, cpu).lock);
+#endif
+        service_table_init(&srvtable);
+#if defined(OS_USER)
+        spin_lock_init(&srvcache_lock);
+#endif
         return 0;
 }
 
 void __exit service_fini(void) 
 {
+#if defined(OS_LINUX_KERNEL)
+        int cpu;
+
+        for_each_possible_cpu(cpu)
+                service_cache_flush(&per_cpu(srvcache, cpu));
+#else
+        service_cache_flush(&srvcache);
+        spin_lock_destroy(&srvcache_lock);
+#endif
         service_table_destroy(&srvtable);
 }
@@ -8,6 +8,7 @@
 #include <serval/skbuff.h>
 #include <serval/dst.h>
 #include <serval/sock.h>
+#include <netinet/serval.h>
 #include "bst.h"
 
 #define LOCAL_SERVICE_DEFAULT_PRIORITY 32000
@@ -18,6 +19,16 @@
 
 struct service_id;
 
+/**
+   Counter values as of the last stats delta report.
+*/
+struct stats_mark {
+        uint32_t packets_resolved;
+        uint32_t bytes_resolved;
+        uint32_t packets_dropped;
+        uint32_t bytes_dropped;
+};
+
 /** 
     The service entry contains a list of sets of destinations.
     Each set contains destinations with the same priority.
@@ -30,6 +41,8 @@ struct service_entry {
         atomic_t bytes_resolved;
         atomic_t bytes_dropped;
         atomic_t packets_dropped;
+        struct stats_mark mark;
+        unsigned long stats_dirty; /* Changed since the mark was set */
         rwlock_t lock;
         atomic_t refcnt;
 };
@@ -123,11 +136,33 @@ struct target {
         atomic_t bytes_resolved;
         atomic_t bytes_dropped;
         atomic_t packets_dropped;
+        struct stats_mark mark;
         union target_out out;
         int dstlen;
         unsigned char dst[0]; /* Must be last */
 };
 
+/**
+   One entry of a bulk update of the service table. The fields after
+   out are set by the bulk functions.
+*/
+struct service_bulk_entry {
+        struct service_id srvid;
+        uint16_t prefix_bits;
+        uint16_t flags;
+        uint32_t priority;
+        uint32_t weight;
+        const void *dst;
+        int dstlen;
+        union target_out out;
+        int result;
+        struct target_stats stats; /* Of removed targets */
+        /* Preallocated for adds */
+        struct service_entry *se;
+        struct target_set *set;
+        struct target *t;
+};
+
 typedef enum rule_match {
         RULE_MATCH_LOCAL, /* Matches DEMUX rules */
         RULE_MATCH_GLOBAL, /* Mathes FORWARD rules */
@@ -181,6 +216,8 @@ void service_iter_destroy(struct service_iter *iter);
 struct target *service_iter_next(struct service_iter *iter);
 void service_iter_inc_stats(struct service_iter *iter, 
                             int packets, int bytes);
+struct target *service_iter_get_sock_target(struct service_iter *iter,
+                                            int protocol, u32 hash);
 int service_iter_get_priority(struct service_iter *iter);
 int service_iter_get_flags(struct service_iter *iter);
 
@@ -190,6 +227,8 @@ int service_entry_target_fill(struct service_entry *se, void *dst,
 int service_get_id(const struct service_entry *se, struct service_id *srvid);
 unsigned char service_get_prefix_bits(const struct service_entry *se);
 
+/* On success, returns the entry's number of targets of the type, or 0
+ * if the target was already there */
 int service_add(struct service_id *srvid, uint16_t prefix_bits,
                 service_rule_type_t type,
                 uint16_t flags, uint32_t priority, uint32_t weight,
@@ -203,12 +242,20 @@ int service_modify(struct service_id *srvid, uint16_t prefix_bits,
                    const void *new_dst, int new_dstlen,
                    const union target_out out);
 
+int service_add_bulk(service_rule_type_t type,
+                     struct service_bulk_entry *entries,
+                     unsigned int num, gfp_t alloc);
+int service_del_bulk(service_rule_type_t type,
+                     struct service_bulk_entry *entries,
+                     unsigned int num);
+
 void service_del(struct service_id *srvid, uint16_t prefix_bits);
-void service_del_target(struct service_id *srvid, 
-                        uint16_t prefix_bits,
-                        service_rule_type_t type,
-                        const void *dst, int dstlen, 
-                        struct target_stats *stats);
+/* Returns the number of targets of the type that remain */
+int service_del_target(struct service_id *srvid, 
+                       uint16_t prefix_bits,
+                       service_rule_type_t type,
+                       const void *dst, int dstlen, 
+                       struct target_stats *stats);
 
 int service_del_target_all(service_rule_type_t type, 
                            const void *dst, int dstlen);
@@ -232,13 +279,50 @@ inline struct service_entry *service_find_exact(struct service_id *srvid,
         return service_find_type(srvid, prefix, RULE_MATCH_EXACT);
 }
 
+struct service_entry *service_find_cached(struct service_id *srvid);
+void service_cache_get_stats(unsigned int *hits, unsigned int *misses);
+
 struct sock *service_find_sock(struct service_id *srvid, 
                                int prefix, int protocol);
+struct sock *service_find_sock_hash(struct service_id *srvid, 
+                                    int prefix, int protocol, u32 hash);
+struct sock *service_find_sock_match(struct service_id *srvid,
+                                     int prefix, int protocol,
+                                     int (*match)(struct sock *, void *),
+                                     void *arg);
 
 void service_entry_hold(struct service_entry *se);
 void service_entry_put(struct service_entry *se);
 int service_entry_print(struct service_entry *se, char *buf, int buflen);
 
+/**
+   Position in the service table, which stays valid while the table
+   changes, since it is a copy of the last visited prefix.
+*/
+struct service_table_cursor {
+        struct service_id prefix;
+        unsigned int prefix_bits;
+        unsigned char started;
+        unsigned char done;
+        unsigned char header_done;
+};
+
+static inline void service_table_cursor_init(struct service_table_cursor *c)
+{
+        memset(c, 0, sizeof(*c));
+}
+
+int service_table_walk(struct service_table_cursor *c, unsigned int max,
+                       int (*func)(struct service_entry *se, void *arg),
+                       void *arg);
+int service_table_print_chunk(struct service_table_cursor *c, 
+                              char *buf, int buflen);
+
+unsigned int service_table_stats_dirty(void);
+int service_entry_stats_dirty(struct service_entry *se);
+void service_entry_stats_reported(struct service_entry *se);
+void service_entry_stats_unreported(struct service_entry *se);
+
 void service_table_read_lock(void);
 void service_table_read_unlock(void);
 int __service_table_print(char *buf, int buflen);
@@ -35,6 +35,13 @@
 
 #include <serval/platform.h>
 #include <serval/checksum.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CSUM_X86 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CSUM_NEON 1
+#endif
 
 static inline unsigned short from32to16(unsigned int x)
 {
@@ -45,7 +52,14 @@ static inline unsigned short from32to16(unsigned int x)
 	return x;
 }
 
-static unsigned int do_csum(const unsigned char *buff, int len)
+static inline unsigned short from64to16(u64 x)
+{
+	x = (x & 0xffffffff) + (x >> 32);
+	x = (x & 0xffffffff) + (x >> 32);
+	return from32to16((unsigned int)x);
+}
+
+static unsigned int do_csum_generic(const unsigned char *buff, int len)
 {
 	int odd, count;
 	unsigned int result = 0;
@@ -102,6 +116,341 @@ out:
 	return result;
 }
 
+/*
+ * The kernels below sum the buffer as native 32-bit words into a
+ * 64-bit accumulator, which folds to the same ones' complement sum as
+ * 16-bit words do. Loads are unaligned, so, unlike do_csum_generic(),
+ * they need no fixup for odd addresses. A trailing partial word is
+ * zero padded.
+ */
+static inline u64 csum_words_scalar(const unsigned char *buff, size_t len)
+{
+	u64 s0 = 0, s1 = 0;
+	u32 w0, w1;
+
+	while (len >= 8) {
+		memcpy(&w0, buff, 4);
+		memcpy(&w1, buff + 4, 4);
+		s0 += w0;
+		s1 += w1;
+		buff += 8;
+		len -= 8;
+	}
+	if (len >= 4) {
+		memcpy(&w0, buff, 4);
+		s0 += w0;
+		buff += 4;
+		len -= 4;
+	}
+	if (len) {
+		w1 = 0;
+		memcpy(&w1, buff, len);
+		s1 += w1;
+	}
+	return s0 + s1;
+}
+
+static inline u64 csum_copy_words_scalar(const unsigned char *src,
+					 unsigned char *dst, size_t len)
+{
+	u64 sum = 0;
+	u32 w;
+
+	while (len >= 4) {
+		memcpy(&w, src, 4);
+		memcpy(dst, &w, 4);
+		sum += w;
+		src += 4;
+		dst += 4;
+		len -= 4;
+	}
+	if (len) {
+		w = 0;
+		memcpy(&w, src, len);
+		memcpy(dst, src, len);
+		sum += w;
+	}
+	return sum;
+}
+
+static u64 csum_words_generic(const unsigned char *buff, size_t len)
+{
+	return do_csum_generic(buff, len);
+}
+
+/* Two passes, as before the fused kernels */
+static u64 csum_copy_words_generic(const unsigned char *src,
+				   unsigned char *dst, size_t len)
+{
+	memcpy(dst, src, len);
+	return do_csum_generic(dst, len);
+}
+
+static u64 csum_words_scalar64(const unsigned char *buff, size_t len)
+{
+	return csum_words_scalar(buff, len);
+}
+
+static u64 csum_copy_words_scalar64(const unsigned char *src,
+				    unsigned char *dst, size_t len)
+{
+	return csum_copy_words_scalar(src, dst, len);
+}
+
+#if defined(CSUM_X86)
+/*
+ * The low and high halves of each 64-bit lane are added separately,
+ * so that the lanes cannot overflow for any realistic length.
+ */
+__attribute__((target("sse2")))
+static u64 csum_words_sse2(const unsigned char *buff, size_t len)
+{
+	const __m128i mask = _mm_set_epi32(0, -1, 0, -1);
+	__m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+	u64 lanes[2];
+
+	while (len >= 32) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)buff);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(buff + 16));
+		lo = _mm_add_epi64(lo, _mm_and_si128(v0, mask));
+		hi = _mm_add_epi64(hi, _mm_srli_epi64(v0, 32));
+		lo = _mm_add_epi64(lo, _mm_and_si128(v1, mask));
+		hi = _mm_add_epi64(hi, _mm_srli_epi64(v1, 32));
+		buff += 32;
+		len -= 32;
+	}
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(lo, hi));
+
+	return lanes[0] + lanes[1] + csum_words_scalar(buff, len);
+}
+
+__attribute__((target("sse2")))
+static u64 csum_copy_words_sse2(const unsigned char *src,
+				unsigned char *dst, size_t len)
+{
+	const __m128i mask = _mm_set_epi32(0, -1, 0, -1);
+	__m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+	u64 lanes[2];
+
+	while (len >= 32) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)src);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(src + 16));
+		_mm_storeu_si128((__m128i *)dst, v0);
+		_mm_storeu_si128((__m128i *)(dst + 16), v1);
+		lo = _mm_add_epi64(lo, _mm_and_si128(v0, mask));
+		hi = _mm_add_epi64(hi, _mm_srli_epi64(v0, 32));
+		lo = _mm_add_epi64(lo, _mm_and_si128(v1, mask));
+		hi = _mm_add_epi64(hi, _mm_srli_epi64(v1, 32));
+		src += 32;
+		dst += 32;
+		len -= 32;
+	}
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(lo, hi));
+
+	return lanes[0] + lanes[1] + csum_copy_words_scalar(src, dst, len);
+}
+
+__attribute__((target("avx2")))
+static inline u64 csum_avx2_lanes(__m256i v)
+{
+	u64 lanes[2];
+
+	_mm_storeu_si128((__m128i *)lanes,
+			 _mm_add_epi64(_mm256_castsi256_si128(v),
+				       _mm256_extracti128_si256(v, 1)));
+	return lanes[0] + lanes[1];
+}
+
+__attribute__((target("avx2")))
+static u64 csum_words_avx2(const unsigned char *buff, size_t len)
+{
+	const __m256i mask = _mm256_set1_epi64x(0xffffffff);
+	__m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+
+	while (len >= 64) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)buff);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(buff + 32));
+		lo = _mm256_add_epi64(lo, _mm256_and_si256(v0, mask));
+		hi = _mm256_add_epi64(hi, _mm256_srli_epi64(v0, 32));
+		lo = _mm256_add_epi64(lo, _mm256_and_si256(v1, mask));
+		hi = _mm256_add_epi64(hi, _mm256_srli_epi64(v1, 32));
+		buff += 64;
+		len -= 64;
+	}
+
+	return csum_avx2_lanes(_mm256_add_epi64(lo, hi)) + 
+		csum_words_scalar(buff, len);
+}
+
+__attribute__((target("avx2")))
+static u64 csum_copy_words_avx2(const unsigned char *src,
+				unsigned char *dst, size_t len)
+{
+	const __m256i mask = _mm256_set1_epi64x(0xffffffff);
+	__m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+
+	while (len >= 64) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)src);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+		_mm256_storeu_si256((__m256i *)dst, v0);
+		_mm256_storeu_si256((__m256i *)(dst + 32), v1);
+		lo = _mm256_add_epi64(lo, _mm256_and_si256(v0, mask));
+		hi = _mm256_add_epi64(hi, _mm256_srli_epi64(v0, 32));
+		lo = _mm256_add_epi64(lo, _mm256_and_si256(v1, mask));
+		hi = _mm256_add_epi64(hi, _mm256_srli_epi64(v1, 32));
+		src += 64;
+		dst += 64;
+		len -= 64;
+	}
+
+	return csum_avx2_lanes(_mm256_add_epi64(lo, hi)) + 
+		csum_copy_words_scalar(src, dst, len);
+}
+
+static int csum_have_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static int csum_have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif /* CSUM_X86 */
+
+#if defined(CSUM_NEON)
+/* vpadalq_u32 widens pairs of 32-bit words into the 64-bit lanes */
+static u64 csum_words_neon(const unsigned char *buff, size_t len)
+{
+	uint64x2_t s0 = vdupq_n_u64(0), s1 = vdupq_n_u64(0);
+
+	while (len >= 32) {
+		s0 = vpadalq_u32(s0, vreinterpretq_u32_u8(vld1q_u8(buff)));
+		s1 = vpadalq_u32(s1, vreinterpretq_u32_u8(vld1q_u8(buff + 16)));
+		buff += 32;
+		len -= 32;
+	}
+	s0 = vaddq_u64(s0, s1);
+
+	return vgetq_lane_u64(s0, 0) + vgetq_lane_u64(s0, 1) +
+		csum_words_scalar(buff, len);
+}
+
+static u64 csum_copy_words_neon(const unsigned char *src,
+				unsigned char *dst, size_t len)
+{
+	uint64x2_t s0 = vdupq_n_u64(0), s1 = vdupq_n_u64(0);
+
+	while (len >= 32) {
+		uint8x16_t v0 = vld1q_u8(src);
+		uint8x16_t v1 = vld1q_u8(src + 16);
+		vst1q_u8(dst, v0);
+		vst1q_u8(dst + 16, v1);
+		s0 = vpadalq_u32(s0, vreinterpretq_u32_u8(v0));
+		s1 = vpadalq_u32(s1, vreinterpretq_u32_u8(v1));
+		src += 32;
+		dst += 32;
+		len -= 32;
+	}
+	s0 = vaddq_u64(s0, s1);
+
+	return vgetq_lane_u64(s0, 0) + vgetq_lane_u64(s0, 1) +
+		csum_copy_words_scalar(src, dst, len);
+}
+#endif /* CSUM_NEON */
+
+struct csum_impl {
+	const char *name;
+	int (*supported)(void);
+	u64 (*words)(const unsigned char *buff, size_t len);
+	u64 (*copy_words)(const unsigned char *src, unsigned char *dst,
+			  size_t len);
+};
+
+/* In order of preference */
+static const struct csum_impl csum_impls[] = {
+#if defined(CSUM_X86)
+	{ "avx2", csum_have_avx2, csum_words_avx2, csum_copy_words_avx2 },
+	{ "sse2", csum_have_sse2, csum_words_sse2, csum_copy_words_sse2 },
+#endif
+#if defined(CSUM_NEON)
+	{ "neon", NULL, csum_words_neon, csum_copy_words_neon },
+#endif
+	{ "scalar64", NULL, csum_words_scalar64, csum_copy_words_scalar64 },
+	{ "generic", NULL, csum_words_generic, csum_copy_words_generic },
+	{ NULL, NULL, NULL, NULL }
+};
+
+static const struct csum_impl *csum_impl;
+
+/*
+ * Select the checksum implementation by name, or the fastest one
+ * the CPU supports if name is NULL. Returns -1 if the named one is
+ * unknown or unsupported.
+ */
+int csum_impl_select(const char *name)
+{
+	const struct csum_impl *impl;
+
+	for (impl = csum_impls; impl->name; impl++) {
+		if (name && strcmp(name, impl->name) != 0)
+			continue;
+		if (impl->supported && !impl->supported())
+			continue;
+		csum_impl = impl;
+		return 0;
+	}
+	return -1;
+}
+
+const char *csum_impl_name(void)
+{
+	if (!csum_impl)
+		csum_impl_select(NULL);
+	return csum_impl->name;
+}
+
+/* Below this, the indirect call costs more than the vectors save */
+#define CSUM_SMALL_LEN 64
+
+static inline const struct csum_impl *csum_get_impl(void)
+{
+	if (unlikely(!csum_impl))
+		csum_impl_select(NULL);
+	return csum_impl;
+}
+
+static unsigned int do_csum(const unsigned char *buff, int len)
+{
+	if (len <= 0)
+		return 0;
+	if (len < CSUM_SMALL_LEN)
+		return from64to16(csum_words_scalar(buff, len));
+	return from64to16(csum_get_impl()->words(buff, len));
+}
+
+static unsigned int do_csum_copy(const unsigned char *src,
+				 unsigned char *dst, int len)
+{
+	if (len <= 0)
+		return 0;
+	if (len < CSUM_SMALL_LEN)
+		return from64to16(csum_copy_words_scalar(src, dst, len));
+	return from64to16(csum_get_impl()->copy_words(src, dst, len));
+}
+
+/* add in old sum, and carry.. */
+static inline __wsum csum_add_result(unsigned int result, __wsum wsum)
+{
+	unsigned int sum = (__force unsigned int)wsum;
+
+	result += sum;
+	if (sum > result)
+		result += 1;
+	return (__force __wsum)result;
+}
 
 /*
  *	This is a version of ip_compute_csum() optimized for IP headers,
@@ -109,7 +458,7 @@ out:
  */
 __sum16 ip_fast_csum(const void *iph, unsigned int ihl)
 {
-	return (__force __sum16)~do_csum(iph, ihl*4);
+	return (__force __sum16)~from64to16(csum_words_scalar(iph, ihl*4));
 }
 
 /*
@@ -126,14 +475,7 @@ __sum16 ip_fast_csum(const void *iph, unsigned int ihl)
  */
 __wsum csum_partial(const void *buff, int len, __wsum wsum)
 {
-	unsigned int sum = (__force unsigned int)wsum;
-	unsigned int result = do_csum(buff, len);
-
-	/* add in old sum, and carry.. */
-	result += sum;
-	if (sum > result)
-		result += 1;
-	return (__force __wsum)result;
+	return csum_add_result(do_csum(buff, len), wsum);
 }
 
 /*
@@ -152,27 +494,19 @@ __wsum
 csum_partial_copy_from_user(const void *src, void *dst, int len,
 			    __wsum sum, int *csum_err)
 {
-        int missing = 0;
-        
-        memcpy(dst, src, len);
-  
-	if (missing) {
-		memset(dst + len - missing, 0, missing);
-		*csum_err = -EFAULT;
-	} else
-		*csum_err = 0;
+	*csum_err = 0;
 
-	return csum_partial(dst, len, sum);
+	return csum_partial_copy(src, dst, len, sum);
 }
 
 /*
- * copy from ds while checksumming, otherwise like csum_partial
+ * copy from ds while checksumming, otherwise like csum_partial. The
+ * data is summed as it is copied, in a single pass.
  */
 __wsum
 csum_partial_copy(const void *src, void *dst, int len, __wsum sum)
 {
-	memcpy(dst, src, len);
-	return csum_partial(dst, len, sum);
+	return csum_add_result(do_csum_copy(src, dst, len), sum);
 }
 #include <serval/debug.h>
 
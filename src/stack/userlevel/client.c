@@ -521,6 +521,7 @@ int client_handle_accept2_req_msg(struct client *c, struct client_msg *msg)
         struct client_msg_accept2_req *req = 
                 (struct client_msg_accept2_req *)msg;
         struct client_msg_accept2_rsp rsp;
+        struct flow_id flowid;
         struct sock *psk;
         int err, flags = 0;
 
@@ -529,9 +530,14 @@ int client_handle_accept2_req_msg(struct client *c, struct client_msg *msg)
 
         client_msg_hdr_init(&rsp.msghdr, MSG_ACCEPT2_RSP);
 
-        /* Find parent sock */
-        psk = serval_sock_lookup_service(&req->srvid, 
-                                         c->sock->sk->sk_protocol);
+        /* Find parent sock. Several may listen on the serviceID
+           (SVSF_REUSEPORT), so match the flowID it reported in
+           accept as well. */
+        memcpy(&flowid, &req->flowid, sizeof(flowid));
+
+        psk = serval_sock_lookup_listener(&req->srvid, 
+                                          c->sock->sk->sk_protocol,
+                                          &flowid);
 
         if (!psk) {
                 LOG_ERR("no parent sock\n");
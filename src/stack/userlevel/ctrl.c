@@ -11,7 +11,7 @@
 static int ctrl_sock = -1;
 struct sockaddr_un unaddr;
 
-#define RCV_BUFSIZE 2048
+#define RCV_BUFSIZE CTRLMSG_MAX_LEN
 static unsigned char rbuf[RCV_BUFSIZE];
 
 extern ctrlmsg_handler_t handlers[];
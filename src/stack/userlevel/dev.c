@@ -24,8 +24,11 @@
 #include "packet.h"
 #include <input.h>
 #include <service.h>
+#include <serval_tcp.h>
 
 #define NETDEV_HASHBITS    8
+/* Max packets received per wakeup of a device thread */
+#define DEV_RX_BATCH       64
 #define NETDEV_HASHENTRIES (1 << NETDEV_HASHBITS)
 
 DEFINE_RWLOCK(dev_base_lock);
@@ -729,6 +732,22 @@ int dev_xmit(struct net_device *dev)
         return n;
 }
 
+/*
+  Receive the packets that are ready, up to a batch limit. Device
+  reads do not block, so the batch ends when the device is drained
+  without polling before each packet. ACKs that sockets coalesce are
+  sent once the batch has been processed.
+ */
+static void dev_rx_batch(struct net_device *dev)
+{
+        unsigned int n = 0;
+
+        while (n++ < DEV_RX_BATCH && dev->pack_ops->recv(dev) == 0)
+                ;
+
+        serval_tcp_ack_batch_flush();
+}
+
 void *dev_thread(void *arg)
 {
         struct net_device *dev = (struct net_device *)arg;
@@ -778,7 +797,7 @@ void *dev_thread(void *arg)
                                 LOG_DBG("POLLHUP on pipe\n");
                         }
                         if (fds[0].revents & POLLIN) {
-                                ret = dev->pack_ops->recv(dev);
+                                dev_rx_batch(dev);
                         } else if (fds[0].revents & POLLHUP) {
                                 LOG_DBG("socket POLLHUP\n");
                         } else if (fds[0].revents & POLLERR) {
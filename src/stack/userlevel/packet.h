@@ -4,8 +4,16 @@
 
 #include <serval/netdevice.h>
 #include <serval/skbuff.h>
+#include <serval_sal.h>
 
-#define SKB_HEADROOM_RESERVE (20+14)
+/* Headroom reserved on receive, so that forwarding can grow the SAL
+   header and add a link header without reallocating */
+#define SKB_HEADROOM_RESERVE (LL_MAX_HEADER + SAL_FORWARD_EXT_GROWTH)
+/* Forwarded packets are a header followed by a shared payload */
+#define PACKET_IOV_MAX 4
+/* Returned by recv() when no packet is queued on the device. Reads
+   never block, so the device thread drains the fd until it sees this */
+#define PACKET_RECV_EMPTY 1
 
 struct packet_ops {
 	int (*init)(struct net_device *);
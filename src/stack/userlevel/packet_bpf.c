@@ -113,6 +113,15 @@ static int packet_bpf_init(struct net_device *dev)
                 goto fail_ioctl;
         }
 
+        /* Non-blocking reads let the device thread drain the buffer */
+        ret = ioctl(dev->fd, FIONBIO, &i);
+        
+        if (ret == -1) {
+                LOG_ERR("bpf FIONBIO ioctl: %s\n", 
+                        strerror(errno));
+                goto fail_ioctl;
+        }
+
         /*
         ret = ioctl(dev->fd, BIOCSRTIMEOUT, &to);
                    
@@ -170,6 +179,8 @@ static int packet_bpf_recv(struct net_device *dev)
         len = read(dev->fd, priv->buf, priv->buflen);
         
         if (len == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return PACKET_RECV_EMPTY;
                 LOG_ERR("read header: %s\n", 
                         strerror(errno));
                 return -1;
@@ -184,12 +195,15 @@ static int packet_bpf_recv(struct net_device *dev)
 		int ret;
                 unsigned long data_len = bh->bh_caplen + 20;
 
-                skb = alloc_skb(data_len, GFP_KERNEL);
+                skb = alloc_skb(SKB_HEADROOM_RESERVE + data_len, 
+                                GFP_KERNEL);
                 
                 if (!skb) {
                         LOG_ERR("could not allocate skb\n");
                         return -1;
                 }
+
+                skb_reserve(skb, SKB_HEADROOM_RESERVE);
                 
                 /* Copy frame */
                 memcpy(skb->data, (char *)bh + bh->bh_hdrlen, 
@@ -229,9 +243,18 @@ static int packet_bpf_recv(struct net_device *dev)
 
 static int packet_bpf_xmit(struct sk_buff *skb)
 {
-        int err = 0;
+        struct iovec iov[PACKET_IOV_MAX];
+        int n, err = 0;
+
+        n = skb_to_iovec(skb, iov, PACKET_IOV_MAX);
+
+        if (n == -1) {
+                LOG_ERR("Too many fragments in skb\n");
+                free_skb(skb);
+                return NET_XMIT_DROP;
+        }
 
-        err = write(skb->dev->fd, skb->data, skb->len);
+        err = writev(skb->dev->fd, iov, n);
 
         if (err == -1) {
                 LOG_ERR("write error: %s\n", strerror(errno));
@@ -11,7 +11,9 @@
 #include "packet.h"
 #include <input.h>
 
-#define RCVLEN 1500 /* Should be more than enough for normal MTUs */
+#define RCVLEN (1500 + SKB_HEADROOM_RESERVE) /* Should be more than
+                                              * enough for normal
+                                              * MTUs */
 #define get_priv(dev) ((struct packet_linux_priv *)dev_get_priv(dev))
 
 static int packet_linux_init(struct net_device *dev)
@@ -64,15 +66,22 @@ static int packet_linux_recv(struct net_device *dev)
 		return -1;
 	}
         
-	ret = recvfrom(dev->fd, skb->data, RCVLEN, 0,
+	skb_reserve(skb, SKB_HEADROOM_RESERVE);
+
+	ret = recvfrom(dev->fd, skb->data, skb_tailroom(skb), MSG_DONTWAIT,
 		       (struct sockaddr *)&lladdr, 
 		       &addrlen);
 	
 	if (ret == -1) {
-		LOG_ERR("recvfrom: %s\n", 
-			strerror(errno));
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			ret = PACKET_RECV_EMPTY;
+		} else {
+			LOG_ERR("recvfrom: %s\n", 
+				strerror(errno));
+			ret = -1;
+		}
 		free_skb(skb);
-		return -1;
+		return ret;
 	} else if (ret == 0) {
 		/* Should not happen */
 		free_skb(skb);
@@ -89,7 +98,7 @@ static int packet_linux_recv(struct net_device *dev)
 	case PACKET_OTHERHOST:
 	default:
 		free_skb(skb);
-		return -1;              
+		return 0;
 	}
 
         skb_put(skb, ret);
@@ -124,7 +133,9 @@ static int packet_linux_recv(struct net_device *dev)
 static int packet_linux_xmit(struct sk_buff *skb)
 {
 	struct sockaddr_ll lladdr;
-	int err;
+	struct iovec iov[PACKET_IOV_MAX];
+	struct msghdr msg;
+	int n, err;
 
 	if (!skb->dev) {
                 LOG_ERR("No device set in skb\n");
@@ -139,10 +150,21 @@ static int packet_linux_xmit(struct sk_buff *skb)
         
         LOG_DBG("sending message len=%u\n", skb->len);
 
-	err = sendto(skb->dev->fd, skb->data, 
-		     skb->len, 0, 
-		     (struct sockaddr *)&lladdr, 
-		     sizeof(lladdr));
+	n = skb_to_iovec(skb, iov, PACKET_IOV_MAX);
+
+	if (n == -1) {
+                LOG_ERR("Too many fragments in skb\n");
+		free_skb(skb);
+		return NET_XMIT_DROP;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &lladdr;
+	msg.msg_namelen = sizeof(lladdr);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+
+	err = sendmsg(skb->dev->fd, &msg, 0);
 	
 	if (err == -1) {
 		LOG_ERR("sendto error: %s\n", 
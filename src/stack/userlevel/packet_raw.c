@@ -99,16 +99,21 @@ static int packet_raw_recv(struct net_device *dev)
 		return -1;
 	}
 
-	/* skb_reserve(skb, SKB_HEADROOM_RESERVE); */
+	skb_reserve(skb, SKB_HEADROOM_RESERVE);
         
-	ret = recvfrom(dev->fd, skb->data, RCVLEN, 0, 
+	ret = recvfrom(dev->fd, skb->data, skb_tailroom(skb), MSG_DONTWAIT, 
                        (struct sockaddr *)&addr, &addrlen);
 	
 	if (ret == -1) {
-		LOG_ERR("recv: %s\n", 
-			strerror(errno));
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			ret = PACKET_RECV_EMPTY;
+		} else {
+			LOG_ERR("recv: %s\n", 
+				strerror(errno));
+			ret = -1;
+		}
 		__kfree_skb(skb);
-		return -1;
+		return ret;
 	} else if (ret == 0) {
 		/* Should not happen */
                 LOG_ERR("recv return 0\n");
@@ -147,14 +152,18 @@ static int packet_raw_recv(struct net_device *dev)
         skb->ip_summed = CHECKSUM_NONE;
 
 	/* Packet should be freed by upper layers */
-	return serval_ipv4_rcv(skb);
+	serval_ipv4_rcv(skb);
+
+	return 0;
 }
 
 static int packet_raw_xmit(struct sk_buff *skb)
 {
 	struct iphdr *iph = ip_hdr(skb);
 	struct sockaddr_in addr;
-	int err;
+	struct iovec iov[PACKET_IOV_MAX];
+	struct msghdr msg;
+	int n, err;
 
 	memset(&addr, 0, sizeof(addr));
         addr.sin_family = AF_INET;
@@ -175,8 +184,21 @@ static int packet_raw_xmit(struct sk_buff *skb)
                                   buf, 18));
         }
 #endif
-	err = sendto(skb->dev->fd, skb->data, skb->len, 0, 
-		     (struct sockaddr *)&addr, sizeof(addr));
+	n = skb_to_iovec(skb, iov, PACKET_IOV_MAX);
+
+	if (n == -1) {
+                LOG_ERR("Too many fragments in skb\n");
+		kfree_skb(skb);
+		return NET_XMIT_DROP;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+
+	err = sendmsg(skb->dev->fd, &msg, 0);
 
 	if (err == -1) {
 		LOG_ERR("send error: %s\n", 
@@ -33,6 +33,7 @@
 #include <serval/netdevice.h>
 #include <serval/timer.h>
 #include <af_serval.h>
+#include <serval_syncookies.h>
 #include <userlevel/client.h>
 #include <ctrl.h>
 
@@ -510,7 +511,9 @@ static void print_usage()
                "-u, --udp-encap                   - Enable UDP encapsulation.\n"
                "-d, --daemon                      - Run in the background as a daemon.\n"
                "-l, --debug-level LEVEL           - Set the level of debug output.\n"
-               "-s, --sal-forward                 - Enable SAL forwarding.\n");
+               "-s, --sal-forward                 - Enable SAL forwarding.\n"
+               "-c, --syncookies MODE             - SYN cookies: 0 off, 1 on backlog\n"
+               "                                    overflow (default), 2 always.\n");
 }
 
 int main(int argc, char **argv)
@@ -564,6 +567,7 @@ int main(int argc, char **argv)
         
         /* Init configuration parameters */
         memset(&net_serval, 0, sizeof(net_serval));
+        net_serval.sysctl_sal_syncookies = SAL_SYNCOOKIES_ON_OVERFLOW;
         
 	argc--;
 	argv++;
@@ -588,6 +592,21 @@ int main(int argc, char **argv)
                 } else if (strcmp(argv[0], "-u") == 0 ||
                            strcmp(argv[0], "--udp-encap") == 0) {
                         net_serval.sysctl_udp_encap = 1;
+                } else if (argc > 1 && (strcmp(argv[0], "-c") == 0 ||
+                                        strcmp(argv[0], "--syncookies") == 0)) {
+                        char *p = NULL;
+                        unsigned int mode = strtoul(argv[1], &p, 10);
+
+                        if (*argv[1] == '\0' || *p != '\0' ||
+                            mode > SAL_SYNCOOKIES_ALWAYS) {
+                                fprintf(stderr, "Invalid SYN cookie mode %s\n",
+                                        argv[1]);
+                                print_usage();
+                                return -1;
+                        }
+                        net_serval.sysctl_sal_syncookies = mode;
+                        argv++;
+                        argc--;
                 } else if (strcmp(argv[0], "-d") == 0 ||
                            strcmp(argv[0], "--daemon") == 0) {
                         daemon = 1;
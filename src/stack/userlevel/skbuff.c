@@ -20,11 +20,26 @@ static void skb_release_head_state(struct sk_buff *skb)
 	}
 }
 
+static void skb_drop_fraglist(struct sk_buff *skb)
+{
+	struct sk_buff *list = skb_shinfo(skb)->frag_list;
+
+	skb_shinfo(skb)->frag_list = NULL;
+
+	while (list) {
+		struct sk_buff *next = list->next;
+		kfree_skb(list);
+		list = next;
+	}
+}
+
 static void skb_release_data(struct sk_buff *skb)
 {
 	if (!skb->cloned ||
 	    !atomic_sub_return(skb->nohdr ? (1 << SKB_DATAREF_SHIFT) + 1 : 1,
 			       &skb_shinfo(skb)->dataref)) {
+		if (skb_has_frag_list(skb))
+			skb_drop_fraglist(skb);
 		free(skb->head);
 	}
 }
@@ -47,6 +62,32 @@ void __kfree_skb(struct sk_buff *skb)
         atomic_inc(&num_skb_free);
 }
 
+/*
+  Describe the data of skb, followed by that of any buffers on its
+  frag_list, in iov. Returns the number of entries used, or -1 if
+  max is too small.
+ */
+int skb_to_iovec(const struct sk_buff *skb, struct iovec *iov, int max)
+{
+	const struct sk_buff *frag;
+	int n = 0;
+
+	if (max < 1)
+		return -1;
+
+	iov[n].iov_base = skb->data;
+	iov[n++].iov_len = skb_headlen(skb);
+
+	skb_walk_frags(skb, frag) {
+		if (n == max)
+			return -1;
+		iov[n].iov_base = frag->data;
+		iov[n++].iov_len = frag->len;
+	}
+
+	return n;
+}
+
 void kfree_skb(struct sk_buff *skb)
 {
 	if (likely(!atomic_dec_and_test(&skb->users))) {
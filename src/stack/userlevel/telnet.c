@@ -7,6 +7,7 @@
 #include <pthread.h>
 #include <service.h>
 #include <serval_sock.h>
+#include <serval_sal.h>
 
 #define TELNET_ADDR "127.0.0.1"
 #define TELNET_PORT 9999
@@ -32,16 +33,26 @@ static void telnet_client_destroy(struct telnet_client *tc);
 
 static void cmd_services_print(struct telnet_client *tc, char *buf, int buflen)
 {
+	struct service_table_cursor cursor;
 	int ret;
 
 	ret = sprintf(buf, "# Service table:\n");
 
-	ret += service_table_print(buf + ret, buflen - ret);
-		
-	if (ret < 0)
-		return;
+	send(tc->sock, buf, ret, 0);
 
-	send(tc->sock, buf, ret, 0);	
+	service_table_cursor_init(&cursor);
+
+	/* Send chunk by chunk, to not hold the table locked for the
+	 * whole table */
+	while ((ret = service_table_print_chunk(&cursor, buf, buflen)) > 0) {
+		if (send(tc->sock, buf, ret, 0) == -1)
+			break;
+	}
+
+	if (ret < 0) {
+		LOG_ERR("could not print service table: %s\n", 
+			KERN_STRERROR(ret));
+	}
 }
 
 
@@ -59,6 +70,17 @@ static void cmd_flows_print(struct telnet_client *tc, char *buf, int buflen)
 	send(tc->sock, buf, ret, 0);	
 }
 
+static void cmd_stats_print(struct telnet_client *tc, char *buf, int buflen)
+{
+	int ret;
+	
+	ret = sprintf(buf, "# SAL statistics:\n");
+
+	ret += serval_sal_stats_print(buf + ret, buflen - ret);
+
+	send(tc->sock, buf, ret, 0);	
+}
+
 static void cmd_quit(struct telnet_client *tc, char *buf, int buflen)
 {
 	telnet_client_destroy(tc);
@@ -72,6 +94,7 @@ static struct command command_list[] = {
 	{ "exit", "e", "quit telnet session", cmd_quit },
 	{ "flows", "f", "print neighbor table", cmd_flows_print },
 	{ "services", "s", "print service table", cmd_services_print },
+	{ "stats", "t", "print SAL statistics", cmd_stats_print },
 	{ NULL, NULL, NULL, NULL }
 };
 
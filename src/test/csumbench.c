@@ -0,0 +1,128 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+/*
+ * Microbenchmark of the user-level stack's checksum implementations.
+ * Each one is checked against the generic code before it is timed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <serval/platform.h>
+#include <serval/checksum.h>
+
+static const char *impls[] = {
+        "generic", "scalar64", "sse2", "avx2", "neon", NULL
+};
+
+static const int sizes[] = { 20, 64, 576, 1500, 9000, 65536, 0 };
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *progname)
+{
+        printf("Usage: %s [MBYTES]\n", progname);
+}
+
+/* Compare with the generic code at all lengths and alignments */
+static int verify(const char *name, unsigned char *buf, unsigned char *dst)
+{
+        int len, off;
+
+        for (len = 0; len < 512; len++) {
+                for (off = 0; off < 8; off++) {
+                        __wsum ref, sum, csum;
+
+                        csum_impl_select("generic");
+                        ref = csum_partial(buf + off, len, 0);
+                        csum_impl_select(name);
+                        sum = csum_partial(buf + off, len, 0);
+                        csum = csum_partial_copy(buf + off, dst + 1,
+                                                 len, 0);
+
+                        if (csum_fold(sum) != csum_fold(ref) ||
+                            csum_fold(csum) != csum_fold(ref) ||
+                            memcmp(buf + off, dst + 1, len) != 0) {
+                                fprintf(stderr, "%s: mismatch len=%d "
+                                        "off=%d\n", name, len, off);
+                                return -1;
+                        }
+                }
+        }
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        unsigned char *buf, *dst;
+        unsigned long mbytes = 256;
+        int i, j;
+
+        if (argc > 1) {
+                char *ptr;
+
+                mbytes = strtoul(argv[1], &ptr, 10);
+
+                if (*ptr != '\0' || mbytes == 0) {
+                        usage(argv[0]);
+                        return 0;
+                }
+        }
+
+        buf = malloc(65536 + 8);
+        dst = malloc(65536 + 8);
+
+        if (!buf || !dst)
+                return -1;
+
+        srandom(time(NULL));
+
+        for (i = 0; i < 65536 + 8; i++)
+                buf[i] = random();
+
+        printf("default implementation: %s\n", csum_impl_name());
+        printf("%-10s %6s %14s %14s\n", "impl", "bytes",
+               "csum MB/s", "copy+csum MB/s");
+
+        for (i = 0; impls[i]; i++) {
+                if (csum_impl_select(impls[i]) == -1)
+                        continue;
+
+                if (verify(impls[i], buf, dst) == -1)
+                        return -1;
+
+                for (j = 0; sizes[j]; j++) {
+                        unsigned long n, iters =
+                                (mbytes << 20) / sizes[j];
+                        volatile __wsum sink = 0;
+                        double t, t_csum, t_copy;
+
+                        csum_impl_select(impls[i]);
+
+                        t = now();
+                        for (n = 0; n < iters; n++)
+                                sink += csum_partial(buf, sizes[j], 0);
+                        t_csum = now() - t;
+
+                        t = now();
+                        for (n = 0; n < iters; n++)
+                                sink += csum_partial_copy(buf, dst,
+                                                          sizes[j], 0);
+                        t_copy = now() - t;
+
+                        printf("%-10s %6d %14.0f %14.0f\n", impls[i],
+                               sizes[j], mbytes / t_csum, mbytes / t_copy);
+                }
+        }
+
+        free(buf);
+        free(dst);
+
+        return 0;
+}
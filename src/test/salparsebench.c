@@ -0,0 +1,164 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+/*
+ * Microbenchmark of the SAL header parser. Each header layout is
+ * parsed by both the inline parser and the generic one, which must
+ * agree before they are timed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <serval/platform.h>
+#include <serval_sal_parse.h>
+
+/* The parser logs only in debug builds */
+void logme(log_level_t level, const char *func, const char *format, ...)
+{
+}
+
+/* Keep the compiler from hoisting the parse out of the loop */
+#define clobber() asm volatile("" : : : "memory")
+
+struct layout {
+        const char *name;
+        int types[3];
+};
+
+static const struct layout layouts[] = {
+        { "data", { 0 } },
+        { "connection", { SERVAL_CONNECTION_EXT, 0 } },
+        { "control", { SERVAL_CONTROL_EXT, 0 } },
+        { "service", { SERVAL_SERVICE_EXT, 0 } },
+        { "ctrl+source", { SERVAL_CONTROL_EXT, SERVAL_SOURCE_EXT, 0 } },
+        { NULL, { 0 } }
+};
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *progname)
+{
+        printf("Usage: %s [MILLIONS]\n", progname);
+}
+
+static int build_hdr(const struct layout *l, unsigned char *buf)
+{
+        struct serval_hdr *sh = (struct serval_hdr *)buf;
+        int i, len = sizeof(*sh);
+
+        memset(buf, 0, 256);
+        sh->ack = 1;
+
+        for (i = 0; l->types[i]; i++) {
+                struct serval_ext *ext = (struct serval_ext *)(buf + len);
+                int ext_len = min_ext_length[l->types[i]];
+
+                if (l->types[i] == SERVAL_SOURCE_EXT)
+                        ext_len += 2 * 4;
+
+                ext->type = l->types[i];
+                ext->length = ext_len;
+
+                if (l->types[i] == SERVAL_CONTROL_EXT) {
+                        struct serval_control_ext *ctrl =
+                                (struct serval_control_ext *)ext;
+                        ctrl->seqno = htonl(1000 + i);
+                        ctrl->ackno = htonl(2000 + i);
+                }
+                len += ext_len;
+        }
+
+        sh->length = htons(len);
+
+        return len;
+}
+
+/* Compare the fields that the inline parser fills in */
+static int verify(const char *name, struct serval_hdr *sh)
+{
+        struct serval_context fast, slow;
+        int ret_fast, ret_slow;
+
+        ret_fast = serval_sal_parse(sh, &fast, SERVAL_PARSE_ALL);
+        ret_slow = serval_sal_parse_slow(sh, &slow, SERVAL_PARSE_ALL);
+
+        if (ret_fast != ret_slow || ret_fast != 0 ||
+            fast.hdr != slow.hdr ||
+            fast.length != slow.length ||
+            fast.flags != slow.flags ||
+            fast.seqno != slow.seqno ||
+            fast.ackno != slow.ackno ||
+            fast.ctrl_ext != slow.ctrl_ext ||
+            fast.conn_ext != slow.conn_ext ||
+            fast.desc_ext != slow.desc_ext ||
+            fast.srv_ext != slow.srv_ext ||
+            fast.src_ext != slow.src_ext ||
+            fast.mig_ext != slow.mig_ext) {
+                fprintf(stderr, "%s: parsers disagree\n", name);
+                return -1;
+        }
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        unsigned char buf[256];
+        unsigned long n, iters = 50;
+        struct serval_context ctx;
+        int i;
+
+        if (argc > 1) {
+                char *ptr;
+
+                iters = strtoul(argv[1], &ptr, 10);
+
+                if (*ptr != '\0' || iters == 0) {
+                        usage(argv[0]);
+                        return 0;
+                }
+        }
+
+        iters *= 1000000;
+
+        printf("%-12s %6s %12s %12s\n", "layout", "bytes",
+               "inline ns", "generic ns");
+
+        for (i = 0; layouts[i].name; i++) {
+                struct serval_hdr *sh = (struct serval_hdr *)buf;
+                volatile unsigned int sink = 0;
+                double t, t_fast, t_slow;
+                int len;
+
+                len = build_hdr(&layouts[i], buf);
+
+                if (verify(layouts[i].name, sh) == -1)
+                        return -1;
+
+                t = now();
+                for (n = 0; n < iters; n++) {
+                        serval_sal_parse(sh, &ctx, SERVAL_PARSE_ALL);
+                        sink += ctx.seqno;
+                        clobber();
+                }
+                t_fast = now() - t;
+
+                t = now();
+                for (n = 0; n < iters; n++) {
+                        serval_sal_parse_slow(sh, &ctx, SERVAL_PARSE_ALL);
+                        sink += ctx.seqno;
+                        clobber();
+                }
+                t_slow = now() - t;
+
+                printf("%-12s %6d %12.2f %12.2f\n", layouts[i].name, len,
+                       t_fast * 1e9 / iters, t_slow * 1e9 / iters);
+        }
+
+        return 0;
+}
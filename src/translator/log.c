@@ -66,27 +66,35 @@ ssize_t log_write(struct log_handle *lh, const char *fmt, ...)
 	return len;
 }
 
+/*
+  Write a time stamped line. Safe to call from several threads, since
+  the line is written while holding the stream lock.
+ */
 ssize_t log_write_line(struct log_handle *lh, const char *fmt, ...)
 {
 	va_list ap;
 	time_t tm;
 	int len, ret;
-	char *ct;
+	char ct[26];
 	
 	if (!log_is_open(lh))
 		return -1;
 	
 	time(&tm);
 
-	ct = ctime(&tm);
+	ctime_r(&tm, ct);
 	
 	/* Remove end of line */
 	ct[strlen(ct) - 1] = '\0';
 
+	flockfile(lh->f);
+
 	ret = fprintf(lh->f, "[%s] ", ct);
 
-	if (ret == -1) 
-		return -1;
+	if (ret == -1) {
+		len = -1;
+		goto out;
+	}
 	
 	len = ret;
 
@@ -97,12 +105,14 @@ ssize_t log_write_line(struct log_handle *lh, const char *fmt, ...)
 	va_end(ap);
 
 	if (ret == -1)
-		return len;
+		goto out;
 
 	len += ret;
 	
 	if (fputc('\n', lh->f) != EOF)
 		len++;
+out:
+	funlockfile(lh->f);
 	
 	return len;
 }
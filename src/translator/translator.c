@@ -26,14 +26,15 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
-#include <netdb.h>
 #include <common/signal.h>
 #include <common/list.h>
+#include <common/atomic.h>
 #define ENABLE_DEBUG 1
 #include <common/debug.h>
 #include <poll.h>
-#include <pthread.h>
+#include <sys/epoll.h>
 #include <linux/netfilter_ipv4.h>
 #include "log.h"
 
@@ -41,7 +42,8 @@
 #include "splice.h"
 #endif
 
-static unsigned int client_num = 0;
+/* Workers create clients concurrently */
+static atomic_t client_num = ATOMIC_INIT(0);
 
 typedef union sockaddr_generic {
         struct sockaddr sa;
@@ -49,31 +51,99 @@ typedef union sockaddr_generic {
         struct sockaddr_in in;
 } sockaddr_generic_t;
 
+enum client_state {
+        CLIENT_RECV_INIT, /* Waiting for translator_init_pkt */
+        CLIENT_CONNECTING,
+        CLIENT_FORWARDING,
+        CLIENT_POOL_CONNECTING, /* Pooled Serval connection, see below */
+        CLIENT_POOLED,
+        CLIENT_CLOSED,
+};
+
+struct client;
+
+/* Registered with epoll, so that events can be mapped back to the
+ * client and the socket they occurred on. */
+struct client_sock {
+        struct client *c;
+        int fd;
+};
+
+/* One direction of a connection, with its own splice pipe so that
+ * both directions can make progress independently. */
+struct pipe_flow {
+        int pipefd[2];
+        size_t in_pipe;
+        size_t tot_bytes;
+        unsigned char eof;
+        unsigned char shut;
+};
+
+struct translator_init_pkt {
+        struct in_addr addr;
+        uint16_t port;
+} __attribute__((packed));
+
+struct worker;
+
 struct client {
         int from_family;
         unsigned int id;
         sockaddr_generic_t addr;
         socklen_t addrlen;
-        pthread_t thr;
-        int inet_sock;
-        int serval_sock;
+        enum client_state state;
+        struct worker *w;
         int translator_port;
-        int splicefd[2];
-        unsigned char is_garbage;
+        struct client_sock inet;
+        struct client_sock serval;
+        struct pipe_flow inet_to_serval;
+        struct pipe_flow serval_to_inet;
+        unsigned char should_send_init_pkt;
+        struct translator_init_pkt tip;
+        size_t tip_len; /* Bytes of tip sent or received */
         struct list_head lh;
-        struct signal exit_signal;
 };
 
-struct translator_init_pkt {
-        struct in_addr addr;
-        uint16_t port;
-} __attribute__((packed));
+/* 
+   A worker owns the clients handed to it by the acceptor. All client
+   state is touched only from the worker's own thread; the acceptor
+   passes new clients through the pending queue.
+
+   When sharded, a worker instead accepts clients on its own
+   SO_REUSEPORT listener and shares no state with other workers.
+
+   A worker may also keep a pool of established Serval connections to
+   the translated service, each held by an otherwise empty client, so
+   that new AF_INET clients need not wait for the SAL handshake.
+*/
+struct worker {
+        unsigned int id;
+        pthread_t thr;
+        int epfd;
+        unsigned short port;
+        struct client_sock listen; /* Only used when sharded */
+        struct signal wakeup;
+        pthread_mutex_t lock; /* Protects the pending queue */
+        struct list_head pending;
+        struct list_head client_list;
+        struct list_head pool;
+        unsigned int pool_count;
+};
 
 #define DEFAULT_TRANSLATOR_PORT 8080
+#define MAX_EVENTS 64
 static LOG_DEFINE(logh);
 struct signal exit_signal;
-static LIST_HEAD(client_list);
 int cross_translate = 0;
+/* Number of epoll workers, zero means one per online CPU */
+unsigned int num_workers = 0;
+/* Let each worker accept on its own SO_REUSEPORT listener */
+int shard_listeners = 0;
+/* Pin each worker to a CPU */
+int pin_workers = 0;
+/* Pre-established Serval connections to keep per worker */
+unsigned int pool_size = 0;
+static struct worker *workers = NULL;
 
 static const char *family_to_str(int family)
 {
@@ -92,60 +162,112 @@ static const char *family_to_str(int family)
         return unknown;
 }
 
-static ssize_t forward_data(int from, int to, int splicefd[2])
+static int set_nonblocking(int fd)
 {
-        ssize_t rlen, wlen = 0;
+        int flags = fcntl(fd, F_GETFL, 0);
 
-         rlen = splice(from, NULL, splicefd[1], NULL, 
-                       INT_MAX, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
-        
-        if (rlen == -1) {
-                LOG_ERR("splice1: %s\n",
-                        strerror(errno));
-                return rlen;
-        } else if (rlen == 0) {
-                LOG_DBG("splice1: other end closed\n");
-        }
-        
-        /* printf("splice1 %zd bytes\n", rlen); */
-        
-        while (rlen) {
-                ssize_t w = splice(splicefd[0], NULL, to, NULL,
-                                   rlen, SPLICE_F_MOVE);
-                
-                if (w == -1) {
-                        if (errno == EPIPE) {
-                                LOG_DBG("splice2: other end closed\n");
-                        } else {
-                                LOG_ERR("splice2: %s\n",
-                                        strerror(errno));
+        if (flags == -1)
+                return -1;
+
+        return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+  Move as much data as possible from one socket to the other through
+  the direction's pipe, without copying it to user space. Since
+  sockets are registered edge-triggered, we keep going until either
+  end would block.
+
+  Returns -1 on error and 0 otherwise.
+ */
+static int forward_data(struct pipe_flow *f, int from, int to)
+{
+        while (1) {
+                ssize_t rlen;
+
+                while (f->in_pipe > 0) {
+                        ssize_t w = splice(f->pipefd[0], NULL, to, NULL,
+                                           f->in_pipe, 
+                                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                        
+                        if (w == -1) {
+                                if (errno == EAGAIN)
+                                        return 0;
+                                if (errno == EPIPE) {
+                                        LOG_DBG("splice2: other end closed\n");
+                                } else {
+                                        LOG_ERR("splice2: %s\n",
+                                                strerror(errno));
+                                }
+                                return -1;
                         }
-                        break;
+                        f->in_pipe -= w;
+                        f->tot_bytes += w;
+                }
+
+                if (f->eof) {
+                        if (!f->shut) {
+                                shutdown(to, SHUT_WR);
+                                f->shut = 1;
+                        }
+                        return 0;
+                }
+
+                rlen = splice(from, NULL, f->pipefd[1], NULL, 
+                              INT_MAX, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                
+                if (rlen == -1) {
+                        if (errno == EAGAIN)
+                                return 0;
+                        LOG_ERR("splice1: %s\n",
+                                strerror(errno));
+                        return -1;
+                } else if (rlen == 0) {
+                        LOG_DBG("splice1: other end closed\n");
+                        f->eof = 1;
                 }
-                wlen += w;
-                rlen -= w;
+                f->in_pipe += rlen;
         }
-        
-        /* printf("splice2 %zd bytes\n", wlen); */
-        
-        return wlen;
+        return 0;
+}
+
+static int pipe_flow_init(struct pipe_flow *f)
+{
+        memset(f, 0, sizeof(*f));
+
+        if (pipe(f->pipefd) == -1) {
+                LOG_ERR("pipe: %s\n",
+			strerror(errno));
+                return -1;
+        }
+        return 0;
 }
 
-static ssize_t inet_to_serval(struct client *c)
+static void pipe_flow_destroy(struct pipe_flow *f)
 {
-        return forward_data(c->inet_sock, c->serval_sock, c->splicefd);
+        close(f->pipefd[0]);
+        close(f->pipefd[1]);
 }
 
-static ssize_t serval_to_inet(struct client *c)
+static int client_add_sock(struct client *c, struct client_sock *cs)
 {
-        return forward_data(c->serval_sock, c->inet_sock, c->splicefd);
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = cs;
+        
+        if (epoll_ctl(c->w->epfd, EPOLL_CTL_ADD, cs->fd, &ev) == -1) {
+                LOG_ERR("client %u epoll_ctl: %s\n",
+                        c->id, strerror(errno));
+                return -1;
+        }
+        return 0;
 }
 
-struct client *client_create(int sock, struct sockaddr *sa, 
-                             socklen_t salen)
+static struct client *client_alloc(void)
 {
         struct client *c;
-        int ret;
 
         c = malloc(sizeof(struct client));
 
@@ -153,75 +275,119 @@ struct client *client_create(int sock, struct sockaddr *sa,
                 return NULL;
         
         memset(c, 0, sizeof(struct client));
-        c->id = client_num++;
-        c->from_family = sa->sa_family;
-        c->is_garbage = 0;
+        c->inet.c = c;
+        c->inet.fd = -1;
+        c->serval.c = c;
+        c->serval.fd = -1;
         INIT_LIST_HEAD(&c->lh);
-        signal_init(&c->exit_signal);
         
-        ret = pipe(c->splicefd);
+        if (pipe_flow_init(&c->inet_to_serval) == -1)
+                goto fail_pipe1;
 
-        if (ret == -1) {
-                LOG_ERR("pipe: %s\n",
-			strerror(errno));
-                goto fail_pipe;
+        if (pipe_flow_init(&c->serval_to_inet) == -1)
+                goto fail_pipe2;
+
+        return c;
+fail_pipe2:
+        pipe_flow_destroy(&c->inet_to_serval);
+fail_pipe1:
+        free(c);
+        return NULL;
+}
+
+/*
+  Create a client for an accepted socket. The socket on the other
+  side is created when we know where to connect it, or taken from
+  the worker's pool of Serval connections.
+ */
+struct client *client_create(int sock, struct sockaddr *sa, 
+                             socklen_t salen)
+{
+        struct client *c;
+
+        if (set_nonblocking(sock) == -1) {
+                LOG_ERR("could not set non-blocking: %s\n",
+                        strerror(errno));
+                return NULL;
         }
+
+        c = client_alloc();
+
+        if (!c)
+                return NULL;
+        
+        c->id = atomic_inc_return(&client_num) - 1;
+        c->from_family = sa->sa_family;
+        memcpy(&c->addr, sa, salen);
         
         if (c->from_family == AF_INET) {
                 /* We're translating from AF_INET to AF_SERVAL */
-                c->inet_sock = sock;
-                memcpy(&c->addr, sa, salen);
-
-                c->serval_sock = socket(AF_SERVAL, SOCK_STREAM, 0);
-                
-                if (c->serval_sock == -1) {
-                        LOG_ERR("serval socket: %s\n",
-                                strerror(errno));
-                        goto fail_sock;
-                }
+                c->inet.fd = sock;
+                c->state = CLIENT_CONNECTING;
         } else if (c->from_family == AF_SERVAL) {
                 /* We're translating from AF_SERVAL to AF_INET */
-                c->serval_sock = sock;
-                memcpy(&c->addr, sa, salen);
-                
-                c->inet_sock = socket(AF_INET, SOCK_STREAM, 0);
-                
-                if (c->inet_sock == -1) {
-                        LOG_ERR("inet socket: %s\n",
-                                strerror(errno));
-                        goto fail_sock;
-                }
+                c->serval.fd = sock;
+                c->state = CLIENT_RECV_INIT;
         } else {
                 LOG_ERR("Unsupported client family\n");
-                goto fail_sock;
+                pipe_flow_destroy(&c->serval_to_inet);
+                pipe_flow_destroy(&c->inet_to_serval);
+                free(c);
+                return NULL;
         }
 
         return c;
-fail_sock:
-        close(c->splicefd[0]);
-        close(c->splicefd[1]);
-fail_pipe:
-        free(c);
-        signal_destroy(&c->exit_signal);
-        return NULL;
 }
 
 static void client_free(struct client *c)
 {
-        signal_destroy(&c->exit_signal);
         free(c);
 }
 
-static int client_send_init_packet(struct client *c)
+static void worker_free_clients(struct list_head *dead)
+{
+        struct client *c, *tmp;
+
+        list_for_each_entry_safe(c, tmp, dead, lh) {
+                list_del(&c->lh);
+                client_free(c);
+        }
+}
+
+/* 
+   Close the client's sockets and pipes right away. Closing removes
+   the sockets from epoll, but events for the client may remain in the
+   worker's current batch, so the memory is released only once the
+   batch has been processed.
+*/
+static void client_close(struct client *c, struct list_head *dead)
+{
+        LOG_DBG("client %u exits, "
+                "tot_inet_to_serval=%zu tot_serval_to_inet=%zu\n", 
+                c->id, c->inet_to_serval.tot_bytes, 
+                c->serval_to_inet.tot_bytes);
+
+        if (c->state == CLIENT_POOL_CONNECTING || 
+            c->state == CLIENT_POOLED)
+                c->w->pool_count--;
+
+        c->state = CLIENT_CLOSED;
+        if (c->serval.fd != -1)
+                close(c->serval.fd);
+        if (c->inet.fd != -1)
+                close(c->inet.fd);
+        pipe_flow_destroy(&c->inet_to_serval);
+        pipe_flow_destroy(&c->serval_to_inet);
+        list_move_tail(&c->lh, dead);
+}
+
+static int client_prepare_init_packet(struct client *c)
 {
-        struct translator_init_pkt tip;
         struct sockaddr_in addr;
         socklen_t addrlen = sizeof(addr);
-        size_t tot_sent = 0, send_len = sizeof(tip);
-        unsigned char *send_ptr = (unsigned char *)&tip;
         int ret;
 
-        ret = getsockopt(c->inet_sock, SOL_IP, SO_ORIGINAL_DST, 
+        ret = getsockopt(c->inet.fd, SOL_IP, SO_ORIGINAL_DST, 
                          &addr, &addrlen);
         
         if (ret == -1) {
@@ -238,230 +404,407 @@ static int client_send_init_packet(struct client *c)
         }
 
         /* Send destination addr and port to other end */        
-        memset(&tip, 0, sizeof(tip));
-        memcpy(&tip.addr, &addr.sin_addr, sizeof(tip.addr));
-        tip.port = addr.sin_port;
-        
-        do {
-                ret = send(c->serval_sock, send_ptr, send_len, 0);
+        memset(&c->tip, 0, sizeof(c->tip));
+        memcpy(&c->tip.addr, &addr.sin_addr, sizeof(c->tip.addr));
+        c->tip.port = addr.sin_port;
+        c->tip_len = 0;
+
+        return 0;
+}
+
+/*
+  Returns 1 when the whole init packet is sent, 0 if we have to wait
+  for the socket to become writable, and -1 on error.
+ */
+static int client_send_init_packet(struct client *c)
+{
+        while (c->tip_len < sizeof(c->tip)) {
+                ssize_t ret = send(c->serval.fd, 
+                                   (unsigned char *)&c->tip + c->tip_len,
+                                   sizeof(c->tip) - c->tip_len, 0);
                 
-                if (ret == 0) {
-                        LOG_DBG("client %u other proxy closed\n",
-                                c->id);
-                } else if (ret == -1) {
+                if (ret == -1) {
+                        if (errno == EAGAIN)
+                                return 0;
                         LOG_ERR("client %u init packet: %s\n", 
                                 c->id, strerror(errno));
-                } else {
-                        tot_sent += ret;
-                        send_len -= ret;
-                        send_ptr += ret;
+                        return -1;
+                } else if (ret == 0) {
+                        LOG_DBG("client %u other proxy closed\n",
+                                c->id);
+                        return -1;
                 }
-        } while (send_len > 0 && ret > 0);
+                c->tip_len += ret;
+        }
 
         LOG_DBG("client %u sent %zu bytes init pkt\n",
-                c->id, tot_sent);
+                c->id, c->tip_len);
+        c->should_send_init_pkt = 0;
 
-        return ret;
+        return 1;
+}
+
+static int client_sock_connect(struct client *c, struct client_sock *cs,
+                               struct sockaddr *sa, socklen_t salen)
+{
+        int ret;
+
+        cs->fd = socket(sa->sa_family, SOCK_STREAM, 0);
+                
+        if (cs->fd == -1) {
+                LOG_ERR("%s socket: %s\n",
+                        family_to_str(sa->sa_family),
+                        strerror(errno));
+                return -1;
+        }
+
+        if (set_nonblocking(cs->fd) == -1) {
+                LOG_ERR("could not set non-blocking: %s\n",
+                        strerror(errno));
+                return -1;
+        }
+
+        ret = connect(cs->fd, sa, salen);
+
+        if (ret == -1 && errno != EINPROGRESS) {
+                LOG_ERR("connect failed: %s\n",
+                        strerror(errno));
+                return -1;
+        }
+
+        /* Completion is signalled by the socket becoming writable */
+        return client_add_sock(c, cs);
 }
 
-static void *client_thread(void *arg)
+static int client_forward(struct client *c);
+
+/*
+  Connect the side that was not accepted. Returns -1 on error, and 0
+  otherwise, unless the client already has a pooled connection, in
+  which case the result of client_forward() is returned.
+ */
+static int client_connect(struct client *c)
 {
-        struct client *c = (struct client *)arg;
         sockaddr_generic_t addr;
         socklen_t addrlen;
-        size_t tot_inet_to_serval = 0, tot_serval_to_inet = 0;
-        int sock = -1;
+        struct client_sock *cs;
         char ipstr[18];
-        int running = 1, ret;
-        int should_send_init_pkt = 0;
 
         memset(&addr, 0, sizeof(addr));
         
         if (c->from_family == AF_SERVAL) {
-                struct translator_init_pkt tip;
-                
-                if (!cross_translate) {
-                        LOG_ERR("Cannot translate from AF_SERVAL to AF_INET without cross-translation enabled\n");
-                        goto done;
-                }
-                /* Receive destination addr and port from other end */
-                ret = recv(c->serval_sock, &tip, sizeof(tip), MSG_WAITALL);
-
-                if (ret == -1) {
-                        LOG_ERR("client %u could not read init packet: %s\n",
-                                c->id, strerror(errno));
-                        goto done;
-                } else if (ret != sizeof(tip)) {
-                        LOG_ERR("client %u bad init packet size %d\n",
-                                c->id, ret);
-                        goto done;
-                }
-                
-                LOG_DBG("client %u received %d bytes init pkt\n",
-                        c->id, ret);
-
                 addr.in.sin_family = AF_INET;
-                memcpy(&addr.in.sin_addr, &tip.addr, sizeof(tip.addr));
-                addr.in.sin_port = tip.port;
+                memcpy(&addr.in.sin_addr, &c->tip.addr, sizeof(c->tip.addr));
+                addr.in.sin_port = c->tip.port;
                 addrlen = sizeof(addr.in);
-                sock = c->inet_sock;
+                cs = &c->inet;
 
                 inet_ntop(AF_INET, &addr.in.sin_addr, 
                           ipstr, sizeof(ipstr));
                 
                 LOG_DBG("client %u connecting to %s:%u\n",
                         c->id, ipstr, ntohs(addr.in.sin_port));
-        } else if (c->from_family == AF_INET) {
+        } else {
                 addr.sv.sv_family = AF_SERVAL;
                 addr.sv.sv_srvid.s_sid32[0] = htonl(c->translator_port);
                 addrlen = sizeof(addr.sv);
-                sock = c->serval_sock;
-                if (cross_translate)
-                        should_send_init_pkt = 1;
+                cs = &c->serval;
+
+                if (cross_translate) {
+                        if (client_prepare_init_packet(c) == -1)
+                                return -1;
+                        c->should_send_init_pkt = 1;
+                }
                 inet_ntop(AF_INET, &c->addr.in.sin_addr, ipstr, 18);
 
+                if (cs->fd != -1) {
+                        LOG_DBG("client %u from %s using pooled connection to service %s\n",
+                                c->id, ipstr, 
+                                service_id_to_str(&addr.sv.sv_srvid));
+                        c->state = CLIENT_FORWARDING;
+                        /* The service may already have sent data */
+                        return client_forward(c);
+                }
+
                 LOG_DBG("client %u from %s connecting to service %s...\n",
                         c->id, ipstr, service_id_to_str(&addr.sv.sv_srvid));
-        } else {
-                LOG_ERR("client %u - bad address family, exiting\n",
-                        c->id);
-                goto done;
-         }
-       
-        ret = connect(sock, &addr.sa, addrlen);
-
-        if (ret == -1) {
-                LOG_ERR("connect failed: %s\n",
-                        strerror(errno));
-                goto done;
         }
-        
-        LOG_DBG("client %u connected successfully!\n", c->id);
+       
+        c->state = CLIENT_CONNECTING;
 
-        while (running) {
-                ssize_t bytes = 0;
-                struct pollfd fds[3];
+        return client_sock_connect(c, cs, &addr.sa, addrlen);
+}
 
-                memset(fds, 0, sizeof(fds));
-                fds[0].fd = signal_get_fd(&c->exit_signal);
-                fds[0].events = POLLIN | POLLERR | POLLHUP;
-                fds[1].fd = c->inet_sock;
-                fds[1].events = POLLIN | POLLERR;
-                fds[2].fd = c->serval_sock;
-                fds[2].events = POLLIN | POLLERR;
-                
-                ret = poll(fds, 3, -1);
+/* Read the destination addr and port from the other translator. */
+static int client_recv_init_packet(struct client *c)
+{
+        while (c->tip_len < sizeof(c->tip)) {
+                ssize_t ret = recv(c->serval.fd, 
+                                   (unsigned char *)&c->tip + c->tip_len,
+                                   sizeof(c->tip) - c->tip_len, 0);
 
                 if (ret == -1) {
-                        LOG_ERR("poll: %s\n",
-                                strerror(errno));
-                        running = 0;
-                        continue;
+                        if (errno == EAGAIN)
+                                return 0;
+                        LOG_ERR("client %u could not read init packet: %s\n",
+                                c->id, strerror(errno));
+                        return -1;
+                } else if (ret == 0) {
+                        LOG_ERR("client %u bad init packet size %zu\n",
+                                c->id, c->tip_len);
+                        return -1;
                 }
+                c->tip_len += ret;
+        }
                 
-                if (fds[0].revents) {
-                        running = 0;
-                        continue;
-                } 
+        LOG_DBG("client %u received %zu bytes init pkt\n",
+                c->id, c->tip_len);
 
-                if (fds[1].revents & POLLERR) {
-                        running = 0;
-                } else if (fds[1].revents) {
-                        if (should_send_init_pkt == 1) {
-                                ret = client_send_init_packet(c);
-
-                                if (ret <= 0) {
-                                        LOG_ERR("client %u could not send init packet, ret=%d\n", c->id, ret);
-                                        running = 0;
-                                        break;
-                                }
-                                should_send_init_pkt = 0;
-                        }
-                        
-                        bytes = inet_to_serval(c);
-                        
-                        if (bytes == 0) {
-                                running = 0;
-                        } else if (bytes < 0) {
-                                LOG_ERR("forwarding error\n");
-                                running = 0;
-                        } else {
-                                tot_inet_to_serval += bytes;
-                        }
-                }
+        return client_connect(c);
+}
 
-                if (fds[2].revents & POLLERR) {
-                        running = 0;
-                } else if (fds[2].revents) {
-                        bytes = serval_to_inet(c);
-                        
-                        if (bytes == 0) {
-                                running = 0;
-                        } else if (bytes < 0) {
-                                LOG_ERR("forwarding error\n");
-                                running = 0;
-                        } else {
-                                tot_serval_to_inet += bytes;
-                        }
-                }        
+/*
+  Returns 1 when both directions are done, 0 if the client should
+  stay, and -1 on error.
+ */
+static int client_forward(struct client *c)
+{
+        if (c->should_send_init_pkt) {
+                int ret = client_send_init_packet(c);
+
+                if (ret <= 0)
+                        return ret;
         }
- done:
-        LOG_DBG("client %u exits, "
-                "tot_inet_to_serval=%zu tot_serval_to_inet=%zu\n", 
-                c->id, tot_inet_to_serval, tot_serval_to_inet);
 
-        c->is_garbage = 1;
-        close(c->serval_sock);
-        close(c->inet_sock);
-        close(c->splicefd[0]);
-        close(c->splicefd[1]);
+        if (forward_data(&c->inet_to_serval, c->inet.fd, c->serval.fd) == -1 ||
+            forward_data(&c->serval_to_inet, c->serval.fd, c->inet.fd) == -1) {
+                LOG_ERR("client %u forwarding error\n", c->id);
+                return -1;
+        }
 
-        return NULL;
+        return c->inet_to_serval.shut && c->serval_to_inet.shut;
 }
 
-static void signal_handler(int sig)
+static int client_sock_connected(struct client *c, struct client_sock *cs)
 {
-        LOG_DBG("signal %u caught!\n", sig);
+        int err = 0;
+        socklen_t errlen = sizeof(err);
 
-        if (sig == SIGKILL || sig == SIGTERM)
-                signal_raise(&exit_signal);
+        if (getsockopt(cs->fd, SOL_SOCKET, SO_ERROR, 
+                       &err, &errlen) == -1 || err != 0) {
+                LOG_ERR("client %u connect failed: %s\n",
+                        c->id, strerror(err ? err : errno));
+                return -1;
+        }
+        return 0;
 }
 
-static void garbage_collect_clients(void)
+/*
+  An idle pooled connection is dropped when the service closes it.
+  Data that the service sends before any request, e.g., a greeting,
+  is left queued for the client that eventually gets the connection.
+ */
+static int client_pool_check_idle(struct client *c, uint32_t events)
 {
-        struct client *c, *tmp;
+        char b;
+        ssize_t ret;
+
+        if (events & (EPOLLERR | EPOLLHUP))
+                return -1;
+
+        ret = recv(c->serval.fd, &b, 1, MSG_PEEK);
+
+        if (ret == 0) {
+                LOG_DBG("worker %u pooled connection closed by service\n",
+                        c->w->id);
+                return -1;
+        } else if (ret == -1 && errno != EAGAIN) {
+                return -1;
+        }
+        return 0;
+}
 
-        list_for_each_entry_safe(c, tmp, &client_list, lh) {
-                if (c->is_garbage) {
-                        LOG_DBG("garbage collecting client %u\n", c->id);
-                        list_del(&c->lh);
-                        pthread_join(c->thr, NULL);
-                        client_free(c);
+static int client_handle_event(struct client *c, struct client_sock *cs,
+                               uint32_t events)
+{
+        switch (c->state) {
+        case CLIENT_RECV_INIT:
+                if (!cross_translate) {
+                        LOG_ERR("Cannot translate from AF_SERVAL to AF_INET without cross-translation enabled\n");
+                        return -1;
                 }
+                if (cs != &c->serval)
+                        return 0;
+                return client_recv_init_packet(c);
+        case CLIENT_CONNECTING:
+                /* Data from the accepted side stays queued until we
+                 * are connected. */
+                if ((c->from_family == AF_INET && cs != &c->serval) ||
+                    (c->from_family == AF_SERVAL && cs != &c->inet))
+                        return 0;
+
+                if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+                        return 0;
+
+                if (client_sock_connected(c, cs) == -1)
+                        return -1;
+                
+                LOG_DBG("client %u connected successfully!\n", c->id);
+                c->state = CLIENT_FORWARDING;
+                /* Edge-triggered readiness on the accepted side may
+                 * already have been reported, so try both ways. */
+                return client_forward(c);
+        case CLIENT_FORWARDING:
+                return client_forward(c);
+        case CLIENT_POOL_CONNECTING:
+                if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+                        return 0;
+
+                /* Failed attempts are not retried until the next
+                 * client arrives, to avoid spinning while the service
+                 * is unreachable. */
+                if (client_sock_connected(c, cs) == -1)
+                        return -1;
+
+                LOG_DBG("worker %u pooled connection ready\n", c->w->id);
+                c->state = CLIENT_POOLED;
+                return 0;
+        case CLIENT_POOLED:
+                return client_pool_check_idle(c, events);
+        case CLIENT_CLOSED:
+                break;
         }
+        return 0;
 }
 
-static void cleanup_clients(void)
+/* Start a connection to the translated service ahead of time. */
+static int worker_pool_add(struct worker *w, struct list_head *dead)
 {
-        while (!list_empty(&client_list)) {
-                struct client *c;
+        sockaddr_generic_t addr;
+        struct client *p;
+
+        p = client_alloc();
 
-                c = list_first_entry(&client_list, struct client, lh);
+        if (!p)
+                return -1;
+
+        p->from_family = AF_INET;
+        p->translator_port = w->port;
+        p->state = CLIENT_POOL_CONNECTING;
+        p->w = w;
+        list_add_tail(&p->lh, &w->pool);
+        w->pool_count++;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sv.sv_family = AF_SERVAL;
+        addr.sv.sv_srvid.s_sid32[0] = htonl(w->port);
+        
+        if (client_sock_connect(p, &p->serval, &addr.sa, 
+                                sizeof(addr.sv)) == -1) {
+                client_close(p, dead);
+                return -1;
+        }
+        return 0;
+}
+
+static void worker_pool_fill(struct worker *w, struct list_head *dead)
+{
+        while (w->pool_count < pool_size) {
+                if (worker_pool_add(w, dead) == -1)
+                        break;
+        }
+}
 
-                if (!c->is_garbage) {
-                        signal_raise(&c->exit_signal);
-                        /* Sending an interrupt signal in case the
-                           thread is stuck on, e.g., a connect() */
-                        pthread_kill(c->thr, SIGINT);
+/* 
+   Hand an established pooled connection over to the client. Returns
+   -1 if no pooled connection is ready.
+*/
+static int worker_pool_take(struct worker *w, struct client *c,
+                            struct list_head *dead)
+{
+        struct epoll_event ev;
+        struct client *p;
+
+        list_for_each_entry(p, &w->pool, lh) {
+                if (p->state != CLIENT_POOLED)
+                        continue;
+
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+                ev.data.ptr = &c->serval;
+
+                if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, 
+                              p->serval.fd, &ev) == -1) {
+                        LOG_ERR("worker %u epoll_ctl: %s\n",
+                                w->id, strerror(errno));
+                        client_close(p, dead);
+                        return -1;
                 }
-                list_del(&c->lh);
-                LOG_DBG("cleaning up client %u\n", c->id);
-                pthread_join(c->thr, NULL);
-                client_free(c);
+
+                c->serval.fd = p->serval.fd;
+                p->serval.fd = -1;
+                client_close(p, dead);
+                return 0;
+        }
+        return -1;
+}
+
+static void worker_start_client(struct worker *w, struct client *c,
+                                struct list_head *dead)
+{
+        /* The connecting socket is added once we know where to
+           connect. */
+        if (client_add_sock(c, c->from_family == AF_INET ? 
+                            &c->inet : &c->serval) == -1) {
+                client_close(c, dead);
+                return;
         }
+
+        if (c->from_family == AF_INET) {
+                if (pool_size > 0)
+                        worker_pool_take(w, c, dead);
+
+                if (client_connect(c) != 0)
+                        client_close(c, dead);
+
+                worker_pool_fill(w, dead);
+        }
+}
+
+/* Start the clients that the acceptor has queued for us. */
+static void worker_start_clients(struct worker *w, struct list_head *dead)
+{
+        struct client *c, *tmp;
+        LIST_HEAD(new_clients);
+
+        signal_clear(&w->wakeup);
+
+        pthread_mutex_lock(&w->lock);
+        list_splice_init(&w->pending, &new_clients);
+        pthread_mutex_unlock(&w->lock);
+
+        list_for_each_entry_safe(c, tmp, &new_clients, lh) {
+                list_move_tail(&c->lh, &w->client_list);
+                worker_start_client(w, c, dead);
+        }
+}
+
+static void worker_add_client(struct worker *w, struct client *c)
+{
+        int was_empty;
+
+        c->w = w;
+
+        pthread_mutex_lock(&w->lock);
+        was_empty = list_empty(&w->pending);
+        list_add_tail(&c->lh, &w->pending);
+        pthread_mutex_unlock(&w->lock);
+
+        if (was_empty)
+                signal_raise(&w->wakeup);
 }
 
-static int create_server_sock(int family, unsigned short port)
+static int create_server_sock(int family, unsigned short port, int reuseport)
 {
         sockaddr_generic_t addr;
         socklen_t addrlen = 0;
@@ -486,6 +829,22 @@ static int create_server_sock(int family, unsigned short port)
                         LOG_ERR("Could not set SO_REUSEADDR - %s\n",
                                 strerror(errno));
                 }
+
+                if (reuseport) {
+#if defined(SO_REUSEPORT)
+                        ret = 1;
+                        ret = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, 
+                                         &ret, sizeof(ret));
+#else
+                        ret = -1;
+                        errno = ENOPROTOOPT;
+#endif
+                        if (ret == -1) {
+                                LOG_ERR("Could not set SO_REUSEPORT - %s\n",
+                                        strerror(errno));
+                                goto failure;
+                        }
+                }
                 addr.in.sin_family = AF_INET;
                 addr.in.sin_addr.s_addr = INADDR_ANY;
                 addr.in.sin_port = htons(port);
@@ -507,7 +866,7 @@ static int create_server_sock(int family, unsigned short port)
                 goto failure;
 	}
 
-        ret = listen(sock, 10);
+        ret = listen(sock, SOMAXCONN);
 
         if (ret == -1) {
                 LOG_ERR("inet listen: %s\n",
@@ -515,6 +874,15 @@ static int create_server_sock(int family, unsigned short port)
                 goto failure;
         }
 
+        /* We accept until the queue is drained */
+        ret = set_nonblocking(sock);
+
+        if (ret == -1) {
+                LOG_ERR("Could not set non-blocking - %s\n",
+                        strerror(errno));
+                goto failure;
+        }
+
         return sock;
  failure:
         close(sock);
@@ -522,17 +890,25 @@ static int create_server_sock(int family, unsigned short port)
         return -1;
 }
 
-static int accept_client(int sock, int port)
+/*
+  Returns 1 if a client was accepted, 0 if there are no more pending
+  clients, and -1 on error.
+ */
+static int accept_client(int sock, int port, struct worker *w,
+                         struct list_head *dead)
 {
         sockaddr_generic_t addr;
         socklen_t addrlen = sizeof(addr);
-        int ret, client_sock;
+        int client_sock;
         struct client *c;
 
         client_sock = accept(sock, &addr.sa, &addrlen);
         
         if (client_sock == -1) {
                 switch (errno) {
+                case EAGAIN:
+                case ECONNABORTED:
+                        return 0;
                 case EINTR:
                         /* This means we should exit
                          * (ctrl-c) */
@@ -556,42 +932,265 @@ static int accept_client(int sock, int port)
         }
 
         c->translator_port = port;
-        
-        ret = pthread_create(&c->thr, NULL, client_thread, c);
-        
-        if (ret != 0) {
-                LOG_ERR("pthread_create: %s\n",
-                        strerror(errno));
-                client_free(c);
-                goto err;
+
+        if (w->listen.fd != -1) {
+                /* Sharded, so we are running in the worker itself */
+                c->w = w;
+                list_add_tail(&c->lh, &w->client_list);
+                worker_start_client(w, c, dead);
+        } else {
+                worker_add_client(w, c);
         }
         
-        list_add_tail(&c->lh, &client_list);
-        
-        /* Make a note in our client log */
+        /* Make a note in our client log. This runs in the workers
+           when sharded, so no blocking reverse lookup here */
         if (addr.sa.sa_family == AF_INET && log_is_open(&logh)) {
-                struct hostent *h;
                 char buf[18];
                 
-                /* Cast to const char * to quell compiler on Android */
-                h = gethostbyaddr((const char *)&addr.in.sin_addr, 4, AF_INET);
-                
-                log_write_line(&logh, "c %s %s",
+                log_write_line(&logh, "c %s",
                                inet_ntop(AF_INET, &addr.in.sin_addr, 
-                                         buf, sizeof(buf)),
-                               h ? h->h_name : "unknown hostname");
+                                         buf, sizeof(buf)));
         }
         
-        return ret;       
+        return 1;
  err:
         close(client_sock);
         return -1;
 }
 
+static void worker_set_affinity(struct worker *w)
+{
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t cpuset;
+        int ret;
+
+        if (ncpus <= 0)
+                return;
+
+        CPU_ZERO(&cpuset);
+        CPU_SET(w->id % ncpus, &cpuset);
+
+        /* Applies to the calling thread only */
+        ret = sched_setaffinity(0, sizeof(cpuset), &cpuset);
+
+        if (ret == -1) {
+                LOG_ERR("worker %u could not set CPU affinity: %s\n",
+                        w->id, strerror(errno));
+        } else {
+                LOG_DBG("worker %u pinned to CPU %ld\n", 
+                        w->id, w->id % ncpus);
+        }
+}
+
+static void *worker_thread(void *arg)
+{
+        struct worker *w = (struct worker *)arg;
+        struct epoll_event events[MAX_EVENTS];
+        int running = 1;
+
+        if (pin_workers)
+                worker_set_affinity(w);
+
+        if (pool_size > 0) {
+                LIST_HEAD(dead);
+                worker_pool_fill(w, &dead);
+                worker_free_clients(&dead);
+        }
+
+        while (running) {
+                struct client *c;
+                LIST_HEAD(dead);
+                int i, n;
+
+                n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        LOG_ERR("worker %u epoll_wait: %s\n",
+                                w->id, strerror(errno));
+                        break;
+                }
+
+                for (i = 0; i < n; i++) {
+                        struct client_sock *cs = events[i].data.ptr;
+
+                        if (!cs) {
+                                /* Exit signal */
+                                running = 0;
+                                break;
+                        } else if (cs == (struct client_sock *)w) {
+                                worker_start_clients(w, &dead);
+                                continue;
+                        } else if (cs == &w->listen) {
+                                int ret;
+
+                                do {
+                                        ret = accept_client(w->listen.fd,
+                                                            w->port, w, 
+                                                            &dead);
+                                } while (ret == 1);
+
+                                if (ret == -1) {
+                                        LOG_ERR("worker %u could not accept new client\n", w->id);
+                                }
+                                continue;
+                        }
+                        
+                        c = cs->c;
+
+                        if (c->state == CLIENT_CLOSED)
+                                continue;
+
+                        if (client_handle_event(c, cs, events[i].events) != 0)
+                                client_close(c, &dead);
+                }
+                
+                worker_free_clients(&dead);
+        }
+
+        LOG_DBG("worker %u exits\n", w->id);
+
+        return NULL;
+}
+
+static void worker_cleanup_clients(struct worker *w)
+{
+        struct client *c, *tmp;
+        LIST_HEAD(dead);
+
+        list_splice_init(&w->pending, &w->client_list);
+        list_splice_init(&w->pool, &w->client_list);
+
+        list_for_each_entry_safe(c, tmp, &w->client_list, lh) {
+                LOG_DBG("cleaning up client %u\n", c->id);
+                client_close(c, &dead);
+        }
+
+        worker_free_clients(&dead);
+}
+
+static int worker_init(struct worker *w, unsigned int id, 
+                       int family, unsigned short port)
+{
+        struct epoll_event ev;
+
+        memset(w, 0, sizeof(*w));
+        w->id = id;
+        w->port = port;
+        w->listen.c = NULL;
+        w->listen.fd = -1;
+        INIT_LIST_HEAD(&w->pending);
+        INIT_LIST_HEAD(&w->client_list);
+        INIT_LIST_HEAD(&w->pool);
+        pthread_mutex_init(&w->lock, NULL);
+
+        if (signal_init(&w->wakeup) == -1) {
+                LOG_ERR("signal_init: %s\n", strerror(errno));
+                goto fail_signal;
+        }
+
+        w->epfd = epoll_create(MAX_EVENTS);
+
+        if (w->epfd == -1) {
+                LOG_ERR("epoll_create: %s\n", strerror(errno));
+                goto fail_epoll;
+        }
+
+        /* Level-triggered, so that every worker sees it */
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, 
+                      signal_get_fd(&exit_signal), &ev) == -1) {
+                LOG_ERR("epoll_ctl: %s\n", strerror(errno));
+                goto fail_ctl;
+        }
+
+        /* The worker itself marks new clients being queued */
+        ev.data.ptr = w;
+
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, 
+                      signal_get_fd(&w->wakeup), &ev) == -1) {
+                LOG_ERR("epoll_ctl: %s\n", strerror(errno));
+                goto fail_ctl;
+        }
+
+        if (shard_listeners) {
+                w->listen.fd = create_server_sock(family, port, 1);
+
+                if (w->listen.fd == -1) {
+                        LOG_ERR("worker %u could not create listener\n",
+                                w->id);
+                        goto fail_ctl;
+                }
+
+                ev.data.ptr = &w->listen;
+
+                if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, 
+                              w->listen.fd, &ev) == -1) {
+                        LOG_ERR("epoll_ctl: %s\n", strerror(errno));
+                        goto fail_listen;
+                }
+        }
+
+        if (pthread_create(&w->thr, NULL, worker_thread, w) != 0) {
+                LOG_ERR("pthread_create: %s\n",
+                        strerror(errno));
+                goto fail_listen;
+        }
+
+        return 0;
+fail_listen:
+        if (w->listen.fd != -1)
+                close(w->listen.fd);
+fail_ctl:
+        close(w->epfd);
+fail_epoll:
+        signal_destroy(&w->wakeup);
+fail_signal:
+        pthread_mutex_destroy(&w->lock);
+        return -1;
+}
+
+static void worker_fini(struct worker *w)
+{
+        pthread_join(w->thr, NULL);
+        worker_cleanup_clients(w);
+        if (w->listen.fd != -1)
+                close(w->listen.fd);
+        close(w->epfd);
+        signal_destroy(&w->wakeup);
+        pthread_mutex_destroy(&w->lock);
+}
+
+static void signal_handler(int sig)
+{
+        LOG_DBG("signal %u caught!\n", sig);
+
+        if (sig == SIGKILL || sig == SIGTERM)
+                signal_raise(&exit_signal);
+}
+
+
+static unsigned int get_num_workers(void)
+{
+        long n;
+
+        if (num_workers > 0)
+                return num_workers;
+
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+
+        return n > 0 ? (unsigned int)n : 1;
+}
+
 int run_translator(int family, unsigned short port)
 {
 	struct sigaction action;
 	int sock, ret = 0, running = 1;
+        unsigned int i, n, next_worker = 0;
 
         memset(&action, 0, sizeof(struct sigaction));
         action.sa_handler = signal_handler;
@@ -604,19 +1203,58 @@ int run_translator(int family, unsigned short port)
         
         signal_init(&exit_signal);
 
-        sock = create_server_sock(family, port);
+        if (pool_size > 0 && family != AF_INET) {
+                LOG_ERR("Connection pooling requires an AF_INET translator, disabling it\n");
+                pool_size = 0;
+        }
+
+        if (shard_listeners && family != AF_INET) {
+                LOG_ERR("SO_REUSEPORT sharding requires an AF_INET translator, using a single listener\n");
+                shard_listeners = 0;
+        }
 
-        if (sock == -1) {
-                LOG_ERR("could not create AF_INET server sock\n");
+        if (shard_listeners) {
+                /* The workers create their own listeners */
+                sock = -1;
+        } else {
+                sock = create_server_sock(family, port, 0);
+
+                if (sock == -1) {
+                        LOG_ERR("could not create AF_INET server sock\n");
+                        signal_destroy(&exit_signal);
+                        return -1;
+                }
+        }
+
+        n = get_num_workers();
+        workers = calloc(n, sizeof(struct worker));
+
+        if (!workers) {
+                LOG_ERR("could not allocate workers\n");
+                if (sock != -1)
+                        close(sock);
                 signal_destroy(&exit_signal);
                 return -1;
         }
 
-        LOG_DBG("%s to %s translator running on port/serviceID %u\n", 
+        for (i = 0; i < n; i++) {
+                if (worker_init(&workers[i], i, family, port) == -1) {
+                        LOG_ERR("could not start worker %u\n", i);
+                        ret = -1;
+                        running = 0;
+                        break;
+                }
+        }
+        n = i;
+
+        LOG_DBG("%s to %s translator running on port/serviceID %u "
+                "with %u %s\n", 
                 family_to_str(family), 
                 family_to_str(family == AF_INET ? AF_SERVAL : AF_INET),
-                port);
+                port, n, shard_listeners ? "shards" : "workers");
 
+        /* When sharded, the listener is -1 and ignored by poll(),
+           so we only wait for the exit signal here. */
         while (running) {
                 struct pollfd fds[2];
 
@@ -628,18 +1266,15 @@ int run_translator(int family, unsigned short port)
                 fds[1].events = POLLIN | POLLERR | POLLHUP;
                 fds[1].revents = 0;
 
-                ret = poll(fds, 2, 10000);
+                ret = poll(fds, 2, -1);
                 
                 if (ret == -1) {
+                        if (errno == EINTR)
+                                continue;
                         /* Treat this as fatal error */
                         running = 0;
                         continue;
-                } else if (ret == 0) {
-                        /* Garbage collect */
-                        /* LOG_DBG("garbage collecting clients\n"); */
-                        garbage_collect_clients();
-                        continue;
-                } 
+                }
                 
                 if (fds[0].revents) {
                         running = 0;
@@ -653,8 +1288,15 @@ int run_translator(int family, unsigned short port)
                 }
                 
                 if (fds[1].revents & POLLIN) {
-                        LOG_DBG("accepting client\n");
-                        ret = accept_client(sock, port); 
+                        /* Spread clients over the workers round-robin */
+                        do {
+                                ret = accept_client(sock, port, 
+                                                    &workers[next_worker],
+                                                    NULL);
+                                
+                                if (ret == 1)
+                                        next_worker = (next_worker + 1) % n;
+                        } while (ret == 1);
                         
                         if (ret == -1) {
                                 LOG_ERR("could not accept new client\n");
@@ -663,8 +1305,16 @@ int run_translator(int family, unsigned short port)
         }
         
         LOG_DBG("Translator exits.\n");
-        cleanup_clients();
-	close(sock);
+        /* Make sure the workers exit also when we stop on error */
+        signal_raise(&exit_signal);
+
+        for (i = 0; i < n; i++)
+                worker_fini(&workers[i]);
+
+        free(workers);
+        workers = NULL;
+        if (sock != -1)
+                close(sock);
         signal_destroy(&exit_signal);
 
         return ret;
@@ -681,6 +1331,10 @@ static void print_usage(void)
         printf("\t-l, --log LOG_FILE\t\t file to write client IPs to.\n");
         printf("\t-s, --serval\t\t run an AF_SERVAL to AF_INET translator.\n");
         printf("\t-x, --x-translate\t\t cross translate, i.e., this translator will connect to another translator that reverses the translation.\n");
+        printf("\t-w, --workers NUM\t\t number of worker threads (default: one per CPU).\n");
+        printf("\t-r, --reuseport\t\t let each worker accept on its own SO_REUSEPORT listener.\n");
+        printf("\t-a, --affinity\t\t pin each worker thread to a CPU.\n");
+        printf("\t-P, --pool NUM\t\t keep NUM pre-established Serval connections per worker.\n");
 }
 
 static int daemonize(void)
@@ -773,6 +1427,30 @@ int main(int argc, char **argv)
                 } else if (strcmp(argv[0], "-d") == 0 ||
                            strcmp(argv[0], "--daemon") ==  0) {
                         daemon = 1;
+                } else if (strcmp(argv[0], "-w") == 0 ||
+                           strcmp(argv[0], "--workers") ==  0) {
+                        if (argc == 1) {
+                                print_usage();
+                                goto fail;
+                        }
+                        num_workers = atoi(argv[1]);
+                        argv++;
+                        argc--;
+                } else if (strcmp(argv[0], "-r") == 0 ||
+                           strcmp(argv[0], "--reuseport") ==  0) {
+                        shard_listeners = 1;
+                } else if (strcmp(argv[0], "-P") == 0 ||
+                           strcmp(argv[0], "--pool") ==  0) {
+                        if (argc == 1) {
+                                print_usage();
+                                goto fail;
+                        }
+                        pool_size = atoi(argv[1]);
+                        argv++;
+                        argc--;
+                } else if (strcmp(argv[0], "-a") == 0 ||
+                           strcmp(argv[0], "--affinity") ==  0) {
+                        pin_workers = 1;
                 } else if (strcmp(argv[0], "-x") == 0 ||
                            strcmp(argv[0], "--x-translate") ==  0) {
                         cross_translate = 1;